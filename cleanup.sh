@@ -1,5 +1,9 @@
 #!/bin/bash
 # make sure we don't delete the init.mp4
-find /var/www/html/hls -name "segment*.mp4" -mmin +30 -delete
-find /var/www/html/hls -name "video*.ts" -mmin +30 -delete
-find /var/www/html/hls -name "audio*.ts" -mmin +30 -delete
+find /var/www/html/hls -name "segment*.mp4" ! -name "*_range*" -mmin +30 -delete
+find /var/www/html/hls -name "video*.ts" ! -name "*_range*" -mmin +30 -delete
+find /var/www/html/hls -name "audio*.ts" ! -name "*_range*" -mmin +30 -delete
+# byte-range containers back the dvr window, which can be up to a day long
+find /var/www/html/hls -name "*_range*" -mmin +1500 -delete
+# exported clips point into those containers and go with them
+find /var/www/html/hls -name "clip_*" -mmin +1500 -delete
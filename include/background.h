@@ -29,6 +29,7 @@ int load_kvp_config(fillet_app_struct *core);
 int launch_new_fillet(fillet_app_struct *core, int new_session);
 void *status_thread(void *context);
 void *client_thread(void *context);
+void *clip_thread(void *context);
 int wait_for_event(fillet_app_struct *core);
 
 #endif
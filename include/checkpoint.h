@@ -0,0 +1,49 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_CHECKPOINT_H_)
+#define _CHECKPOINT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC                0x54504b43
+#define CHECKPOINT_VERSION              1
+#define CHECKPOINT_MAX_NAME             512
+#define CHECKPOINT_BLOCK_SIZE           512
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    void *checkpoint_create(const char *filename, int record_size);
+    void checkpoint_destroy(void *checkpoint);
+    void checkpoint_update(void *checkpoint, size_t offset, const void *data, size_t size);
+    int64_t checkpoint_commit(void *checkpoint);
+    int checkpoint_restore(void *checkpoint, size_t offset, void *data, size_t size);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _CHECKPOINT_H_
@@ -0,0 +1,49 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_CLIPEXPORT_H_)
+#define _CLIPEXPORT_H_
+
+#include "fillet.h"
+
+#define CLIP_FILE_PREFIX         "clip_"
+#define CLIP_MAX_NAME            48
+
+typedef struct _clip_request_struct_ {
+    int64_t          start;             // utc milliseconds, 90kHz ticks when by_pts is set
+    int64_t          end;
+    int              by_pts;
+    char             name[CLIP_MAX_NAME];
+} clip_request_struct;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    int clip_parse_request(const char *query, clip_request_struct *request);
+    int clip_export(fillet_app_struct *core, clip_request_struct *request, char *result, int result_size);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _CLIPEXPORT_H_
@@ -46,6 +46,8 @@
 #include "udpsource.h"
 #include "tsdecode.h"
 #include "mp4core.h"
+#include "segcrypt.h"
+#include "muxworker.h"
 
 #define MAX_STR_SIZE               512
 #define MAX_AUDIO_SOURCES          5
@@ -61,12 +63,19 @@
 #define MAX_TEXT_BUFFER            1024*1024
 #define MAX_WINDOW_SIZE            25
 #define MIN_WINDOW_SIZE            3
+#define MAX_DVR_WINDOW_MINUTES     1440
 #define DEFAULT_WINDOW_SIZE        5
 #define MAX_SEGMENT_LENGTH         10
 #define MIN_SEGMENT_LENGTH         1
 #define DEFAULT_SEGMENT_LENGTH     5
 #define MAX_ROLLOVER_SIZE          128
 #define MIN_ROLLOVER_SIZE          32
+#define MIN_PART_LENGTH            100
+#define MAX_SEGMENT_PARTS          64
+#define MAX_PART_SEGMENTS          4
+#define MAX_SEGMENT_IFRAMES        8
+#define MAX_IFRAME_SEGMENTS        32
+#define MAX_TS_DESCRIPTORS         32
 #define OVERFLOW_DTS               8589100000
 #define MAX_PTS                    8589934592
 #define MAX_DTS                    MAX_PTS
@@ -81,6 +90,9 @@
 #define MAX_VIDEO_COMPRESSED_BUFFER_SIZE  0
 #define MAX_AUDIO_COMPRESSED_BUFFERS      4096
 #define MAX_AUDIO_COMPRESSED_BUFFER_SIZE  0
+// fmp4 holds every frame of the segment being built, size for this frame rate
+#define POOL_PINNED_VIDEO_FPS             60
+#define POOL_PINNED_AUDIO_FPS             50
 #define MAX_VIDEO_RAW_BUFFERS             512
 #define MAX_VIDEO_RAW_BUFFER_SIZE         0
 #define MAX_AUDIO_RAW_BUFFERS             2048
@@ -222,6 +234,27 @@ typedef struct _config_options_struct_ {
     int              enable_webvtt;
 
     int              stream_select;
+
+    int              enable_hugepages;
+    int              enable_numa;
+    int              numa_node;
+
+    int              origin_port;
+    int              origin_cache_mb;
+    int              part_length_ms;
+    int              chunk_frames;
+    int              mux_workers;
+    int              segment_store_mb;
+    int              enable_byterange;
+    int              enable_trickplay;
+    int              enable_muxed_ts;
+    int              enable_muxed_cmaf;
+    int              dvr_window_minutes;
+    int              ts_encryption;
+    int              fmp4_encryption;
+    char             key_source[MAX_STR_SIZE];
+    char             key_uri[MAX_STR_SIZE];
+    segcrypt_key_struct content_key;
 #if defined(ENABLE_TRANSCODE)
     int                           num_outputs;
     trans_video_output_struct     transvideo_info[MAX_TRANS_OUTPUTS];
@@ -237,21 +270,60 @@ typedef struct _packet_struct_ {
     int                      count;
 } packet_struct;
 
+typedef struct _byterange_struct_ {
+    int64_t                  container;
+    int64_t                  offset;
+    int64_t                  length;
+} byterange_struct;
+
+typedef struct _iframe_struct_ {
+    int64_t                  pts;
+    int64_t                  offset;            // from the start of the segment
+    int64_t                  length;
+} iframe_struct;
+
+typedef struct _dvr_struct_ {
+    void                     *index;
+    int64_t                  archived;          // media sequence following the last archived segment
+    int64_t                  program_time;      // where the next archived segment starts, 0 if unknown
+    int64_t                  cue_program_time;  // where the last archived break went out
+    int                      resumed;
+} dvr_struct;
+
 typedef struct _stream_struct_ {
     int                      sources;
     uint8_t                  *muxbuffer;
-    uint8_t                  *pesbuffer;
     char                     *textbuffer;
-    packet_struct            *packettable;
+    int                      mux_buffer_size;
     int                      packet_count;
     int64_t                  file_sequence_number;
     int64_t                  media_sequence_number;
     int64_t                  fragments_published;
     int64_t                  discontinuity_adjustment;
     int64_t                  last_segment_time;
-    FILE                     *output_ts_file;
-    FILE                     *output_fmp4_file;
-    FILE                     *output_webvtt_file;
+    void                     *output_ts_file;
+    void                     *output_fmp4_file;
+    void                     *output_webvtt_file;
+    void                     *ts_playlist;
+    void                     *fmp4_playlist;
+
+    int64_t                  ts_container;
+    int64_t                  ts_container_offset;
+    byterange_struct         ts_ranges[MAX_ROLLOVER_SIZE];
+    int64_t                  mp4_container;
+    int64_t                  mp4_container_offset;
+    byterange_struct         mp4_ranges[MAX_ROLLOVER_SIZE];
+    dvr_struct               ts_dvr;
+    dvr_struct               fmp4_dvr;
+
+    int                      part_count;
+    double                   part_duration;
+    double                   part_lengths[MAX_PART_SEGMENTS][MAX_SEGMENT_PARTS];
+    int                      part_counts[MAX_PART_SEGMENTS];
+    int                      chunk_samples;
+    int64_t                  chunk_segment_time;
+    int64_t                  chunk_segment_sequence;
+    void                     *worker;
 
     void                     *source_queue;
     int                      cnt;
@@ -260,7 +332,26 @@ typedef struct _stream_struct_ {
     int                      pat_cnt;
     int                      pmt_cnt;
 
+    int                      ts_audio_cnt;
+    int                      ts_audio_codec;
+    int                      ts_audio_descriptors_size;
+    uint8_t                  ts_audio_descriptors[MAX_TS_DESCRIPTORS];
+
+    iframe_struct            ts_iframes[MAX_IFRAME_SEGMENTS][MAX_SEGMENT_IFRAMES];
+    int                      ts_iframe_counts[MAX_IFRAME_SEGMENTS];
+    int64_t                  ts_iframe_first[MAX_IFRAME_SEGMENTS];
+    int64_t                  ts_iframe_total;
+    int                      mp4_iframe_sizes[MAX_IFRAME_SEGMENTS];
+    int                      ts_iframe_bandwidth;
+    int                      mp4_iframe_bandwidth;
+    void                     *ts_iframe_playlist;
+    void                     *mp4_iframe_playlist;
+
     fragment_file_struct     *fmp4;
+    fragment_file_struct     *fmp4_init;          // muxed cmaf keeps the video init for the audio track to join
+    int                      mp4_audio_media_type;  // the audio stream's codec once it starts, for muxed cmaf
+    void                     *ts_crypt;
+    void                     *fmp4_crypt;
 } stream_struct;
 
 typedef struct _hlsmux_struct_ {
@@ -269,6 +360,15 @@ typedef struct _hlsmux_struct_ {
     stream_struct            audio[MAX_VIDEO_SOURCES][MAX_AUDIO_STREAMS];
     stream_struct            video[MAX_VIDEO_SOURCES];
 
+    void                     *writer;
+    void                     *ts_master_playlist;
+    void                     *fmp4_master_playlist;
+    void                     *dash_master_playlist;
+    void                     *dash_cache;
+    void                     *workers[MAX_MUX_WORKERS];
+    int                      worker_count;
+    int                      dash_manifest_pending;
+    void                     *checkpoint;
     pthread_t                hlsmux_thread_id;
 } hlsmux_struct;
 
@@ -438,6 +538,9 @@ typedef struct _fillet_app_struct_
     void                          *raw_video_pool;
     void                          *raw_audio_pool;
 
+    void                          *overload;
+    void                          *origin;
+
     basic_info_struct             info;
 
 #if defined(ENABLE_TRANSCODE)
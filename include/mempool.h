@@ -23,6 +23,8 @@
 #if !defined(_MEMORY_POOL_H_)
 #define _MEMORY_POOL_H_
 
+#include <stddef.h>
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -31,8 +33,17 @@ extern "C" {
     int memory_destroy(void *pool);
     void *memory_take(void *pool, int owner);
     int memory_return(void *pool, void *buffer);
+    int memory_ref(void *pool, void *buffer);
     int memory_reset(void *pool);
     int memory_unused(void *pool);
+    int memory_used_percent(void *pool);
+    int memory_count(void *pool);
+    int memory_report(void *pool, const char *name);
+    int memory_enable_magazines(void *pool);
+    int memory_arena_config(int hugepages, int numa_node, int numa_enabled);
+    void *memory_arena_alloc(size_t size);
+    int memory_arena_free(void *memory, size_t size);
+    int memory_arena_report(void);
 
 #if defined(__cplusplus)
 }
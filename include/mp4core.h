@@ -23,10 +23,11 @@
 #if !defined(_MP4CORE_H_)
 #define _MP4CORE_H_
 
+#include "segcrypt.h"
+
 #define TRACK_TYPE_VIDEO    0x00
 #define TRACK_TYPE_AUDIO    0x01
 #define TRACK_TYPE_CAPTION  0x02
-#define MAX_TRACKS          2
 
 #define MAX_NAME_SIZE       512
 #define MAX_MP4_SIZE        16*1024*1024   //16mb - this may become an issue at high bitrates
@@ -47,13 +48,25 @@
 #define VIDEO_FRAGMENT      0x01
 #define AUDIO_FRAGMENT      0x00
 
+#define FRAGMENT_CONVERT_NONE  0x00
+#define FRAGMENT_CONVERT_H264  0x01
+#define FRAGMENT_CONVERT_HEVC  0x02
+
 typedef struct _fragment_struct_
 {
+    uint8_t                 *fragment_base;         // start of the owned or referenced buffer
+    void                    *fragment_pool;         // pool holding the reference, NULL if malloc'd
+    int                     fragment_convert;       // annexb conversion still to be done when writing the mdat
+    int                     fragment_source_size;
     uint8_t                 *fragment_buffer;
     int                     fragment_buffer_size;
     int                     fragment_duration;
     double                  fragment_timestamp;
     int64_t                 fragment_composition_time;
+
+    int                     subsample_first;        // into the file's subsample map when encrypting
+    int                     subsample_count;
+    uint8_t                 sample_iv[SEGCRYPT_SAMPLE_IV_SIZE];
 } fragment_struct;
 
 typedef struct _track_struct_ {
@@ -66,6 +79,15 @@ typedef struct _track_struct_ {
     int                    fragment_count;
     int64_t                fragment_start_timestamp;
     int64_t                sidx_buffer_offset;
+    int64_t                data_offset_position;  // trun data offset, filled in once the moof is complete
+
+    int                    part_count;            // parts already written for the current segment
+    double                 part_decode_time;      // decode time of the next part
+
+    int64_t                iframe_position;       // where the segment's leading sync sample went out in the buffer
+    int                    iframe_size;
+    double                 iframe_time;
+    int                    iframe_reuse_iv;
 } track_struct;
 
 typedef struct _fragment_file_struct_
@@ -73,9 +95,11 @@ typedef struct _fragment_file_struct_
     char                   fragment_filename[MAX_NAME_SIZE];
     FILE                   *output_file;
     int                    enable_youtube;
+    int                    enable_muxed;          // every track goes out in the same moof/mdat
 
     int                    track_count;
-    track_struct           track_data[MAX_TRACKS];
+    int                    track_slots;           // allocated track_data entries, indexed by track id-1
+    track_struct           *track_data;
     int                    video_track_id;
     int                    audio_track_id;
     int                    next_track_id;
@@ -110,33 +134,46 @@ typedef struct _fragment_file_struct_
     int64_t                buffer_offset;
     int64_t                initial_offset;
     uint8_t                *buffer;
+
+    void                   *crypt;                // segcrypt handle, NULL for clear output
+    segcrypt_subsample_struct *subsamples;
+    int                    subsample_count;
+    int                    subsample_size;
 } fragment_file_struct;
 
 int fmp4_audio_fragment_add(fragment_file_struct *fmp4,
                             uint8_t *fragment_buffer,
                             int fragment_buffer_size,
                             double fragment_timestamp,
-                            int fragment_duration);
+                            int fragment_duration,
+                            void *buffer_pool);
 
 int fmp4_video_fragment_add(fragment_file_struct *fmp4,
                             uint8_t *fragment_buffer,
                             int fragment_buffer_size,
                             double fragment_timestamp,
                             int fragment_duration,
-                            int64_t fragment_composition_time);
+                            int64_t fragment_composition_time,
+                            void *buffer_pool);
 
 fragment_file_struct *fmp4_file_create_youtube(int video_media_type, int audio_media_type, int timescale, int lang_code, int frag_duration);
+fragment_file_struct *fmp4_file_create_muxed(int video_media_type, int audio_media_type, int timescale, int lang_code, int frag_duration);
 fragment_file_struct *fmp4_file_create(int media_type, int timescale, int lang_code, int frag_duration);
 int fmp4_file_finalize(fragment_file_struct *fmp4);
 int fmp4_fragment_start(fragment_file_struct *fmp4);
 int fmp4_fragment_end(fragment_file_struct *fmp4, int64_t *sidx_time, int64_t *sidx_duration, double start_time, double frag_length, uint32_t sequence_number, int fragment_type);
+int fmp4_fragment_part(fragment_file_struct *fmp4, double start_time, int fragment_type, int end_of_segment);
 int fmp4_video_set_pps(fragment_file_struct *fmp4, uint8_t *pps, int pps_size);
 int fmp4_video_set_sps(fragment_file_struct *fmp4, uint8_t *sps, int sps_size);
 int fmp4_video_set_vps(fragment_file_struct *fmp4, uint8_t *vps, int vps_size);
 int fmp4_output_header(fragment_file_struct *fmp4, int is_video);
 uint8_t *fmp4_get_fragment(fragment_file_struct *fmp4, int *fragment_size);
 int fmp4_video_track_create(fragment_file_struct *fmp4, int video_width, int video_height, int video_bitrate);
+int64_t fmp4_bytes_copied(void);
 int fmp4_audio_track_create(fragment_file_struct *fmp4, int audio_channels, int audio_samplerate, int audio_object_type, int audio_bitrate);
+int fmp4_set_encryption(fragment_file_struct *fmp4, void *crypt);
+int fmp4_iframe_fragment(fragment_file_struct *fmp4, int64_t *header_offset, int *header_size, int64_t *sample_offset, int *sample_size);
+int fmp4_segment_trim(fragment_file_struct *fmp4, uint8_t *segment, int segment_size, int64_t *from, int64_t *to, int fragment_type);
 
 
 #endif // _MP4CORE_H_
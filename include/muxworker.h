@@ -0,0 +1,50 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_MUXWORKER_H_)
+#define _MUXWORKER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define MAX_MUX_WORKERS            16
+#define MUXWORKER_QUEUE_SIZE       512
+#define MUXWORKER_JOB_SIZE         256
+
+typedef void (*muxworker_job)(void *context);
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    void *muxworker_create(int index);
+    void muxworker_destroy(void *worker);
+    int muxworker_submit(void *worker, muxworker_job job, const void *context, int context_size);
+    int muxworker_wait(void *worker);
+    void muxworker_report(void *worker);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _MUXWORKER_H_
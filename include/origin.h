@@ -0,0 +1,59 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_ORIGIN_H_)
+#define _ORIGIN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define ORIGIN_DEFAULT_CACHE_MB      512
+#define ORIGIN_MAX_NAME              256
+#define ORIGIN_MAX_CONNECTIONS       512
+#define ORIGIN_KEEPALIVE_TIMEOUT     15
+#define ORIGIN_MAX_REQUEST_SIZE      8192
+#define ORIGIN_HASH_SIZE             4096
+#define ORIGIN_SKIP_SUFFIX           "?_HLS_skip=YES"
+
+#define ORIGIN_FLAG_PINNED           0x01
+#define ORIGIN_FLAG_GROWING          0x02   // served with chunked transfer while it is still being written
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    int start_origin_server(fillet_app_struct *core);
+    int stop_origin_server(fillet_app_struct *core);
+    void *origin_open(void *origin, const char *name, int flags);
+    int origin_write(void *object, const struct iovec *iov, int iov_count);
+    int origin_close(void *origin, void *object);
+    int origin_put(void *origin, const char *name, const char *buffer, int buffer_size, int flags, int64_t media_sequence, int part);
+    int origin_alias(void *origin, const char *name, const char *alias);
+    void origin_report(void *origin);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _ORIGIN_H_
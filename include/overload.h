@@ -0,0 +1,59 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_OVERLOAD_H_)
+#define _OVERLOAD_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define OVERLOAD_LEVEL_NORMAL           0
+#define OVERLOAD_LEVEL_SHED_THUMBNAILS  1
+#define OVERLOAD_LEVEL_SHED_NONREF      2
+#define OVERLOAD_LEVEL_SHED_RENDITIONS  3
+#define OVERLOAD_LEVEL_MINIMAL          4
+
+#define OVERLOAD_HIGH_WATERMARK         75
+#define OVERLOAD_LOW_WATERMARK          50
+#define OVERLOAD_ESCALATE_INTERVAL_MS   1000
+#define OVERLOAD_RECOVER_INTERVAL_MS    10000
+#define OVERLOAD_FATAL_INTERVAL_MS      60000
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    void *overload_create(fillet_app_struct *core);
+    void overload_destroy(void *overload);
+    int overload_update(fillet_app_struct *core);
+    int overload_level(fillet_app_struct *core);
+    int overload_exhausted(fillet_app_struct *core, const char *what);
+    int overload_shed_thumbnails(fillet_app_struct *core);
+    int overload_rendition_shed(fillet_app_struct *core, int index, int count);
+    int overload_drop_video(fillet_app_struct *core, int source, uint8_t *buffer, int buffer_size, int sample_type, int sync_frame);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _OVERLOAD_H_
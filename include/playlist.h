@@ -0,0 +1,52 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_PLAYLIST_H_)
+#define _PLAYLIST_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define PLAYLIST_MAX_ENTRY_SIZE     1024
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    void *playlist_create(int window_size);
+    void playlist_destroy(void *playlist);
+    FILE *playlist_begin_entry(void *playlist, int64_t media_sequence, int64_t file_sequence);
+    int playlist_end_entry(void *playlist, FILE *entry);
+    int playlist_write(void *playlist, FILE *manifest, int64_t media_sequence, int count);
+    int playlist_changed(void *playlist, const char *buffer, size_t buffer_size);
+
+    void *playlist_create_archive(int max_entries);
+    int playlist_append(void *playlist, const char *text, int length);
+    int playlist_entries(void *playlist);
+    char *playlist_render(void *playlist, const char *header, size_t header_size, size_t *size);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _PLAYLIST_H_
@@ -0,0 +1,81 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_SEGCRYPT_H_)
+#define _SEGCRYPT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define SEGCRYPT_SCHEME_NONE            0
+#define SEGCRYPT_SCHEME_AES128          1     // hls ts, the whole segment in cbc
+#define SEGCRYPT_SCHEME_SAMPLE_AES      2     // hls ts, slice data and aac frames
+#define SEGCRYPT_SCHEME_CENC            3     // fmp4, aes-ctr on subsamples
+#define SEGCRYPT_SCHEME_CBCS            4     // fmp4, 1:9 pattern cbc with a constant iv
+
+#define SEGCRYPT_BLOCK_SIZE             16
+#define SEGCRYPT_KEY_SIZE               16
+#define SEGCRYPT_SAMPLE_IV_SIZE         8     // per sample iv carried in the senc for cenc
+#define SEGCRYPT_CLEAR_LEADER           32    // nal header and the start of the slice header
+#define SEGCRYPT_MAX_SOURCE             512
+
+typedef struct _segcrypt_key_struct_ {
+    uint8_t          kid[SEGCRYPT_KEY_SIZE];
+    uint8_t          key[SEGCRYPT_KEY_SIZE];
+    uint8_t          iv[SEGCRYPT_KEY_SIZE];    // constant iv for cbcs
+} segcrypt_key_struct;
+
+typedef struct _segcrypt_subsample_struct_ {
+    uint16_t         clear_bytes;
+    uint32_t         protected_bytes;
+} segcrypt_subsample_struct;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    int segcrypt_scheme(const char *name);
+    const char *segcrypt_scheme_name(int scheme);
+    int segcrypt_load_key(const char *source, segcrypt_key_struct *key);
+    int segcrypt_uuid(const uint8_t *kid, char *text, int text_size);
+
+    void *segcrypt_create(int scheme, segcrypt_key_struct *key);
+    void segcrypt_destroy(void *crypt);
+    int segcrypt_get_scheme(void *crypt);
+    segcrypt_key_struct *segcrypt_get_key(void *crypt);
+
+    int segcrypt_segment_start(void *crypt, int64_t media_sequence);
+    int segcrypt_segment_update(void *crypt, uint8_t *buffer, int buffer_size, uint8_t *lead, int *lead_size, uint8_t **body);
+    int segcrypt_segment_end(void *crypt, uint8_t *block);
+
+    int segcrypt_sample_aes(void *crypt, int media_type, uint8_t *sample, int sample_size, uint8_t **output);
+
+    int segcrypt_subsamples(int media_type, uint8_t *nal, int nal_size, int *clear_bytes, int *protected_bytes);
+    int segcrypt_sample_iv(void *crypt, uint8_t *iv);
+    int segcrypt_sample(void *crypt, uint8_t *sample, int sample_size, segcrypt_subsample_struct *subsamples, int subsample_count, uint8_t *iv);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _SEGCRYPT_H_
@@ -0,0 +1,71 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_SEGINDEX_H_)
+#define _SEGINDEX_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define SEGINDEX_MAGIC                  0x58444753
+#define SEGINDEX_VERSION                2
+#define SEGINDEX_MAX_NAME               512
+
+#define SEGINDEX_FLAG_DISCONTINUITY     0x01
+#define SEGINDEX_FLAG_CUE_OUT           0x02
+#define SEGINDEX_FLAG_CUE_OUT_CONT      0x04
+#define SEGINDEX_FLAG_CUE_IN            0x08
+
+// one archived segment, times and durations are in 90kHz ticks
+typedef struct _segindex_record_struct_ {
+    int64_t          sequence;
+    int64_t          pts;
+    int64_t          duration;
+    int64_t          program_time;      // utc milliseconds where the segment starts
+    int64_t          container;
+    int64_t          offset;
+    int32_t          bytes;
+    int32_t          flags;
+    int32_t          cue_duration;      // seconds
+    int32_t          cue_elapsed;       // milliseconds
+    int64_t          key_sequence;      // media sequence the segment iv was made from
+} segindex_record_struct;
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    void *segindex_create(const char *filename, int capacity);
+    void *segindex_open(const char *filename);
+    void segindex_destroy(void *index);
+    int64_t segindex_append(void *index, segindex_record_struct *record);
+    int segindex_count(void *index);
+    segindex_record_struct *segindex_record(void *index, int position);
+    int segindex_find(void *index, int64_t program_time);
+    int segindex_find_pts(void *index, int64_t pts);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _SEGINDEX_H_
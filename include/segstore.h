@@ -0,0 +1,51 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_SEGSTORE_H_)
+#define _SEGSTORE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define SEGSTORE_MAX_NAME          512
+#define SEGSTORE_MAX_RINGS         128
+#define SEGSTORE_MAX_LINKS         4
+#define SEGSTORE_SAFETY_SEGMENTS   4      // slots kept past the window for clients still fetching
+#define SEGSTORE_DIRECTORY         ".segstore"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    void *segstore_create(const char *directory, int slot_count, int64_t slot_bytes);
+    void segstore_destroy(void *store);
+    void *segstore_open(void *store, const char *filename, int *fd);
+    int segstore_close(void *store, void *slot);
+    int segstore_link(void *store, const char *target, const char *linkname);
+    void segstore_report(void *store);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _SEGSTORE_H_
@@ -0,0 +1,73 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#if !defined(_SEGWRITER_H_)
+#define _SEGWRITER_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define SEGWRITER_CHUNK_SIZE           (256*1024)
+#define SEGWRITER_BATCH_CHUNKS         4
+#define SEGWRITER_MAX_IOV              8
+#define SEGWRITER_MAX_PENDING          (256*1024*1024)
+#define SEGWRITER_MAX_NAME             512
+#define SEGWRITER_HISTOGRAM_BUCKETS    32
+
+#define SEGWRITER_FLAG_PINNED          0x01
+#define SEGWRITER_FLAG_MEMORY          0x02   // skip the disk when the origin keeps a copy
+#define SEGWRITER_FLAG_GROWING         0x04   // the origin serves it while it is being written
+#define SEGWRITER_FLAG_APPEND          0x08   // appended to a byte-range container
+
+typedef void (*segwriter_callback)(void *context, int event, const char *filename);
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+    void *segwriter_create(void);
+    void segwriter_destroy(void *writer);
+    int segwriter_set_origin(void *writer, void *origin, const char *root_directory);
+    int segwriter_set_store(void *writer, const char *directory, int slot_count, int64_t slot_bytes);
+    void *segwriter_open(void *writer, const char *filename, int flags);
+    void *segwriter_append(void *writer, const char *filename, int flags, int64_t offset);
+    int64_t segwriter_tell(void *file);
+    int segwriter_write(void *writer, void *file, const uint8_t *buffer, int buffer_size);
+    uint8_t *segwriter_reserve(void *writer, void *file, int size);
+    int segwriter_commit(void *writer, void *file, int size);
+    int segwriter_flush(void *writer, void *file);
+    int segwriter_close(void *writer, void *file);
+    int segwriter_file(void *writer, const char *filename, char *buffer, int buffer_size);
+    int segwriter_playlist(void *writer, const char *filename, char *buffer, int buffer_size, int flags, int64_t media_sequence, int part);
+    int segwriter_symlink(void *writer, const char *target, const char *linkname);
+    int segwriter_notify(void *writer, segwriter_callback callback, void *context, int event, const char *filename);
+    void segwriter_report(void *writer);
+
+    void latency_histogram_add(int64_t *histogram, int64_t usec);
+    int64_t latency_histogram_percentile(int64_t *histogram, int percentile);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // _SEGWRITER_H_
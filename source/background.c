@@ -37,6 +37,7 @@
 #include "dataqueue.h"
 #include "esignal.h"
 #include "background.h"
+#include "clipexport.h"
 #include "curl.h"
 #include "filletversion.h"
 
@@ -484,9 +485,22 @@ void *status_thread(void *context)
     return NULL;
 }
 
-void *client_thread(void *context)
+static const char *http_reason(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 409: return "Conflict";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+// the full control api, or with clip_only just the clip export on the loopback interface-
+// the dvr turns that one on and nothing on it can stop or kill the process
+static void restful_server(fillet_app_struct *core, int clip_only)
 {
-    fillet_app_struct *core = (fillet_app_struct*)context;
     int server = -1;
     int port = 18000;
     fd_set commset;
@@ -512,11 +526,9 @@ void *client_thread(void *context)
 
                 memset(&commserver, 0, sizeof(commserver));
 
-                // placeholder
-                // add option for local server loopback only
                 commserver.sin_family = AF_INET;
                 commserver.sin_port = htons(port);
-                commserver.sin_addr.s_addr = htonl(INADDR_ANY);
+                commserver.sin_addr.s_addr = htonl(clip_only ? INADDR_LOOPBACK : INADDR_ANY);
 
                 setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (char*)&yesflag, sizeof(yesflag));
 
@@ -594,6 +606,27 @@ void *client_thread(void *context)
                 syslog(LOG_INFO,"SESSION:%d (RESTFUL) STATUS: RECEIVED HTTP REQUEST (METHOD:%s,URL:%s,VER:%s)\n",
                        core->session_id, method, url, httpver);
 
+                if (clip_only && (strncmp(method,"POST",4) != 0 || strncmp(url,"/api/v1/clip",12) != 0)) {
+                    char *status_response = "{\"error\":[\"only clip export is served on this port\"]}";
+                    int content_length = strlen(status_response)+4;
+                    memset(response_buffer, 0, MAX_RESPONSE_SIZE);
+                    snprintf(response_buffer, MAX_RESPONSE_SIZE-1,
+                             "HTTP/1.1 404 Not Found\r\n"
+                             "Server: fillet\r\n"
+                             "Access-Control-Allow-Methods: POST\r\n"
+                             "Content-Length: %d\r\n"
+                             "\r\n"
+                             "%s\r\n\r\n",
+                             content_length,
+                             status_response);
+                    send(client, response_buffer, strlen(response_buffer), 0);
+                    close(client);
+                    client = -1;
+                    syslog(LOG_WARNING,"SESSION:%d (RESTFUL) WARNING: REFUSED %s %s ON THE CLIP PORT\n",
+                           core->session_id, method, url);
+                    continue;
+                }
+
                 if (strncmp(method,"GET",3) == 0) {
                     int ping_event = 0;
                     int status_event = 0;
@@ -671,6 +704,7 @@ void *client_thread(void *context)
                     int stop_event = 0;
                     int restart_event = 0;
                     int respawn_event = 0;
+                    int clip_event = 0;
                     dataqueue_message_struct *msg;
 
                     // "POST" methods
@@ -688,6 +722,41 @@ void *client_thread(void *context)
                         // kill the pid
                         respawn_event = 1;
                     }
+                    if (strncmp(url,"/api/v1/clip",12) == 0) {  // exports a vod clip from the dvr window
+                        clip_event = 1;
+                    }
+
+                    if (clip_event) {
+                        clip_request_struct clip_request;
+                        char status_response[MAX_STR_SIZE*4];
+                        int content_length;
+                        int http_status;
+
+                        if (clip_parse_request(strchr(url, '?') ? strchr(url, '?') + 1 : NULL, &clip_request) < 0) {
+                            snprintf(status_response, sizeof(status_response), "{\"error\":[\"invalid clip request\"]}");
+                            http_status = 400;
+                        } else {
+                            http_status = clip_export(core, &clip_request, status_response, sizeof(status_response));
+                        }
+                        content_length = strlen(status_response)+4;
+                        memset(response_buffer, 0, MAX_RESPONSE_SIZE);
+                        snprintf(response_buffer, MAX_RESPONSE_SIZE-1,
+                                 "HTTP/1.1 %d %s\r\n"
+                                 "Server: fillet\r\n"
+                                 "Access-Control-Allow-Methods: GET, POST\r\n"
+                                 "Content-Length: %d\r\n"
+                                 "\r\n"
+                                 "%s\r\n\r\n",
+                                 http_status, http_reason(http_status),
+                                 content_length,
+                                 status_response);
+                        send(client, response_buffer, strlen(response_buffer), 0);
+                        close(client);
+                        client = -1;
+                        syslog(LOG_INFO,"SESSION:%d (RESTFUL) STATUS: RECEIVED CLIP REQUEST (%d)\n",
+                               core->session_id, http_status);
+                        continue;
+                    }
 
                     if (respawn_event || restart_event || start_event || stop_event) {
                         //post to main thread something is ready
@@ -791,5 +860,16 @@ void *client_thread(void *context)
 
     free(request_buffer);
     free(response_buffer);
+}
+
+void *client_thread(void *context)
+{
+    restful_server((fillet_app_struct*)context, 0);
+    return NULL;
+}
+
+void *clip_thread(void *context)
+{
+    restful_server((fillet_app_struct*)context, 1);
     return NULL;
 }
@@ -0,0 +1,315 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "crc.h"
+#include "checkpoint.h"
+
+#define CHECKPOINT_SLOTS         2
+#define CHECKPOINT_PAGE_SIZE     4096
+#define CHECKPOINT_ALIGN(x)      ((((x) + CHECKPOINT_PAGE_SIZE - 1) / CHECKPOINT_PAGE_SIZE) * CHECKPOINT_PAGE_SIZE)
+
+typedef struct _checkpoint_header_struct_ {
+    uint32_t                magic;
+    uint32_t                version;
+    int32_t                 record_size;
+    int32_t                 block_count;
+    int64_t                 generation;        // 0 while the slot is being rewritten
+    uint32_t                table_crc;
+    uint32_t                reserved0;
+    int64_t                 reserved[4];
+} checkpoint_header_struct;
+
+// two copies of the record mapped from disk, a commit rewrites the older copy and only then
+// bumps its generation, so a crash part way through still leaves the previous one intact.
+// every block carries its own crc and only the blocks that changed are copied and summed again
+typedef struct _checkpoint_struct_ {
+    int                         fd;
+    int                         record_size;
+    int                         block_count;
+    size_t                      map_size;
+    uint8_t                     *map;
+    checkpoint_header_struct    *headers;
+    uint32_t                    *tables[CHECKPOINT_SLOTS];
+    uint8_t                     *records[CHECKPOINT_SLOTS];
+    uint8_t                     *changed;          // blocks rewritten since the last commit
+    uint8_t                     *carried;          // blocks the staging copy is still behind on
+    int                         current;           // newest complete copy, -1 if there is none
+    int                         staging;
+    int                         staging_open;
+    int64_t                     generation;
+    char                        filename[CHECKPOINT_MAX_NAME];
+} checkpoint_struct;
+
+static int block_length(checkpoint_struct *checkpoint, int block)
+{
+    int remaining = checkpoint->record_size - block * CHECKPOINT_BLOCK_SIZE;
+
+    return remaining < CHECKPOINT_BLOCK_SIZE ? remaining : CHECKPOINT_BLOCK_SIZE;
+}
+
+static int slot_valid(checkpoint_struct *checkpoint, int slot)
+{
+    checkpoint_header_struct *header = &checkpoint->headers[slot];
+    int block;
+
+    if (header->magic != CHECKPOINT_MAGIC ||
+        header->version != CHECKPOINT_VERSION ||
+        header->record_size != checkpoint->record_size ||
+        header->block_count != checkpoint->block_count ||
+        header->generation <= 0 ||
+        header->table_crc != getcrc32((unsigned char*)checkpoint->tables[slot], checkpoint->block_count * sizeof(uint32_t))) {
+        return 0;
+    }
+    for (block = 0; block < checkpoint->block_count; block++) {
+        if (checkpoint->tables[slot][block] != getcrc32(checkpoint->records[slot] + block * CHECKPOINT_BLOCK_SIZE, block_length(checkpoint, block))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void *checkpoint_create(const char *filename, int record_size)
+{
+    checkpoint_struct *checkpoint;
+    size_t table_size;
+    size_t record_span;
+    struct stat sb;
+    void *map;
+    int slot;
+
+    if (record_size <= 0) {
+        return NULL;
+    }
+
+    checkpoint = (checkpoint_struct*)malloc(sizeof(checkpoint_struct));
+    if (!checkpoint) {
+        return NULL;
+    }
+    memset(checkpoint, 0, sizeof(checkpoint_struct));
+    snprintf(checkpoint->filename, CHECKPOINT_MAX_NAME-1, "%s", filename);
+    checkpoint->record_size = record_size;
+    checkpoint->block_count = (record_size + CHECKPOINT_BLOCK_SIZE - 1) / CHECKPOINT_BLOCK_SIZE;
+    table_size = (size_t)checkpoint->block_count * sizeof(uint32_t);
+    record_span = CHECKPOINT_ALIGN((size_t)record_size);
+    checkpoint->map_size = CHECKPOINT_ALIGN(CHECKPOINT_SLOTS * (sizeof(checkpoint_header_struct) + table_size)) + CHECKPOINT_SLOTS * record_span;
+    checkpoint->changed = (uint8_t*)malloc(checkpoint->block_count);
+    checkpoint->carried = (uint8_t*)malloc(checkpoint->block_count);
+    if (!checkpoint->changed || !checkpoint->carried) {
+        free(checkpoint->changed);
+        free(checkpoint->carried);
+        free(checkpoint);
+        return NULL;
+    }
+    memset(checkpoint->changed, 0, checkpoint->block_count);
+    memset(checkpoint->carried, 0, checkpoint->block_count);
+
+    checkpoint->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (checkpoint->fd < 0) {
+        syslog(LOG_ERR,"CHECKPOINT: UNABLE TO OPEN %s (%s)\n", filename, strerror(errno));
+        goto create_failed;
+    }
+    if (fstat(checkpoint->fd, &sb) < 0) {
+        syslog(LOG_ERR,"CHECKPOINT: UNABLE TO SIZE %s (%s)\n", filename, strerror(errno));
+        close(checkpoint->fd);
+        goto create_failed;
+    }
+    if (sb.st_size != (off_t)checkpoint->map_size) {
+        if (sb.st_size > 0) {
+            syslog(LOG_INFO,"CHECKPOINT: %s DOES NOT MATCH THE STATE LAYOUT, STARTING OVER\n", filename);
+        }
+        // truncating first leaves every byte zero, so neither copy looks complete
+        if (ftruncate(checkpoint->fd, 0) < 0 || ftruncate(checkpoint->fd, checkpoint->map_size) < 0) {
+            syslog(LOG_ERR,"CHECKPOINT: UNABLE TO SIZE %s (%s)\n", filename, strerror(errno));
+            close(checkpoint->fd);
+            goto create_failed;
+        }
+    }
+
+    map = mmap(NULL, checkpoint->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, checkpoint->fd, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR,"CHECKPOINT: UNABLE TO MAP %s (%s)\n", filename, strerror(errno));
+        close(checkpoint->fd);
+        goto create_failed;
+    }
+    checkpoint->map = (uint8_t*)map;
+    checkpoint->headers = (checkpoint_header_struct*)map;
+    for (slot = 0; slot < CHECKPOINT_SLOTS; slot++) {
+        checkpoint->tables[slot] = (uint32_t*)(checkpoint->map + CHECKPOINT_SLOTS * sizeof(checkpoint_header_struct) + slot * table_size);
+        checkpoint->records[slot] = checkpoint->map + CHECKPOINT_ALIGN(CHECKPOINT_SLOTS * (sizeof(checkpoint_header_struct) + table_size)) + slot * record_span;
+    }
+
+    checkpoint->current = -1;
+    for (slot = 0; slot < CHECKPOINT_SLOTS; slot++) {
+        if (slot_valid(checkpoint, slot) && (checkpoint->current < 0 || checkpoint->headers[slot].generation > checkpoint->generation)) {
+            checkpoint->current = slot;
+            checkpoint->generation = checkpoint->headers[slot].generation;
+        }
+    }
+    if (checkpoint->current >= 0) {
+        // the other copy may be arbitrarily old, bring all of it forward on the first commit
+        memset(checkpoint->carried, 1, checkpoint->block_count);
+        checkpoint->staging = (checkpoint->current + 1) % CHECKPOINT_SLOTS;
+        syslog(LOG_INFO,"CHECKPOINT: RESUMING %s AT GENERATION %ld\n", filename, checkpoint->generation);
+    } else {
+        checkpoint->staging = 0;
+    }
+
+    return (void*)checkpoint;
+
+create_failed:
+    free(checkpoint->changed);
+    free(checkpoint->carried);
+    free(checkpoint);
+    return NULL;
+}
+
+void checkpoint_destroy(void *checkpoint)
+{
+    checkpoint_struct *checkpoint1 = (checkpoint_struct*)checkpoint;
+
+    if (!checkpoint1) {
+        return;
+    }
+    msync(checkpoint1->map, checkpoint1->map_size, MS_ASYNC);
+    munmap(checkpoint1->map, checkpoint1->map_size);
+    close(checkpoint1->fd);
+    free(checkpoint1->changed);
+    free(checkpoint1->carried);
+    free(checkpoint1);
+}
+
+static void open_staging(checkpoint_struct *checkpoint)
+{
+    int staging = checkpoint->staging;
+    int block;
+
+    // the copy stops being a candidate before any of it is touched
+    checkpoint->headers[staging].generation = 0;
+    __sync_synchronize();
+
+    for (block = 0; block < checkpoint->block_count; block++) {
+        if (checkpoint->carried[block] && checkpoint->current >= 0) {
+            size_t offset = (size_t)block * CHECKPOINT_BLOCK_SIZE;
+
+            memcpy(checkpoint->records[staging] + offset, checkpoint->records[checkpoint->current] + offset, block_length(checkpoint, block));
+            checkpoint->tables[staging][block] = checkpoint->tables[checkpoint->current][block];
+        }
+    }
+    memset(checkpoint->carried, 0, checkpoint->block_count);
+    // with nothing to start from every block of the first copy needs its sum
+    memset(checkpoint->changed, checkpoint->current < 0, checkpoint->block_count);
+    checkpoint->staging_open = 1;
+}
+
+// copies the part of the record that differs from the staging copy, nothing is visible until the commit
+void checkpoint_update(void *checkpoint, size_t offset, const void *data, size_t size)
+{
+    checkpoint_struct *checkpoint1 = (checkpoint_struct*)checkpoint;
+    const uint8_t *source = (const uint8_t*)data;
+
+    if (!checkpoint1 || offset + size > (size_t)checkpoint1->record_size) {
+        return;
+    }
+    if (!checkpoint1->staging_open) {
+        open_staging(checkpoint1);
+    }
+
+    while (size > 0) {
+        int block = offset / CHECKPOINT_BLOCK_SIZE;
+        size_t length = (size_t)(block + 1) * CHECKPOINT_BLOCK_SIZE - offset;
+        uint8_t *target = checkpoint1->records[checkpoint1->staging] + offset;
+
+        if (length > size) {
+            length = size;
+        }
+        if (memcmp(target, source, length) != 0) {
+            memcpy(target, source, length);
+            checkpoint1->changed[block] = 1;
+        }
+        source += length;
+        offset += length;
+        size -= length;
+    }
+}
+
+// publishes the staging copy, returns its generation
+int64_t checkpoint_commit(void *checkpoint)
+{
+    checkpoint_struct *checkpoint1 = (checkpoint_struct*)checkpoint;
+    checkpoint_header_struct *header;
+    int staging;
+    int block;
+
+    if (!checkpoint1) {
+        return -1;
+    }
+    if (!checkpoint1->staging_open) {
+        return checkpoint1->generation;
+    }
+    staging = checkpoint1->staging;
+    header = &checkpoint1->headers[staging];
+
+    for (block = 0; block < checkpoint1->block_count; block++) {
+        if (checkpoint1->changed[block]) {
+            checkpoint1->tables[staging][block] = getcrc32(checkpoint1->records[staging] + (size_t)block * CHECKPOINT_BLOCK_SIZE, block_length(checkpoint1, block));
+        }
+    }
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->record_size = checkpoint1->record_size;
+    header->block_count = checkpoint1->block_count;
+    header->table_crc = getcrc32((unsigned char*)checkpoint1->tables[staging], checkpoint1->block_count * sizeof(uint32_t));
+    // the record and its sums have to land before the generation that vouches for them
+    __sync_synchronize();
+    header->generation = checkpoint1->generation + 1;
+    msync(checkpoint1->map, checkpoint1->map_size, MS_ASYNC);
+
+    checkpoint1->generation++;
+    checkpoint1->current = staging;
+    checkpoint1->staging = (staging + 1) % CHECKPOINT_SLOTS;
+    checkpoint1->staging_open = 0;
+    memcpy(checkpoint1->carried, checkpoint1->changed, checkpoint1->block_count);
+
+    return checkpoint1->generation;
+}
+
+// copies part of the newest complete record out, returns 0 when there is nothing to resume from
+int checkpoint_restore(void *checkpoint, size_t offset, void *data, size_t size)
+{
+    checkpoint_struct *checkpoint1 = (checkpoint_struct*)checkpoint;
+
+    if (!checkpoint1 || checkpoint1->current < 0 || offset + size > (size_t)checkpoint1->record_size) {
+        return 0;
+    }
+    memcpy(data, checkpoint1->records[checkpoint1->current] + offset, size);
+    return 1;
+}
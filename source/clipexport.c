@@ -0,0 +1,876 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "fillet.h"
+#include "mp4core.h"
+#include "segindex.h"
+#include "clipexport.h"
+
+#define CLIP_MAX_PATH            512
+#define CLIP_MAX_STREAMS         ((MAX_VIDEO_SOURCES + MAX_AUDIO_STREAMS) * 2)
+#define CLIP_CLOCK               90000
+#define CLIP_PTS_MASK            0x1ffffffffLL
+
+#define CLIP_CUT_NONE            0
+#define CLIP_CUT_HEAD            1
+#define CLIP_CUT_TAIL            2
+
+// a clip segment is either a byte range of a live container or a boundary segment cut into its own file
+typedef struct _clip_piece_struct_ {
+    int64_t               container;
+    int64_t               offset;
+    int64_t               bytes;
+    int64_t               pts;
+    int64_t               duration;
+    int                   flags;
+    int                   cut;
+} clip_piece_struct;
+
+typedef struct _clip_stream_struct_ {
+    char                  variant[CLIP_MAX_PATH];      // live playlist name less the .m3u8
+    char                  uri_prefix[CLIP_MAX_PATH];   // container uri up to the container number
+    char                  map_uri[CLIP_MAX_PATH];      // empty for ts
+    const char            *uri_suffix;
+    int                   video;
+    int                   fmp4;
+    int                   number;                      // video output or audio substream
+    void                  *index;
+    clip_piece_struct     *pieces;
+    int                   piece_count;
+    int64_t               duration;
+    int64_t               program_time;
+} clip_stream_struct;
+
+typedef struct _clip_context_struct_ {
+    fillet_app_struct     *core;
+    char                  prefix[CLIP_MAX_PATH];
+    clip_stream_struct    streams[CLIP_MAX_STREAMS];
+    int                   stream_count;
+    int64_t               remuxed_bytes;
+    const char            *error;
+    int                   status;                      // http status the error is answered with
+} clip_context_struct;
+
+typedef struct _clip_unit_struct_ {
+    int                   offset;
+    int                   sync;
+    int64_t               time;
+} clip_unit_struct;
+
+// the first failure is the one reported
+static void clip_fail(clip_context_struct *clip, int status, const char *error)
+{
+    if (!clip->error) {
+        clip->error = error;
+        clip->status = status;
+    }
+}
+
+static int64_t clip_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int clip_valid_name(const char *name)
+{
+    const char *c;
+
+    if (!*name) {
+        return 0;
+    }
+    for (c = name; *c; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '-' || *c == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// start=&end= in utc milliseconds or start_pts=&end_pts= on the 90kHz timeline, name= is optional
+int clip_parse_request(const char *query, clip_request_struct *request)
+{
+    char parameters[CLIP_MAX_PATH];
+    char *parameter;
+    char *next;
+    int have_start = 0;
+    int have_end = 0;
+
+    memset(request, 0, sizeof(clip_request_struct));
+    if (!query) {
+        return -1;
+    }
+    snprintf(parameters, sizeof(parameters), "%s", query);
+    for (parameter = strtok_r(parameters, "&", &next); parameter; parameter = strtok_r(NULL, "&", &next)) {
+        if (strncmp(parameter, "start=", 6) == 0) {
+            request->start = strtoll(parameter + 6, NULL, 10);
+            have_start = 1;
+        } else if (strncmp(parameter, "end=", 4) == 0) {
+            request->end = strtoll(parameter + 4, NULL, 10);
+            have_end = 1;
+        } else if (strncmp(parameter, "start_pts=", 10) == 0) {
+            request->start = strtoll(parameter + 10, NULL, 10);
+            request->by_pts = 1;
+            have_start = 1;
+        } else if (strncmp(parameter, "end_pts=", 8) == 0) {
+            request->end = strtoll(parameter + 8, NULL, 10);
+            request->by_pts = 1;
+            have_end = 1;
+        } else if (strncmp(parameter, "name=", 5) == 0) {
+            snprintf(request->name, CLIP_MAX_NAME, "%s", parameter + 5);
+        }
+    }
+    if (!have_start || !have_end || request->end <= request->start || request->start < 0) {
+        return -1;
+    }
+    if (!request->name[0]) {
+        snprintf(request->name, CLIP_MAX_NAME, "%ld", request->start);
+    }
+    if (!clip_valid_name(request->name)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void clip_add_stream(clip_context_struct *clip, const char *variant, const char *uri_prefix, const char *uri_suffix,
+                            const char *map_uri, int video, int fmp4, int number)
+{
+    clip_stream_struct *stream = &clip->streams[clip->stream_count];
+    char index_name[CLIP_MAX_PATH * 2];
+
+    snprintf(index_name, sizeof(index_name), "%s/%s.idx", clip->core->cd->manifest_directory, variant);
+    stream->index = segindex_open(index_name);
+    if (!stream->index) {
+        return;
+    }
+    snprintf(stream->variant, CLIP_MAX_PATH, "%s", variant);
+    snprintf(stream->uri_prefix, CLIP_MAX_PATH, "%s", uri_prefix);
+    snprintf(stream->map_uri, CLIP_MAX_PATH, "%s", map_uri);
+    stream->uri_suffix = uri_suffix;
+    stream->video = video;
+    stream->fmp4 = fmp4;
+    stream->number = number;
+    clip->stream_count++;
+}
+
+// the dvr indexes sit next to the live playlists, one per rendition and format
+static void clip_find_streams(clip_context_struct *clip)
+{
+    config_options_struct *cd = clip->core->cd;
+    char variant[CLIP_MAX_PATH];
+    char uri_prefix[CLIP_MAX_PATH];
+    char map_uri[CLIP_MAX_PATH];
+    int i;
+
+    for (i = 0; i < MAX_VIDEO_SOURCES; i++) {
+        if (cd->enable_ts_output) {
+            snprintf(variant, CLIP_MAX_PATH, "video%d", i);
+            snprintf(uri_prefix, CLIP_MAX_PATH, "video_stream%d_range", i);
+            clip_add_stream(clip, variant, uri_prefix, ".ts", "", 1, 0, i);
+        }
+        if (cd->enable_fmp4_output) {
+            snprintf(variant, CLIP_MAX_PATH, "video%dfmp4", i);
+            snprintf(uri_prefix, CLIP_MAX_PATH, "video%d/segment_range", i);
+            snprintf(map_uri, CLIP_MAX_PATH, "video%d/init.mp4", i);
+            clip_add_stream(clip, variant, uri_prefix, ".mp4", map_uri, 1, 1, i);
+        }
+    }
+    for (i = 0; i < MAX_AUDIO_STREAMS; i++) {
+        if (cd->enable_ts_output) {
+            snprintf(variant, CLIP_MAX_PATH, "audio0_substream%d", i);
+            snprintf(uri_prefix, CLIP_MAX_PATH, "audio_stream0_substream_%d_range", i);
+            clip_add_stream(clip, variant, uri_prefix, ".ts", "", 0, 0, i);
+        }
+        if (cd->enable_fmp4_output) {
+            snprintf(variant, CLIP_MAX_PATH, "audio0_substream%d_fmp4", i);
+            snprintf(uri_prefix, CLIP_MAX_PATH, "audio0_substream%d/segment_range", i);
+            snprintf(map_uri, CLIP_MAX_PATH, "audio0_substream%d/init.mp4", i);
+            clip_add_stream(clip, variant, uri_prefix, ".mp4", map_uri, 0, 1, i);
+        }
+    }
+}
+
+static void clip_release(clip_context_struct *clip)
+{
+    int i;
+
+    for (i = 0; i < clip->stream_count; i++) {
+        segindex_destroy(clip->streams[i].index);
+        free(clip->streams[i].pieces);
+    }
+    free(clip);
+}
+
+static void clip_piece_uri(clip_context_struct *clip, clip_stream_struct *stream, clip_piece_struct *piece, char *uri, int uri_size)
+{
+    if (piece->cut == CLIP_CUT_NONE) {
+        snprintf(uri, uri_size, "%s%ld%s", stream->uri_prefix, piece->container, stream->uri_suffix);
+    } else {
+        snprintf(uri, uri_size, "%s%s_%s%s", clip->prefix, stream->variant,
+                 piece->cut == CLIP_CUT_HEAD ? "head" : "tail", stream->uri_suffix);
+    }
+}
+
+// written beside the live output and renamed into place so the origin never serves half a file
+static int clip_write_file(clip_context_struct *clip, const char *name, const void *buffer, size_t buffer_size)
+{
+    char filename[CLIP_MAX_PATH * 2];
+    char temporary[CLIP_MAX_PATH * 2 + 8];
+    FILE *output;
+    int failed;
+
+    snprintf(filename, sizeof(filename), "%s/%s", clip->core->cd->manifest_directory, name);
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+    output = fopen(temporary, "wb");
+    if (!output) {
+        syslog(LOG_ERR,"CLIP: UNABLE TO WRITE %s (%s)\n", temporary, strerror(errno));
+        return -1;
+    }
+    failed = fwrite(buffer, 1, buffer_size, output) != buffer_size;
+    failed |= fclose(output) != 0;
+    if (failed || rename(temporary, filename) < 0) {
+        syslog(LOG_ERR,"CLIP: UNABLE TO WRITE %s (%s)\n", filename, strerror(errno));
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+static int64_t clip_ts_time(uint8_t *timestamp)
+{
+    return ((int64_t)(timestamp[0] & 0x0e) << 29) | ((int64_t)timestamp[1] << 22) | ((int64_t)(timestamp[2] & 0xfe) << 14) |
+           ((int64_t)timestamp[3] << 7) | ((int64_t)timestamp[4] >> 1);
+}
+
+// the packetiser puts a pat/pmt in front of every frame, so cutting at one of those leaves
+// exactly the packets a fresh mux of the remaining frames would produce
+static int clip_ts_trim(uint8_t *segment, int segment_size, int64_t duration, int video,
+                        int64_t *from, int64_t *to, int *cut_start, int *cut_end)
+{
+    clip_unit_struct *units;
+    int unit_count = 0;
+    int first = 0;
+    int last;
+    int pat = -1;
+    int64_t best;
+    int pos;
+    int unit;
+
+    units = (clip_unit_struct*)malloc(sizeof(clip_unit_struct) * (segment_size / 188 + 1));
+    if (!units) {
+        return -1;
+    }
+    for (pos = 0; pos + 188 <= segment_size; pos += 188) {
+        uint8_t *packet = segment + pos;
+        int pid = ((packet[1] & 0x1f) << 8) | packet[2];
+        int payload = 4;
+        uint8_t *pes;
+
+        if (packet[0] != 0x47) {
+            free(units);
+            return -1;
+        }
+        if (pid == 0) {
+            pat = pos;
+            continue;
+        }
+        if (!(packet[1] & 0x40)) {
+            continue;
+        }
+        if (packet[3] & 0x20) {
+            payload += 1 + packet[4];
+        }
+        pes = packet + payload;
+        if (payload + 19 > 188 || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01 || pes[3] < 0xc0 || !(pes[7] & 0x80)) {
+            continue;
+        }
+        units[unit_count].offset = pat >= 0 ? pat : pos;
+        units[unit_count].sync = !video || ((packet[3] & 0x20) && packet[4] > 0 && (packet[5] & 0x40));
+        units[unit_count].time = clip_ts_time((pes[7] & 0x40) ? pes + 14 : pes + 9);
+        unit_count++;
+        pat = -1;
+    }
+    if (unit_count == 0) {
+        free(units);
+        return -1;
+    }
+    for (unit = unit_count - 1; unit >= 0; unit--) {
+        units[unit].time = (units[unit].time - units[0].time) & CLIP_PTS_MASK;
+    }
+
+    best = -1;
+    for (unit = 0; unit < unit_count && *from > 0; unit++) {
+        if (units[unit].sync && (best < 0 || llabs(units[unit].time - *from) < best)) {
+            best = llabs(units[unit].time - *from);
+            first = unit;
+        }
+    }
+    last = unit_count;
+    best = -1;
+    for (unit = first + 1; unit <= unit_count && *to >= 0; unit++) {
+        int64_t end_time = unit < unit_count ? units[unit].time : duration;
+
+        if (best < 0 || llabs(end_time - *to) < best) {
+            best = llabs(end_time - *to);
+            last = unit;
+        }
+    }
+
+    *from = units[first].time;
+    *to = last < unit_count ? units[last].time : duration;
+    *cut_start = units[first].offset;
+    *cut_end = last < unit_count ? units[last].offset : segment_size;
+    free(units);
+
+    return *to > *from ? 0 : 1;
+}
+
+// re-muxes a boundary segment so the clip starts on the nearest idr and stops on the nearest frame.
+// returns 1 when nothing of the segment is left
+static int clip_cut_piece(clip_context_struct *clip, clip_stream_struct *stream, segindex_record_struct *record,
+                          clip_piece_struct *piece, int64_t *from, int64_t *to)
+{
+    char filename[CLIP_MAX_PATH * 2];
+    char uri[CLIP_MAX_PATH];
+    uint8_t *segment;
+    ssize_t bytes;
+    int retval;
+    int fd;
+
+    piece->cut = CLIP_CUT_NONE;
+    clip_piece_uri(clip, stream, piece, uri, sizeof(uri));
+    snprintf(filename, sizeof(filename), "%s/%s", clip->core->cd->manifest_directory, uri);
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        clip_fail(clip, 503, "segment container is missing");
+        return -1;
+    }
+    segment = (uint8_t*)malloc(record->bytes);
+    if (!segment) {
+        close(fd);
+        return -1;
+    }
+    bytes = pread(fd, segment, record->bytes, record->offset);
+    close(fd);
+    if (bytes != record->bytes) {
+        // still queued on the writer thread
+        clip_fail(clip, 503, "segment not written yet");
+        free(segment);
+        return -1;
+    }
+
+    piece->cut = *from > 0 ? CLIP_CUT_HEAD : CLIP_CUT_TAIL;
+    clip_piece_uri(clip, stream, piece, uri, sizeof(uri));
+    if (stream->fmp4) {
+        fragment_file_struct *fmp4;
+
+        // with muxed cmaf the primary audio is the second track of every video segment
+        if (stream->video && clip->core->cd->enable_muxed_cmaf) {
+            fmp4 = fmp4_file_create_muxed(MEDIA_TYPE_H264, MEDIA_TYPE_AAC, CLIP_CLOCK, 0x15c7, clip->core->cd->segment_length);
+        } else {
+            fmp4 = fmp4_file_create(stream->video ? MEDIA_TYPE_H264 : MEDIA_TYPE_AAC, CLIP_CLOCK, 0x15c7, clip->core->cd->segment_length);
+        }
+        if (!fmp4) {
+            free(segment);
+            return -1;
+        }
+        if (stream->video) {
+            fmp4_video_track_create(fmp4, 0, 0, 0);
+            if (fmp4->enable_muxed) {
+                fmp4_audio_track_create(fmp4, 2, 48000, 2, 0);
+            }
+        } else {
+            fmp4_audio_track_create(fmp4, 2, 48000, 2, 0);
+        }
+        retval = fmp4_segment_trim(fmp4, segment, record->bytes, from, to, stream->video ? VIDEO_FRAGMENT : AUDIO_FRAGMENT);
+        if (retval == 0) {
+            int fragment_size;
+            uint8_t *fragment = fmp4_get_fragment(fmp4, &fragment_size);
+
+            retval = clip_write_file(clip, uri, fragment, fragment_size);
+            clip->remuxed_bytes += fragment_size;
+        }
+        fmp4_file_finalize(fmp4);
+    } else {
+        int cut_start;
+        int cut_end;
+
+        retval = clip_ts_trim(segment, record->bytes, record->duration, stream->video, from, to, &cut_start, &cut_end);
+        if (retval == 0) {
+            retval = clip_write_file(clip, uri, segment + cut_start, cut_end - cut_start);
+            clip->remuxed_bytes += cut_end - cut_start;
+        }
+    }
+    free(segment);
+    if (retval < 0 && !clip->error) {
+        clip_fail(clip, 500, "unable to cut a boundary segment");
+    }
+
+    return retval;
+}
+
+// everything between the boundary segments is referenced where it already sits in the containers
+static int clip_export_stream(clip_context_struct *clip, clip_stream_struct *stream, int64_t *start, int64_t *end)
+{
+    int64_t sequence = -1;
+    int first;
+    int last;
+    int count;
+    int i;
+
+    first = segindex_find(stream->index, *start);
+    last = segindex_find(stream->index, *end - 1);
+    if (first < 0 || last < first) {
+        clip_fail(clip, 404, "clip is outside the dvr window");
+        return -1;
+    }
+    count = last - first + 1;
+    stream->pieces = (clip_piece_struct*)malloc(sizeof(clip_piece_struct) * count);
+    if (!stream->pieces) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        segindex_record_struct *current = segindex_record(stream->index, first + i);
+        segindex_record_struct record;
+        clip_piece_struct *piece = &stream->pieces[stream->piece_count];
+        int64_t from = 0;
+        int64_t to = -1;
+        int retval = 0;
+
+        if (!current) {
+            clip_fail(clip, 503, "dvr window moved, try again");
+            return -1;
+        }
+        record = *current;
+        if (sequence >= 0 && record.sequence != sequence + 1) {
+            clip_fail(clip, 503, "dvr window moved, try again");
+            return -1;
+        }
+        sequence = record.sequence;
+
+        if (i == 0) {
+            from = (*start - record.program_time) * CLIP_CLOCK / 1000;
+        }
+        if (i == count - 1) {
+            to = (*end - record.program_time) * CLIP_CLOCK / 1000;
+            if (to >= record.duration) {
+                to = -1;
+            }
+        }
+
+        memset(piece, 0, sizeof(clip_piece_struct));
+        piece->container = record.container;
+        piece->offset = record.offset;
+        piece->bytes = record.bytes;
+        piece->flags = record.flags;
+        if (from > 0 || to >= 0) {
+            retval = clip_cut_piece(clip, stream, &record, piece, &from, &to);
+            if (retval < 0) {
+                return -1;
+            }
+        }
+        if (to < 0) {
+            to = record.duration;
+        }
+        if (i == 0) {
+            *start = record.program_time + from * 1000 / CLIP_CLOCK;
+            stream->program_time = *start;
+        }
+        if (i == count - 1) {
+            *end = record.program_time + to * 1000 / CLIP_CLOCK;
+        }
+        if (retval == 1) {
+            continue;
+        }
+        piece->pts = record.pts + from;
+        piece->duration = to - from;
+        stream->duration += piece->duration;
+        stream->piece_count++;
+    }
+    if (stream->piece_count == 0) {
+        clip_fail(clip, 400, "clip is shorter than a frame");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int clip_write_variant(clip_context_struct *clip, clip_stream_struct *stream)
+{
+    char name[CLIP_MAX_PATH * 2];
+    char uri[CLIP_MAX_PATH];
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    FILE *playlist;
+    int64_t longest = 0;
+    time_t seconds = stream->program_time / 1000;
+    struct tm tm_program;
+    int retval;
+    int i;
+
+    for (i = 0; i < stream->piece_count; i++) {
+        if (stream->pieces[i].duration > longest) {
+            longest = stream->pieces[i].duration;
+        }
+    }
+
+    playlist = open_memstream(&buffer, &buffer_size);
+    if (!playlist) {
+        return -1;
+    }
+    fprintf(playlist,"#EXTM3U\n");
+    fprintf(playlist,"#EXT-X-VERSION:%d\n", stream->fmp4 ? 6 : 4);
+    fprintf(playlist,"#EXT-X-PLAYLIST-TYPE:VOD\n");
+    fprintf(playlist,"#EXT-X-MEDIA-SEQUENCE:0\n");
+    fprintf(playlist,"#EXT-X-INDEPENDENT-SEGMENTS\n");
+    fprintf(playlist,"#EXT-X-TARGETDURATION:%ld\n", (longest + CLIP_CLOCK - 1) / CLIP_CLOCK);
+    if (stream->fmp4) {
+        fprintf(playlist,"#EXT-X-MAP:URI=\"%s\"\n", stream->map_uri);
+    }
+    gmtime_r(&seconds, &tm_program);
+    fprintf(playlist,"#EXT-X-PROGRAM-DATE-TIME:%d-%02d-%02dT%02d:%02d:%02d.%03ldZ\n",
+            tm_program.tm_year + 1900, tm_program.tm_mon + 1, tm_program.tm_mday,
+            tm_program.tm_hour, tm_program.tm_min, tm_program.tm_sec, stream->program_time % 1000);
+    for (i = 0; i < stream->piece_count; i++) {
+        clip_piece_struct *piece = &stream->pieces[i];
+
+        if (i > 0 && (piece->flags & SEGINDEX_FLAG_DISCONTINUITY)) {
+            fprintf(playlist,"#EXT-X-DISCONTINUITY\n");
+        }
+        fprintf(playlist,"#EXTINF:%.3f,\n", (double)piece->duration / (double)CLIP_CLOCK);
+        if (piece->cut == CLIP_CUT_NONE) {
+            fprintf(playlist,"#EXT-X-BYTERANGE:%ld@%ld\n", piece->bytes, piece->offset);
+        }
+        clip_piece_uri(clip, stream, piece, uri, sizeof(uri));
+        fprintf(playlist,"%s\n", uri);
+    }
+    fprintf(playlist,"#EXT-X-ENDLIST\n");
+    fclose(playlist);
+
+    snprintf(name, sizeof(name), "%s%s.m3u8", clip->prefix, stream->variant);
+    retval = clip_write_file(clip, name, buffer, buffer_size);
+    free(buffer);
+
+    return retval;
+}
+
+static char *clip_read_manifest(clip_context_struct *clip, const char *name)
+{
+    char filename[CLIP_MAX_PATH * 2];
+    struct stat sb;
+    char *buffer;
+    FILE *input;
+
+    snprintf(filename, sizeof(filename), "%s/%s", clip->core->cd->manifest_directory, name);
+    input = fopen(filename, "rb");
+    if (!input) {
+        return NULL;
+    }
+    if (fstat(fileno(input), &sb) < 0 || !(buffer = (char*)malloc(sb.st_size + 1))) {
+        fclose(input);
+        return NULL;
+    }
+    buffer[fread(buffer, 1, sb.st_size, input)] = '\0';
+    fclose(input);
+
+    return buffer;
+}
+
+static int clip_exported(clip_context_struct *clip, const char *uri)
+{
+    char filename[CLIP_MAX_PATH * 2];
+
+    snprintf(filename, sizeof(filename), "%s/%s%s", clip->core->cd->manifest_directory, clip->prefix, uri);
+    return access(filename, R_OK) == 0;
+}
+
+// the live master already carries the codecs and bandwidths, only the variant uris change
+static int clip_write_master(clip_context_struct *clip, const char *live_name, char *output_name, int output_size)
+{
+    char *live = clip_read_manifest(clip, live_name);
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    char *line;
+    char *next;
+    FILE *master;
+    int retval;
+
+    if (!live) {
+        clip_fail(clip, 500, "live master playlist is missing");
+        return -1;
+    }
+    master = open_memstream(&buffer, &buffer_size);
+    if (!master) {
+        free(live);
+        return -1;
+    }
+    for (line = strtok_r(live, "\n", &next); line; line = strtok_r(NULL, "\n", &next)) {
+        char *uri = strstr(line, "URI=\"");
+
+        if (line[0] == '#' && uri) {
+            uri += 5;
+            fprintf(master,"%.*s%s%s\n", (int)(uri - line), line, clip->prefix, uri);
+        } else if (line[0] != '#' && line[0] != '\0') {
+            if (!clip_exported(clip, line)) {
+                clip_fail(clip, 500, "a rendition has no dvr index");
+                break;
+            }
+            fprintf(master,"%s%s\n", clip->prefix, line);
+        } else {
+            fprintf(master,"%s\n", line);
+        }
+    }
+    fclose(master);
+    free(live);
+
+    snprintf(output_name, output_size, "%s%s", clip->prefix, live_name);
+    retval = clip->error ? -1 : clip_write_file(clip, output_name, buffer, buffer_size);
+    free(buffer);
+    if (retval < 0 && !clip->error) {
+        clip_fail(clip, 500, "unable to write the clip playlists");
+    }
+
+    return retval;
+}
+
+static clip_stream_struct *clip_dash_stream(clip_context_struct *clip, int video, int number)
+{
+    int i;
+
+    for (i = 0; i < clip->stream_count; i++) {
+        clip_stream_struct *stream = &clip->streams[i];
+
+        if (stream->fmp4 && stream->video == video && stream->number == number) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static void clip_write_segment_list(clip_context_struct *clip, FILE *mpd, clip_stream_struct *stream)
+{
+    char uri[CLIP_MAX_PATH];
+    int i;
+
+    fprintf(mpd,"<SegmentList presentationTimeOffset=\"%ld\" timescale=\"%d\">\n", stream->pieces[0].pts, CLIP_CLOCK);
+    fprintf(mpd,"<Initialization sourceURL=\"%s\"/>\n", stream->map_uri);
+    fprintf(mpd,"<SegmentTimeline>\n");
+    for (i = 0; i < stream->piece_count; i++) {
+        fprintf(mpd,"<S t=\"%ld\" d=\"%ld\"/>\n", stream->pieces[i].pts, stream->pieces[i].duration);
+    }
+    fprintf(mpd,"</SegmentTimeline>\n");
+    for (i = 0; i < stream->piece_count; i++) {
+        clip_piece_struct *piece = &stream->pieces[i];
+
+        clip_piece_uri(clip, stream, piece, uri, sizeof(uri));
+        if (piece->cut == CLIP_CUT_NONE) {
+            fprintf(mpd,"<SegmentURL media=\"%s\" mediaRange=\"%ld-%ld\"/>\n", uri, piece->offset, piece->offset + piece->bytes - 1);
+        } else {
+            fprintf(mpd,"<SegmentURL media=\"%s\"/>\n", uri);
+        }
+    }
+    fprintf(mpd,"</SegmentList>\n");
+}
+
+// the live mpd is rewritten as a static presentation, each segment template or list is
+// swapped for the clip's own segment list
+static int clip_write_mpd(clip_context_struct *clip, double duration, char *output_name, int output_size)
+{
+    char *live = clip_read_manifest(clip, clip->core->cd->manifest_dash);
+    clip_stream_struct *stream = NULL;
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    char *line;
+    char *next;
+    FILE *mpd;
+    int video = 0;
+    int representation = 0;
+    int skipping = 0;
+    int retval;
+
+    if (!live) {
+        clip_fail(clip, 500, "live mpd is missing");
+        return -1;
+    }
+    mpd = open_memstream(&buffer, &buffer_size);
+    if (!mpd) {
+        free(live);
+        return -1;
+    }
+    for (line = strtok_r(live, "\n", &next); line; line = strtok_r(NULL, "\n", &next)) {
+        if (strncmp(line, "<MPD ", 5) == 0) {
+            fprintf(mpd,"<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" minBufferTime=\"PT5S\" type=\"static\" mediaPresentationDuration=\"PT%.3fS\">\n",
+                    duration);
+        } else if (strncmp(line, "<AdaptationSet ", 15) == 0) {
+            char *id = strstr(line, " id=\"");
+
+            video = strstr(line, "contentType=\"video\"") != NULL;
+            representation = video ? 0 : (id ? atoi(id + 5) - 1 : 0);
+            fprintf(mpd,"%s\n", line);
+        } else if (strncmp(line, "<Representation ", 16) == 0) {
+            stream = clip_dash_stream(clip, video, representation);
+            if (video) {
+                representation++;
+            }
+            fprintf(mpd,"%s\n", line);
+        } else if (strncmp(line, "<SegmentTemplate", 16) == 0 || strncmp(line, "<SegmentList", 12) == 0) {
+            skipping = 1;
+        } else if (strncmp(line, "</SegmentTemplate>", 18) == 0 || strncmp(line, "</SegmentList>", 14) == 0) {
+            skipping = 0;
+            if (!stream || stream->piece_count == 0) {
+                clip_fail(clip, 500, "a rendition has no dvr index");
+                break;
+            }
+            clip_write_segment_list(clip, mpd, stream);
+        } else if (!skipping && strncmp(line, "<UTCTiming", 10) != 0) {
+            fprintf(mpd,"%s\n", line);
+        }
+    }
+    fclose(mpd);
+    free(live);
+
+    snprintf(output_name, output_size, "%s%s", clip->prefix, clip->core->cd->manifest_dash);
+    retval = clip->error ? -1 : clip_write_file(clip, output_name, buffer, buffer_size);
+    free(buffer);
+    if (retval < 0 && !clip->error) {
+        clip_fail(clip, 500, "unable to write the clip playlists");
+    }
+
+    return retval;
+}
+
+// the first rendition picks the cut points, the rest follow it so every rendition covers
+// the same span.  returns the http status to answer with, the json body is left in result
+int clip_export(fillet_app_struct *core, clip_request_struct *request, char *result, int result_size)
+{
+    clip_context_struct *clip;
+    clip_stream_struct *reference;
+    char playlists[CLIP_MAX_PATH * 4];
+    char name[CLIP_MAX_PATH];
+    int64_t started = clip_now_us();
+    int64_t start = request->start;
+    int64_t end = request->end;
+    int length = 0;
+    double elapsed;
+    double duration;
+    int i;
+
+    // the archived segments are encrypted with per segment ivs the clip would have to carry over
+    if (core->cd->ts_encryption || core->cd->fmp4_encryption) {
+        snprintf(result, result_size, "{\"error\":[\"clip export is not available for encrypted output\"]}");
+        return 409;
+    }
+
+    clip = (clip_context_struct*)malloc(sizeof(clip_context_struct));
+    if (!clip) {
+        snprintf(result, result_size, "{\"error\":[\"internal error\"]}");
+        return 500;
+    }
+    memset(clip, 0, sizeof(clip_context_struct));
+    clip->core = core;
+    snprintf(clip->prefix, CLIP_MAX_PATH, "%s%s_", CLIP_FILE_PREFIX, request->name);
+
+    clip_find_streams(clip);
+    if (clip->stream_count == 0) {
+        snprintf(result, result_size, "{\"error\":[\"no dvr index to clip from\"]}");
+        clip_release(clip);
+        return 404;
+    }
+    reference = &clip->streams[0];
+
+    if (request->by_pts) {
+        int first = segindex_find_pts(reference->index, start);
+        int last = segindex_find_pts(reference->index, end);
+        segindex_record_struct *record;
+
+        if (first < 0 || last < 0) {
+            snprintf(result, result_size, "{\"error\":[\"clip is outside the dvr window\"]}");
+            clip_release(clip);
+            return 404;
+        }
+        record = segindex_record(reference->index, first);
+        start = record->program_time + (start - record->pts) * 1000 / CLIP_CLOCK;
+        record = segindex_record(reference->index, last);
+        end = record->program_time + (end - record->pts) * 1000 / CLIP_CLOCK;
+    }
+
+    for (i = 0; i < clip->stream_count; i++) {
+        int64_t stream_start = start;
+        int64_t stream_end = end;
+
+        if (clip_export_stream(clip, &clip->streams[i], &stream_start, &stream_end) < 0 ||
+            clip_write_variant(clip, &clip->streams[i]) < 0) {
+            break;
+        }
+        if (i == 0) {
+            start = stream_start;
+            end = stream_end;
+        }
+    }
+
+    playlists[0] = '\0';
+    if (i < clip->stream_count && !clip->error) {
+        clip_fail(clip, 500, "internal error");
+    }
+    if (!clip->error && core->cd->enable_ts_output && clip_write_master(clip, core->cd->manifest_hls, name, sizeof(name)) == 0) {
+        length += snprintf(playlists + length, sizeof(playlists) - length, ",\"hls\":\"%s\"", name);
+    }
+    if (!clip->error && core->cd->enable_fmp4_output && clip_write_master(clip, core->cd->manifest_fmp4, name, sizeof(name)) == 0) {
+        length += snprintf(playlists + length, sizeof(playlists) - length, ",\"fmp4\":\"%s\"", name);
+    }
+    if (!clip->error && core->cd->enable_fmp4_output && clip_write_mpd(clip, (double)reference->duration / CLIP_CLOCK, name, sizeof(name)) == 0) {
+        length += snprintf(playlists + length, sizeof(playlists) - length, ",\"dash\":\"%s\"", name);
+    }
+    if (clip->error) {
+        int status = clip->status;
+
+        syslog(LOG_ERR,"CLIP: UNABLE TO EXPORT %s (%s)\n", request->name, clip->error);
+        snprintf(result, result_size, "{\"error\":[\"%s\"]}", clip->error);
+        clip_release(clip);
+        return status;
+    }
+
+    elapsed = (double)(clip_now_us() - started) / 1000.0;
+    duration = (double)reference->duration / CLIP_CLOCK;
+    syslog(LOG_INFO,"CLIP: EXPORTED %s (%.3fs, %d RENDITIONS, %ld BYTES RE-MUXED) IN %.3fms\n",
+           request->name, duration, clip->stream_count, clip->remuxed_bytes, elapsed);
+    snprintf(result, result_size,
+             "{\"status\":[\"clip exported\"],\"name\":\"%s\",\"start\":%ld,\"end\":%ld,\"duration\":%.3f,"
+             "\"renditions\":%d,\"remuxed_bytes\":%ld,\"elapsed_ms\":%.3f%s}",
+             request->name, start, end, duration, clip->stream_count, clip->remuxed_bytes, elapsed, playlists);
+    clip_release(clip);
+
+    return 200;
+}
@@ -95,8 +95,8 @@ int send_signal(fillet_app_struct *core, int signal_type, const char *message)
         snprintf(msg->smallbuf, MAX_SMALLBUF_SIZE-1, "%s", message);
         dataqueue_put_front(core->signal_queue, msg);
     } else {
-        fprintf(stderr,"fatal error: unable to generate signal!\n");
-        exit(-1);
+        fprintf(stderr,"error: unable to generate signal, dropping (%s)\n", message);
+        return -1;
     }
     return 0;
 }
@@ -51,7 +51,10 @@
 #include "mp4core.h"
 #include "background.h"
 #include "webdav.h"
+#include "origin.h"
+#include "segstore.h"
 #include "esignal.h"
+#include "overload.h"
 #include "filletversion.h"
 #if defined(ENABLE_TRANSCODE)
 #include "transvideo.h"
@@ -79,6 +82,11 @@ static int enable_webvtt = 0;
 static int enable_fmp4 = 0;
 static int enable_youtube = 0;
 static int enable_ts = 0;
+static int enable_hugepages = 0;
+static int enable_byterange = 0;
+static int enable_trickplay = 0;
+static int enable_muxed_ts = 0;
+static int enable_muxed_cmaf = 0;
 static int audio_streams = 1;
 
 static config_options_struct config_data;
@@ -113,6 +121,22 @@ static struct option long_options[] = {
      {"cdnusername", required_argument, 0, '7'},
      {"cdnpassword", required_argument, 0, '8'},
      {"cdnserver", required_argument, 0, '9'},
+     {"hugepages", no_argument, &enable_hugepages, 'G'},
+     {"numa", required_argument, 0, 'N'},
+     {"origin", required_argument, 0, 'O'},
+     {"origin-cache", required_argument, 0, 'K'},
+     {"part", required_argument, 0, 'L'},
+     {"chunk", required_argument, 0, 'J'},
+     {"mux-workers", required_argument, 0, 'X'},
+     {"segment-store", required_argument, 0, 'Q'},
+     {"byterange", no_argument, &enable_byterange, 'R'},
+     {"dvr", required_argument, 0, 'D'},
+     {"trickplay", no_argument, &enable_trickplay, 'j'},
+     {"muxed-ts", no_argument, &enable_muxed_ts, 'x'},
+     {"muxed-cmaf", no_argument, &enable_muxed_cmaf, 'b'},
+     {"encrypt", required_argument, 0, 'E'},              // segment encryption         --encrypt aes128,cbcs
+     {"key", required_argument, 0, 'k'},                  // key file or url            --key /etc/fillet/key.json
+     {"key-uri", required_argument, 0, 'U'},              // key uri for the playlists  --key-uri https://keys.example.com/channel1
 #if defined(ENABLE_TRANSCODE)
      {"transcode", no_argument, &enable_transcode, 'z'},
      {"outputs", required_argument, 0, 'o'},              // number of output profiles
@@ -305,6 +329,8 @@ static int destroy_fillet_core(fillet_app_struct *core)
     memory_destroy(core->scte35_pool);
     memory_destroy(core->raw_video_pool);
     memory_destroy(core->raw_audio_pool);
+    overload_destroy(core->overload);
+    core->overload = NULL;
 
     free(core);
 
@@ -315,6 +341,8 @@ static fillet_app_struct *create_fillet_core(config_options_struct *cd, int num_
 {
     fillet_app_struct *core;
     int current_source;
+    int video_pool_count = MAX_VIDEO_COMPRESSED_BUFFERS;
+    int audio_pool_count = MAX_AUDIO_COMPRESSED_BUFFERS;
 
     core = (fillet_app_struct*)malloc(sizeof(fillet_app_struct));
     if (!core) {
@@ -342,6 +370,8 @@ static fillet_app_struct *create_fillet_core(config_options_struct *cd, int num_
     core->fillet_msg_pool = memory_create(MAX_MSG_BUFFERS, 0);
     core->frame_msg_pool = memory_create(MAX_FRAME_BUFFERS, 0);
 #endif
+    memory_enable_magazines(core->fillet_msg_pool);
+    memory_enable_magazines(core->frame_msg_pool);
     // this will limit memory usage for transcode so that it never turns into a
     // neverending malloc causing other instances of the app to fail
     //
@@ -349,11 +379,19 @@ static fillet_app_struct *create_fillet_core(config_options_struct *cd, int num_
     // while running for longer periods of time
     // heap fragmentation will add more kernel load- for now this is alright
     // since we are aware of the tradeoffs regarding this choice
-    core->compressed_video_pool = memory_create(MAX_VIDEO_COMPRESSED_BUFFERS, 0);
-    core->compressed_audio_pool = memory_create(MAX_AUDIO_COMPRESSED_BUFFERS, 0);
+    //
+    // fmp4 keeps a reference on each compressed frame until its segment is
+    // written, so leave room for a full segment per rendition on top of that
+    if (cd->enable_fmp4_output) {
+        video_pool_count += num_video_sources * POOL_PINNED_VIDEO_FPS * cd->segment_length;
+        audio_pool_count += num_audio_sources * POOL_PINNED_AUDIO_FPS * cd->segment_length;
+    }
+    core->compressed_video_pool = memory_create(video_pool_count, 0);
+    core->compressed_audio_pool = memory_create(audio_pool_count, 0);
     core->scte35_pool = memory_create(MAX_VIDEO_COMPRESSED_BUFFERS, 0);
     core->raw_video_pool = memory_create(MAX_VIDEO_RAW_BUFFERS, 0);
     core->raw_audio_pool = memory_create(MAX_AUDIO_RAW_BUFFERS, 0);
+    core->overload = overload_create(core);
 
     core->video_receive_time_set = 0;
     core->video_decode_time_set = 0;
@@ -417,7 +455,7 @@ static int parse_input_options(int argc, char **argv)
 
           c = fgetopt_long(argc,
                            argv,
-                           "C:w:s:f:i:I:V:S:r:u:o:c:e:v:a:t:d:h:A:m:M:H:F:3:2:q:p:W:T",
+                           "C:w:s:f:i:I:V:S:r:u:o:c:e:v:a:t:d:h:A:m:M:H:F:3:2:q:p:W:TN:",
                            long_options,
                            &option_index);
 
@@ -820,6 +858,124 @@ static int parse_input_options(int argc, char **argv)
                   return -1;
               }
               break;
+          case 'N':
+              if (optarg) {
+                  config_data.enable_numa = 1;
+                  if (strcmp(optarg,"local") == 0) {
+                      config_data.numa_node = -1;
+                      fprintf(stderr,"STATUS: Binding memory to the local NUMA node of each thread\n");
+                  } else {
+                      config_data.numa_node = atoi(optarg);
+                      if (config_data.numa_node < 0) {
+                          fprintf(stderr,"ERROR: INVALID NUMA NODE: %d\n", config_data.numa_node);
+                          return -1;
+                      }
+                      fprintf(stderr,"STATUS: Binding memory to NUMA node: %d\n", config_data.numa_node);
+                  }
+              }
+              break;
+          case 'O':
+              if (optarg) {
+                  config_data.origin_port = atoi(optarg);
+                  if (config_data.origin_port <= 0 || config_data.origin_port > 65535) {
+                      fprintf(stderr,"ERROR: INVALID ORIGIN PORT: %d\n", config_data.origin_port);
+                      return -1;
+                  }
+                  fprintf(stderr,"STATUS: Serving segments and manifests from memory on port: %d\n", config_data.origin_port);
+              }
+              break;
+          case 'K':
+              if (optarg) {
+                  config_data.origin_cache_mb = atoi(optarg);
+                  if (config_data.origin_cache_mb <= 0) {
+                      fprintf(stderr,"ERROR: INVALID ORIGIN CACHE SIZE: %d\n", config_data.origin_cache_mb);
+                      return -1;
+                  }
+                  fprintf(stderr,"STATUS: Origin cache size: %dMB\n", config_data.origin_cache_mb);
+              }
+              break;
+          case 'L':
+              if (optarg) {
+                  config_data.part_length_ms = atoi(optarg);
+                  if (config_data.part_length_ms < MIN_PART_LENGTH) {
+                      fprintf(stderr,"ERROR: INVALID PART LENGTH: %d\n", config_data.part_length_ms);
+                      return -1;
+                  }
+                  fprintf(stderr,"STATUS: Using low latency HLS part length: %dms\n", config_data.part_length_ms);
+              }
+              break;
+          case 'J':
+              if (optarg) {
+                  config_data.chunk_frames = atoi(optarg);
+                  if (config_data.chunk_frames <= 0) {
+                      fprintf(stderr,"ERROR: INVALID CHUNK SIZE: %d\n", config_data.chunk_frames);
+                      return -1;
+                  }
+                  fprintf(stderr,"STATUS: Using chunked CMAF output: %d frames per chunk\n", config_data.chunk_frames);
+              }
+              break;
+          case 'X':
+              if (optarg) {
+                  config_data.mux_workers = atoi(optarg);
+                  if (config_data.mux_workers < 0 || config_data.mux_workers > MAX_MUX_WORKERS) {
+                      fprintf(stderr,"ERROR: INVALID NUMBER OF MUX WORKERS: %d (0-%d)\n", config_data.mux_workers, MAX_MUX_WORKERS);
+                      return -1;
+                  }
+                  fprintf(stderr,"STATUS: Using %d mux worker threads\n", config_data.mux_workers);
+              }
+              break;
+          case 'Q':
+              if (optarg) {
+                  config_data.segment_store_mb = atoi(optarg);
+                  if (config_data.segment_store_mb <= 0) {
+                      fprintf(stderr,"ERROR: INVALID SEGMENT STORE SLOT SIZE: %d\n", config_data.segment_store_mb);
+                      return -1;
+                  }
+                  fprintf(stderr,"STATUS: Using segment store with %dMB slots\n", config_data.segment_store_mb);
+              }
+              break;
+          case 'D':
+              if (optarg) {
+                  config_data.dvr_window_minutes = atoi(optarg);
+                  if (config_data.dvr_window_minutes <= 0 || config_data.dvr_window_minutes > MAX_DVR_WINDOW_MINUTES) {
+                      fprintf(stderr,"ERROR: INVALID DVR WINDOW: %d MINUTES (1-%d)\n", config_data.dvr_window_minutes, MAX_DVR_WINDOW_MINUTES);
+                      return -1;
+                  }
+                  fprintf(stderr,"STATUS: Using a %d minute DVR window\n", config_data.dvr_window_minutes);
+              }
+              break;
+          case 'E':
+              if (optarg) {
+                  char schemes[MAX_STR_SIZE];
+                  char *save = NULL;
+                  char *name;
+                  snprintf(schemes,MAX_STR_SIZE-1,"%s",optarg);
+                  for (name = strtok_r(schemes, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+                      int scheme = segcrypt_scheme(name);
+                      if (scheme == SEGCRYPT_SCHEME_AES128 || scheme == SEGCRYPT_SCHEME_SAMPLE_AES) {
+                          config_data.ts_encryption = scheme;
+                      } else if (scheme == SEGCRYPT_SCHEME_CENC || scheme == SEGCRYPT_SCHEME_CBCS) {
+                          config_data.fmp4_encryption = scheme;
+                      } else {
+                          fprintf(stderr,"ERROR: INVALID ENCRYPTION SCHEME: %s (aes128, sample-aes, cenc or cbcs)\n", name);
+                          return -1;
+                      }
+                      fprintf(stderr,"STATUS: Using %s segment encryption\n", segcrypt_scheme_name(scheme));
+                  }
+              }
+              break;
+          case 'k':
+              if (optarg) {
+                  snprintf(config_data.key_source,MAX_STR_SIZE-1,"%s",optarg);
+                  fprintf(stderr,"STATUS: Content key source: %s\n", config_data.key_source);
+              }
+              break;
+          case 'U':
+              if (optarg) {
+                  snprintf(config_data.key_uri,MAX_STR_SIZE-1,"%s",optarg);
+                  fprintf(stderr,"STATUS: Content key uri: %s\n", config_data.key_uri);
+              }
+              break;
           case 'u':
               if (optarg) {
                   config_data.identity = atoi(optarg);
@@ -1342,6 +1498,20 @@ int add_frame(sorted_frame_struct **frame_data, int entries, sorted_frame_struct
     return new_count;
 }
 
+static void drop_sorted_frame(fillet_app_struct *core, sorted_frame_struct *frame)
+{
+    if (!frame) {
+        return;
+    }
+    if (frame->frame_type == FRAME_TYPE_VIDEO) {
+        memory_return(core->compressed_video_pool, frame->buffer);
+    } else {
+        memory_return(core->compressed_audio_pool, frame->buffer);
+    }
+    frame->buffer = NULL;
+    memory_return(core->frame_msg_pool, frame);
+}
+
 int dump_frames(fillet_app_struct *core, sorted_frame_struct **frame_data, int max)
 {
     int i;
@@ -1485,10 +1655,11 @@ static void *frame_sync_thread(void *context)
                             dataqueue_put_front(core->hlsmux->input_queue, msg);
                             output_frame = NULL;
                         } else {
-                            fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+                            fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! DROPPING AUDIO FRAME!!!\n",
                                     core->session_id);
-                            send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Audio Message Buffers - Check CPU LOAD!");
-                            _Exit(0);
+                            drop_sorted_frame(core, output_frame);
+                            output_frame = NULL;
+                            overload_exhausted(core, "message pool");
                         }
                     } else {
                         usleep(1000);
@@ -1534,10 +1705,11 @@ static void *frame_sync_thread(void *context)
                         dataqueue_put_front(core->hlsmux->input_queue, msg);
                         output_frame = NULL;
                     } else {
-                        fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+                        fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! DROPPING VIDEO FRAME!!!\n",
                                 core->session_id);
-                        send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Video Message Buffers - Check CPU LOAD!");
-                        _Exit(0);
+                        drop_sorted_frame(core, output_frame);
+                        output_frame = NULL;
+                        overload_exhausted(core, "message pool");
                     }
                 } else {
                     usleep(1000);
@@ -1560,10 +1732,11 @@ int audio_sink_frame_callback(fillet_app_struct *core, uint8_t *new_buffer, int
 
     new_frame = (sorted_frame_struct*)memory_take(core->frame_msg_pool, sizeof(sorted_frame_struct));
     if (!new_frame) {
-        fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain frame message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+        fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain frame message! CHECK CPU RESOURCES!!! DROPPING AUDIO FRAME!!!\n",
                 core->session_id);
-        send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Audio Message Buffers - Check CPU LOAD!");
-        _Exit(0);
+        memory_return(core->compressed_audio_pool, new_buffer);
+        overload_exhausted(core, "frame pool");
+        return 0;
     }
 
     new_frame->buffer = new_buffer;
@@ -1628,10 +1801,11 @@ int video_sink_frame_callback(fillet_app_struct *core, uint8_t *new_buffer, int
 
     new_frame = (sorted_frame_struct*)memory_take(core->frame_msg_pool, sizeof(sorted_frame_struct));
     if (!new_frame) {
-        fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain frame message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+        fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain frame message! CHECK CPU RESOURCES!!! DROPPING VIDEO FRAME!!!\n",
                 core->session_id);
-        send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Video Message Buffers - Check CPU LOAD!");
-        _Exit(0);
+        memory_return(core->compressed_video_pool, new_buffer);
+        overload_exhausted(core, "frame pool");
+        return 0;
     }
     new_frame->buffer = new_buffer;
     new_frame->buffer_size = sample_size;
@@ -1783,8 +1957,8 @@ static int receive_frame(uint8_t *sample, int sample_size, int sample_type, uint
             if (!scte35_buffer) {
                 fprintf(stderr,"receive_frame (scte35): session=%d, Unable to obtain scte35 buffer!\n",
                         core->session_id);
-                send_direct_error(core, SIGNAL_DIRECT_ERROR_NALPOOL, "out of scte35 buffers");
-                _Exit(0);
+                overload_exhausted(core, "scte35 pool");
+                return 0;
             }
             memcpy(scte35_buffer, sample, sample_size);
 
@@ -1798,8 +1972,10 @@ static int receive_frame(uint8_t *sample, int sample_size, int sample_type, uint
             } else {
                 fprintf(stderr,"receive_frame (scte35): session=%d, unable to obtain message\n",
                         core->session_id);
-                send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "out of scte35 message buffers - Check CPU LOAD!");
-                _Exit(0);
+                memory_return(core->scte35_pool, scte35_buffer);
+                scte35_buffer = NULL;
+                overload_exhausted(core, "message pool");
+                return 0;
             }
         } else {
             core->scte35_ready = 0;
@@ -1909,21 +2085,26 @@ static int receive_frame(uint8_t *sample, int sample_size, int sample_type, uint
                 }
             }
 
+            if (overload_drop_video(core, source, sample, sample_size, sample_type, sample_flags)) {
+                return 0;
+            }
+
             new_buffer = (uint8_t*)memory_take(core->compressed_video_pool, sample_size);
             if (!new_buffer) {
-                fprintf(stderr,"SESSION:%d (MAIN) STATUS: unable to obtain compressed video buffer! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+                fprintf(stderr,"SESSION:%d (MAIN) STATUS: unable to obtain compressed video buffer! CHECK CPU RESOURCES!!! DROPPING VIDEO FRAME!!!\n",
                         core->session_id);
-                send_direct_error(core, SIGNAL_DIRECT_ERROR_NALPOOL, "Out of Video NAL Buffers - Check CPU LOAD!");
-                _Exit(0);
+                overload_exhausted(core, "compressed video pool");
+                return 0;
             }
             memcpy(new_buffer, sample, sample_size);
 
             new_frame = (sorted_frame_struct*)memory_take(core->frame_msg_pool, sizeof(sorted_frame_struct));
             if (!new_frame) {
-                fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain frame message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+                fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain frame message! CHECK CPU RESOURCES!!! DROPPING VIDEO FRAME!!!\n",
                         core->session_id);
-                send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Video Message Buffers - Check CPU LOAD!");
-                _Exit(0);
+                memory_return(core->compressed_video_pool, new_buffer);
+                overload_exhausted(core, "frame pool");
+                return 0;
             }
             new_frame->buffer = new_buffer;
             new_frame->buffer_size = sample_size;
@@ -2146,10 +2327,11 @@ static int receive_frame(uint8_t *sample, int sample_size, int sample_type, uint
                     dataqueue_put_front(core->transvideo->input_queue, decode_msg);
                     decode_msg = NULL;
                 } else {
-                    fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+                    fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! DROPPING VIDEO FRAME!!!\n",
                             core->session_id);
-                    send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Video Message Buffers - Check CPU LOAD!");
-                    _Exit(0);
+                    drop_sorted_frame(core, new_frame);
+                    new_frame = NULL;
+                    overload_exhausted(core, "message pool");
                 }
 #endif // ENABLE_TRANSCODE
             } else {
@@ -2236,10 +2418,10 @@ static int receive_frame(uint8_t *sample, int sample_size, int sample_type, uint
 
         new_buffer = (uint8_t*)memory_take(core->compressed_audio_pool, sample_size);
         if (!new_buffer) {
-            fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain compressed audio buffer! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+            fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain compressed audio buffer! CHECK CPU RESOURCES!!! DROPPING AUDIO FRAME!!!\n",
                     core->session_id);
-            send_direct_error(core, SIGNAL_DIRECT_ERROR_NALPOOL, "Out of Compressed Audio Buffers - Check CPU LOAD!");
-            _Exit(0);
+            overload_exhausted(core, "compressed audio pool");
+            return 0;
         }
         memcpy(new_buffer, sample, sample_size);
 
@@ -2287,10 +2469,11 @@ static int receive_frame(uint8_t *sample, int sample_size, int sample_type, uint
 
             new_frame = (sorted_frame_struct*)memory_take(core->frame_msg_pool, sizeof(sorted_frame_struct));
             if (!new_frame) {
-                fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain frame message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+                fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain frame message! CHECK CPU RESOURCES!!! DROPPING AUDIO FRAME!!!\n",
                         core->session_id);
-                send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Audio Message Buffers - Check CPU LOAD!");
-                _Exit(0);
+                memory_return(core->compressed_audio_pool, new_buffer);
+                overload_exhausted(core, "frame pool");
+                return 0;
             }
             new_frame->buffer = new_buffer;
             new_frame->buffer_size = sample_size;
@@ -2337,10 +2520,11 @@ static int receive_frame(uint8_t *sample, int sample_size, int sample_type, uint
                     dataqueue_put_front(core->transaudio[sub_source]->input_queue, decode_msg);
                     decode_msg = NULL;
                 } else {
-                    fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
+                    fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! DROPPING AUDIO FRAME!!!\n",
                             core->session_id);
-                    send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Audio Message Buffers - Check CPU LOAD!");
-                    _Exit(0);
+                    drop_sorted_frame(core, new_frame);
+                    new_frame = NULL;
+                    overload_exhausted(core, "message pool");
                 }
 #endif // ENABLE_TRANSCODE
             } else {
@@ -2386,8 +2570,10 @@ int main(int argc, char **argv)
      int i;
      fillet_app_struct *core;
      pthread_t client_thread_id;
+     pthread_t control_thread_id;
      int c;
      int loop_count = 0;
+     int report_count = 0;
 
      socket_udp_global_init();
 
@@ -2405,6 +2591,24 @@ int main(int argc, char **argv)
      config_data.audio_source_index = 0;
      config_data.stream_select = 0;
      config_data.gpu = 0;
+     config_data.enable_hugepages = 0;
+     config_data.enable_numa = 0;
+     config_data.numa_node = -1;
+     config_data.origin_port = 0;
+     config_data.origin_cache_mb = ORIGIN_DEFAULT_CACHE_MB;
+     config_data.part_length_ms = 0;
+     config_data.chunk_frames = 0;
+     config_data.mux_workers = 0;
+     config_data.segment_store_mb = 0;
+     config_data.enable_byterange = 0;
+     config_data.dvr_window_minutes = 0;
+     config_data.enable_trickplay = 0;
+     config_data.enable_muxed_ts = 0;
+     config_data.enable_muxed_cmaf = 0;
+     config_data.ts_encryption = SEGCRYPT_SCHEME_NONE;
+     config_data.fmp4_encryption = SEGCRYPT_SCHEME_NONE;
+     memset(config_data.key_source,0,sizeof(config_data.key_source));
+     memset(config_data.key_uri,0,sizeof(config_data.key_uri));
 
 #if defined(ENABLE_TRANSCODE)
      for (c = 0; c < MAX_TRANS_OUTPUTS; c++) {
@@ -2474,6 +2678,23 @@ int main(int argc, char **argv)
          fprintf(stderr,"       --cdnusername   [USERNAME FOR WEBDAV ACCOUNT]\n");
          fprintf(stderr,"       --cdnpassword   [PASSWORD FOR WEBDAV ACCOUNT]\n");
          fprintf(stderr,"       --cdnserver     [HTTP(S) URL FOR WEBDAV SERVER]\n");
+         fprintf(stderr,"       --hugepages     [BACK LARGE BUFFERS WITH HUGEPAGES AND PREFAULT THEM AT STARTUP]\n");
+         fprintf(stderr,"       --numa          [BIND BUFFER MEMORY TO A NUMA NODE - node number or local]\n");
+         fprintf(stderr,"       --origin        [SERVE SEGMENTS AND MANIFESTS OVER HTTP FROM MEMORY ON THIS PORT]\n");
+         fprintf(stderr,"       --origin-cache  [MEMORY IN MB KEPT FOR THE HTTP ORIGIN - default: 512]\n");
+         fprintf(stderr,"       --part          [LOW LATENCY HLS PART LENGTH IN MS - needs --dash and --origin]\n");
+         fprintf(stderr,"       --chunk         [LOW LATENCY DASH FRAMES PER CMAF CHUNK - needs --dash and --origin]\n");
+         fprintf(stderr,"       --mux-workers   [THREADS SHARING THE PER RENDITION SEGMENT MUXING - default: 0 (mux thread only)]\n");
+         fprintf(stderr,"       --segment-store [WRITE SEGMENTS INTO A PREALLOCATED RING - slot size in MB, window+%d slots per stream]\n", SEGSTORE_SAFETY_SEGMENTS);
+         fprintf(stderr,"       --byterange     [APPEND SEGMENTS TO HOURLY CONTAINER FILES AND LIST THEM AS BYTE RANGES]\n");
+         fprintf(stderr,"       --dvr           [KEEP THIS MANY MINUTES IN THE HLS PLAYLISTS FOR TIMESHIFT - needs --byterange]\n");
+         fprintf(stderr,"                       [CLIPS ARE EXPORTED FROM IT WITH POST http://127.0.0.1:18000/api/v1/clip?start=MS&end=MS&name=NAME]\n");
+         fprintf(stderr,"       --trickplay     [WRITE I-FRAME PLAYLISTS AND A DASH TRICK MODE SET FOR SCRUBBING]\n");
+         fprintf(stderr,"       --muxed-ts      [CARRY THE PRIMARY AUDIO IN THE TS VIDEO SEGMENTS - alternate languages stay separate]\n");
+         fprintf(stderr,"       --muxed-cmaf    [CARRY THE PRIMARY AUDIO AS A SECOND TRACK OF THE fMP4 VIDEO SEGMENTS]\n");
+         fprintf(stderr,"       --encrypt       [ENCRYPT THE SEGMENTS - aes128 or sample-aes for TS, cenc or cbcs for fMP4, comma separated]\n");
+         fprintf(stderr,"       --key           [CONTENT KEY FILE OR HTTP(S) URL - 16 raw bytes, hex, or json with key, kid and iv]\n");
+         fprintf(stderr,"       --key-uri       [KEY URI PUT IN THE HLS PLAYLISTS - needs --encrypt]\n");
          fprintf(stderr,"\n");
 #if defined(ENABLE_TRANSCODE)
          fprintf(stderr,"OUTPUT TRANSCODE OPTIONS\n");
@@ -2515,6 +2736,117 @@ int main(int argc, char **argv)
      config_data.enable_ts_output = !!enable_ts;
      config_data.enable_fmp4_output = !!enable_fmp4;
 
+     if (config_data.part_length_ms > 0) {
+         if (!config_data.enable_fmp4_output || config_data.origin_port == 0) {
+             fprintf(stderr,"FILLET: ERROR: Low latency HLS (--part) needs fMP4 output (--dash) and the origin server (--origin)\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (config_data.part_length_ms * MAX_SEGMENT_PARTS < config_data.segment_length * 1000 ||
+             config_data.part_length_ms > config_data.segment_length * 1000) {
+             fprintf(stderr,"FILLET: ERROR: Part length %dms does not fit the %d second segment length\n",
+                     config_data.part_length_ms, config_data.segment_length);
+             fprintf(stderr,"\n");
+             return 1;
+         }
+     }
+     if (config_data.chunk_frames > 0) {
+         if (!config_data.enable_fmp4_output || config_data.origin_port == 0) {
+             fprintf(stderr,"FILLET: ERROR: Chunked CMAF (--chunk) needs fMP4 output (--dash) and the origin server (--origin)\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (config_data.part_length_ms > 0) {
+             fprintf(stderr,"FILLET: ERROR: Chunked CMAF (--chunk) and low latency HLS (--part) cannot be combined\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+     }
+     config_data.enable_byterange = !!enable_byterange;
+     if (config_data.enable_byterange) {
+         if (config_data.part_length_ms > 0 || config_data.chunk_frames > 0) {
+             fprintf(stderr,"FILLET: ERROR: Byte-range output (--byterange) cannot be combined with --part or --chunk\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (strlen(config_data.cdn_server) > 0) {
+             fprintf(stderr,"FILLET: ERROR: Byte-range output (--byterange) cannot be uploaded to a CDN (--cdnserver)\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         fprintf(stderr,"STATUS: Using byte-range output with hourly container files\n");
+     }
+     if (config_data.dvr_window_minutes > 0) {
+         if (!config_data.enable_byterange) {
+             fprintf(stderr,"FILLET: ERROR: The DVR window (--dvr) keeps its segments in byte-range containers and needs --byterange\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (config_data.dvr_window_minutes * 60 / config_data.segment_length <= config_data.window_size) {
+             fprintf(stderr,"FILLET: ERROR: The DVR window (--dvr) has to be longer than the live window\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+     }
+     if (config_data.ts_encryption || config_data.fmp4_encryption) {
+         if (strlen(config_data.key_source) == 0 || strlen(config_data.key_uri) == 0) {
+             fprintf(stderr,"FILLET: ERROR: Segment encryption (--encrypt) needs a content key (--key) and a key uri (--key-uri)\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (enable_youtube) {
+             fprintf(stderr,"FILLET: ERROR: Segment encryption (--encrypt) cannot be used with YouTube publishing\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (segcrypt_load_key(config_data.key_source, &config_data.content_key) < 0) {
+             fprintf(stderr,"FILLET: ERROR: Unable to load the content key from %s\n", config_data.key_source);
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (config_data.ts_encryption == SEGCRYPT_SCHEME_SAMPLE_AES) {
+             fprintf(stderr,"STATUS: SAMPLE-AES covers H.264 and AAC, HEVC and AC-3 in the TS output stay clear\n");
+         }
+     }
+     config_data.enable_trickplay = !!enable_trickplay;
+     if (config_data.enable_trickplay) {
+         if (enable_youtube) {
+             fprintf(stderr,"FILLET: ERROR: I-frame playlists (--trickplay) cannot be used with YouTube publishing\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (config_data.ts_encryption == SEGCRYPT_SCHEME_AES128) {
+             fprintf(stderr,"STATUS: AES-128 chains the whole TS segment, the TS I-frame playlists are left out\n");
+         }
+         if (config_data.enable_byterange) {
+             fprintf(stderr,"STATUS: Byte-range output has no separate trick files, the fMP4 I-frame playlists and DASH trick mode are left out\n");
+         }
+     }
+     config_data.enable_muxed_ts = !!enable_muxed_ts;
+     if (config_data.enable_muxed_ts && !config_data.enable_ts_output) {
+         fprintf(stderr,"FILLET: ERROR: Muxed audio (--muxed-ts) applies to the TS output, please add --hls\n");
+         fprintf(stderr,"\n");
+         return 1;
+     }
+     config_data.enable_muxed_cmaf = !!enable_muxed_cmaf;
+     if (config_data.enable_muxed_cmaf) {
+         if (!config_data.enable_fmp4_output) {
+             fprintf(stderr,"FILLET: ERROR: Muxed audio (--muxed-cmaf) applies to the fMP4 output, please add --dash\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+         if (config_data.part_length_ms > 0 || config_data.chunk_frames > 0) {
+             fprintf(stderr,"FILLET: ERROR: Muxed audio (--muxed-cmaf) writes one fragment per segment and cannot be combined with --part or --chunk\n");
+             fprintf(stderr,"\n");
+             return 1;
+         }
+     }
+     config_data.enable_hugepages = !!enable_hugepages;
+
+     if (config_data.enable_hugepages || config_data.enable_numa) {
+         memory_arena_config(config_data.enable_hugepages, config_data.numa_node, config_data.enable_numa);
+     }
+
 #if defined(ENABLE_TRANSCODE)
      if (enable_transcode && config_data.transvideo_info[0].video_codec == STREAM_TYPE_HEVC) {
          if (config_data.enable_ts_output) {
@@ -2606,6 +2938,7 @@ int main(int argc, char **argv)
          }
 #endif // ENABLE_TRANSCODE
 
+         start_origin_server(core);
          hlsmux_create(core);
          start_webdav_threads(core);
 
@@ -2640,6 +2973,10 @@ int main(int argc, char **argv)
 #endif
 
          pthread_create(&client_thread_id, NULL, status_thread, (void*)core);
+         if (config_data.dvr_window_minutes > 0) {
+             // clip export requests come in on the control port, loopback only and nothing else served
+             pthread_create(&control_thread_id, NULL, clip_thread, (void*)core);
+         }
 
          /*#if defined(ENABLE_TRANSCODE)
          pthread_create(&client_thread_id, NULL, status_thread, (void*)core);
@@ -2678,6 +3015,25 @@ int main(int argc, char **argv)
              }
 
              loop_count++;
+             report_count++;
+#define MEMORY_REPORT_INTERVAL 60000
+             if (report_count >= MEMORY_REPORT_INTERVAL) {
+                 memory_report(core->fillet_msg_pool, "fillet_msg");
+                 memory_report(core->frame_msg_pool, "frame_msg");
+                 memory_report(core->compressed_video_pool, "compressed_video");
+                 memory_report(core->compressed_audio_pool, "compressed_audio");
+                 memory_report(core->raw_video_pool, "raw_video");
+                 memory_report(core->raw_audio_pool, "raw_audio");
+                 memory_report(core->scte35_pool, "scte35");
+                 syslog(LOG_INFO,"SESSION:%d (MAIN) STATUS: hlsmux ts buffers=%ld bytes\n",
+                        core->session_id, hlsmux_footprint());
+                 if (core->cd->enable_hugepages || core->cd->enable_numa) {
+                     memory_arena_report();
+                 }
+                 origin_report(core->origin);
+                 report_count = 0;
+             }
+             overload_update(core);
 #if defined(ENABLE_TRANSCODE)
 #define WAIT_THRESHOLD_WARNING 8
 #define WAIT_THRESHOLD_ERROR   15
@@ -2756,17 +3112,16 @@ int main(int argc, char **argv)
 
                          // these are good numbers to start raising the alarm
                          if (video_encode_frames_waiting > WAIT_THRESHOLD_FAIL) {
-                             syslog(LOG_INFO,"SESSION:%d (MAIN): STATUS: ERROR: ENCODE(%d): %d (ENCODE QUEUE FALLING BEHIND!!! CHECK CPU RESOURCES!!! UNRECOVERABLE!!!)\n",
+                             syslog(LOG_INFO,"SESSION:%d (MAIN): STATUS: ERROR: ENCODE(%d): %d (ENCODE QUEUE FALLING BEHIND!!! CHECK CPU RESOURCES!!! SHEDDING LOAD!!!)\n",
                                     core->session_id,
                                     n,
                                     video_encode_frames_waiting);
-                             fprintf(stderr,"SESSION:%d (MAIN): STATUS: ERROR: ENCODE(%d): %d (ENCODE QUEUE FALLING BEHIND!!! CHECK CPU RESOURCES!!! UNRECOVERABLE!!!)\n",
+                             fprintf(stderr,"SESSION:%d (MAIN): STATUS: ERROR: ENCODE(%d): %d (ENCODE QUEUE FALLING BEHIND!!! CHECK CPU RESOURCES!!! SHEDDING LOAD!!!)\n",
                                      core->session_id,
                                      n,
                                      video_encode_frames_waiting);
 
-                             send_direct_error(core, SIGNAL_DIRECT_ERROR_CPU, "Video Encoder Fell Too Far Behind - Check CPU Resources!");
-                             _Exit(0);
+                             overload_exhausted(core, "encoder queue");
                          } else if (video_encode_frames_waiting > WAIT_THRESHOLD_ERROR) {
                              syslog(LOG_INFO,"SESSION:%d (MAIN): STATUS: ERROR: ENCODE(%d): %d (ENCODE QUEUE FALLING BEHIND!!! CHECK CPU RESOURCES!!!)\n",
                                     core->session_id,
@@ -2825,6 +3180,7 @@ cleanup_main_app:
              hlsmux_destroy(core->hlsmux);
              core->hlsmux = NULL;
          }
+         stop_origin_server(core);
          destroy_fillet_core(core);
          fprintf(stderr,"STATUS: LEAVING APPLICATION\n");
      }
@@ -33,9 +33,18 @@
 #include "hlsmux.h"
 #include "webdav.h"
 #include "esignal.h"
+#include "overload.h"
+#include "segwriter.h"
+#include "playlist.h"
+#include "origin.h"
+#include "muxworker.h"
+#include "segstore.h"
+#include "segindex.h"
+#include "checkpoint.h"
 
 #define MAX_STREAM_NAME       256
 #define MAX_TEXT_SIZE         512
+#define MAX_KEY_TAG_SIZE      (MAX_STR_SIZE + 64)
 
 #define VIDEO_PID             480
 #define AUDIO_BASE_PID        481
@@ -45,6 +54,8 @@
 #define CODEC_H264            0x1b
 #define CODEC_AAC             0x0f
 #define CODEC_AC3             0x81
+#define CODEC_H264_SAMPLE_AES 0xdb
+#define CODEC_AAC_SAMPLE_AES  0xcf
 
 #define MAX_SOURCE_STREAMS    16
 
@@ -55,6 +66,11 @@
 #define IS_AUDIO              0
 #define NO_SUBSTREAM          -1
 
+#define MUX_OUTPUT_TS         0x01
+#define MUX_OUTPUT_FMP4       0x02
+#define MUX_OUTPUT_TS_MUXED   0x04
+#define MUX_OUTPUT_FMP4_MUXED 0x08
+
 #define VIDEO_OFFSET          150000
 #define AUDIO_OFFSET          20000
 #define OVERFLOW_PTS          8589934592   // 2^33
@@ -62,6 +78,9 @@
 #define AUDIO_CLOCK           90000
 #define VIDEO_CLOCK           90000
 
+#define LLHLS_PART_SEGMENTS   2     // completed segments still listed with their parts
+#define SCTE35_MAX_SECTION    40    // splice_insert() carrying a break duration
+
 //#define DEBUG_MP4
 
 #if defined(DEBUG_MP4)
@@ -85,6 +104,7 @@ typedef struct _source_context_struct_ {
     int64_t       splice_duration[MAX_ROLLOVER_SIZE];
     double        splice_elapsed_time[MAX_ROLLOVER_SIZE];
     double        splice_duration_remaining[MAX_ROLLOVER_SIZE];
+    int64_t       splice_start[MAX_ROLLOVER_SIZE];
     int64_t       full_time_video[MAX_ROLLOVER_SIZE];
     int64_t       full_duration_video[MAX_ROLLOVER_SIZE];
     int64_t       full_time_audio[MAX_ROLLOVER_SIZE][MAX_AUDIO_STREAMS];
@@ -95,6 +115,11 @@ typedef struct _source_context_struct_ {
     int64_t       source_splice_duration;
     double        source_splice_duration_remaining;
     double        source_splice_elapsed_time;
+    int64_t       source_splice_start;
+    int           splice_pending;
+    int64_t       splice_pending_time;
+    int64_t       splice_pending_duration;
+    int64_t       program_time_base;     // utc milliseconds at media time zero
 
     int           h264_sps_decoded;
     int           h264_profile;
@@ -139,7 +164,29 @@ typedef struct _decode_struct_ {
 } decode_struct;
 
 static int quit_mux_pump_thread = 0;
+
+// copy accounting for the mux outputs- bytes moved around per byte ingested
+#define MUX_COPY_REPORT_INTERVAL 3000
+static int64_t mux_frames = 0;
+static int64_t mux_bytes_ingested = 0;
+static int64_t mux_bytes_copied = 0;
+// time spent handling each frame in the mux loop, disk writes are handed to the segment writer
+static int64_t mux_loop_latency[SEGWRITER_HISTOGRAM_BUCKETS];
+static int64_t mux_loop_max = 0;
 static void *mux_pump_thread(void *context);
+static int write_dash_master_manifest(fillet_app_struct *core, source_context_struct *sdata);
+
+// ts mux scratch buffers are only created for streams that actually carry data
+// and grow when a frame does not fit
+#define MUX_VIDEO_INITIAL_PES     (512*1024)
+#define MUX_AUDIO_INITIAL_PES     (16*1024)
+#define MUX_PES_HEADER_SIZE       32
+#define MUX_NO_PCR                -1
+#define MUX_TABLE_PACKETS         2
+#define MUX_ARENA_THRESHOLD       (2*1024*1024)
+static int64_t mux_footprint_bytes = 0;
+static int64_t mux_footprint_peak = 0;
+static int64_t mux_buffer_grows = 0;
 
 uint32_t getbit(decode_struct *d)
 {
@@ -466,6 +513,25 @@ void *hlsmux_create(fillet_app_struct *core)
     }
 
     memset(hlsmux, 0, sizeof(hlsmux_struct));
+    hlsmux->writer = segwriter_create();
+    if (!hlsmux->writer) {
+        free(hlsmux);
+        return NULL;
+    }
+    if (core->origin) {
+        segwriter_set_origin(hlsmux->writer, core->origin, core->cd->manifest_directory);
+    }
+    if (core->cd->segment_store_mb > 0) {
+        char store_directory[MAX_STREAM_NAME];
+
+        // hard links only work within one filesystem, so the ring lives under the served directory
+        mkdir(core->cd->manifest_directory, 0700);
+        snprintf(store_directory, MAX_STREAM_NAME-1, "%s/%s", core->cd->manifest_directory, SEGSTORE_DIRECTORY);
+        if (segwriter_set_store(hlsmux->writer, store_directory, core->cd->window_size + SEGSTORE_SAFETY_SEGMENTS,
+                                (int64_t)core->cd->segment_store_mb * 1024 * 1024) < 0) {
+            fprintf(stderr,"HLSMUX: ERROR: unable to set up the segment store in %s, writing segments as files\n", store_directory);
+        }
+    }
     hlsmux->input_queue = dataqueue_create();
     core->hlsmux = hlsmux;
     pthread_create(&hlsmux->hlsmux_thread_id, NULL, mux_pump_thread, (void*)core);
@@ -480,6 +546,13 @@ void hlsmux_destroy(void *hlsmux)
         quit_mux_pump_thread = 1;
         pthread_join(hlsmux1->hlsmux_thread_id, NULL);
 
+        // flushes whatever is still queued for disk
+        segwriter_destroy(hlsmux1->writer);
+        hlsmux1->writer = NULL;
+
+        checkpoint_destroy(hlsmux1->checkpoint);
+        hlsmux1->checkpoint = NULL;
+
         if (hlsmux1->input_queue) {
             dataqueue_destroy(hlsmux1->input_queue);
             hlsmux1->input_queue = NULL;
@@ -492,111 +565,124 @@ void hlsmux_destroy(void *hlsmux)
     return;
 }
 
-static void hlsmux_save_state(fillet_app_struct *core, source_context_struct *sdata)
+// the counters that have to survive a restart alongside the source contexts
+typedef struct _hlsmux_stream_state_struct_ {
+    int64_t       file_sequence_number;
+    int64_t       media_sequence_number;
+    int64_t       fragments_published;
+    int64_t       last_segment_time;
+    int64_t       discontinuity_adjustment;
+} hlsmux_stream_state_struct;
+
+typedef struct _hlsmux_state_struct_ {
+    hlsmux_stream_state_struct  video[MAX_VIDEO_SOURCES];
+    hlsmux_stream_state_struct  audio[MAX_VIDEO_SOURCES][MAX_AUDIO_STREAMS];
+    time_t                      t_avail;
+    int                         timeset;
+} hlsmux_state_struct;
+
+#define HLSMUX_STATE_SIZE     (sizeof(source_context_struct) * MAX_SOURCE_STREAMS + sizeof(hlsmux_state_struct))
+
+static int hlsmux_state_sources(fillet_app_struct *core)
 {
-    FILE *state_file;
-    int num_sources = core->num_sources;
-    int i;
-    char state_filename[MAX_STREAM_NAME];
+#if defined(ENABLE_TRANSCODE)
+    if (core->transcode_enabled) {
+        return core->cd->num_outputs;
+    }
+#endif
+    return core->num_sources;
+}
 
-    snprintf(state_filename,MAX_STREAM_NAME-1,"/var/tmp/hlsmux_state_%d", core->cd->identity);
+static void *hlsmux_checkpoint(fillet_app_struct *core)
+{
+    hlsmux_struct *hlsmux = (hlsmux_struct*)core->hlsmux;
 
-    state_file = fopen(state_filename,"wb");
+    if (!hlsmux->checkpoint) {
+        char state_filename[MAX_STREAM_NAME];
 
-    for (i = 0; i < MAX_SOURCE_STREAMS; i++) {
-        fwrite(sdata, sizeof(source_context_struct), 1, state_file);
-        sdata++;
+        snprintf(state_filename,MAX_STREAM_NAME-1,"/var/tmp/hlsmux_state_%d", core->cd->identity);
+        hlsmux->checkpoint = checkpoint_create(state_filename, HLSMUX_STATE_SIZE);
+        if (!hlsmux->checkpoint) {
+            fprintf(stderr,"HLSMUX: ERROR: unable to open the state checkpoint %s\n", state_filename);
+        }
     }
+    return hlsmux->checkpoint;
+}
 
-#if defined(ENABLE_TRANSCODE)
-    if (core->transcode_enabled) {
-        num_sources = core->cd->num_outputs;
-    } else {
-        num_sources = core->num_sources;
+// once per segment, only the pages of the mapped checkpoint that changed get copied
+static void hlsmux_save_state(fillet_app_struct *core, source_context_struct *sdata)
+{
+    hlsmux_struct *hlsmux = (hlsmux_struct*)core->hlsmux;
+    void *checkpoint = hlsmux_checkpoint(core);
+    int num_sources = hlsmux_state_sources(core);
+    hlsmux_state_struct state;
+    int i;
+
+    if (!checkpoint) {
+        return;
     }
-#endif
 
-    for (i = 0; i < num_sources; i++) {
+    memset(&state, 0, sizeof(state));
+    for (i = 0; i < num_sources && i < MAX_VIDEO_SOURCES; i++) {
         int j;
 
-        hlsmux_struct *hlsmux = (hlsmux_struct*)core->hlsmux;
-
-        fwrite(&hlsmux->video[i].file_sequence_number, sizeof(int64_t), 1, state_file);
-        fwrite(&hlsmux->video[i].media_sequence_number, sizeof(int64_t), 1, state_file);
-        fwrite(&hlsmux->video[0].fragments_published, sizeof(int64_t), 1, state_file);  //the 0 is not a typo-need to line up if restart occurs
-        fwrite(&hlsmux->video[0].last_segment_time, sizeof(int64_t), 1, state_file);
-        fwrite(&hlsmux->video[0].discontinuity_adjustment, sizeof(int64_t), 1, state_file);
+        state.video[i].file_sequence_number = hlsmux->video[i].file_sequence_number;
+        state.video[i].media_sequence_number = hlsmux->video[i].media_sequence_number;
+        state.video[i].fragments_published = hlsmux->video[0].fragments_published;  //the 0 is not a typo-need to line up if restart occurs
+        state.video[i].last_segment_time = hlsmux->video[0].last_segment_time;
+        state.video[i].discontinuity_adjustment = hlsmux->video[0].discontinuity_adjustment;
 
         for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
-            fwrite(&hlsmux->audio[i][j].file_sequence_number, sizeof(int64_t), 1, state_file);
-            fwrite(&hlsmux->audio[i][j].media_sequence_number, sizeof(int64_t), 1, state_file);
-            fwrite(&hlsmux->video[0].fragments_published, sizeof(int64_t), 1, state_file);  //yes,video - so they match
-            fwrite(&hlsmux->audio[i][j].last_segment_time, sizeof(int64_t), 1, state_file);
-            fwrite(&hlsmux->audio[i][j].discontinuity_adjustment, sizeof(int64_t), 1, state_file);
+            state.audio[i][j].file_sequence_number = hlsmux->audio[i][j].file_sequence_number;
+            state.audio[i][j].media_sequence_number = hlsmux->audio[i][j].media_sequence_number;
+            state.audio[i][j].fragments_published = hlsmux->video[0].fragments_published;  //yes,video - so they match
+            state.audio[i][j].last_segment_time = hlsmux->audio[i][j].last_segment_time;
+            state.audio[i][j].discontinuity_adjustment = hlsmux->audio[i][j].discontinuity_adjustment;
         }
     }
-    fwrite(&core->t_avail, sizeof(time_t), 1, state_file);
-    fwrite(&core->timeset, sizeof(int), 1, state_file);
+    state.t_avail = core->t_avail;
+    state.timeset = core->timeset;
 
-    fclose(state_file);
+    checkpoint_update(checkpoint, 0, sdata, sizeof(source_context_struct) * MAX_SOURCE_STREAMS);
+    checkpoint_update(checkpoint, sizeof(source_context_struct) * MAX_SOURCE_STREAMS, &state, sizeof(state));
+    checkpoint_commit(checkpoint);
     return;
 }
 
 static int hlsmux_load_state(fillet_app_struct *core, source_context_struct *sdata)
 {
-    FILE *state_file;
-    int num_sources = core->num_sources;
+    hlsmux_struct *hlsmux = (hlsmux_struct*)core->hlsmux;
+    void *checkpoint = hlsmux_checkpoint(core);
+    int num_sources = hlsmux_state_sources(core);
+    hlsmux_state_struct state;
     int i;
-    int r;
-    char state_filename[MAX_STREAM_NAME];
-    //int s64 = sizeof(int64_t);
-
-    snprintf(state_filename,MAX_STREAM_NAME-1,"/var/tmp/hlsmux_state_%d", core->cd->identity);
 
-#if defined(ENABLE_TRANSCODE)
-    if (core->transcode_enabled) {
-        num_sources = core->cd->num_outputs;
-    } else {
-        num_sources = core->num_sources;
+    if (!checkpoint_restore(checkpoint, sizeof(source_context_struct) * MAX_SOURCE_STREAMS, &state, sizeof(state))) {
+        return 0;
     }
-#endif
+    checkpoint_restore(checkpoint, 0, sdata, sizeof(source_context_struct) * MAX_SOURCE_STREAMS);
 
-    state_file = fopen(state_filename,"rb");
-    if (state_file) {
-        for (i = 0; i < MAX_SOURCE_STREAMS; i++) {
-            r = fread(sdata, sizeof(source_context_struct), 1, state_file);
-            sdata++;
-        }
-
-        for (i = 0; i < num_sources; i++) {
-            hlsmux_struct *hlsmux = (hlsmux_struct*)core->hlsmux;
-            int j;
+    for (i = 0; i < num_sources && i < MAX_VIDEO_SOURCES; i++) {
+        int j;
 
-            r = fread(&hlsmux->video[i].file_sequence_number, sizeof(int64_t), 1, state_file);
-            r = fread(&hlsmux->video[i].media_sequence_number, sizeof(int64_t), 1, state_file);
-            r = fread(&hlsmux->video[i].fragments_published, sizeof(int64_t), 1, state_file);
-            r = fread(&hlsmux->video[i].last_segment_time, sizeof(int64_t), 1, state_file);
-            r = fread(&hlsmux->video[i].discontinuity_adjustment, sizeof(int64_t), 1, state_file);
+        hlsmux->video[i].file_sequence_number = state.video[i].file_sequence_number;
+        hlsmux->video[i].media_sequence_number = state.video[i].media_sequence_number;
+        hlsmux->video[i].fragments_published = state.video[i].fragments_published;
+        hlsmux->video[i].last_segment_time = state.video[i].last_segment_time;
+        hlsmux->video[i].discontinuity_adjustment = state.video[i].discontinuity_adjustment;
 
-            for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
-                r = fread(&hlsmux->audio[i][j].file_sequence_number, sizeof(int64_t), 1, state_file);
-                r = fread(&hlsmux->audio[i][j].media_sequence_number, sizeof(int64_t), 1, state_file);
-                r = fread(&hlsmux->audio[i][j].fragments_published, sizeof(int64_t), 1, state_file);
-                r = fread(&hlsmux->audio[i][j].last_segment_time, sizeof(int64_t), 1, state_file);
-                r = fread(&hlsmux->audio[i][j].discontinuity_adjustment, sizeof(int64_t), 1, state_file);
-            }
-            /*if (r < s64*6) {
-                fclose(state_file);
-                return 0;
-            }*/
+        for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
+            hlsmux->audio[i][j].file_sequence_number = state.audio[i][j].file_sequence_number;
+            hlsmux->audio[i][j].media_sequence_number = state.audio[i][j].media_sequence_number;
+            hlsmux->audio[i][j].fragments_published = state.audio[i][j].fragments_published;
+            hlsmux->audio[i][j].last_segment_time = state.audio[i][j].last_segment_time;
+            hlsmux->audio[i][j].discontinuity_adjustment = state.audio[i][j].discontinuity_adjustment;
         }
-        r = fread(&core->t_avail, sizeof(time_t), 1, state_file);
-        r = fread(&core->timeset, sizeof(int), 1, state_file);
-
-        fclose(state_file);
-        return 1;
     }
-    return 0;
+    core->t_avail = state.t_avail;
+    core->timeset = state.timeset;
+
+    return 1;
 }
 
 static int apply_pts(uint8_t *header, int64_t ts)
@@ -655,17 +741,31 @@ static int muxpatsample(fillet_app_struct *core, stream_struct *stream, uint8_t
     return 0;
 }
 
-static int muxpmtsample(fillet_app_struct *core, stream_struct *stream, uint8_t *pmt, int pid, int codec_type)
+typedef struct _mux_es_struct_ {
+    int           pid;
+    int           codec_type;
+    uint8_t       *descriptors;
+    int           descriptors_size;
+} mux_es_struct;
+
+// the first elementary stream carries the pcr, the version moves on when a muxed audio stream joins
+static int muxpmtsample(fillet_app_struct *core, stream_struct *stream, uint8_t *pmt, mux_es_struct *es, int es_count)
 {
     uint16_t *save16;
     uint32_t *save32;
     uint32_t calculated_crc;
-    int crcsize = 17;
+    int section_size = 13;
+    int pos = 17;
+    int i;
 
     if (!pmt) {
         return -1;
     }
 
+    for (i = 0; i < es_count; i++) {
+        section_size += 5 + es[i].descriptors_size;
+    }
+
     memset(pmt, 0xff, 188);
 
     pmt[0] = 0x47;
@@ -679,28 +779,34 @@ static int muxpmtsample(fillet_app_struct *core, stream_struct *stream, uint8_t
     pmt[5] = 0x02; // PMT table id
 
     save16 = (uint16_t*)&pmt[6];
-    *save16 = htons(0xb000 | 18);
+    *save16 = htons(0xb000 | section_size);
 
     save16 = (uint16_t*)&pmt[8];
     *save16 = htons(1); // program number
-    pmt[10] = 0xc3;
+    pmt[10] = 0xc1 | ((es_count & 0x1f) << 1);
     pmt[11] = 0x00;
     pmt[12] = 0x00;
 
     save16 = (uint16_t*)&pmt[13];
-    *save16 = htons(0xe000 | pid);  // video pid - pcr pid
+    *save16 = htons(0xe000 | es[0].pid);  // pcr pid
     save16 = (uint16_t*)&pmt[15];
     *save16 = htons(0xf000);
 
-    pmt[17] = codec_type;
-    save16 = (uint16_t*)&pmt[18];
-    *save16 = htons(0xe000 | pid);  // actual video pid
-    pmt[20] = 0xf0;
-    pmt[21] = 0x00;
+    for (i = 0; i < es_count; i++) {
+        pmt[pos] = es[i].codec_type;
+        save16 = (uint16_t*)&pmt[pos+1];
+        *save16 = htons(0xe000 | es[i].pid);
+        pmt[pos+3] = 0xf0 | ((es[i].descriptors_size >> 8) & 0x0f);
+        pmt[pos+4] = es[i].descriptors_size & 0xff;
+        if (es[i].descriptors_size > 0) {
+            memcpy(&pmt[pos+5], es[i].descriptors, es[i].descriptors_size);
+        }
+        pos += 5 + es[i].descriptors_size;
+    }
 
-    save32 = (uint32_t*)&pmt[22];
+    save32 = (uint32_t*)&pmt[pos];
 
-    calculated_crc = getcrc32(&pmt[5], crcsize);
+    calculated_crc = getcrc32(&pmt[5], section_size - 1);
     calculated_crc = htonl(calculated_crc);
 
     *save32 = calculated_crc;
@@ -708,24 +814,315 @@ static int muxpmtsample(fillet_app_struct *core, stream_struct *stream, uint8_t
     return 0;
 }
 
+static void *mux_buffer_alloc(size_t size)
+{
+    if (size >= MUX_ARENA_THRESHOLD) {
+        return memory_arena_alloc(size);
+    }
+    return malloc(size);
+}
+
+static void mux_buffer_free(void *buffer, size_t size)
+{
+    if (!buffer) {
+        return;
+    }
+    if (size >= MUX_ARENA_THRESHOLD) {
+        memory_arena_free(buffer, size);
+    } else {
+        free(buffer);
+    }
+}
+
+static int mux_packets_needed(int pes_size)
+{
+    // pat+pmt, then the worst case of a short first packet plus a split 183-byte tail
+    return MUX_TABLE_PACKETS + (pes_size / 184) + 4;
+}
+
+static int mux_stream_reserve(stream_struct *stream, int pes_size, int initial_size)
+{
+    int new_pes_size;
+    int new_mux_size;
+    int64_t footprint;
+    uint8_t *muxbuffer;
+
+    if (mux_packets_needed(pes_size) * 188 <= stream->mux_buffer_size) {
+        return 0;
+    }
+
+    new_pes_size = initial_size;
+    while (new_pes_size < pes_size) {
+        new_pes_size *= 2;
+    }
+    new_mux_size = mux_packets_needed(new_pes_size) * 188;
+    while (new_mux_size <= stream->mux_buffer_size) {
+        new_pes_size *= 2;
+        new_mux_size = mux_packets_needed(new_pes_size) * 188;
+    }
+
+    muxbuffer = (uint8_t*)mux_buffer_alloc(new_mux_size);
+    if (!muxbuffer) {
+        fprintf(stderr,"HLSMUX: ERROR: unable to grow mux buffer to %d bytes\n", new_mux_size);
+        return -1;
+    }
+
+    if (stream->mux_buffer_size > 0) {
+        __sync_fetch_and_add(&mux_buffer_grows, 1);
+        syslog(LOG_INFO,"HLSMUX: growing mux buffer from %d to %d bytes for a %d byte sample\n",
+               stream->mux_buffer_size, new_mux_size, pes_size);
+    }
+    footprint = __sync_add_and_fetch(&mux_footprint_bytes, new_mux_size - stream->mux_buffer_size);
+    mux_buffer_free(stream->muxbuffer, stream->mux_buffer_size);
+
+    stream->muxbuffer = muxbuffer;
+    stream->mux_buffer_size = new_mux_size;
+    // several workers can grow their buffers at once, the peak only ever moves up
+    while (1) {
+        int64_t peak = mux_footprint_peak;
+
+        if (footprint <= peak || __sync_bool_compare_and_swap(&mux_footprint_peak, peak, footprint)) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// clear ts is packetised straight into the segment writer's staged chunk, aes-128
+// has to run over the packets first so those are still built in the stream's buffer
+static int mux_ts_direct(fillet_app_struct *core, stream_struct *stream)
+{
+    return stream->output_ts_file && segcrypt_get_scheme(stream->ts_crypt) != SEGCRYPT_SCHEME_AES128;
+}
+
+static uint8_t *mux_ts_output(fillet_app_struct *core, stream_struct *stream, int pes_size, int initial_size)
+{
+    if (mux_ts_direct(core, stream)) {
+        return segwriter_reserve(core->hlsmux->writer, stream->output_ts_file, mux_packets_needed(pes_size) * 188);
+    }
+    if (mux_stream_reserve(stream, pes_size, initial_size) < 0) {
+        return NULL;
+    }
+    return stream->muxbuffer;
+}
+
+static void mux_stream_release(stream_struct *stream)
+{
+    segcrypt_destroy(stream->ts_crypt);
+    segcrypt_destroy(stream->fmp4_crypt);
+    stream->ts_crypt = NULL;
+    stream->fmp4_crypt = NULL;
+    __sync_fetch_and_sub(&mux_footprint_bytes, stream->mux_buffer_size);
+    mux_buffer_free(stream->muxbuffer, stream->mux_buffer_size);
+    stream->muxbuffer = NULL;
+    stream->mux_buffer_size = 0;
+}
+
+int64_t hlsmux_footprint(void)
+{
+    return mux_footprint_bytes;
+}
+
+typedef struct _mux_cursor_struct_ {
+    uint8_t       *header;
+    int           header_left;
+    uint8_t       *data;
+} mux_cursor_struct;
+
+static void mux_payload(mux_cursor_struct *cursor, uint8_t *dst, int size)
+{
+    if (cursor->header_left > 0) {
+        int n = size < cursor->header_left ? size : cursor->header_left;
+
+        memcpy(dst, cursor->header, n);
+        cursor->header += n;
+        cursor->header_left -= n;
+        dst += n;
+        size -= n;
+    }
+    memcpy(dst, cursor->data, size);
+    cursor->data += size;
+}
+
+static void mux_pcr(uint8_t *pcr, int64_t timestamp_offset)
+{
+    int64_t base;
+    int64_t ext;
+    int64_t full;
+    int64_t offset_count;
+
+    offset_count = (int64_t)(((double)(timestamp_offset)*(double)300.0*(double)20.0/(double)216) - (double)10)/(double)188;
+
+    full = (int64_t)((int64_t)offset_count * (int64_t)40608) / (int64_t)20;
+    full = full % (8589934592 * 300);
+    base = full / 300;
+    ext = full % 300;
+
+    pcr[0] = (0xff & (base >> 25));
+    pcr[1] = (0xff & (base >> 17));
+    pcr[2] = (0xff & (base >> 9));
+    pcr[3] = (0xff & (base >> 1));
+    pcr[4] = ((0x01 & base) << 7) | 0x7e | ((0x100 & ext) >> 8);
+    pcr[5] = (0xff & ext);
+}
+
+static void mux_packet_header(int *cnt, uint8_t *sp, uint16_t pid, uint8_t flags)
+{
+    sp[0] = 0x47;
+    sp[1] = (pid >> 8) & 0xff;
+    sp[2] = pid & 0xff;
+    sp[3] = (*cnt & 0x0f) | flags;
+    *cnt = (*cnt + 1) & 0x0f;
+}
+
+static void mux_stuffing(uint8_t *sp, int adaptation_length)
+{
+    sp[4] = adaptation_length;
+    sp[5] = 0;
+    memset(sp + 6, 0xff, adaptation_length - 1);
+}
+
+// single pass packetiser- ts headers and adaptation fields are generated in place
+// and every payload byte is copied once, straight from the pes header or the frame
+static int muxsample(int *cnt, sorted_frame_struct *frame, uint16_t pid,
+                     uint8_t *header, int header_size, int first_payload,
+                     int64_t pcr_timestamp, uint8_t *buffer)
+{
+    mux_cursor_struct cursor;
+    int remaining = header_size + frame->buffer_size;
+    uint16_t firstdata = 0x4000 | pid;
+    uint8_t firstflag = 0x10;
+    int packetcount = 0;
+
+    cursor.header = header;
+    cursor.header_left = header_size;
+    cursor.data = frame->buffer;
+
+    if (frame->sync_frame) {
+        firstflag = 0x20;
+    }
+
+    while (remaining > 0) {
+        uint8_t *sp = buffer + packetcount * 188;
+
+        if (packetcount == 0 && remaining >= first_payload) {
+            mux_packet_header(cnt, sp, firstdata, firstflag | 0x30);
+            sp[4] = 188 - first_payload - 5;
+            if (pcr_timestamp == MUX_NO_PCR) {
+                // same layout, the pcr bytes become stuffing
+                sp[5] = frame->sync_frame ? 0x40 : 0x00;
+                memset(sp + 6, 0xff, 188 - first_payload - 6);
+            } else {
+                sp[5] = frame->sync_frame ? 0x50 : 0x10;  // RAI, PCR flag
+                mux_pcr(sp + 6, pcr_timestamp);
+                memset(sp + 12, 0xff, 188 - first_payload - 12);
+            }
+            mux_payload(&cursor, sp + 188 - first_payload, first_payload);
+            remaining -= first_payload;
+            packetcount++;
+        } else if (remaining == 183) {
+            // a single byte of adaptation can't carry the flags, so split across two packets
+            mux_packet_header(cnt, sp, firstdata, firstflag | 0x30);
+            mux_stuffing(sp, 91);
+            mux_payload(&cursor, sp + 188 - 92, 92);
+            packetcount++;
+
+            sp = buffer + packetcount * 188;
+            mux_packet_header(cnt, sp, pid, 0x10 | 0x30);
+            mux_stuffing(sp, 92);
+            mux_payload(&cursor, sp + 188 - 91, 91);
+            packetcount++;
+            remaining = 0;
+        } else if (remaining < 184) {
+            mux_packet_header(cnt, sp, firstdata, firstflag | 0x30);
+            mux_stuffing(sp, 188 - remaining - 5);
+            mux_payload(&cursor, sp + 188 - remaining, remaining);
+            packetcount++;
+            remaining = 0;
+        } else {
+            mux_packet_header(cnt, sp, firstdata, firstflag);
+            mux_payload(&cursor, sp + 4, 184);
+            remaining -= 184;
+            packetcount++;
+        }
+        firstdata = pid;
+        firstflag = 0x10;
+    }
+
+    __sync_fetch_and_add(&mux_bytes_copied, header_size + frame->buffer_size);
+
+    return packetcount;
+}
+
+// sample-aes streams are signalled with their own stream types and a private data indicator,
+// aac also needs its setup information since the decoder can't read it from the adts header
+static int sample_aes_descriptors(sorted_frame_struct *frame, uint8_t *descriptors)
+{
+    uint16_t audio_config;
+    int profile;
+    int sample_index;
+    int channels;
+
+    if (frame->media_type == MEDIA_TYPE_H264) {
+        memcpy(descriptors, "\x0f\x04zavc", 6);
+        return 6;
+    }
+
+    profile = (frame->buffer[2] >> 6) & 0x03;
+    sample_index = (frame->buffer[2] >> 2) & 0x0f;
+    channels = ((frame->buffer[2] & 0x01) << 2) | ((frame->buffer[3] >> 6) & 0x03);
+    audio_config = ((profile + 1) << 11) | (sample_index << 7) | (channels << 3);
+
+    memcpy(descriptors, "\x0f\x04" "aacd\x05\x0e" "apad" "zaac\x00\x00\x01\x02", 20);
+    descriptors[20] = (audio_config >> 8) & 0xff;
+    descriptors[21] = audio_config & 0xff;
+    return 22;
+}
+
+static int sample_aes_enabled(stream_struct *stream, sorted_frame_struct *frame)
+{
+    return segcrypt_get_scheme(stream->ts_crypt) == SEGCRYPT_SCHEME_SAMPLE_AES &&
+           (frame->media_type == MEDIA_TYPE_H264 || frame->media_type == MEDIA_TYPE_AAC);
+}
+
+// the frame is shared with the fmp4 output, the pes goes out from a protected copy instead
+static int sample_aes_frame(stream_struct *stream, sorted_frame_struct *frame, sorted_frame_struct *protected_frame)
+{
+    *protected_frame = *frame;
+    protected_frame->buffer_size = segcrypt_sample_aes(stream->ts_crypt, frame->media_type, frame->buffer, frame->buffer_size,
+                                                       &protected_frame->buffer);
+    return protected_frame->buffer_size;
+}
+
 static int muxvideosample(fillet_app_struct *core, stream_struct *stream, sorted_frame_struct *frame)
 {
+    uint8_t header[MUX_PES_HEADER_SIZE];
+    uint8_t descriptors[MUX_PES_HEADER_SIZE];
+    sorted_frame_struct protected_frame;
+    mux_es_struct es[2];
+    int es_count = 1;
+    int descriptors_size = 0;
+    int codec_type = CODEC_H264;
     int header_size;
-    uint8_t *muxbuffer = stream->muxbuffer;
-    uint8_t *pesbuffer = stream->pesbuffer;
-    uint8_t *buffer = muxbuffer;
-    packet_struct *packettable = stream->packettable;
-    packet_struct *ptable = packettable;
-    uint8_t *header = pesbuffer;
-    uint8_t *muxdata;
-    int video_size;
-    int widx = 0;
-    uint16_t video_pid = VIDEO_PID;
-    uint16_t firstdata;
-    uint16_t *save16;
-    uint16_t firstflag;
-    int s;
-    int packetcount = 0;
+    int64_t timestamp;
+    int64_t timestamp_offset;
+    int packetcount;
+    uint8_t *output;
+
+    if (sample_aes_enabled(stream, frame)) {
+        if (sample_aes_frame(stream, frame, &protected_frame) < 0) {
+            return -1;
+        }
+        descriptors_size = sample_aes_descriptors(frame, descriptors);
+        codec_type = CODEC_H264_SAMPLE_AES;
+        frame = &protected_frame;
+    }
+
+    output = mux_ts_output(core, stream, frame->buffer_size + MUX_PES_HEADER_SIZE, MUX_VIDEO_INITIAL_PES);
+    if (!output) {
+        return -1;
+    }
 
     header[0] = 0x00;
     header[1] = 0x00;
@@ -753,167 +1150,66 @@ static int muxvideosample(fillet_app_struct *core, stream_struct *stream, sorted
         header_size = 14;
     }
 
-    memcpy(pesbuffer + header_size, frame->buffer, frame->buffer_size);
-    muxdata = pesbuffer;
-
-    video_size = header_size + frame->buffer_size;
-
-    firstdata = 0x4000 | video_pid;
-    firstflag = 0x10;
-    if (frame->sync_frame) {
-        firstflag = 0x20;
+    if (frame->dts > 0) {
+        timestamp = frame->dts;
+    } else {
+        timestamp = frame->pts;
+    }
+    timestamp_offset = timestamp - VIDEO_OFFSET;
+    if (timestamp_offset < 0) {
+        timestamp_offset += 8589934592;
     }
 
-    while (video_size > 0) {
-        uint8_t *sp;
-
-        widx = packetcount * 188;
-        sp = buffer + widx;
-
-        buffer[widx++] = 0x47;
-        save16 = (uint16_t*)&buffer[widx];
-        *save16 = htons(firstdata);
-        widx += 2;
-        firstdata = video_pid;  // overwrite from first time
-        buffer[widx] = (stream->cnt & 0x0f) | firstflag;
-        firstflag = 0x10;
-        stream->prev_cnt = stream->cnt;
-        stream->cnt = (stream->cnt + 1) & 0x0f;
-        if (packetcount == 0 && video_size >= MDSIZE_VIDEO) {
-            buffer[widx] = buffer[widx] | 0x30;
-            widx++;
-            buffer[widx++] = 188 - MDSIZE_VIDEO - 5;
-            buffer[widx] = 0x10;  // PCR flag
-            if (frame->sync_frame) {
-                buffer[widx] = 0x50; // RAI, PCR flag
-            }
-            widx++;
-
-            widx += 6; // PCR
-
-            // null filler
-            for (s = 12; s < 188 - MDSIZE_VIDEO; s++) {
-                buffer[widx++] = 0xff;
-            }
-            memcpy(sp + 188 - MDSIZE_VIDEO, muxdata, MDSIZE_VIDEO);
-            widx += MDSIZE_VIDEO;           // this is the 188-byte output stream
-            muxdata += MDSIZE_VIDEO;        // this is the source data
-
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
-
-            video_size -= MDSIZE_VIDEO;
-        } else if (video_size == 183) {
-            buffer[widx] = buffer[widx] | 0x30;
-            widx++;
-            buffer[widx++] = 91;
-            buffer[widx++] = 0;
-            for (s = 6; s < 188 - 92; s++) {
-                buffer[widx++] = 0xff;
-            }
-            memcpy(sp + 188 - 92, muxdata, 92);
-            widx += 92;
-            muxdata += 92;
-
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
-
-            widx = packetcount * 188;
-            sp = buffer + widx;
-            buffer[widx++] = 0x47;
-            save16 = (uint16_t*)&buffer[widx];
-            *save16 = htons(video_pid);
-            widx += 2;
-
-            buffer[widx] = (stream->cnt & 0x0f) | 0x10;
-            stream->prev_cnt = stream->cnt;
-            stream->cnt = (stream->cnt + 1) & 0x0f;
-
-            buffer[widx] = buffer[widx] | 0x30;
-            widx++;
-            buffer[widx++] = 92;
-            buffer[widx++] = 0;
-            for (s = 6; s < 188 - 91; s++) {
-                buffer[widx++] = 0xff;
-            }
-            memcpy(sp + 188 - 91, muxdata, 91);
-            widx += 91;
-            muxdata += 91;
-
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
-
-            video_size = 0;
-        } else if (video_size < 184) {
-            buffer[widx] = buffer[widx] | 0x30;
-            widx++;
-            buffer[widx++] = 188 - video_size - 5;
-            buffer[widx++] = 0;
-            for (s = 6; s < 188 - video_size; s++) {
-                buffer[widx++] = 0xff;
-            }
-            memcpy(sp + 188 - video_size, muxdata, video_size);
-
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
-
-            muxdata += video_size;
-            widx += video_size;
-
-            video_size = 0;
-        } else {
-            memcpy(sp + 4, muxdata, 184);
-            muxdata += 184;
-            widx += 184;
-
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
-
-            video_size -= 184;
-        }
+    es[0].pid = VIDEO_PID;
+    es[0].codec_type = codec_type;
+    es[0].descriptors = descriptors;
+    es[0].descriptors_size = descriptors_size;
+    if (stream->ts_audio_codec) {
+        es[1].pid = AUDIO_BASE_PID;
+        es[1].codec_type = stream->ts_audio_codec;
+        es[1].descriptors = stream->ts_audio_descriptors;
+        es[1].descriptors_size = stream->ts_audio_descriptors_size;
+        es_count = 2;
     }
 
+    muxpatsample(core, stream, output);
+    muxpmtsample(core, stream, output + 188, es, es_count);
+    packetcount = muxsample(&stream->cnt, frame, VIDEO_PID, header, header_size, MDSIZE_VIDEO,
+                            timestamp_offset, output + MUX_TABLE_PACKETS * 188);
+
     return packetcount;
 }
 
-static int muxaudiosample(fillet_app_struct *core, stream_struct *stream, sorted_frame_struct *frame, int audio_stream)
+// muxed audio goes into a video rendition's segments under its pat/pmt and pcr,
+// only the pes packets are produced, counted on the rendition's audio continuity counter
+static int muxaudiosample(fillet_app_struct *core, stream_struct *stream, sorted_frame_struct *frame, int audio_stream, int muxed)
 {
-    int header_size;
-    uint8_t *muxbuffer = stream->muxbuffer;
-    uint8_t *pesbuffer = stream->pesbuffer;
-    uint8_t *buffer = muxbuffer;
-    packet_struct *packettable = stream->packettable;
-    packet_struct *ptable = packettable;
-    uint8_t *header = pesbuffer;
-    uint8_t *muxdata;
-    int audio_size;
-    int widx = 0;
-    uint16_t audio_pid = AUDIO_BASE_PID+audio_stream;
-    uint16_t firstdata;
+    uint8_t header[MUX_PES_HEADER_SIZE];
+    uint8_t descriptors[MUX_PES_HEADER_SIZE];
+    sorted_frame_struct protected_frame;
+    mux_es_struct es;
+    int descriptors_size = 0;
     uint16_t *save16;
-    uint16_t firstflag;
-    int s;
-    int packetcount = 0;
+    int64_t timestamp_offset;
+    int codec_type = CODEC_AAC;
+    int packetcount;
+    uint8_t *output;
+
+    if (frame->media_type == MEDIA_TYPE_AC3) {
+        codec_type = CODEC_AC3;
+    } else if (sample_aes_enabled(stream, frame)) {
+        if (sample_aes_frame(stream, frame, &protected_frame) < 0) {
+            return -1;
+        }
+        descriptors_size = sample_aes_descriptors(frame, descriptors);
+        codec_type = CODEC_AAC_SAMPLE_AES;
+        frame = &protected_frame;
+    }
+
+    output = mux_ts_output(core, stream, frame->buffer_size + MUX_PES_HEADER_SIZE, MUX_AUDIO_INITIAL_PES);
+    if (!output) {
+        return -1;
+    }
 
     header[0] = 0x00;
     header[1] = 0x00;
@@ -929,181 +1225,349 @@ static int muxaudiosample(fillet_app_struct *core, stream_struct *stream, sorted
     apply_pts(&header[9], frame->pts);
     header[9] = header[9] & 0x0f;
     header[9] = header[9] | 0x20;
-    header_size = 14;
 
-    memcpy(pesbuffer + header_size, frame->buffer, frame->buffer_size);
-    muxdata = pesbuffer;
-
-    audio_size = header_size + frame->buffer_size;
+    timestamp_offset = frame->pts - AUDIO_OFFSET;
+    if (timestamp_offset < 0) {
+        timestamp_offset += 8589934592;
+    }
 
-    firstdata = 0x4000 | audio_pid;
-    firstflag = 0x10;
-    if (frame->sync_frame) {
-        firstflag = 0x20;
+    if (muxed) {
+        stream->ts_audio_codec = codec_type;
+        memcpy(stream->ts_audio_descriptors, descriptors, descriptors_size);
+        stream->ts_audio_descriptors_size = descriptors_size;
+        // no tables of its own, the packets start at the front of the output
+        return muxsample(&stream->ts_audio_cnt, frame, AUDIO_BASE_PID+audio_stream, header, 14, MDSIZE_AUDIO,
+                         MUX_NO_PCR, output);
     }
 
-    while (audio_size > 0) {
-        uint8_t *sp;
+    es.pid = AUDIO_BASE_PID;
+    es.codec_type = codec_type;
+    es.descriptors = descriptors;
+    es.descriptors_size = descriptors_size;
 
-        widx = packetcount * 188;
-        sp = buffer + widx;
+    muxpatsample(core, stream, output);
+    muxpmtsample(core, stream, output + 188, &es, 1);
+    packetcount = muxsample(&stream->cnt, frame, AUDIO_BASE_PID+audio_stream, header, 14, MDSIZE_AUDIO,
+                            timestamp_offset, output + MUX_TABLE_PACKETS * 188);
 
-        buffer[widx++] = 0x47;
-        save16 = (uint16_t*)&buffer[widx];
-        *save16 = htons(firstdata);
-        widx += 2;
-        firstdata = audio_pid;  // overwrite from first time
-        buffer[widx] = (stream->cnt & 0x0f) | firstflag;
-        firstflag = 0x10;
-        stream->prev_cnt = stream->cnt;
-        stream->cnt = (stream->cnt + 1) & 0x0f;
-        if (packetcount == 0 && audio_size >= MDSIZE_AUDIO) {
-            buffer[widx] = buffer[widx] | 0x30;
-            widx++;
-            buffer[widx++] = 188 - MDSIZE_AUDIO - 5;
-            buffer[widx] = 0x10;  // PCR flag
-            if (frame->sync_frame) {
-                buffer[widx] = 0x50; // RAI, PCR flag
-            }
-            widx++;
+    return packetcount;
+}
 
-            widx += 6; // PCR
+static int64_t mux_now(void)
+{
+    struct timespec now;
 
-            // null filler
-            for (s = 12; s < 188 - MDSIZE_AUDIO; s++) {
-                buffer[widx++] = 0xff;
-            }
-            memcpy(sp + 188 - MDSIZE_AUDIO, muxdata, MDSIZE_AUDIO);
-            widx += MDSIZE_AUDIO;           // this is the 188-byte output stream
-            muxdata += MDSIZE_AUDIO;        // this is the source data
-
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
-
-            audio_size -= MDSIZE_AUDIO;
-        } else if (audio_size == 183) {
-            buffer[widx] = buffer[widx] | 0x30;
-            widx++;
-            buffer[widx++] = 91;
-            buffer[widx++] = 0;
-            for (s = 6; s < 188 - 92; s++) {
-                buffer[widx++] = 0xff;
-            }
-            memcpy(sp + 188 - 92, muxdata, 92);
-            widx += 92;
-            muxdata += 92;
-
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
-
-            widx = packetcount * 188;
-            sp = buffer + widx;
-            buffer[widx++] = 0x47;
-            save16 = (uint16_t*)&buffer[widx];
-            *save16 = htons(audio_pid);
-            widx += 2;
-
-            buffer[widx] = (stream->cnt & 0x0f) | 0x10;
-            stream->prev_cnt = stream->cnt;
-            stream->cnt = (stream->cnt + 1) & 0x0f;
-
-            buffer[widx] = buffer[widx] | 0x30;
-            widx++;
-            buffer[widx++] = 92;
-            buffer[widx++] = 0;
-            for (s = 6; s < 188 - 91; s++) {
-                buffer[widx++] = 0xff;
-            }
-            memcpy(sp + 188 - 91, muxdata, 91);
-            widx += 91;
-            muxdata += 91;
-
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
-
-            audio_size = 0;
-        } else if (audio_size < 184) {
-            buffer[widx] = buffer[widx] | 0x30;
-            widx++;
-            buffer[widx++] = 188 - audio_size - 5;
-            buffer[widx++] = 0;
-            for (s = 6; s < 188 - audio_size; s++) {
-                buffer[widx++] = 0xff;
-            }
-            memcpy(sp + 188 - audio_size, muxdata, audio_size);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
+static int cdn_enabled(fillet_app_struct *core)
+{
+    return (strlen(core->cd->cdn_server) > 0) && (strlen(core->cd->cdn_username) > 0) && (strlen(core->cd->cdn_password) > 0);
+}
 
-            muxdata += audio_size;
-            widx += audio_size;
+static void mux_signal_written(void *context, int event, const char *filename)
+{
+    send_signal((fillet_app_struct*)context, event, filename);
+}
 
-            audio_size = 0;
-        } else {
-            memcpy(sp + 4, muxdata, 184);
-            muxdata += 184;
-            widx += 184;
+static void mux_webdav_request(void *context, int event, const char *filename)
+{
+    fillet_app_struct *core = (fillet_app_struct*)context;
+    dataqueue_message_struct *msg;
 
-            ptable->pts = frame->pts;
-            ptable->dts = frame->dts;
-            ptable->sync = frame->sync_frame;
-            ptable->disflag = 0;
-            ptable->count = ++packetcount;
-            ptable++;
+    //send message to webdav thread for upload
+    //base url is: core->cd->cdn_server        - it doesn't need to match the manifest directory tag since it can be uploaded anywhere and we are keeping the
+    //                                           manifest in the same directory as the transport files right now. this could be changed, to accommodate archival
+    //                                           but for now we'll keep it simple and straightforward to setup
+    msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
+    if (msg) {
+        snprintf(msg->smallbuf, MAX_SMALLBUF_SIZE-1, "%s", filename); // this is the directory on the local server which is what we want
+        msg->buffer = NULL;
+        msg->buffer_type = event;
+        dataqueue_put_front(core->webdav_queue, msg);
+    } else {
+        fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! SKIPPING UPLOAD!!!\n",
+                core->session_id);
+        overload_exhausted(core, "message pool");
+    }
+}
 
-            audio_size -= 184;
-        }
+// queued behind the file writes so the signal and upload only happen once the file is on disk
+static int publish_file(fillet_app_struct *core, int signal_type, const char *filename, int upload)
+{
+    segwriter_notify(core->hlsmux->writer, mux_signal_written, core, signal_type, filename);
+    if (upload && cdn_enabled(core)) {
+        segwriter_notify(core->hlsmux->writer, mux_webdav_request, core, WEBDAV_UPLOAD, filename);
     }
+    return 0;
+}
 
-    return packetcount;
+static FILE *manifest_open(char **manifest_buffer, size_t *manifest_size)
+{
+    *manifest_buffer = NULL;
+    *manifest_size = 0;
+    return open_memstream(manifest_buffer, manifest_size);
 }
 
-static int start_ts_fragment(fillet_app_struct *core, stream_struct *stream, int source, int sub_stream, int video)
+// returns 0 when the playlist has not changed since it was last published
+static int manifest_publish(fillet_app_struct *core, void *playlist, FILE *manifest, char **manifest_buffer, size_t *manifest_size, const char *filename,
+                            int flags, int64_t media_sequence, int part)
 {
-    if (!stream->output_ts_file) {
-        char stream_name[MAX_STREAM_NAME];
-        if (video) {
-            snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video_stream%d_%ld.ts", core->cd->manifest_directory, source, stream->file_sequence_number);
-        } else {
-            snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio_stream%d_substream_%d_%ld.ts", core->cd->manifest_directory, source, sub_stream, stream->file_sequence_number);
-        }
-        stream->output_ts_file = fopen(stream_name,"w");
+    fclose(manifest);
+    if (!playlist_changed(playlist, *manifest_buffer, *manifest_size)) {
+        free(*manifest_buffer);
+        *manifest_buffer = NULL;
+        return 0;
     }
+    segwriter_playlist(core->hlsmux->writer, filename, *manifest_buffer, *manifest_size, flags, media_sequence, part);
+    *manifest_buffer = NULL;
+    return 1;
+}
 
-    return 0;
+static int manifest_close(fillet_app_struct *core, void *playlist, FILE *manifest, char **manifest_buffer, size_t *manifest_size, const char *filename)
+{
+    return manifest_publish(core, playlist, manifest, manifest_buffer, manifest_size, filename, 0, -1, -1);
 }
 
-static int start_init_mp4_fragment(fillet_app_struct *core, stream_struct *stream, int source, int video, int sub_stream)
+static int llhls_enabled(fillet_app_struct *core)
 {
-    struct stat sb;
+    return core->cd->part_length_ms > 0 && core->cd->enable_fmp4_output;
+}
 
-    if (!stream->output_fmp4_file) {
-        char stream_name[MAX_STREAM_NAME];
-        char local_dir[MAX_STREAM_NAME];
+static int dash_chunked(fillet_app_struct *core)
+{
+    return core->cd->chunk_frames > 0 && core->cd->enable_fmp4_output;
+}
 
-        snprintf(local_dir, MAX_STREAM_NAME-1, "%s", core->cd->manifest_directory);
-        if (stat(local_dir, &sb) == 0 && S_ISDIR(sb.st_mode)) {
-            fprintf(stderr,"STATUS: fMP4 manifest directory exists: %s\n", local_dir);
-        } else {
-            fprintf(stderr,"STATUS: fMP4 manifest directory does not exist: %s (CREATING)\n", local_dir);
-            mkdir(local_dir, 0700);
-            fprintf(stderr,"STATUS: Done creating fMP4 manifest directory\n");
+static int byterange_enabled(fillet_app_struct *core)
+{
+    return core->cd->enable_byterange;
+}
+
+// aes-128 runs one cbc chain over the whole segment, a range out of the middle could not be decrypted
+static int ts_iframes_enabled(fillet_app_struct *core)
+{
+    return core->cd->enable_trickplay && core->cd->enable_ts_output && core->cd->ts_encryption != SEGCRYPT_SCHEME_AES128;
+}
+
+// the primary audio goes into the video rendition's segments, alternate languages keep their own
+static int ts_audio_muxed(fillet_app_struct *core, int source, int sub_stream)
+{
+    return core->cd->enable_muxed_ts && core->cd->enable_ts_output && source == 0 && sub_stream == 0;
+}
+
+// the primary audio becomes the second track of each video rendition's fmp4, alternates keep their own files
+static int mp4_audio_muxed(fillet_app_struct *core, int source, int sub_stream)
+{
+    return core->cd->enable_muxed_cmaf && core->cd->enable_fmp4_output && source == 0 && sub_stream == 0;
+}
+
+// the trick files are cut from the segment buffer, the byte-range containers have no place for them
+static int mp4_iframes_enabled(fillet_app_struct *core)
+{
+    return core->cd->enable_trickplay && core->cd->enable_fmp4_output && !byterange_enabled(core);
+}
+
+// containers roll over on the hour so cleanup can remove them once they age out of the window
+static int64_t byterange_offset(int64_t *container, int64_t *offset)
+{
+    int64_t hour = (int64_t)time(NULL) / 3600;
+
+    if (hour != *container) {
+        *container = hour;
+        *offset = 0;
+    }
+    return *offset;
+}
+
+// a restart within the hour carries on after what is already in the container
+static int64_t byterange_resume(const char *stream_name, int64_t *offset)
+{
+    struct stat sb;
+
+    if (*offset == 0 && stat(stream_name, &sb) == 0) {
+        *offset = sb.st_size;
+    }
+    return *offset;
+}
+
+static int ts_container_name(fillet_app_struct *core, char *stream_name, int source, int sub_stream, int video, int64_t container)
+{
+    if (video) {
+        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video_stream%d_range%ld.ts", core->cd->manifest_directory, source, container);
+    } else {
+        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio_stream%d_substream_%d_range%ld.ts", core->cd->manifest_directory, source, sub_stream, container);
+    }
+    return 0;
+}
+
+// records where the segment just written sits inside its container
+static int byterange_record(stream_struct *stream, void *file, byterange_struct *ranges, int64_t container, int64_t *offset)
+{
+    byterange_struct *range = &ranges[stream->file_sequence_number % MAX_ROLLOVER_SIZE];
+
+    range->container = container;
+    range->offset = *offset;
+    range->length = segwriter_tell(file);
+    *offset += range->length;
+    return 0;
+}
+
+// each rendition keeps its own cipher state, made the first time a segment needs it
+static void *stream_ts_crypt(fillet_app_struct *core, stream_struct *stream)
+{
+    if (core->cd->ts_encryption && !stream->ts_crypt) {
+        stream->ts_crypt = segcrypt_create(core->cd->ts_encryption, &core->cd->content_key);
+    }
+    return stream->ts_crypt;
+}
+
+static void *stream_fmp4_crypt(fillet_app_struct *core, stream_struct *stream)
+{
+    if (core->cd->fmp4_encryption && !stream->fmp4_crypt) {
+        stream->fmp4_crypt = segcrypt_create(core->cd->fmp4_encryption, &core->cd->content_key);
+    }
+    return stream->fmp4_crypt;
+}
+
+// aes-128 runs over the packets in place on their way out, a segment is one cbc chain
+static int mux_ts_write(fillet_app_struct *core, stream_struct *stream, uint8_t *buffer, int buffer_size)
+{
+    uint8_t lead[SEGCRYPT_BLOCK_SIZE];
+    uint8_t *body;
+    int lead_size;
+    int body_size;
+
+    if (segcrypt_get_scheme(stream->ts_crypt) != SEGCRYPT_SCHEME_AES128) {
+        return segwriter_write(core->hlsmux->writer, stream->output_ts_file, buffer, buffer_size);
+    }
+    body_size = segcrypt_segment_update(stream->ts_crypt, buffer, buffer_size, lead, &lead_size, &body);
+    if (lead_size > 0) {
+        segwriter_write(core->hlsmux->writer, stream->output_ts_file, lead, lead_size);
+    }
+    if (body_size > 0) {
+        return segwriter_write(core->hlsmux->writer, stream->output_ts_file, body, body_size);
+    }
+    return 0;
+}
+
+// hands over the packets the last sample built, wherever mux_ts_output put them
+static int mux_ts_commit(fillet_app_struct *core, stream_struct *stream, int buffer_size)
+{
+    if (mux_ts_direct(core, stream)) {
+        return segwriter_commit(core->hlsmux->writer, stream->output_ts_file, buffer_size);
+    }
+    return mux_ts_write(core, stream, stream->muxbuffer, buffer_size);
+}
+
+static void mux_ts_finish(fillet_app_struct *core, stream_struct *stream)
+{
+    uint8_t block[SEGCRYPT_BLOCK_SIZE];
+
+    if (segcrypt_get_scheme(stream->ts_crypt) == SEGCRYPT_SCHEME_AES128) {
+        segcrypt_segment_end(stream->ts_crypt, block);
+        segwriter_write(core->hlsmux->writer, stream->output_ts_file, block, SEGCRYPT_BLOCK_SIZE);
+    }
+}
+
+static int start_ts_fragment(fillet_app_struct *core, stream_struct *stream, int source, int sub_stream, int video)
+{
+    if (!stream->output_ts_file && stream_ts_crypt(core, stream)) {
+        // the iv is the media sequence number the playlist gives the segment
+        segcrypt_segment_start(stream->ts_crypt, stream->media_sequence_number);
+    }
+    if (!stream->output_ts_file && video) {
+        int slot = stream->media_sequence_number % MAX_IFRAME_SEGMENTS;
+
+        stream->ts_iframe_counts[slot] = 0;
+        stream->ts_iframe_first[slot] = stream->ts_iframe_total;
+    }
+    if (!stream->output_ts_file) {
+        char stream_name[MAX_STREAM_NAME];
+        if (byterange_enabled(core)) {
+            byterange_offset(&stream->ts_container, &stream->ts_container_offset);
+            ts_container_name(core, stream_name, source, sub_stream, video, stream->ts_container);
+            stream->output_ts_file = segwriter_append(core->hlsmux->writer, stream_name, 0,
+                                                      byterange_resume(stream_name, &stream->ts_container_offset));
+            return 0;
+        }
+        if (video) {
+            snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video_stream%d_%ld.ts", core->cd->manifest_directory, source, stream->file_sequence_number);
+        } else {
+            snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio_stream%d_substream_%d_%ld.ts", core->cd->manifest_directory, source, sub_stream, stream->file_sequence_number);
+        }
+        stream->output_ts_file = segwriter_open(core->hlsmux->writer, stream_name, 0);
+    }
+
+    return 0;
+}
+
+// every sample goes out behind its own pat/pmt, so the packets of a sync frame can be fetched on their own
+static void ts_iframe_record(stream_struct *stream, int64_t pts, int64_t offset, int64_t length)
+{
+    int slot = stream->media_sequence_number % MAX_IFRAME_SEGMENTS;
+    iframe_struct *iframe;
+
+    if (stream->ts_iframe_counts[slot] >= MAX_SEGMENT_IFRAMES) {
+        return;
+    }
+    iframe = &stream->ts_iframes[slot][stream->ts_iframe_counts[slot]++];
+    iframe->pts = pts;
+    iframe->offset = offset;
+    iframe->length = length;
+    stream->ts_iframe_total++;
+}
+
+// the trick file is the sync sample that opened the segment under a header of its own,
+// both are still in the fmp4 buffer right after the segment or its first part went out
+static int write_mp4_iframe(fillet_app_struct *core, stream_struct *stream, int source, int64_t segment_time)
+{
+    char stream_name[MAX_STREAM_NAME];
+    char stream_name_link[MAX_STREAM_NAME];
+    int64_t header_offset;
+    int64_t sample_offset;
+    int header_size;
+    int sample_size;
+    void *iframe_file;
+
+    if (!mp4_iframes_enabled(core) || !stream->fmp4 ||
+        !fmp4_iframe_fragment(stream->fmp4, &header_offset, &header_size, &sample_offset, &sample_size)) {
+        return 0;
+    }
+
+    snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%d/iframe%ld.mp4", core->cd->manifest_directory, source, stream->file_sequence_number);
+    snprintf(stream_name_link, MAX_STREAM_NAME-1, "%s/video%d/iframe%ld.mp4", core->cd->manifest_directory, source, segment_time);
+    iframe_file = segwriter_open(core->hlsmux->writer, stream_name, 0);
+    if (!iframe_file) {
+        return -1;
+    }
+    segwriter_write(core->hlsmux->writer, iframe_file, stream->fmp4->buffer + header_offset, header_size);
+    segwriter_write(core->hlsmux->writer, iframe_file, stream->fmp4->buffer + sample_offset, sample_size);
+    segwriter_close(core->hlsmux->writer, iframe_file);
+    segwriter_symlink(core->hlsmux->writer, stream_name, stream_name_link);
+    publish_file(core, SIGNAL_SEGMENT_WRITTEN, stream_name_link, 0);
+
+    stream->mp4_iframe_sizes[stream->media_sequence_number % MAX_IFRAME_SEGMENTS] = header_size + sample_size;
+
+    return 0;
+}
+
+static int start_init_mp4_fragment(fillet_app_struct *core, stream_struct *stream, int source, int video, int sub_stream)
+{
+    struct stat sb;
+
+    if (!stream->output_fmp4_file) {
+        char stream_name[MAX_STREAM_NAME];
+        char local_dir[MAX_STREAM_NAME];
+
+        snprintf(local_dir, MAX_STREAM_NAME-1, "%s", core->cd->manifest_directory);
+        if (stat(local_dir, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            fprintf(stderr,"STATUS: fMP4 manifest directory exists: %s\n", local_dir);
+        } else {
+            fprintf(stderr,"STATUS: fMP4 manifest directory does not exist: %s (CREATING)\n", local_dir);
+            mkdir(local_dir, 0700);
+            fprintf(stderr,"STATUS: Done creating fMP4 manifest directory\n");
         }
 
         if (video) {
@@ -1120,7 +1584,7 @@ static int start_init_mp4_fragment(fillet_app_struct *core, stream_struct *strea
         }
 
         snprintf(stream_name, MAX_STREAM_NAME-1, "%s/init.mp4", local_dir);
-        stream->output_fmp4_file = fopen(stream_name,"w");
+        stream->output_fmp4_file = segwriter_open(core->hlsmux->writer, stream_name, SEGWRITER_FLAG_PINNED);
     }
     return 0;
 }
@@ -1128,7 +1592,7 @@ static int start_init_mp4_fragment(fillet_app_struct *core, stream_struct *strea
 static int end_init_mp4_fragment(fillet_app_struct *core, stream_struct *stream, int source)
 {
     if (stream->output_fmp4_file) {
-        fclose(stream->output_fmp4_file);
+        segwriter_close(core->hlsmux->writer, stream->output_fmp4_file);
         stream->output_fmp4_file = NULL;
     }
 
@@ -1155,16 +1619,39 @@ static int start_mp4_fragment(fillet_app_struct *core, stream_struct *stream, in
             fprintf(stderr,"STATUS: Done creating fMP4 manifest directory\n");
         }
 
-        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/segment%ld.mp4", local_dir, stream->file_sequence_number);
-        stream->output_fmp4_file = fopen(stream_name,"w");
+        if (byterange_enabled(core)) {
+            byterange_offset(&stream->mp4_container, &stream->mp4_container_offset);
+            snprintf(stream_name, MAX_STREAM_NAME-1, "%s/segment_range%ld.mp4", local_dir, stream->mp4_container);
+            stream->output_fmp4_file = segwriter_append(core->hlsmux->writer, stream_name, 0,
+                                                        byterange_resume(stream_name, &stream->mp4_container_offset));
+        } else {
+            snprintf(stream_name, MAX_STREAM_NAME-1, "%s/segment%ld.mp4", local_dir, stream->file_sequence_number);
+            stream->output_fmp4_file = segwriter_open(core->hlsmux->writer, stream_name, dash_chunked(core) ? SEGWRITER_FLAG_GROWING : 0);
+        }
+
+        stream->part_count = 0;
+        stream->part_duration = 0;
+        stream->chunk_samples = 0;
+        stream->part_counts[stream->media_sequence_number % MAX_PART_SEGMENTS] = 0;
     }
     return 0;
 }
 
 static int end_mp4_fragment(fillet_app_struct *core, stream_struct *stream, int source, int sub_stream, int video, int64_t segment_time)
 {
-    if (stream->output_fmp4_file) {
-        fclose(stream->output_fmp4_file);
+    if (stream->output_fmp4_file && byterange_enabled(core)) {
+        char stream_name[MAX_STREAM_NAME];
+        if (video) {
+            snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%d/segment_range%ld.mp4", core->cd->manifest_directory, source, stream->mp4_container);
+        } else {
+            snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d/segment_range%ld.mp4", core->cd->manifest_directory, source, sub_stream, stream->mp4_container);
+        }
+        byterange_record(stream, stream->output_fmp4_file, stream->mp4_ranges, stream->mp4_container, &stream->mp4_container_offset);
+        segwriter_close(core->hlsmux->writer, stream->output_fmp4_file);
+        stream->output_fmp4_file = NULL;
+        publish_file(core, SIGNAL_SEGMENT_WRITTEN, stream_name, 0);
+    } else if (stream->output_fmp4_file) {
+        segwriter_close(core->hlsmux->writer, stream->output_fmp4_file);
         stream->output_fmp4_file = NULL;
         {
             char stream_name[MAX_STREAM_NAME];
@@ -1178,8 +1665,8 @@ static int end_mp4_fragment(fillet_app_struct *core, stream_struct *stream, int
             snprintf(stream_name, MAX_STREAM_NAME-1, "%s/segment%ld.mp4", local_dir, stream->file_sequence_number);
             snprintf(stream_name_link, MAX_STREAM_NAME-1, "%s/segment%ld.mp4", local_dir, segment_time); //stream->media_sequence_number);
             syslog(LOG_INFO,"HLSMUX: WRITING OUT %s (%s)\n", stream_name_link, stream_name);
-            symlink(stream_name, stream_name_link);
-            send_signal(core, SIGNAL_SEGMENT_WRITTEN, stream_name_link);
+            segwriter_symlink(core->hlsmux->writer, stream_name, stream_name_link);
+            publish_file(core, SIGNAL_SEGMENT_WRITTEN, stream_name_link, 0);
 
             /*
             if ((strlen(core->cd->cdn_server) > 0) && (strlen(core->cd->cdn_username) > 0) && (strlen(core->cd->cdn_password) > 0)) {
@@ -1227,7 +1714,7 @@ static int start_webvtt_fragment(fillet_app_struct *core, stream_struct *stream,
         }
 
         snprintf(stream_name, MAX_STREAM_NAME-1, "%s/segment%ld.vtt", local_dir, stream->file_sequence_number);
-        stream->output_webvtt_file = fopen(stream_name,"w");
+        stream->output_webvtt_file = segwriter_open(core->hlsmux->writer, stream_name, 0);
     }
     return 0;
 }
@@ -1235,7 +1722,7 @@ static int start_webvtt_fragment(fillet_app_struct *core, stream_struct *stream,
 static int end_webvtt_fragment(fillet_app_struct *core, stream_struct *stream, int source, int64_t segment_time)
 {
     if (stream->output_webvtt_file) {
-        fclose(stream->output_webvtt_file);
+        segwriter_close(core->hlsmux->writer, stream->output_webvtt_file);
         stream->output_webvtt_file = NULL;
         {
             char stream_name[MAX_STREAM_NAME];
@@ -1245,20 +1732,413 @@ static int end_webvtt_fragment(fillet_app_struct *core, stream_struct *stream, i
             snprintf(stream_name, MAX_STREAM_NAME-1, "%s/segment%ld.vtt", local_dir, stream->file_sequence_number);
             snprintf(stream_name_link, MAX_STREAM_NAME-1, "%s/segment%ld.vtt", local_dir, segment_time);
             syslog(LOG_INFO,"HLSMUX: WRITING OUT %s (%s)\n", stream_name_link, stream_name);
-            symlink(stream_name, stream_name_link);
+            segwriter_symlink(core->hlsmux->writer, stream_name, stream_name_link);
+        }
+    }
+    return 0;
+}
+
+static int dvr_enabled(fillet_app_struct *core)
+{
+    return core->cd->dvr_window_minutes > 0;
+}
+
+static int dvr_window_segments(fillet_app_struct *core)
+{
+    return core->cd->dvr_window_minutes * 60 / core->cd->segment_length;
+}
+
+static void scte35_put32(uint8_t *buffer, uint32_t value)
+{
+    buffer[0] = (value >> 24) & 0xff;
+    buffer[1] = (value >> 16) & 0xff;
+    buffer[2] = (value >> 8) & 0xff;
+    buffer[3] = value & 0xff;
+}
+
+// splice_info_section() with a splice_insert() for the cue, duration is in seconds
+static int scte35_splice_insert(uint8_t *section, uint32_t event_id, int64_t splice_pts, int64_t duration, int out)
+{
+    int command_length = (out && duration > 0) ? 20 : 15;
+    int section_length = 11 + command_length + 2 + 4;
+    int size = 0;
+
+    section[size++] = 0xfc;
+    section[size++] = 0x30 | ((section_length >> 8) & 0x0f);
+    section[size++] = section_length & 0xff;
+    memset(section + size, 0, 7);  // protocol version, no pts_adjustment, cw_index
+    size += 7;
+    section[size++] = 0xff;
+    section[size++] = 0xf0 | ((command_length >> 8) & 0x0f);
+    section[size++] = command_length & 0xff;
+    section[size++] = 0x05;  // splice_insert
+    scte35_put32(section + size, event_id);
+    size += 4;
+    section[size++] = 0x7f;
+    section[size++] = (out ? 0x80 : 0x00) | 0x40 | (command_length == 20 ? 0x20 : 0x00) | 0x0f;
+    splice_pts %= OVERFLOW_PTS;
+    section[size++] = 0xfe | ((splice_pts >> 32) & 0x01);
+    scte35_put32(section + size, (uint32_t)splice_pts);
+    size += 4;
+    if (command_length == 20) {
+        int64_t break_duration = (duration * VIDEO_CLOCK) % OVERFLOW_PTS;
+
+        section[size++] = 0xfe | ((break_duration >> 32) & 0x01);  // auto return
+        scte35_put32(section + size, (uint32_t)break_duration);
+        size += 4;
+    }
+    memset(section + size, 0, 6);  // unique_program_id, avail_num, avails_expected, no descriptors
+    size += 6;
+    scte35_put32(section + size, getcrc32(section, size));
+    size += 4;
+
+    return size;
+}
+
+static int scte35_base64(char *text, int text_size, uint8_t *data, int size)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int length = 0;
+    int i;
+
+    for (i = 0; i < size && length + 4 < text_size; i += 3) {
+        uint32_t block = data[i] << 16;
+
+        if (i + 1 < size) {
+            block |= data[i + 1] << 8;
+        }
+        if (i + 2 < size) {
+            block |= data[i + 2];
+        }
+        text[length++] = alphabet[(block >> 18) & 0x3f];
+        text[length++] = alphabet[(block >> 12) & 0x3f];
+        text[length++] = i + 1 < size ? alphabet[(block >> 6) & 0x3f] : '=';
+        text[length++] = i + 2 < size ? alphabet[block & 0x3f] : '=';
+    }
+    text[length] = 0;
+
+    return length;
+}
+
+static int program_date(char *text, int text_size, int64_t program_time)
+{
+    time_t seconds = program_time / 1000;
+    struct tm tm_program;
+    int length;
+
+    gmtime_r(&seconds, &tm_program);
+    length = strftime(text, text_size, "%Y-%m-%dT%H:%M:%S", &tm_program);
+    length += snprintf(text + length, text_size - length, ".%03ldZ", program_time % 1000);
+
+    return length;
+}
+
+// cue 2 takes the break out at program_time, cue 3 brings it back there after a break that
+// went out at start_time- both ends of a break carry the same id
+static int scte35_daterange(char *text, int text_size, int cue, int64_t splice_pts, int64_t start_time, int64_t program_time, int64_t duration)
+{
+    uint8_t section[SCTE35_MAX_SECTION];
+    uint32_t event_id = (uint32_t)start_time;
+    char start_date[64];
+    char end_date[64];
+    int section_size;
+    int length;
+    int i;
+
+    program_date(start_date, sizeof(start_date), start_time);
+    if (cue == 2) {
+        section_size = scte35_splice_insert(section, event_id, splice_pts, duration, 1);
+        length = snprintf(text, text_size, "#EXT-X-DATERANGE:ID=\"splice-%u\",START-DATE=\"%s\"", event_id, start_date);
+        if (duration > 0) {
+            length += snprintf(text + length, text_size - length, ",PLANNED-DURATION=%ld", duration);
+        }
+        length += snprintf(text + length, text_size - length, ",SCTE35-OUT=0x");
+    } else {
+        section_size = scte35_splice_insert(section, event_id, splice_pts, 0, 0);
+        program_date(end_date, sizeof(end_date), program_time);
+        length = snprintf(text, text_size, "#EXT-X-DATERANGE:ID=\"splice-%u\",START-DATE=\"%s\",END-DATE=\"%s\",SCTE35-IN=0x",
+                          event_id, start_date, end_date);
+    }
+    for (i = 0; i < section_size && length + 3 < text_size; i++) {
+        length += snprintf(text + length, text_size - length, "%02X", section[i]);
+    }
+    length += snprintf(text + length, text_size - length, "\n");
+    if (length >= text_size) {
+        length = text_size - 1;
+    }
+    return length;
+}
+
+// a cue cut at its splice point marks the segment starting there
+static void splice_begin(source_context_struct *sdata)
+{
+    sdata->source_discontinuity = sdata->splice_pending;
+    if (sdata->splice_pending == 2) {
+        sdata->source_splice_elapsed_time = 0;
+        sdata->source_splice_duration_remaining = sdata->splice_pending_duration;
+        sdata->source_splice_duration = sdata->splice_pending_duration;
+    } else {
+        // an early return ends the break here
+        sdata->source_splice_duration_remaining = 0;
+    }
+    sdata->splice_pending = 0;
+}
+
+// the live playlists carry no program time of their own, so one goes ahead of each daterange
+static void write_splice_daterange(FILE *entry, source_context_struct *sdata, int64_t file_sequence)
+{
+    char text[MAX_TEXT_SIZE];
+    char date[64];
+    int64_t program_time;
+    int64_t start_time;
+
+    if ((sdata->discontinuity[file_sequence] != 2 && sdata->discontinuity[file_sequence] != 3) || !sdata->program_time_base) {
+        return;
+    }
+    program_time = sdata->program_time_base + sdata->full_time_video[file_sequence] / (VIDEO_CLOCK / 1000);
+    start_time = sdata->program_time_base + sdata->splice_start[file_sequence] / (VIDEO_CLOCK / 1000);
+    program_date(date, sizeof(date), program_time);
+    fprintf(entry,"#EXT-X-PROGRAM-DATE-TIME:%s\n", date);
+    scte35_daterange(text, sizeof(text), sdata->discontinuity[file_sequence], sdata->full_time_video[file_sequence],
+                     start_time, program_time, sdata->splice_duration[file_sequence]);
+    fputs(text, entry);
+}
+
+static int dvr_flags(source_context_struct *sdata, int64_t file_sequence)
+{
+    if (sdata->discontinuity[file_sequence] == 1) {
+        return SEGINDEX_FLAG_DISCONTINUITY;
+    } else if (sdata->discontinuity[file_sequence] == 2) {
+        return SEGINDEX_FLAG_CUE_OUT;
+    } else if (sdata->splice_duration_remaining[file_sequence] > 0) {
+        return SEGINDEX_FLAG_CUE_OUT_CONT;
+    } else if (sdata->discontinuity[file_sequence] == 3) {
+        return SEGINDEX_FLAG_CUE_IN;
+    }
+    return 0;
+}
+
+// the key tag of an encrypted playlist without its line end, the ts archive adds an iv to it
+static int hls_key_tag(fillet_app_struct *core, int fmp4, char *text, int text_size)
+{
+    int scheme = fmp4 ? core->cd->fmp4_encryption : core->cd->ts_encryption;
+    const char *method;
+
+    text[0] = '\0';
+    if (scheme == SEGCRYPT_SCHEME_AES128) {
+        method = "AES-128";
+    } else if (scheme == SEGCRYPT_SCHEME_SAMPLE_AES || scheme == SEGCRYPT_SCHEME_CBCS) {
+        method = "SAMPLE-AES";
+    } else if (scheme == SEGCRYPT_SCHEME_CENC) {
+        method = "SAMPLE-AES-CTR";
+    } else {
+        return 0;
+    }
+    return snprintf(text, text_size, "#EXT-X-KEY:METHOD=%s,URI=\"%s\"", method, core->cd->key_uri);
+}
+
+// archived entries are rendered from the index alone so a restart can rebuild them
+static int dvr_entry(char *text, int text_size, segindex_record_struct *record, const char *uri_prefix, const char *uri_suffix,
+                     const char *key_tag)
+{
+    int length = 0;
+
+    if (record->flags & SEGINDEX_FLAG_DISCONTINUITY) {
+        length += snprintf(text + length, text_size - length, "#EXT-X-DISCONTINUITY\n");
+    } else if (record->flags & SEGINDEX_FLAG_CUE_OUT) {
+        length += snprintf(text + length, text_size - length, "#EXT-X-CUE-OUT:DURATION=%d\n", record->cue_duration);
+        length += scte35_daterange(text + length, text_size - length, 2, record->pts,
+                                   record->program_time, record->program_time, record->cue_duration);
+    } else if (record->flags & SEGINDEX_FLAG_CUE_OUT_CONT) {
+        length += snprintf(text + length, text_size - length, "#EXT-X-CUE-OUT-CONT:ElapsedTime=%.3f,Duration=%d\n",
+                           record->cue_elapsed / 1000.0, record->cue_duration);
+    } else if (record->flags & SEGINDEX_FLAG_CUE_IN) {
+        length += snprintf(text + length, text_size - length, "#EXT-X-CUE-IN\n");
+        length += scte35_daterange(text + length, text_size - length, 3, record->pts,
+                                   record->program_time - record->cue_elapsed, record->program_time, 0);
+    }
+    if (key_tag) {
+        // the archive numbers its segments apart from the live window, so the iv is spelled out
+        length += snprintf(text + length, text_size - length, "%s,IV=0x%016x%016lx\n", key_tag, 0, record->key_sequence);
+    }
+    length += snprintf(text + length, text_size - length, "#EXTINF:%.3f,\n#EXT-X-BYTERANGE:%d@%ld\n%s%ld%s\n",
+                       (float)record->duration / (float)VIDEO_CLOCK,
+                       record->bytes, record->offset,
+                       uri_prefix, record->container, uri_suffix);
+    if (length >= text_size) {
+        length = text_size - 1;
+    }
+    return length;
+}
+
+static int64_t dvr_wallclock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void dvr_release(dvr_struct *dvr)
+{
+    segindex_destroy(dvr->index);
+    memset(dvr, 0, sizeof(dvr_struct));
+}
+
+// the live window feeds the archive, only segments new to it get rendered and the
+// long playlist goes out as one copy of the entries already rendered
+static int update_dvr_manifest(fillet_app_struct *core, stream_struct *stream, source_context_struct *sdata, dvr_struct *dvr, void **playlist,
+                               const char *stream_name, const char *map_uri, const char *uri_prefix, const char *uri_suffix,
+                               byterange_struct *ranges, int sub_stream, int video)
+{
+    char header[PLAYLIST_MAX_ENTRY_SIZE];
+    char text[PLAYLIST_MAX_ENTRY_SIZE];
+    char key_tag[MAX_KEY_TAG_SIZE];
+    const char *entry_key = NULL;
+    segindex_record_struct record;
+    segindex_record_struct *first;
+    int64_t media_sequence;
+    int header_size;
+    char *buffer;
+    size_t size;
+    int i;
+
+    if (hls_key_tag(core, map_uri != NULL, key_tag, sizeof(key_tag)) > 0 && !map_uri) {
+        entry_key = key_tag;
+    }
+
+    if (!*playlist) {
+        char index_name[MAX_STREAM_NAME];
+        int capacity = dvr_window_segments(core);
+
+        snprintf(index_name, MAX_STREAM_NAME-1, "%.*s.idx", (int)strlen(stream_name) - 5, stream_name);
+        dvr->index = segindex_create(index_name, capacity);
+        if (!dvr->index) {
+            fprintf(stderr,"HLSMUX: ERROR: unable to open the DVR index %s\n", index_name);
+            return -1;
+        }
+        *playlist = playlist_create_archive(capacity);
+        if (!*playlist) {
+            dvr_release(dvr);
+            return -1;
+        }
+        for (i = 0; i < segindex_count(dvr->index); i++) {
+            playlist_append(*playlist, text, dvr_entry(text, sizeof(text), segindex_record(dvr->index, i), uri_prefix, uri_suffix, entry_key));
+        }
+        dvr->resumed = segindex_count(dvr->index) > 0;
+        dvr->archived = stream->media_sequence_number - core->cd->window_size;
+    }
+
+    if (dvr->archived < stream->media_sequence_number - core->cd->window_size) {
+        dvr->archived = stream->media_sequence_number - core->cd->window_size;
+    } else if (dvr->archived > stream->media_sequence_number) {
+        dvr->archived = stream->media_sequence_number - 1;
+    }
+
+    for (media_sequence = dvr->archived; media_sequence < stream->media_sequence_number; media_sequence++) {
+        int64_t file_sequence = (stream->file_sequence_number - (stream->media_sequence_number - media_sequence)) % core->cd->rollover_size;
+        byterange_struct *range;
+        double length;
+
+        if (file_sequence < 0) {
+            file_sequence += core->cd->rollover_size;
+        }
+        range = &ranges[file_sequence % MAX_ROLLOVER_SIZE];
+        length = video ? sdata->segment_lengths_video[file_sequence] : sdata->segment_lengths_audio[file_sequence][sub_stream];
+
+        memset(&record, 0, sizeof(record));
+        record.pts = video ? sdata->full_time_video[file_sequence] : sdata->full_time_audio[file_sequence][sub_stream];
+        record.duration = (int64_t)(length * (double)VIDEO_CLOCK + 0.5);
+        record.container = range->container;
+        record.offset = range->offset;
+        record.bytes = range->length;
+        record.flags = dvr_flags(sdata, file_sequence);
+        record.cue_duration = sdata->splice_duration[file_sequence];
+        record.cue_elapsed = (int32_t)(sdata->splice_elapsed_time[file_sequence] * 1000.0);
+        record.key_sequence = media_sequence;
+        if (dvr->resumed) {
+            // picking up after a restart
+            record.flags |= SEGINDEX_FLAG_DISCONTINUITY;
+            dvr->resumed = 0;
+        }
+        if (dvr->program_time == 0) {
+            // the live playlist runs one segment behind the one that just finished
+            dvr->program_time = dvr_wallclock() - (stream->media_sequence_number - media_sequence + 1) * (int64_t)core->cd->segment_length * 1000;
+        }
+        record.program_time = dvr->program_time;
+        dvr->program_time += record.duration * 1000 / VIDEO_CLOCK;
+        if (record.flags & SEGINDEX_FLAG_CUE_OUT) {
+            dvr->cue_program_time = record.program_time;
+        } else if ((record.flags & SEGINDEX_FLAG_CUE_IN) && dvr->cue_program_time) {
+            // measured on the archive clock so the daterange pair starts at the same date
+            record.cue_elapsed = (int32_t)(record.program_time - dvr->cue_program_time);
+        }
+
+        segindex_append(dvr->index, &record);
+        playlist_append(*playlist, text, dvr_entry(text, sizeof(text), &record, uri_prefix, uri_suffix, entry_key));
+    }
+    dvr->archived = stream->media_sequence_number;
+
+    first = segindex_record(dvr->index, 0);
+    if (!first) {
+        return 0;
+    }
+    header_size = snprintf(header, sizeof(header),
+                           "#EXTM3U\n"
+                           "#EXT-X-VERSION:%d\n"
+                           "#EXT-X-MEDIA-SEQUENCE:%ld\n"
+                           "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                           "#EXT-X-TARGETDURATION:%d\n",
+                           map_uri ? 6 : 4,
+                           first->sequence,
+                           core->cd->segment_length);
+    if (map_uri) {
+        header_size += snprintf(header + header_size, sizeof(header) - header_size, "#EXT-X-MAP:URI=\"%s\"\n", map_uri);
+        if (key_tag[0]) {
+            header_size += snprintf(header + header_size, sizeof(header) - header_size, "%s\n", key_tag);
         }
     }
+    header_size += snprintf(header + header_size, sizeof(header) - header_size, "#EXT-X-PROGRAM-DATE-TIME:");
+    header_size += program_date(header + header_size, sizeof(header) - header_size, first->program_time);
+    header_size += snprintf(header + header_size, sizeof(header) - header_size, "\n");
+
+    buffer = playlist_render(*playlist, header, header_size, &size);
+    if (!buffer) {
+        return -1;
+    }
+    segwriter_playlist(core->hlsmux->writer, stream_name, buffer, size, 0, -1, -1);
+    publish_file(core, SIGNAL_MANIFEST_WRITTEN, stream_name, 0);
+
     return 0;
 }
 
 static int update_ts_video_manifest(fillet_app_struct *core, stream_struct *stream, int source, int discontinuity, source_context_struct *sdata)
 {
     FILE *video_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
     char stream_name[MAX_STREAM_NAME];
+    char key_tag[MAX_KEY_TAG_SIZE];
     int i;
     int64_t starting_file_sequence_number;
     int64_t starting_media_sequence_number;
 
+    if (dvr_enabled(core)) {
+        char uri_prefix[MAX_STREAM_NAME];
+
+        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%d.m3u8", core->cd->manifest_directory, source);
+        snprintf(uri_prefix, MAX_STREAM_NAME-1, "video_stream%d_range", source);
+        return update_dvr_manifest(core, stream, sdata, &stream->ts_dvr, &stream->ts_playlist, stream_name, NULL, uri_prefix, ".ts",
+                                   stream->ts_ranges, NO_SUBSTREAM, IS_VIDEO);
+    }
+
+    if (!stream->ts_playlist) {
+        stream->ts_playlist = playlist_create(core->cd->window_size);
+        if (!stream->ts_playlist) {
+            return -1;
+        }
+    }
+
     starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
     if (starting_file_sequence_number < 0) {
         starting_file_sequence_number += core->cd->rollover_size;
@@ -1266,137 +2146,288 @@ static int update_ts_video_manifest(fillet_app_struct *core, stream_struct *stre
     starting_media_sequence_number = stream->media_sequence_number - core->cd->window_size;
 
     snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%d.m3u8", core->cd->manifest_directory, source);
-    video_manifest = fopen(stream_name,"w");
+    video_manifest = manifest_open(&manifest_buffer, &manifest_size);
 
     if (!video_manifest) {
-        fprintf(stderr,"SESSION:%d (MAIN) ERROR: UNABLE TO WRITE VIDEO MANIFEST TO %s! UNRECOVERABLE ERROR!!!\n",
+        fprintf(stderr,"SESSION:%d (MAIN) ERROR: UNABLE TO WRITE VIDEO MANIFEST TO %s!\n",
                 core->session_id,
                 stream_name);
-        exit(0);
+        return -1;
     }
 
     fprintf(video_manifest,"#EXTM3U\n");
-    fprintf(video_manifest,"#EXT-X-VERSION:3\n");
+    fprintf(video_manifest,"#EXT-X-VERSION:%d\n", byterange_enabled(core) ? 4 : 3);
     fprintf(video_manifest,"#EXT-X-MEDIA-SEQUENCE:%ld\n", starting_media_sequence_number);
     fprintf(video_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
     fprintf(video_manifest,"#EXT-X-TARGETDURATION:%d\n", core->cd->segment_length);
+    if (hls_key_tag(core, 0, key_tag, sizeof(key_tag)) > 0) {
+        fprintf(video_manifest,"%s\n", key_tag);
+    }
 
     for (i = 0; i < core->cd->window_size; i++) {
         int64_t next_sequence_number;
+        FILE *entry;
 
         next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
+        entry = playlist_begin_entry(stream->ts_playlist, starting_media_sequence_number + i, next_sequence_number);
+        if (!entry) {
+            continue;
+        }
         if (sdata->discontinuity[next_sequence_number] == 1) {
-            fprintf(video_manifest,"#EXT-X-DISCONTINUITY\n");
+            fprintf(entry,"#EXT-X-DISCONTINUITY\n");
         } else if (sdata->discontinuity[next_sequence_number] == 2) {
-            fprintf(video_manifest,"#EXT-X-CUE-OUT:DURATION=%ld\n", sdata->splice_duration[next_sequence_number]);
-            //fprintf(video_manifest,"#EXT-X-DISCONTINUITY\n");
+            fprintf(entry,"#EXT-X-CUE-OUT:DURATION=%ld\n", sdata->splice_duration[next_sequence_number]);
+            //fprintf(entry,"#EXT-X-DISCONTINUITY\n");
         } else if (sdata->splice_duration_remaining[next_sequence_number] > 0) {
-            fprintf(video_manifest,"#EXT-X-CUE-OUT-CONT:ElapsedTime=%.3f,Duration=%ld\n",
+            fprintf(entry,"#EXT-X-CUE-OUT-CONT:ElapsedTime=%.3f,Duration=%ld\n",
                     sdata->splice_elapsed_time[next_sequence_number],
                     sdata->splice_duration[next_sequence_number]);
         } else if (sdata->discontinuity[next_sequence_number] == 3) {
-            //fprintf(video_manifest,"#EXT-X-DISCONTINUITY\n");
-            fprintf(video_manifest,"#EXT-X-CUE-IN\n");
+            //fprintf(entry,"#EXT-X-DISCONTINUITY\n");
+            fprintf(entry,"#EXT-X-CUE-IN\n");
         }
+        write_splice_daterange(entry, sdata, next_sequence_number);
 
-        fprintf(video_manifest,"#EXTINF:%.3f,\n", (float)sdata->segment_lengths_video[next_sequence_number]);
-        fprintf(video_manifest,"video_stream%d_%ld.ts\n", source, next_sequence_number);
+        fprintf(entry,"#EXTINF:%.3f,\n", (float)sdata->segment_lengths_video[next_sequence_number]);
+        if (byterange_enabled(core)) {
+            byterange_struct *range = &stream->ts_ranges[next_sequence_number % MAX_ROLLOVER_SIZE];
+            fprintf(entry,"#EXT-X-BYTERANGE:%ld@%ld\n", range->length, range->offset);
+            fprintf(entry,"video_stream%d_range%ld.ts\n", source, range->container);
+        } else {
+            fprintf(entry,"video_stream%d_%ld.ts\n", source, next_sequence_number);
+        }
+        playlist_end_entry(stream->ts_playlist, entry);
     }
+    playlist_write(stream->ts_playlist, video_manifest, starting_media_sequence_number, core->cd->window_size);
 
-    fclose(video_manifest);
+    if (manifest_close(core, stream->ts_playlist, video_manifest, &manifest_buffer, &manifest_size, stream_name) > 0) {
+        publish_file(core, SIGNAL_MANIFEST_WRITTEN, stream_name, 1);
+    }
 
-    send_signal(core, SIGNAL_MANIFEST_WRITTEN, stream_name);
+    return 0;
+}
 
-    if ((strlen(core->cd->cdn_server) > 0) && (strlen(core->cd->cdn_username) > 0) && (strlen(core->cd->cdn_password) > 0)) {
-        dataqueue_message_struct *msg;
-        msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
-        if (msg) {
-            snprintf(msg->smallbuf, MAX_SMALLBUF_SIZE-1, "%s", stream_name); // this is the directory on the local server which is what we want
-            msg->buffer = NULL;
-            msg->buffer_type = WEBDAV_UPLOAD;
-            dataqueue_put_front(core->webdav_queue, msg);
+// the sync frames of one segment as byte ranges of the segment itself, each one lasting up to the next
+static void write_ts_iframe_entry(fillet_app_struct *core, FILE *entry, stream_struct *stream, source_context_struct *sdata,
+                                  int source, int64_t media_sequence, int64_t file_sequence)
+{
+    int slot = media_sequence % MAX_IFRAME_SEGMENTS;
+    iframe_struct *iframes = stream->ts_iframes[slot];
+    int count = stream->ts_iframe_counts[slot];
+    byterange_struct *range = &stream->ts_ranges[file_sequence % MAX_ROLLOVER_SIZE];
+    int64_t segment_end;
+    int n;
+
+    if (count == 0) {
+        return;
+    }
+    segment_end = iframes[0].pts + (int64_t)(sdata->segment_lengths_video[file_sequence] * (double)VIDEO_CLOCK + 0.5);
+    if (sdata->discontinuity[file_sequence] == 1) {
+        fprintf(entry,"#EXT-X-DISCONTINUITY\n");
+    }
+    for (n = 0; n < count; n++) {
+        int64_t end = n + 1 < count ? iframes[n + 1].pts : segment_end;
+        int64_t duration = (end - iframes[n].pts) & (MAX_PTS - 1);  // across the pts wrap
+
+        if (duration > 0) {
+            int64_t bandwidth = iframes[n].length * 8 * VIDEO_CLOCK / duration;
+            if (bandwidth > stream->ts_iframe_bandwidth) {
+                stream->ts_iframe_bandwidth = (int)bandwidth;
+            }
+        }
+        fprintf(entry,"#EXTINF:%.3f,\n", (float)duration / (float)VIDEO_CLOCK);
+        if (byterange_enabled(core)) {
+            fprintf(entry,"#EXT-X-BYTERANGE:%ld@%ld\n", iframes[n].length, range->offset + iframes[n].offset);
+            fprintf(entry,"video_stream%d_range%ld.ts\n", source, range->container);
         } else {
-            fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
-                    core->session_id);
-            exit(0);
+            fprintf(entry,"#EXT-X-BYTERANGE:%ld@%ld\n", iframes[n].length, iframes[n].offset);
+            fprintf(entry,"video_stream%d_%ld.ts\n", source, file_sequence);
         }
-    }// end checking for cdn availability
-
-    return 0;
+    }
 }
 
-static int update_ts_audio_manifest(fillet_app_struct *core, stream_struct *stream, int source, int sub_stream, int discontinuity, source_context_struct *sdata)
+// follows the live window of the video playlist, its media sequence counts sync frames instead of segments
+static int update_ts_iframe_manifest(fillet_app_struct *core, stream_struct *stream, int source, source_context_struct *sdata)
 {
-    FILE *audio_manifest;
+    FILE *iframe_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
     char stream_name[MAX_STREAM_NAME];
+    char key_tag[MAX_KEY_TAG_SIZE];
     int i;
     int64_t starting_file_sequence_number;
     int64_t starting_media_sequence_number;
 
-    starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
-    if (starting_file_sequence_number < 0) {
-        starting_file_sequence_number += core->cd->rollover_size;
+    if (!ts_iframes_enabled(core)) {
+        return 0;
+    }
+    if (!stream->ts_iframe_playlist) {
+        stream->ts_iframe_playlist = playlist_create(core->cd->window_size);
+        if (!stream->ts_iframe_playlist) {
+            return -1;
+        }
+    }
+
+    starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
+    if (starting_file_sequence_number < 0) {
+        starting_file_sequence_number += core->cd->rollover_size;
+    }
+    starting_media_sequence_number = stream->media_sequence_number - core->cd->window_size;
+
+    snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%d_iframes.m3u8", core->cd->manifest_directory, source);
+    iframe_manifest = manifest_open(&manifest_buffer, &manifest_size);
+    if (!iframe_manifest) {
+        fprintf(stderr,"SESSION:%d (MAIN) ERROR: UNABLE TO WRITE I-FRAME MANIFEST TO %s!\n",
+                core->session_id,
+                stream_name);
+        return -1;
+    }
+
+    fprintf(iframe_manifest,"#EXTM3U\n");
+    fprintf(iframe_manifest,"#EXT-X-VERSION:4\n");
+    fprintf(iframe_manifest,"#EXT-X-MEDIA-SEQUENCE:%ld\n", stream->ts_iframe_first[starting_media_sequence_number % MAX_IFRAME_SEGMENTS]);
+    fprintf(iframe_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
+    fprintf(iframe_manifest,"#EXT-X-TARGETDURATION:%d\n", core->cd->segment_length);
+    fprintf(iframe_manifest,"#EXT-X-I-FRAMES-ONLY\n");
+    if (hls_key_tag(core, 0, key_tag, sizeof(key_tag)) > 0) {
+        fprintf(iframe_manifest,"%s\n", key_tag);
+    }
+
+    for (i = 0; i < core->cd->window_size; i++) {
+        int64_t next_sequence_number;
+        FILE *entry;
+
+        next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
+        entry = playlist_begin_entry(stream->ts_iframe_playlist, starting_media_sequence_number + i, next_sequence_number);
+        if (!entry) {
+            continue;
+        }
+        write_ts_iframe_entry(core, entry, stream, sdata, source, starting_media_sequence_number + i, next_sequence_number);
+        playlist_end_entry(stream->ts_iframe_playlist, entry);
+    }
+    playlist_write(stream->ts_iframe_playlist, iframe_manifest, starting_media_sequence_number, core->cd->window_size);
+
+    if (manifest_close(core, stream->ts_iframe_playlist, iframe_manifest, &manifest_buffer, &manifest_size, stream_name) > 0) {
+        publish_file(core, SIGNAL_MANIFEST_WRITTEN, stream_name, 1);
+    }
+
+    return 0;
+}
+
+static int update_ts_audio_manifest(fillet_app_struct *core, stream_struct *stream, int source, int sub_stream, int discontinuity, source_context_struct *sdata)
+{
+    FILE *audio_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
+    char stream_name[MAX_STREAM_NAME];
+    char key_tag[MAX_KEY_TAG_SIZE];
+    int i;
+    int64_t starting_file_sequence_number;
+    int64_t starting_media_sequence_number;
+
+    if (dvr_enabled(core)) {
+        char uri_prefix[MAX_STREAM_NAME];
+
+        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d.m3u8", core->cd->manifest_directory, source, sub_stream);
+        snprintf(uri_prefix, MAX_STREAM_NAME-1, "audio_stream%d_substream_%d_range", source, sub_stream);
+        return update_dvr_manifest(core, stream, sdata, &stream->ts_dvr, &stream->ts_playlist, stream_name, NULL, uri_prefix, ".ts",
+                                   stream->ts_ranges, sub_stream, IS_AUDIO);
+    }
+
+    if (!stream->ts_playlist) {
+        stream->ts_playlist = playlist_create(core->cd->window_size);
+        if (!stream->ts_playlist) {
+            return -1;
+        }
+    }
+
+    starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
+    if (starting_file_sequence_number < 0) {
+        starting_file_sequence_number += core->cd->rollover_size;
     }
     starting_media_sequence_number = stream->media_sequence_number - core->cd->window_size;
 
     snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d.m3u8", core->cd->manifest_directory, source, sub_stream);
-    audio_manifest = fopen(stream_name,"w");
+    audio_manifest = manifest_open(&manifest_buffer, &manifest_size);
 
     fprintf(audio_manifest,"#EXTM3U\n");
-    fprintf(audio_manifest,"#EXT-X-VERSION:3\n");
+    fprintf(audio_manifest,"#EXT-X-VERSION:%d\n", byterange_enabled(core) ? 4 : 3);
     fprintf(audio_manifest,"#EXT-X-MEDIA-SEQUENCE:%ld\n", starting_media_sequence_number);
     fprintf(audio_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
     fprintf(audio_manifest,"#EXT-X-TARGETDURATION:%d\n", core->cd->segment_length);
+    if (hls_key_tag(core, 0, key_tag, sizeof(key_tag)) > 0) {
+        fprintf(audio_manifest,"%s\n", key_tag);
+    }
 
     for (i = 0; i < core->cd->window_size; i++) {
         int64_t next_sequence_number;
+        FILE *entry;
 
         next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
+        entry = playlist_begin_entry(stream->ts_playlist, starting_media_sequence_number + i, next_sequence_number);
+        if (!entry) {
+            continue;
+        }
         if (sdata->discontinuity[next_sequence_number] == 1) {
-            fprintf(audio_manifest,"#EXT-X-DISCONTINUITY\n");
+            fprintf(entry,"#EXT-X-DISCONTINUITY\n");
         } else if (sdata->discontinuity[next_sequence_number] == 2) {
-            fprintf(audio_manifest,"#EXT-X-CUE-OUT:DURATION=%ld\n", sdata->splice_duration[next_sequence_number]);
-            //fprintf(audio_manifest,"#EXT-X-DISCONTINUITY\n");
+            fprintf(entry,"#EXT-X-CUE-OUT:DURATION=%ld\n", sdata->splice_duration[next_sequence_number]);
+            //fprintf(entry,"#EXT-X-DISCONTINUITY\n");
         } else if (sdata->splice_duration_remaining[next_sequence_number] > 0) {
-            fprintf(audio_manifest,"#EXT-X-CUE-OUT-CONT:ElapsedTime=%.3f,Duration=%ld\n",
+            fprintf(entry,"#EXT-X-CUE-OUT-CONT:ElapsedTime=%.3f,Duration=%ld\n",
                     sdata->splice_elapsed_time[next_sequence_number],
                     sdata->splice_duration[next_sequence_number]);
         } else if (sdata->discontinuity[next_sequence_number] == 3) {
-            //fprintf(audio_manifest,"#EXT-X-DISCONTINUITY\n");
-            fprintf(audio_manifest,"#EXT-X-CUE-IN\n");
+            //fprintf(entry,"#EXT-X-DISCONTINUITY\n");
+            fprintf(entry,"#EXT-X-CUE-IN\n");
         }
+        write_splice_daterange(entry, sdata, next_sequence_number);
 
-        fprintf(audio_manifest,"#EXTINF:%.3f,\n", (float)sdata->segment_lengths_audio[next_sequence_number][sub_stream]);
-        fprintf(audio_manifest,"audio_stream%d_substream_%d_%ld.ts\n", source, sub_stream, next_sequence_number);
-    }
-
-    fclose(audio_manifest);
-
-    send_signal(core, SIGNAL_MANIFEST_WRITTEN, stream_name);
-
-    if ((strlen(core->cd->cdn_server) > 0) && (strlen(core->cd->cdn_username) > 0) && (strlen(core->cd->cdn_password) > 0)) {
-        dataqueue_message_struct *msg;
-        msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
-        if (msg) {
-            snprintf(msg->smallbuf, MAX_SMALLBUF_SIZE-1, "%s", stream_name); // this is the directory on the local server which is what we want
-            msg->buffer = NULL;
-            msg->buffer_type = WEBDAV_UPLOAD;
-            dataqueue_put_front(core->webdav_queue, msg);
+        fprintf(entry,"#EXTINF:%.3f,\n", (float)sdata->segment_lengths_audio[next_sequence_number][sub_stream]);
+        if (byterange_enabled(core)) {
+            byterange_struct *range = &stream->ts_ranges[next_sequence_number % MAX_ROLLOVER_SIZE];
+            fprintf(entry,"#EXT-X-BYTERANGE:%ld@%ld\n", range->length, range->offset);
+            fprintf(entry,"audio_stream%d_substream_%d_range%ld.ts\n", source, sub_stream, range->container);
         } else {
-            fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
-                    core->session_id);
-            exit(0);
+            fprintf(entry,"audio_stream%d_substream_%d_%ld.ts\n", source, sub_stream, next_sequence_number);
         }
-    }// end checking for cdn availability
+        playlist_end_entry(stream->ts_playlist, entry);
+    }
+    playlist_write(stream->ts_playlist, audio_manifest, starting_media_sequence_number, core->cd->window_size);
+
+    if (manifest_close(core, stream->ts_playlist, audio_manifest, &manifest_buffer, &manifest_size, stream_name) > 0) {
+        publish_file(core, SIGNAL_MANIFEST_WRITTEN, stream_name, 1);
+    }
 
     return 0;
 }
 
+// the scrubbing rendition sits next to the variant it was cut from, with its measured peak once there is one
+static void write_iframe_stream_inf(FILE *master_manifest, source_context_struct *sdata, int hevc, int bandwidth, const char *uri)
+{
+    if (hevc) {
+        fprintf(master_manifest,"#EXT-X-I-FRAME-STREAM-INF:BANDWIDTH=%d,CODECS=\"hev1.1.6.L63.90\",RESOLUTION=%dx%d,URI=\"%s\"\n",
+                bandwidth,
+                sdata->width, sdata->height,
+                uri);
+    } else {
+        fprintf(master_manifest,"#EXT-X-I-FRAME-STREAM-INF:BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x\",RESOLUTION=%dx%d,URI=\"%s\"\n",
+                bandwidth,
+                sdata->h264_profile, //hex
+                sdata->midbyte,
+                sdata->h264_level,
+                sdata->width, sdata->height,
+                uri);
+    }
+}
+
 static int write_ts_master_manifest(fillet_app_struct *core, source_context_struct *sdata)
 {
     struct stat sb;
     char master_manifest_filename[MAX_STREAM_NAME];
     FILE *master_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
     source_context_struct *lsdata;
     source_context_struct *origsdata;
     int i;
@@ -1404,6 +2435,8 @@ static int write_ts_master_manifest(fillet_app_struct *core, source_context_stru
     int num_sources = core->num_sources;
     int num_video_sources = core->active_video_sources;
     int create_dir = 0;
+    int muxed_audio;
+    int audio_group;
 
 #if defined(ENABLE_TRANSCODE)
     if (core->transcode_enabled) {
@@ -1427,17 +2460,26 @@ static int write_ts_master_manifest(fillet_app_struct *core, source_context_stru
 
     snprintf(master_manifest_filename,MAX_STREAM_NAME-1,"%s/%s",core->cd->manifest_directory,core->cd->manifest_hls);
 
-    master_manifest = fopen(master_manifest_filename,"w");
+    master_manifest = manifest_open(&manifest_buffer, &manifest_size);
     if (!master_manifest) {
         fprintf(stderr,"ERROR: Unable to create master manifest file - please check system configuration: %s\n", master_manifest_filename);
         return -1;
     }
 
     fprintf(master_manifest,"#EXTM3U\n");
-    fprintf(master_manifest,"#EXT-X-VERSION:3\n");
+    fprintf(master_manifest,"#EXT-X-VERSION:%d\n", ts_iframes_enabled(core) ? 4 : 3);
     fprintf(master_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
 
-    for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
+    // muxed primary audio is part of the variants, it only needs an entry without a uri next to alternates
+    muxed_audio = ts_audio_muxed(core, 0, 0) && sdata->start_time_audio[0] != -1;
+    audio_group = !muxed_audio;
+    for (j = 1; j < MAX_AUDIO_STREAMS; j++) {
+        if (sdata->start_time_audio[j] != -1) {
+            audio_group = 1;
+        }
+    }
+
+    for (j = 0; j < MAX_AUDIO_STREAMS && audio_group; j++) {
         lsdata = sdata;
         if (lsdata->start_time_audio[j] != -1) {
             //audio_stream_struct *astream = (audio_stream_struct*)core->source_stream[0].audio_stream[j];
@@ -1450,7 +2492,11 @@ static int write_ts_master_manifest(fillet_app_struct *core, source_context_stru
                 sprintf(yesno,"NO");
             }
 
-            if (strlen(sdata->lang_tag) > 0) {
+            if (j == 0 && muxed_audio) {
+                fprintf(master_manifest,"#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\",LANGUAGE=\"%s\",NAME=\"%s\",AUTOSELECT=YES,DEFAULT=YES\n",
+                        strlen(sdata->lang_tag) > 0 ? sdata->lang_tag : "eng",
+                        strlen(sdata->lang_tag) > 0 ? sdata->lang_tag : "eng");
+            } else if (strlen(sdata->lang_tag) > 0) {
                 fprintf(master_manifest,"#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\",LANGUAGE=\"%s\",NAME=\"%s\",AUTOSELECT=%s,DEFAULT=%s,URI=\"audio0_substream%d.m3u8\"\n",
                         sdata->lang_tag,
                         sdata->lang_tag,
@@ -1479,14 +2525,36 @@ static int write_ts_master_manifest(fillet_app_struct *core, source_context_stru
 #else
         video_bitrate = vstream->video_bitrate;
 #endif
+        if (muxed_audio) {
+            audio_stream_struct *astream = (audio_stream_struct*)core->source_audio_stream[0].audio_stream;
+
+#if defined(ENABLE_TRANSCODE)
+            if (core->transcode_enabled) {
+                video_bitrate += core->cd->transaudio_info[0].audio_bitrate * 1000;
+            } else {
+                video_bitrate += astream->audio_bitrate;
+            }
+#else
+            video_bitrate += astream->audio_bitrate;
+#endif
+        }
 
-        fprintf(master_manifest,"#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x,mp4a.40.2\",RESOLUTION=%dx%d,AUDIO=\"audio\"\n",
+        fprintf(master_manifest,"#EXT-X-STREAM-INF:PROGRAM-ID=1,BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x,mp4a.40.2\",RESOLUTION=%dx%d%s\n",
                 video_bitrate,
                 sdata->h264_profile, //hex
                 sdata->midbyte,
                 sdata->h264_level,
-                sdata->width, sdata->height);
+                sdata->width, sdata->height,
+                audio_group ? ",AUDIO=\"audio\"" : "");
         fprintf(master_manifest,"video%d.m3u8\n", i);
+        if (ts_iframes_enabled(core)) {
+            stream_struct *stream = &core->hlsmux->video[i];
+            char uri[MAX_STREAM_NAME];
+
+            snprintf(uri, MAX_STREAM_NAME-1, "video%d_iframes.m3u8", i);
+            write_iframe_stream_inf(master_manifest, sdata, 0,
+                                    stream->ts_iframe_bandwidth > 0 ? stream->ts_iframe_bandwidth : video_bitrate, uri);
+        }
         sdata++;
     }
 
@@ -1514,53 +2582,99 @@ static int write_ts_master_manifest(fillet_app_struct *core, source_context_stru
     }
     */
 
-    fclose(master_manifest);
+    if (!core->hlsmux->ts_master_playlist) {
+        core->hlsmux->ts_master_playlist = playlist_create(0);
+    }
+    if (manifest_close(core, core->hlsmux->ts_master_playlist, master_manifest, &manifest_buffer, &manifest_size, master_manifest_filename) == 0) {
+        // unchanged since the last time it was published
+        return 0;
+    }
+
+    if (create_dir && cdn_enabled(core)) {
+        //create the directory on the server via MKCOL
+        //chance are if the directory doesn't exist locally
+        //then it doesn't exist on the server
+        //we don't want to try to recreate the directory each time though
+        segwriter_notify(core->hlsmux->writer, mux_webdav_request, core, WEBDAV_CREATE, master_manifest_filename);
+    }
+    publish_file(core, SIGNAL_MANIFEST_WRITTEN, master_manifest_filename, 1);
 
-    send_signal(core, SIGNAL_MANIFEST_WRITTEN, master_manifest_filename);
+    return 0;
+}
 
-    if ((strlen(core->cd->cdn_server) > 0) && (strlen(core->cd->cdn_username) > 0) && (strlen(core->cd->cdn_password) > 0)) {
-        dataqueue_message_struct *msg;
+// range is where the segment sits in its container when byte-range output is on, NULL otherwise
+static void write_mp4_entry(FILE *entry, source_context_struct *sdata, int source, int sub_stream, int video, int64_t next_sequence_number,
+                            byterange_struct *range)
+{
+    if (sdata->discontinuity[next_sequence_number] == 1) {
+        fprintf(entry,"#EXT-X-DISCONTINUITY\n");
+    } else if (sdata->discontinuity[next_sequence_number] == 2) {
+        fprintf(entry,"#EXT-X-CUE-OUT:DURATION=%ld\n", sdata->splice_duration[next_sequence_number]);
+    } else if (sdata->splice_duration_remaining[next_sequence_number] > 0) {
+        fprintf(entry,"#EXT-X-CUE-OUT-CONT:ElapsedTime=%.3f,Duration=%ld\n",
+                sdata->splice_elapsed_time[next_sequence_number],
+                sdata->splice_duration[next_sequence_number]);
+    } else if (sdata->discontinuity[next_sequence_number] == 3) {
+        fprintf(entry,"#EXT-X-CUE-IN\n");
+    }
+    write_splice_daterange(entry, sdata, next_sequence_number);
 
-        if (create_dir) {
-            //create the directory on the server via MKCOL
-            //chance are if the directory doesn't exist locally
-            //then it doesn't exist on the server
-            //we don't want to try to recreate the directory each time though
-            msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
-            if (msg) {
-                msg->buffer = NULL;
-                msg->buffer_type = WEBDAV_CREATE; //we will create the cdn_server directory
-                dataqueue_put_front(core->webdav_queue, msg);
-            } else {
-                fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
-                        core->session_id);
-                exit(0);
-            }
-        }
-        msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
-        if (msg) {
-            snprintf(msg->smallbuf, MAX_SMALLBUF_SIZE-1, "%s", master_manifest_filename); // this is the directory on the local server which is what we want
-            msg->buffer = NULL;
-            msg->buffer_type = WEBDAV_UPLOAD;
-            dataqueue_put_front(core->webdav_queue, msg);
+    if (video) {
+        fprintf(entry,"#EXTINF:%.3f,\n", (float)sdata->segment_lengths_video[next_sequence_number]);
+    } else {
+        fprintf(entry,"#EXTINF:%.3f,\n", (float)sdata->segment_lengths_audio[next_sequence_number][sub_stream]);
+    }
+    if (range) {
+        fprintf(entry,"#EXT-X-BYTERANGE:%ld@%ld\n", range->length, range->offset);
+        if (video) {
+            fprintf(entry,"video%d/segment_range%ld.mp4\n", source, range->container);
         } else {
-            fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
-                    core->session_id);
-            exit(0);
+            fprintf(entry,"audio%d_substream%d/segment_range%ld.mp4\n", source, sub_stream, range->container);
         }
-    }// end checking for cdn availability
+    } else if (video) {
+        fprintf(entry,"video%d/segment%ld.mp4\n", source, next_sequence_number);
+    } else {
+        fprintf(entry,"audio%d_substream%d/segment%ld.mp4\n", source, sub_stream, next_sequence_number);
+    }
+}
 
-    return 0;
+static byterange_struct *mp4_range(fillet_app_struct *core, stream_struct *stream, int64_t file_sequence)
+{
+    if (!byterange_enabled(core)) {
+        return NULL;
+    }
+    return &stream->mp4_ranges[file_sequence % MAX_ROLLOVER_SIZE];
 }
 
 static int update_mp4_video_manifest(fillet_app_struct *core, stream_struct *stream, int source, int discontinuity, source_context_struct *sdata)
 {
     FILE *video_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
     char stream_name[MAX_STREAM_NAME];
+    char key_tag[MAX_KEY_TAG_SIZE];
     int i;
     int64_t starting_file_sequence_number;
     int64_t starting_media_sequence_number;
 
+    if (dvr_enabled(core)) {
+        char uri_prefix[MAX_STREAM_NAME];
+        char map_uri[MAX_STREAM_NAME];
+
+        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%dfmp4.m3u8", core->cd->manifest_directory, source);
+        snprintf(uri_prefix, MAX_STREAM_NAME-1, "video%d/segment_range", source);
+        snprintf(map_uri, MAX_STREAM_NAME-1, "video%d/init.mp4", source);
+        return update_dvr_manifest(core, stream, sdata, &stream->fmp4_dvr, &stream->fmp4_playlist, stream_name, map_uri, uri_prefix, ".mp4",
+                                   stream->mp4_ranges, NO_SUBSTREAM, IS_VIDEO);
+    }
+
+    if (!stream->fmp4_playlist) {
+        stream->fmp4_playlist = playlist_create(core->cd->window_size);
+        if (!stream->fmp4_playlist) {
+            return -1;
+        }
+    }
+
     starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
     if (starting_file_sequence_number < 0) {
         starting_file_sequence_number += core->cd->rollover_size;
@@ -1568,7 +2682,7 @@ static int update_mp4_video_manifest(fillet_app_struct *core, stream_struct *str
     starting_media_sequence_number = stream->media_sequence_number - core->cd->window_size;
 
     snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%dfmp4.m3u8", core->cd->manifest_directory, source);
-    video_manifest = fopen(stream_name,"w");
+    video_manifest = manifest_open(&manifest_buffer, &manifest_size);
 
     fprintf(video_manifest,"#EXTM3U\n");
     fprintf(video_manifest,"#EXT-X-VERSION:6\n");
@@ -1576,83 +2690,698 @@ static int update_mp4_video_manifest(fillet_app_struct *core, stream_struct *str
     fprintf(video_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
     fprintf(video_manifest,"#EXT-X-TARGETDURATION:%d\n", core->cd->segment_length);
     fprintf(video_manifest,"#EXT-X-MAP:URI=\"video%d/init.mp4\"\n", source);
+    if (hls_key_tag(core, 1, key_tag, sizeof(key_tag)) > 0) {
+        fprintf(video_manifest,"%s\n", key_tag);
+    }
+
+    for (i = 0; i < core->cd->window_size; i++) {
+        int64_t next_sequence_number;
+        FILE *entry;
+
+        next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
+        entry = playlist_begin_entry(stream->fmp4_playlist, starting_media_sequence_number + i, next_sequence_number);
+        if (!entry) {
+            continue;
+        }
+        write_mp4_entry(entry, sdata, source, NO_SUBSTREAM, IS_VIDEO, next_sequence_number, mp4_range(core, stream, next_sequence_number));
+        playlist_end_entry(stream->fmp4_playlist, entry);
+    }
+    playlist_write(stream->fmp4_playlist, video_manifest, starting_media_sequence_number, core->cd->window_size);
+
+    if (manifest_close(core, stream->fmp4_playlist, video_manifest, &manifest_buffer, &manifest_size, stream_name) > 0) {
+        publish_file(core, SIGNAL_MANIFEST_WRITTEN, stream_name, 0);
+    }
+
+    return 0;
+}
+
+// one trick file per segment, so the media sequence is the one of the video playlist
+static int update_mp4_iframe_manifest(fillet_app_struct *core, stream_struct *stream, int source, source_context_struct *sdata)
+{
+    FILE *iframe_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
+    char stream_name[MAX_STREAM_NAME];
+    char key_tag[MAX_KEY_TAG_SIZE];
+    int i;
+    int64_t starting_file_sequence_number;
+    int64_t starting_media_sequence_number;
+
+    if (!mp4_iframes_enabled(core)) {
+        return 0;
+    }
+    if (!stream->mp4_iframe_playlist) {
+        stream->mp4_iframe_playlist = playlist_create(core->cd->window_size);
+        if (!stream->mp4_iframe_playlist) {
+            return -1;
+        }
+    }
+
+    starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
+    if (starting_file_sequence_number < 0) {
+        starting_file_sequence_number += core->cd->rollover_size;
+    }
+    starting_media_sequence_number = stream->media_sequence_number - core->cd->window_size;
+
+    snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%dfmp4_iframes.m3u8", core->cd->manifest_directory, source);
+    iframe_manifest = manifest_open(&manifest_buffer, &manifest_size);
+    if (!iframe_manifest) {
+        return -1;
+    }
+
+    fprintf(iframe_manifest,"#EXTM3U\n");
+    fprintf(iframe_manifest,"#EXT-X-VERSION:6\n");
+    fprintf(iframe_manifest,"#EXT-X-MEDIA-SEQUENCE:%ld\n", starting_media_sequence_number);
+    fprintf(iframe_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
+    fprintf(iframe_manifest,"#EXT-X-TARGETDURATION:%d\n", core->cd->segment_length);
+    fprintf(iframe_manifest,"#EXT-X-I-FRAMES-ONLY\n");
+    fprintf(iframe_manifest,"#EXT-X-MAP:URI=\"video%d/init.mp4\"\n", source);
+    if (hls_key_tag(core, 1, key_tag, sizeof(key_tag)) > 0) {
+        fprintf(iframe_manifest,"%s\n", key_tag);
+    }
 
     for (i = 0; i < core->cd->window_size; i++) {
         int64_t next_sequence_number;
+        int64_t media_sequence = starting_media_sequence_number + i;
+        double length;
+        FILE *entry;
 
         next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
+        entry = playlist_begin_entry(stream->mp4_iframe_playlist, media_sequence, next_sequence_number);
+        if (!entry) {
+            continue;
+        }
+        length = sdata->segment_lengths_video[next_sequence_number];
+        if (length > 0 && stream->mp4_iframe_sizes[media_sequence % MAX_IFRAME_SEGMENTS] * 8 / length > stream->mp4_iframe_bandwidth) {
+            stream->mp4_iframe_bandwidth = (int)(stream->mp4_iframe_sizes[media_sequence % MAX_IFRAME_SEGMENTS] * 8 / length);
+        }
         if (sdata->discontinuity[next_sequence_number] == 1) {
-            fprintf(video_manifest,"#EXT-X-DISCONTINUITY\n");
-        } else if (sdata->discontinuity[next_sequence_number] == 2) {
-            fprintf(video_manifest,"#EXT-X-CUE-OUT:DURATION=%ld\n", sdata->splice_duration[next_sequence_number]);
-        } else if (sdata->splice_duration_remaining[next_sequence_number] > 0) {
-            fprintf(video_manifest,"#EXT-X-CUE-OUT-CONT:ElapsedTime=%.3f,Duration=%ld\n",
-                    sdata->splice_elapsed_time[next_sequence_number],
-                    sdata->splice_duration[next_sequence_number]);
-        } else if (sdata->discontinuity[next_sequence_number] == 3) {
-            fprintf(video_manifest,"#EXT-X-CUE-IN\n");
+            fprintf(entry,"#EXT-X-DISCONTINUITY\n");
+        }
+        fprintf(entry,"#EXTINF:%.3f,\n", (float)length);
+        fprintf(entry,"video%d/iframe%ld.mp4\n", source, next_sequence_number);
+        playlist_end_entry(stream->mp4_iframe_playlist, entry);
+    }
+    playlist_write(stream->mp4_iframe_playlist, iframe_manifest, starting_media_sequence_number, core->cd->window_size);
+
+    if (manifest_close(core, stream->mp4_iframe_playlist, iframe_manifest, &manifest_buffer, &manifest_size, stream_name) > 0) {
+        publish_file(core, SIGNAL_MANIFEST_WRITTEN, stream_name, 0);
+    }
+
+    return 0;
+}
+
+static int update_mp4_audio_manifest(fillet_app_struct *core, stream_struct *stream, int source, int sub_stream, int discontinuity, source_context_struct *sdata)
+{
+    FILE *audio_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
+    char stream_name[MAX_STREAM_NAME];
+    char key_tag[MAX_KEY_TAG_SIZE];
+    int i;
+    int64_t starting_file_sequence_number;
+    int64_t starting_media_sequence_number;
+
+    if (dvr_enabled(core)) {
+        char uri_prefix[MAX_STREAM_NAME];
+        char map_uri[MAX_STREAM_NAME];
+
+        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d_fmp4.m3u8", core->cd->manifest_directory, source, sub_stream);
+        snprintf(uri_prefix, MAX_STREAM_NAME-1, "audio%d_substream%d/segment_range", source, sub_stream);
+        snprintf(map_uri, MAX_STREAM_NAME-1, "audio%d_substream%d/init.mp4", source, sub_stream);
+        return update_dvr_manifest(core, stream, sdata, &stream->fmp4_dvr, &stream->fmp4_playlist, stream_name, map_uri, uri_prefix, ".mp4",
+                                   stream->mp4_ranges, sub_stream, IS_AUDIO);
+    }
+
+    if (!stream->fmp4_playlist) {
+        stream->fmp4_playlist = playlist_create(core->cd->window_size);
+        if (!stream->fmp4_playlist) {
+            return -1;
+        }
+    }
+
+    starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
+    if (starting_file_sequence_number < 0) {
+        starting_file_sequence_number += core->cd->rollover_size;
+    }
+    starting_media_sequence_number = stream->media_sequence_number - core->cd->window_size;
+
+    snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d_fmp4.m3u8", core->cd->manifest_directory, source, sub_stream);
+    audio_manifest = manifest_open(&manifest_buffer, &manifest_size);
+
+    fprintf(audio_manifest,"#EXTM3U\n");
+    fprintf(audio_manifest,"#EXT-X-VERSION:6\n");
+    fprintf(audio_manifest,"#EXT-X-MEDIA-SEQUENCE:%ld\n", starting_media_sequence_number);
+    fprintf(audio_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
+    fprintf(audio_manifest,"#EXT-X-TARGETDURATION:%d\n", core->cd->segment_length);
+    fprintf(audio_manifest,"#EXT-X-MAP:URI=\"audio%d_substream%d/init.mp4\"\n", source, sub_stream);
+    if (hls_key_tag(core, 1, key_tag, sizeof(key_tag)) > 0) {
+        fprintf(audio_manifest,"%s\n", key_tag);
+    }
+
+    for (i = 0; i < core->cd->window_size; i++) {
+        int64_t next_sequence_number;
+        FILE *entry;
+
+        next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
+        entry = playlist_begin_entry(stream->fmp4_playlist, starting_media_sequence_number + i, next_sequence_number);
+        if (!entry) {
+            continue;
+        }
+        write_mp4_entry(entry, sdata, source, sub_stream, IS_AUDIO, next_sequence_number, mp4_range(core, stream, next_sequence_number));
+        playlist_end_entry(stream->fmp4_playlist, entry);
+    }
+    playlist_write(stream->fmp4_playlist, audio_manifest, starting_media_sequence_number, core->cd->window_size);
+
+    if (manifest_close(core, stream->fmp4_playlist, audio_manifest, &manifest_buffer, &manifest_size, stream_name) > 0) {
+        publish_file(core, SIGNAL_MANIFEST_WRITTEN, stream_name, 0);
+    }
+
+    return 0;
+}
+
+static void write_mp4_parts(FILE *manifest, stream_struct *stream, const char *stream_dir, int video,
+                            int64_t media_sequence, int64_t file_sequence, int part_count)
+{
+    int slot = media_sequence % MAX_PART_SEGMENTS;
+    int i;
+
+    for (i = 0; i < part_count; i++) {
+        fprintf(manifest,"#EXT-X-PART:DURATION=%.5f,URI=\"%s/part%ld.%d.mp4\"%s\n",
+                stream->part_lengths[slot][i],
+                stream_dir,
+                file_sequence,
+                i,
+                (!video || i == 0) ? ",INDEPENDENT=YES" : "");
+    }
+}
+
+static double mp4_segment_length(source_context_struct *sdata, int sub_stream, int video, int64_t file_sequence)
+{
+    if (video) {
+        return sdata->segment_lengths_video[file_sequence];
+    }
+    return sdata->segment_lengths_audio[file_sequence][sub_stream];
+}
+
+static int llhls_can_skip(fillet_app_struct *core)
+{
+    return core->cd->window_size > 6;  // CAN-SKIP-UNTIL has to be at least six target durations
+}
+
+// file_sequence/media_sequence is the segment still being built, skipped > 0 renders the delta update
+static void write_llhls_manifest(FILE *manifest, fillet_app_struct *core, stream_struct *stream, source_context_struct *sdata,
+                                 int source, int sub_stream, int video, const char *stream_dir,
+                                 int64_t file_sequence, int64_t media_sequence, int part_count, int skipped)
+{
+    int window_size = core->cd->window_size;
+    int recent = LLHLS_PART_SEGMENTS;
+    double part_target = core->cd->part_length_ms / 1000.0;
+    int64_t starting_file_sequence_number;
+    int64_t starting_media_sequence_number;
+    char key_tag[MAX_KEY_TAG_SIZE];
+    int i;
+
+    starting_file_sequence_number = file_sequence - window_size;
+    if (starting_file_sequence_number < 0) {
+        starting_file_sequence_number += core->cd->rollover_size;
+    }
+    starting_media_sequence_number = media_sequence - window_size;
+
+    fprintf(manifest,"#EXTM3U\n");
+    fprintf(manifest,"#EXT-X-VERSION:9\n");
+    fprintf(manifest,"#EXT-X-TARGETDURATION:%d\n", core->cd->segment_length);
+    if (llhls_can_skip(core)) {
+        fprintf(manifest,"#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f,CAN-SKIP-UNTIL=%.1f\n",
+                part_target * 3, 6.0 * core->cd->segment_length);
+    } else {
+        fprintf(manifest,"#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n", part_target * 3);
+    }
+    fprintf(manifest,"#EXT-X-PART-INF:PART-TARGET=%.3f\n", part_target);
+    fprintf(manifest,"#EXT-X-MEDIA-SEQUENCE:%ld\n", starting_media_sequence_number);
+    fprintf(manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
+    fprintf(manifest,"#EXT-X-MAP:URI=\"%s/init.mp4\"\n", stream_dir);
+    if (hls_key_tag(core, 1, key_tag, sizeof(key_tag)) > 0) {
+        fprintf(manifest,"%s\n", key_tag);
+    }
+    if (skipped > 0) {
+        fprintf(manifest,"#EXT-X-SKIP:SKIPPED-SEGMENTS=%d\n", skipped);
+    }
+
+    playlist_write(stream->fmp4_playlist, manifest, starting_media_sequence_number + skipped, window_size - recent - skipped);
+    for (i = window_size - recent; i < window_size; i++) {
+        int64_t next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
+        int64_t next_media_sequence = starting_media_sequence_number + i;
+
+        write_mp4_parts(manifest, stream, stream_dir, video, next_media_sequence, next_sequence_number,
+                        stream->part_counts[next_media_sequence % MAX_PART_SEGMENTS]);
+        write_mp4_entry(manifest, sdata, source, sub_stream, video, next_sequence_number, NULL);
+    }
+    write_mp4_parts(manifest, stream, stream_dir, video, media_sequence, file_sequence, part_count);
+    fprintf(manifest,"#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%s/part%ld.%d.mp4\"\n", stream_dir, file_sequence, part_count);
+}
+
+static int update_mp4_llhls_manifest(fillet_app_struct *core, stream_struct *stream, source_context_struct *sdata,
+                                     int source, int sub_stream, int video,
+                                     int64_t file_sequence, int64_t media_sequence, int part_count)
+{
+    FILE *manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
+    char stream_name[MAX_STREAM_NAME];
+    char delta_name[MAX_STREAM_NAME];
+    char stream_dir[MAX_STREAM_NAME];
+    int window_size = core->cd->window_size;
+    int recent = LLHLS_PART_SEGMENTS;
+    double skip_until = 6.0 * core->cd->segment_length;
+    double newer = 0;
+    int skipped = 0;
+    int64_t starting_file_sequence_number;
+    int64_t starting_media_sequence_number;
+    int i;
+
+    if (!stream->fmp4_playlist) {
+        stream->fmp4_playlist = playlist_create(window_size);
+        if (!stream->fmp4_playlist) {
+            return -1;
+        }
+    }
+
+    starting_file_sequence_number = file_sequence - window_size;
+    if (starting_file_sequence_number < 0) {
+        starting_file_sequence_number += core->cd->rollover_size;
+    }
+    starting_media_sequence_number = media_sequence - window_size;
+
+    if (video) {
+        snprintf(stream_dir, MAX_STREAM_NAME-1, "video%d", source);
+        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%dfmp4.m3u8", core->cd->manifest_directory, source);
+    } else {
+        snprintf(stream_dir, MAX_STREAM_NAME-1, "audio%d_substream%d", source, sub_stream);
+        snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d_fmp4.m3u8", core->cd->manifest_directory, source, sub_stream);
+    }
+    snprintf(delta_name, MAX_STREAM_NAME-1, "%s%s", stream_name, ORIGIN_SKIP_SUFFIX);
+
+    // segments that no longer list their parts are rendered once and cached
+    for (i = 0; i < window_size - recent; i++) {
+        int64_t next_sequence_number;
+        FILE *entry;
+
+        next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
+        entry = playlist_begin_entry(stream->fmp4_playlist, starting_media_sequence_number + i, next_sequence_number);
+        if (!entry) {
+            continue;
+        }
+        write_mp4_entry(entry, sdata, source, sub_stream, video, next_sequence_number, NULL);
+        playlist_end_entry(stream->fmp4_playlist, entry);
+    }
+
+    if (llhls_can_skip(core)) {
+        // the delta update leaves out everything further than CAN-SKIP-UNTIL from the live edge
+        for (i = window_size - 1; i >= 0; i--) {
+            if (newer >= skip_until) {
+                skipped = i + 1;
+                break;
+            }
+            newer += mp4_segment_length(sdata, sub_stream, video, (starting_file_sequence_number + i) % core->cd->rollover_size);
+        }
+        if (skipped > window_size - recent) {
+            skipped = window_size - recent;
+        }
+    }
+
+    manifest = manifest_open(&manifest_buffer, &manifest_size);
+    write_llhls_manifest(manifest, core, stream, sdata, source, sub_stream, video, stream_dir,
+                         file_sequence, media_sequence, part_count, 0);
+    if (manifest_publish(core, stream->fmp4_playlist, manifest, &manifest_buffer, &manifest_size, stream_name,
+                         0, media_sequence, part_count - 1) > 0) {
+        if (skipped > 0) {
+            manifest = manifest_open(&manifest_buffer, &manifest_size);
+            write_llhls_manifest(manifest, core, stream, sdata, source, sub_stream, video, stream_dir,
+                                 file_sequence, media_sequence, part_count, skipped);
+            fclose(manifest);
+            segwriter_playlist(core->hlsmux->writer, delta_name, manifest_buffer, manifest_size,
+                               SEGWRITER_FLAG_MEMORY, media_sequence, part_count - 1);
+        }
+        publish_file(core, SIGNAL_MANIFEST_WRITTEN, stream_name, 0);
+    }
+
+    return 0;
+}
+
+// the part goes to the origin only, the same bytes are appended to the segment being built
+static int write_mp4_part(fillet_app_struct *core, stream_struct *stream, source_context_struct *sdata,
+                          int source, int sub_stream, int video, double start_time, int end_of_segment)
+{
+    char part_name[MAX_STREAM_NAME];
+    uint8_t *part_buffer;
+    int part_size = 0;
+    void *part_file;
+    int slot = stream->media_sequence_number % MAX_PART_SEGMENTS;
+
+    if (!stream->fmp4 || !stream->output_fmp4_file) {
+        return 0;
+    }
+
+    fmp4_fragment_part(stream->fmp4, start_time, video ? VIDEO_FRAGMENT : AUDIO_FRAGMENT, end_of_segment);
+    part_buffer = fmp4_get_fragment(stream->fmp4, &part_size);
+    if (part_size <= 0) {
+        return 0;
+    }
+    segwriter_write(core->hlsmux->writer, stream->output_fmp4_file, part_buffer, part_size);
+    if (video && stream->part_count == 0) {
+        write_mp4_iframe(core, stream, source, (int64_t)start_time);
+    }
+
+    if (dash_chunked(core)) {
+        // the segment is listed under its time as soon as the first chunk is out
+        if (stream->part_count == 0) {
+            char stream_name[MAX_STREAM_NAME];
+            char stream_name_link[MAX_STREAM_NAME];
+
+            if (video) {
+                snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video%d/segment%ld.mp4", core->cd->manifest_directory, source, stream->file_sequence_number);
+                snprintf(stream_name_link, MAX_STREAM_NAME-1, "%s/video%d/segment%ld.mp4", core->cd->manifest_directory, source, (int64_t)start_time);
+            } else {
+                snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d/segment%ld.mp4", core->cd->manifest_directory, source, sub_stream, stream->file_sequence_number);
+                snprintf(stream_name_link, MAX_STREAM_NAME-1, "%s/audio%d_substream%d/segment%ld.mp4", core->cd->manifest_directory, source, sub_stream, (int64_t)start_time);
+            }
+            segwriter_symlink(core->hlsmux->writer, stream_name, stream_name_link);
+            stream->chunk_segment_time = (int64_t)start_time;
+            stream->chunk_segment_sequence = stream->media_sequence_number;
+        }
+        segwriter_flush(core->hlsmux->writer, stream->output_fmp4_file);
+        stream->part_count++;
+        stream->chunk_samples = 0;
+
+        // audio trails video, so once its first chunk is out every track has a live segment to list
+        // the mpd covers every rendition, the mux thread writes it once the workers are idle
+        if (!video && source == 0 && sub_stream == 0 && stream->part_count == 1 &&
+            core->hlsmux->video[0].fragments_published > (core->cd->window_size+2)) {
+            __sync_lock_test_and_set(&core->hlsmux->dash_manifest_pending, 1);
+        }
+        return 0;
+    }
+
+    if (video) {
+        snprintf(part_name, MAX_STREAM_NAME-1, "%s/video%d/part%ld.%d.mp4",
+                 core->cd->manifest_directory, source, stream->file_sequence_number, stream->part_count);
+    } else {
+        snprintf(part_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d/part%ld.%d.mp4",
+                 core->cd->manifest_directory, source, sub_stream, stream->file_sequence_number, stream->part_count);
+    }
+    part_file = segwriter_open(core->hlsmux->writer, part_name, SEGWRITER_FLAG_MEMORY);
+    segwriter_write(core->hlsmux->writer, part_file, part_buffer, part_size);
+    segwriter_close(core->hlsmux->writer, part_file);
+
+    stream->part_lengths[slot][stream->part_count] = stream->part_duration;
+    stream->part_count++;
+    stream->part_counts[slot] = stream->part_count;
+    stream->part_duration = 0;
+
+    if (!end_of_segment && stream->fragments_published > core->cd->window_size) {
+        update_mp4_llhls_manifest(core, stream, sdata, source, sub_stream, video,
+                                  stream->file_sequence_number, stream->media_sequence_number, stream->part_count);
+    }
+
+    return 0;
+}
+
+// called ahead of queueing each sample- cuts a part when the sample would take it past the part target
+static void mp4_part_sample(fillet_app_struct *core, stream_struct *stream, source_context_struct *sdata,
+                            int source, int sub_stream, int video, double start_time, double sample_length)
+{
+    double part_target = core->cd->part_length_ms / 1000.0;
+
+    if (stream->part_duration > 0 && stream->part_count < MAX_SEGMENT_PARTS - 1 &&
+        stream->part_duration + sample_length > part_target + 0.0005) {
+        write_mp4_part(core, stream, sdata, source, sub_stream, video, start_time, 0);
+    }
+    stream->part_duration += sample_length;
+}
+
+// called after queueing each sample- a chunk goes out as soon as it has its frames
+static void mp4_chunk_sample(fillet_app_struct *core, stream_struct *stream, source_context_struct *sdata,
+                             int source, int sub_stream, int video, double start_time)
+{
+    stream->chunk_samples++;
+    if (stream->chunk_samples >= core->cd->chunk_frames) {
+        write_mp4_part(core, stream, sdata, source, sub_stream, video, start_time, 0);
+    }
+}
+
+// everything a worker needs to put one sample into a rendition's segments, the
+// mux thread settles the shared state (outputs, segment timing, silence) up front
+typedef struct _mux_job_struct_ {
+    fillet_app_struct        *core;
+    stream_struct            *stream;
+    source_context_struct    *sdata;
+    sorted_frame_struct      frame;
+    int                      source;
+    int                      sub_stream;
+    int                      outputs;
+    int                      silence;
+    double                   segment_start;
+    double                   fragment_timestamp;
+    int                      fragment_duration;
+    int64_t                  composition_time;
+} mux_job_struct;
+
+static void mux_video_output(mux_job_struct *job)
+{
+    fillet_app_struct *core = job->core;
+    stream_struct *stream = job->stream;
+    sorted_frame_struct *frame = &job->frame;
+
+    if (job->outputs & MUX_OUTPUT_FMP4) {
+        if (llhls_enabled(core)) {
+            mp4_part_sample(core, stream, job->sdata, job->source, NO_SUBSTREAM, IS_VIDEO,
+                            job->segment_start, (double)job->fragment_duration / (double)VIDEO_CLOCK);
+        }
+        fmp4_video_fragment_add(stream->fmp4,
+                                frame->buffer,
+                                frame->buffer_size,
+                                job->fragment_timestamp,
+                                job->fragment_duration,
+                                job->composition_time,
+                                core->compressed_video_pool);
+        if (dash_chunked(core)) {
+            mp4_chunk_sample(core, stream, job->sdata, job->source, NO_SUBSTREAM, IS_VIDEO, job->segment_start);
         }
+    }
+    if (job->outputs & MUX_OUTPUT_TS) {
+        int64_t offset = segwriter_tell(stream->output_ts_file);
+        int pc;
+
+        pc = muxvideosample(core, stream, frame);
+        if (pc > 0) {
+            stream->packet_count += pc;
+            mux_ts_commit(core, stream, (pc + MUX_TABLE_PACKETS) * 188);
+            if (frame->sync_frame && ts_iframes_enabled(core)) {
+                ts_iframe_record(stream, frame->pts, offset, (pc + MUX_TABLE_PACKETS) * 188);
+            }
+        }
+    }
+}
+
+static void mux_audio_output(mux_job_struct *job)
+{
+    fillet_app_struct *core = job->core;
+    stream_struct *stream = job->stream;
+    sorted_frame_struct *frame = &job->frame;
+
+    // with MUX_OUTPUT_FMP4_MUXED the stream is the video rendition and the sample goes into its audio track
+    if (job->outputs & (MUX_OUTPUT_FMP4 | MUX_OUTPUT_FMP4_MUXED)) {
+        if (job->silence == 2) {
+            fmp4_audio_fragment_add(stream->fmp4,
+                                    aac_quiet_2,
+                                    sizeof(aac_quiet_2),
+                                    job->fragment_timestamp,
+                                    job->fragment_duration,
+                                    NULL);
+        } else if (job->silence == 6) {
+            fmp4_audio_fragment_add(stream->fmp4,
+                                    aac_quiet_6,
+                                    sizeof(aac_quiet_6),
+                                    job->fragment_timestamp,
+                                    job->fragment_duration,
+                                    NULL);
+        }
+
+        if (llhls_enabled(core)) {
+            mp4_part_sample(core, stream, job->sdata, job->source, job->sub_stream, IS_AUDIO,
+                            job->segment_start, (double)frame->duration / (double)AUDIO_CLOCK);
+        }
+        fmp4_audio_fragment_add(stream->fmp4,
+                                frame->buffer,
+                                frame->buffer_size,
+                                job->fragment_timestamp,
+                                job->fragment_duration,
+                                core->compressed_audio_pool);
+        if (dash_chunked(core)) {
+            mp4_chunk_sample(core, stream, job->sdata, job->source, job->sub_stream, IS_AUDIO, job->segment_start);
+        }
+    }
+    if (job->outputs & MUX_OUTPUT_TS) {
+        int pc;
+
+        pc = muxaudiosample(core, stream, frame, 0, 0);
+        if (pc > 0) {
+            stream->packet_count += pc;
+            mux_ts_commit(core, stream, (pc + MUX_TABLE_PACKETS) * 188);
+        }
+    }
+    if (job->outputs & MUX_OUTPUT_TS_MUXED) {
+        int pc;
+
+        // the stream is the video rendition here, this runs on its worker between its samples
+        pc = muxaudiosample(core, stream, frame, 0, 1);
+        if (pc > 0) {
+            stream->packet_count += pc;
+            mux_ts_commit(core, stream, pc * 188);
+        }
+    }
+}
+
+static void mux_video_job(void *context)
+{
+    mux_job_struct *job = (mux_job_struct*)context;
+
+    mux_video_output(job);
+    memory_return(job->core->compressed_video_pool, job->frame.buffer);
+}
+
+static void mux_audio_job(void *context)
+{
+    mux_job_struct *job = (mux_job_struct*)context;
 
-        fprintf(video_manifest,"#EXTINF:%.3f,\n", (float)sdata->segment_lengths_video[next_sequence_number]);
-        fprintf(video_manifest,"video%d/segment%ld.mp4\n", source, next_sequence_number);
-    }
+    mux_audio_output(job);
+    memory_return(job->core->compressed_audio_pool, job->frame.buffer);
+}
 
-    fclose(video_manifest);
+// the worker keeps its own reference on the sample, the mux thread returns
+// the frame as soon as it has been handed off
+static void mux_dispatch(mux_job_struct *job, int video)
+{
+    void *pool = video ? job->core->compressed_video_pool : job->core->compressed_audio_pool;
 
-    send_signal(core, SIGNAL_MANIFEST_WRITTEN, stream_name);
+    if (job->outputs == 0) {
+        return;
+    }
+    if (job->stream->worker) {
+        memory_ref(pool, job->frame.buffer);
+        if (muxworker_submit(job->stream->worker, video ? mux_video_job : mux_audio_job, job, sizeof(mux_job_struct)) == 0) {
+            return;
+        }
+        memory_return(pool, job->frame.buffer);
+    }
+    if (video) {
+        mux_video_output(job);
+    } else {
+        mux_audio_output(job);
+    }
+}
 
-    return 0;
+// segment boundaries and manifests read what the workers write, so the
+// rendition's queued samples have to be through first
+static void mux_stream_wait(stream_struct *stream)
+{
+    if (stream->worker) {
+        muxworker_wait(stream->worker);
+    }
 }
 
-static int update_mp4_audio_manifest(fillet_app_struct *core, stream_struct *stream, int source, int sub_stream, int discontinuity, source_context_struct *sdata)
+// the video and audio renditions of a source share its segment tables (lengths,
+// discontinuities, splice state), their manifests are built on the workers
+static void mux_source_wait(hlsmux_struct *hlsmux, int source)
 {
-    FILE *audio_manifest;
-    char stream_name[MAX_STREAM_NAME];
     int i;
-    int64_t starting_file_sequence_number;
-    int64_t starting_media_sequence_number;
 
-    starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
-    if (starting_file_sequence_number < 0) {
-        starting_file_sequence_number += core->cd->rollover_size;
+    mux_stream_wait(&hlsmux->video[source]);
+    for (i = 0; i < MAX_AUDIO_STREAMS; i++) {
+        mux_stream_wait(&hlsmux->audio[source][i]);
     }
-    starting_media_sequence_number = stream->media_sequence_number - core->cd->window_size;
+}
 
-    snprintf(stream_name, MAX_STREAM_NAME-1, "%s/audio%d_substream%d_fmp4.m3u8", core->cd->manifest_directory, source, sub_stream);
-    audio_manifest = fopen(stream_name,"w");
+static void mux_workers_wait(hlsmux_struct *hlsmux)
+{
+    int i;
 
-    fprintf(audio_manifest,"#EXTM3U\n");
-    fprintf(audio_manifest,"#EXT-X-VERSION:6\n");
-    fprintf(audio_manifest,"#EXT-X-MEDIA-SEQUENCE:%ld\n", starting_media_sequence_number);
-    fprintf(audio_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
-    fprintf(audio_manifest,"#EXT-X-TARGETDURATION:%d\n", core->cd->segment_length);
-    fprintf(audio_manifest,"#EXT-X-MAP:URI=\"audio%d_substream%d/init.mp4\"\n", source, sub_stream);
+    for (i = 0; i < hlsmux->worker_count; i++) {
+        muxworker_wait(hlsmux->workers[i]);
+    }
+}
 
-    for (i = 0; i < core->cd->window_size; i++) {
-        int64_t next_sequence_number;
+// the segment fmp4 picks up the audio track the rendition's init describes, the init
+// is only held until then
+static int mp4_muxed_audio_join(stream_struct *stream)
+{
+    fragment_file_struct *init = stream->fmp4_init;
+    fragment_file_struct *fmp4 = stream->fmp4;
 
-        next_sequence_number = (starting_file_sequence_number + i) % core->cd->rollover_size;
-        if (sdata->discontinuity[next_sequence_number] == 1) {
-            fprintf(audio_manifest,"#EXT-X-DISCONTINUITY\n");
-        } else if (sdata->discontinuity[next_sequence_number] == 2) {
-            fprintf(audio_manifest,"#EXT-X-CUE-OUT:DURATION=%ld\n", sdata->splice_duration[next_sequence_number]);
-        } else if (sdata->splice_duration_remaining[next_sequence_number] > 0) {
-            fprintf(audio_manifest,"#EXT-X-CUE-OUT-CONT:ElapsedTime=%.3f,Duration=%ld\n",
-                    sdata->splice_elapsed_time[next_sequence_number],
-                    sdata->splice_duration[next_sequence_number]);
-        } else if (sdata->discontinuity[next_sequence_number] == 3) {
-            fprintf(audio_manifest,"#EXT-X-CUE-IN\n");
+    if (!fmp4 || !init || init->track_count < 2) {
+        return 0;
+    }
+    if (fmp4->track_count < 2) {
+        fmp4->audio_media_type = init->audio_media_type;
+        if (fmp4_audio_track_create(fmp4, init->audio_channels, init->audio_samplerate, init->audio_object_type, init->audio_bitrate) < 0) {
+            return -1;
         }
+    }
+    fmp4_file_finalize(init);
+    stream->fmp4_init = NULL;
+
+    return 0;
+}
+
+// the audio starts after the video, so each rendition's init goes out again with the audio as its
+// second track and the segment being written takes the track on from here
+static void mp4_muxed_audio_start(fillet_app_struct *core, int num_sources)
+{
+    hlsmux_struct *hlsmux = core->hlsmux;
+    audio_stream_struct *astream = (audio_stream_struct*)core->source_audio_stream[0].audio_stream;
+    int media_type = hlsmux->audio[0][0].mp4_audio_media_type;
+    int audio_bitrate;
+    int i;
 
-        fprintf(audio_manifest,"#EXTINF:%.3f,\n", (float)sdata->segment_lengths_audio[next_sequence_number][sub_stream]);
-        fprintf(audio_manifest,"audio%d_substream%d/segment%ld.mp4\n", source, sub_stream, next_sequence_number);
+#if defined(ENABLE_TRANSCODE)
+    if (core->transcode_enabled) {
+        audio_bitrate = core->cd->transaudio_info[0].audio_bitrate;
+    } else {
+        audio_bitrate = astream->audio_bitrate;
     }
+#else
+    audio_bitrate = astream->audio_bitrate;
+#endif
 
-    fclose(audio_manifest);
+    for (i = 0; i < num_sources; i++) {
+        stream_struct *stream = &hlsmux->video[i];
+        fragment_file_struct *init = stream->fmp4_init;
+        char init_name[MAX_STREAM_NAME];
+        void *init_file;
 
-    send_signal(core, SIGNAL_MANIFEST_WRITTEN, stream_name);
+        if (!init || init->track_count > 1) {
+            continue;
+        }
+        init->audio_media_type = media_type;
+        if (fmp4_audio_track_create(init, astream->audio_channels, astream->audio_samplerate, astream->audio_object_type, audio_bitrate) < 0) {
+            continue;
+        }
+        init->buffer_offset = 0;
+        fmp4_output_header(init, IS_VIDEO);
+
+        // a segment may be open on the stream, so the init gets its own handle
+        snprintf(init_name, MAX_STREAM_NAME-1, "%s/video%d/init.mp4", core->cd->manifest_directory, i);
+        init_file = segwriter_open(hlsmux->writer, init_name, SEGWRITER_FLAG_PINNED);
+        if (init_file) {
+            segwriter_write(hlsmux->writer, init_file, init->buffer, init->buffer_offset);
+            segwriter_close(hlsmux->writer, init_file);
+        }
+        syslog(LOG_INFO,"HLSMUX: WRITING OUT MUXED VIDEO INIT FILE - FMP4(%d): %ld\n", i, init->buffer_offset);
 
-    return 0;
+        mux_stream_wait(stream);
+        mp4_muxed_audio_join(stream);
+    }
 }
 
 static int write_dash_master_manifest_youtube(fillet_app_struct *core, source_context_struct *sdata)
@@ -1660,6 +3389,8 @@ static int write_dash_master_manifest_youtube(fillet_app_struct *core, source_co
     struct stat sb;
     char master_manifest_filename[MAX_STREAM_NAME];
     FILE *master_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
     int i;
     static struct tm tm_avail;
     time_t t_publish;
@@ -1713,7 +3444,7 @@ static int write_dash_master_manifest_youtube(fillet_app_struct *core, source_co
 
     snprintf(master_manifest_filename,MAX_STREAM_NAME-1,"%s/youtubedash.mpd",core->cd->manifest_directory);
 
-    master_manifest = fopen(master_manifest_filename,"w");
+    master_manifest = manifest_open(&manifest_buffer, &manifest_size);
     if (!master_manifest) {
         fprintf(stderr,"ERROR: Unable to create master manifest file - please check system configuration: %s\n", master_manifest_filename);
         return -1;
@@ -1791,27 +3522,490 @@ static int write_dash_master_manifest_youtube(fillet_app_struct *core, source_co
     fprintf(master_manifest,"</Period>\n");
     fprintf(master_manifest,"</MPD>\n");
 
+    manifest_close(core, NULL, master_manifest, &manifest_buffer, &manifest_size, master_manifest_filename);
+
     return 0;
 }
 
+// byte-range output lists each segment of the timeline against its container
+static void write_dash_segment_urls(FILE *master_manifest, fillet_app_struct *core, stream_struct *stream, const char *stream_dir,
+                                    int64_t starting_file_sequence_number)
+{
+    int64_t sfsn = starting_file_sequence_number - 1;
+    int segment;
+
+    if (sfsn < 0) {
+        sfsn = core->cd->rollover_size-1;
+    }
+    for (segment = 0; segment < core->cd->window_size; segment++) {
+        byterange_struct *range = &stream->mp4_ranges[((sfsn + segment) % core->cd->rollover_size) % MAX_ROLLOVER_SIZE];
+
+        fprintf(master_manifest,"<SegmentURL media=\"%s/segment_range%ld.mp4\" mediaRange=\"%ld-%ld\"/>\n",
+                stream_dir, range->container, range->offset, range->offset + range->length - 1);
+    }
+}
+
+// a run of back to back segments with the same duration goes out as one S with a repeat count
+static void write_dash_timeline(FILE *master_manifest, int64_t *times, int64_t *durations, int count)
+{
+    int segment = 0;
+
+    while (segment < count) {
+        int repeat = 0;
+
+        while (segment + repeat + 1 < count &&
+               durations[segment + repeat + 1] == durations[segment] &&
+               times[segment + repeat + 1] == times[segment + repeat] + durations[segment]) {
+            repeat++;
+        }
+        if (repeat > 0) {
+            fprintf(master_manifest,"<S t=\"%ld\" d=\"%ld\" r=\"%d\"/>\n", times[segment], durations[segment], repeat);
+        } else {
+            fprintf(master_manifest,"<S t=\"%ld\" d=\"%ld\"/>\n", times[segment], durations[segment]);
+        }
+        segment += repeat + 1;
+    }
+}
+
+// the splice points in the window ride the video timeline as scte35 events, same binary as the hls dateranges
+static void write_dash_events(FILE *master_manifest, source_context_struct *sdata, int64_t first_file_sequence, int count, int rollover_size)
+{
+    int events = 0;
+    int segment;
+
+    for (segment = 0; segment < count; segment++) {
+        int64_t file_sequence = (first_file_sequence + segment) % rollover_size;
+        int cue = sdata->discontinuity[file_sequence];
+        uint8_t section[SCTE35_MAX_SECTION];
+        char binary[SCTE35_MAX_SECTION * 2];
+        int64_t program_time;
+        int64_t start_time;
+        int section_size;
+
+        if ((cue != 2 && cue != 3) || !sdata->program_time_base) {
+            continue;
+        }
+        if (!events) {
+            fprintf(master_manifest,"<EventStream xmlns:scte35=\"http://www.scte.org/schemas/35/2016\" schemeIdUri=\"urn:scte:scte35:2014:xml+bin\" timescale=\"%d\">\n", VIDEO_CLOCK);
+        }
+        events++;
+        program_time = sdata->program_time_base + sdata->full_time_video[file_sequence] / (VIDEO_CLOCK / 1000);
+        start_time = sdata->program_time_base + sdata->splice_start[file_sequence] / (VIDEO_CLOCK / 1000);
+        section_size = scte35_splice_insert(section, (uint32_t)start_time, sdata->full_time_video[file_sequence],
+                                            cue == 2 ? sdata->splice_duration[file_sequence] : 0, cue == 2);
+        scte35_base64(binary, sizeof(binary), section, section_size);
+        if (cue == 2 && sdata->splice_duration[file_sequence] > 0) {
+            fprintf(master_manifest,"<Event presentationTime=\"%ld\" duration=\"%ld\" id=\"%u\">",
+                    sdata->full_time_video[file_sequence], sdata->splice_duration[file_sequence] * VIDEO_CLOCK, (uint32_t)program_time);
+        } else {
+            fprintf(master_manifest,"<Event presentationTime=\"%ld\" id=\"%u\">",
+                    sdata->full_time_video[file_sequence], (uint32_t)program_time);
+        }
+        fprintf(master_manifest,"<scte35:Signal><scte35:Binary>%s</scte35:Binary></scte35:Signal></Event>\n", binary);
+    }
+    if (events) {
+        fprintf(master_manifest,"</EventStream>\n");
+    }
+}
+
+typedef struct _dash_video_struct_ {
+    int           width;
+    int           height;
+    int           h264_profile;
+    int           midbyte;
+    int           h264_level;
+    int           hevc;
+    int           bitrate;
+    int           fps_num;
+    int           fps_den;
+} dash_video_struct;
+
+// everything the adaptation sets and representations are rendered from
+typedef struct _dash_signature_struct_ {
+    int                 num_sources;
+    int                 max_width;
+    int                 max_height;
+    int                 aspect_num;
+    int                 aspect_den;
+    dash_video_struct   video[MAX_VIDEO_SOURCES];
+    int                 audio[MAX_AUDIO_STREAMS];
+    int                 audio_bitrate[MAX_AUDIO_STREAMS];
+    int                 muxed_audio;
+} dash_signature_struct;
+
+// the mpd text outside of the timelines only changes with the stream parameters, so it is
+// rendered once and each update only adds the timelines around it
+typedef struct _dash_cache_struct_ {
+    dash_signature_struct   signature;
+    int                     valid;
+    char                    *video_set;
+    size_t                  video_set_size;
+    char                    *video_head[MAX_VIDEO_SOURCES];
+    size_t                  video_head_size[MAX_VIDEO_SOURCES];
+    char                    *audio_head[MAX_AUDIO_STREAMS];
+    size_t                  audio_head_size[MAX_AUDIO_STREAMS];
+    char                    *trick_set;
+    size_t                  trick_set_size;
+    char                    *trick_head[MAX_VIDEO_SOURCES];
+    size_t                  trick_head_size[MAX_VIDEO_SOURCES];
+} dash_cache_struct;
+
+static void dash_cache_release(dash_cache_struct *cache)
+{
+    int i;
+
+    if (!cache) {
+        return;
+    }
+    free(cache->video_set);
+    free(cache->trick_set);
+    for (i = 0; i < MAX_VIDEO_SOURCES; i++) {
+        free(cache->video_head[i]);
+        free(cache->trick_head[i]);
+    }
+    for (i = 0; i < MAX_AUDIO_STREAMS; i++) {
+        free(cache->audio_head[i]);
+    }
+    memset(cache, 0, sizeof(dash_cache_struct));
+}
+
+static void dash_signature(fillet_app_struct *core, source_context_struct *sdata, int num_sources, dash_signature_struct *signature)
+{
+    int i;
+
+    memset(signature, 0, sizeof(dash_signature_struct));
+    signature->num_sources = num_sources;
+#if defined(ENABLE_TRANSCODE)
+    if (core->transcode_enabled) {
+        signature->aspect_num = core->decoded_source_info.decoded_aspect_num;
+        signature->aspect_den = core->decoded_source_info.decoded_aspect_den;
+    }
+#endif
+    for (i = 0; i < num_sources && i < MAX_VIDEO_SOURCES; i++) {
+        source_context_struct *lsdata = &sdata[i];
+        video_stream_struct *vstream = (video_stream_struct*)core->source_video_stream[i].video_stream;
+        dash_video_struct *video = &signature->video[i];
+
+        if (lsdata->width > signature->max_width && lsdata->height > signature->max_height) {
+            signature->max_width = lsdata->width;
+            signature->max_height = lsdata->height;
+        }
+        video->width = lsdata->width;
+        video->height = lsdata->height;
+        video->h264_profile = lsdata->h264_profile;
+        video->midbyte = lsdata->midbyte;
+        video->h264_level = lsdata->h264_level;
+        video->fps_num = 30000;
+        video->fps_den = 1001;
+#if defined(ENABLE_TRANSCODE)
+        if (core->transcode_enabled) {
+            video->bitrate = core->cd->transvideo_info[i].video_bitrate * 1000;
+            video->fps_num = core->decoded_source_info.decoded_fps_num;
+            video->fps_den = core->decoded_source_info.decoded_fps_den;
+            video->hevc = core->cd->transvideo_info[i].video_codec == STREAM_TYPE_HEVC;
+        } else {
+            video->bitrate = vstream->video_bitrate;
+        }
+#else
+        video->bitrate = vstream->video_bitrate;
+        video->hevc = lsdata->hevc_sps_size > 0 && lsdata->hevc_pps_size > 0 && lsdata->hevc_vps_size > 0;
+#endif
+    }
+    for (i = 0; i < MAX_AUDIO_STREAMS; i++) {
+        if (sdata->start_time_audio[i] != -1) {
+            // FIX FIX FIX FIX FIX
+            audio_stream_struct *astream = (audio_stream_struct*)core->source_audio_stream[0].audio_stream;//[j];
+
+            signature->audio[i] = 1;
+#if defined(ENABLE_TRANSCODE)
+            if (core->transcode_enabled) {
+                signature->audio_bitrate[i] = core->cd->transaudio_info[i].audio_bitrate * 1000;
+            } else {
+                signature->audio_bitrate[i] = astream->audio_bitrate;
+            }
+#else
+            signature->audio_bitrate[i] = astream->audio_bitrate;
+#endif
+        }
+    }
+    if (mp4_audio_muxed(core, 0, 0) && signature->audio[0]) {
+        // the primary audio is a track of every video representation instead of a set of its own
+        signature->muxed_audio = 1;
+        signature->audio[0] = 0;
+        for (i = 0; i < num_sources && i < MAX_VIDEO_SOURCES; i++) {
+            signature->video[i].bitrate += signature->audio_bitrate[0];
+        }
+    }
+}
+
+// the common encryption descriptor every adaptation set carries when the fmp4 output is encrypted
+static void dash_content_protection(fillet_app_struct *core, FILE *output)
+{
+    char kid[40];
+
+    if (core->cd->fmp4_encryption == SEGCRYPT_SCHEME_NONE) {
+        return;
+    }
+    segcrypt_uuid(core->cd->content_key.kid, kid, sizeof(kid));
+    fprintf(output,"<ContentProtection schemeIdUri=\"urn:mpeg:dash:mp4protection:2011\" value=\"%s\" cenc:default_KID=\"%s\"/>\n",
+            segcrypt_scheme_name(core->cd->fmp4_encryption), kid);
+}
+
+static int dash_render_video(fillet_app_struct *core, dash_cache_struct *cache, source_context_struct *sdata, int i)
+{
+    dash_video_struct *video = &cache->signature.video[i];
+    FILE *head = open_memstream(&cache->video_head[i], &cache->video_head_size[i]);
+    const char *audio_codec = cache->signature.muxed_audio ? ",mp4a.40.2" : "";
+
+    if (!head) {
+        return -1;
+    }
+    if (video->hevc) {
+        fprintf(head,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"hev1.1.2.L93.B0%s\" width=\"%d\" height=\"%d\" frameRate=\"%d/%d\" bandwidth=\"%d\">\n",
+                i,
+                audio_codec,
+                video->width, video->height,
+                video->fps_num, video->fps_den,
+                video->bitrate);
+    } else {
+        fprintf(head,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"avc1.%2x%02x%02x%s\" width=\"%d\" height=\"%d\" frameRate=\"%d/%d\" bandwidth=\"%d\">\n",
+                i,
+                video->h264_profile, //hex
+                video->midbyte,
+                video->h264_level,
+                audio_codec,
+                video->width, video->height,
+                video->fps_num, video->fps_den,
+                video->bitrate);
+    }
+    sdata[i].pto_video = 0; // normalizing our time to 0
+    if (dash_chunked(core)) {
+        // a segment can be requested once its first chunk is out
+        fprintf(head,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"video%d/init.mp4\" media=\"video%d/segment$Time$.mp4\" availabilityTimeOffset=\"%.3f\" availabilityTimeComplete=\"false\">\n",
+                sdata[i].pto_video, VIDEO_CLOCK, i, i,
+                (double)core->cd->segment_length - (double)core->cd->chunk_frames * (double)video->fps_den / (double)video->fps_num);
+    } else if (byterange_enabled(core)) {
+        fprintf(head,"<SegmentList presentationTimeOffset=\"%ld\" timescale=\"%d\">\n", sdata[i].pto_video, VIDEO_CLOCK);
+        fprintf(head,"<Initialization sourceURL=\"video%d/init.mp4\"/>\n", i);
+    } else {
+        fprintf(head,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"video%d/init.mp4\" media=\"video%d/segment$Time$.mp4\">\n",
+                sdata[i].pto_video, VIDEO_CLOCK, i, i);
+    }
+    fprintf(head,"<SegmentTimeline>\n");
+    return fclose(head);
+}
+
+// one sync frame per segment, so at normal speed the trick representation plays a picture a segment
+static int dash_render_trick(fillet_app_struct *core, dash_cache_struct *cache, source_context_struct *sdata, int i)
+{
+    dash_video_struct *video = &cache->signature.video[i];
+    FILE *head = open_memstream(&cache->trick_head[i], &cache->trick_head_size[i]);
+    int bandwidth = core->hlsmux->video[i].mp4_iframe_bandwidth;
+    int playout_rate = (int)((int64_t)core->cd->segment_length * video->fps_num / video->fps_den);
+
+    if (!head) {
+        return -1;
+    }
+    if (bandwidth <= 0) {
+        bandwidth = video->bitrate;
+    }
+    // the ids carry on past the audio representations
+    if (video->hevc) {
+        fprintf(head,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"hev1.1.2.L93.B0\" width=\"%d\" height=\"%d\" bandwidth=\"%d\" maxPlayoutRate=\"%d\" codingDependency=\"false\">\n",
+                cache->signature.num_sources + MAX_AUDIO_STREAMS + i,
+                video->width, video->height,
+                bandwidth, playout_rate);
+    } else {
+        fprintf(head,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"avc1.%2x%02x%02x\" width=\"%d\" height=\"%d\" bandwidth=\"%d\" maxPlayoutRate=\"%d\" codingDependency=\"false\">\n",
+                cache->signature.num_sources + MAX_AUDIO_STREAMS + i,
+                video->h264_profile, //hex
+                video->midbyte,
+                video->h264_level,
+                video->width, video->height,
+                bandwidth, playout_rate);
+    }
+    fprintf(head,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"video%d/init.mp4\" media=\"video%d/iframe$Time$.mp4\">\n",
+            sdata[i].pto_video, VIDEO_CLOCK, i, i);
+    fprintf(head,"<SegmentTimeline>\n");
+    return fclose(head);
+}
+
+static int dash_render_audio(fillet_app_struct *core, dash_cache_struct *cache, source_context_struct *sdata, int j)
+{
+    FILE *head = open_memstream(&cache->audio_head[j], &cache->audio_head_size[j]);
+
+    if (!head) {
+        return -1;
+    }
+    fprintf(head,"<AdaptationSet id=\"%d\" contentType=\"audio\" segmentAlignment=\"true\">\n", j+1);
+    dash_content_protection(core, head);
+    // the ids carry on from the video representations
+    fprintf(head,"<Representation id=\"%d\" bandwidth=\"%d\" codecs=\"mp4a.40.2\" mimeType=\"audio/mp4\" audioSamplingRate=\"48000\">\n",
+            cache->signature.num_sources+j, cache->signature.audio_bitrate[j]);
+    fprintf(head,"<AudioChannelConfiguration schemeIdUri=\"urn:mpeg:dash:23003:3:audio_channel_configuration:2011\" value=\"2\"/>\n");
+    // we're actually normalizing our time to 0...
+    sdata->pto_audio = 0;
+    if (byterange_enabled(core)) {
+        fprintf(head,"<SegmentList presentationTimeOffset=\"%ld\" timescale=\"%d\">\n", sdata->pto_audio, AUDIO_CLOCK);
+        fprintf(head,"<Initialization sourceURL=\"audio0_substream%d/init.mp4\"/>\n", j);
+    } else if (dash_chunked(core)) {
+        fprintf(head,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"audio0_substream%d/init.mp4\" media=\"audio0_substream%d/segment$Time$.mp4\" availabilityTimeOffset=\"%.3f\" availabilityTimeComplete=\"false\">\n",
+                sdata->pto_audio,
+                AUDIO_CLOCK,
+                j,
+                j,
+                (double)core->cd->segment_length - (double)core->cd->chunk_frames * 1024.0 / 48000.0);
+    } else {
+        fprintf(head,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"audio0_substream%d/init.mp4\" media=\"audio0_substream%d/segment$Time$.mp4\">\n",
+                sdata->pto_audio,
+                AUDIO_CLOCK,
+                j,
+                j);
+    }
+    fprintf(head,"<SegmentTimeline>\n");
+    return fclose(head);
+}
+
+// renders the static text again only when one of the streams it describes has changed
+static dash_cache_struct *dash_cache(fillet_app_struct *core, source_context_struct *sdata, int num_sources)
+{
+    dash_cache_struct *cache = (dash_cache_struct*)core->hlsmux->dash_cache;
+    dash_signature_struct signature;
+    FILE *video_set;
+    const char *content_type;
+    int i;
+
+    if (!cache) {
+        cache = (dash_cache_struct*)malloc(sizeof(dash_cache_struct));
+        if (!cache) {
+            return NULL;
+        }
+        memset(cache, 0, sizeof(dash_cache_struct));
+        core->hlsmux->dash_cache = cache;
+    }
+
+    dash_signature(core, sdata, num_sources, &signature);
+    if (cache->valid && memcmp(&signature, &cache->signature, sizeof(signature)) == 0) {
+        return cache;
+    }
+    dash_cache_release(cache);
+    cache->signature = signature;
+    // with the audio inside, the set has one component of each kind rather than a single content type
+    content_type = signature.muxed_audio ? "" : " contentType=\"video\"";
+
+    video_set = open_memstream(&cache->video_set, &cache->video_set_size);
+    if (!video_set) {
+        return NULL;
+    }
+#if defined(ENABLE_TRANSCODE)
+    if (core->transcode_enabled) {
+        fprintf(video_set,"<AdaptationSet id=\"0\"%s segmentAlignment=\"true\" maxWidth=\"%d\" maxHeight=\"%d\" par=\"%d:%d\">\n",
+                content_type,
+                signature.max_width, signature.max_height,
+                signature.aspect_num, signature.aspect_den);
+    } else {
+        fprintf(video_set,"<AdaptationSet id=\"0\"%s segmentAlignment=\"true\" maxWidth=\"%d\" maxHeight=\"%d\" maxFrameRate=\"30000/1001\" par=\"16:9\">\n",
+                content_type,
+                signature.max_width, signature.max_height);
+    }
+#else
+    fprintf(video_set,"<AdaptationSet id=\"0\"%s segmentAlignment=\"true\" maxWidth=\"%d\" maxHeight=\"%d\" maxFrameRate=\"30000/1001\" par=\"16:9\">\n",
+            content_type,
+            signature.max_width, signature.max_height);
+#endif
+    dash_content_protection(core, video_set);
+    if (signature.muxed_audio) {
+        fprintf(video_set,"<ContentComponent id=\"1\" contentType=\"video\"/>\n");
+        fprintf(video_set,"<ContentComponent id=\"2\" contentType=\"audio\"/>\n");
+    }
+    if (fclose(video_set) != 0) {
+        return NULL;
+    }
+    for (i = 0; i < num_sources && i < MAX_VIDEO_SOURCES; i++) {
+        if (dash_render_video(core, cache, sdata, i) != 0) {
+            return NULL;
+        }
+    }
+    for (i = 0; i < MAX_AUDIO_STREAMS; i++) {
+        if (signature.audio[i] && dash_render_audio(core, cache, sdata, i) != 0) {
+            return NULL;
+        }
+    }
+    if (mp4_iframes_enabled(core)) {
+        FILE *trick_set = open_memstream(&cache->trick_set, &cache->trick_set_size);
+
+        if (!trick_set) {
+            return NULL;
+        }
+        // the set ids carry on past the audio sets, the property points back at the video set
+        fprintf(trick_set,"<AdaptationSet id=\"%d\" contentType=\"video\" segmentAlignment=\"true\" maxWidth=\"%d\" maxHeight=\"%d\">\n",
+                MAX_AUDIO_STREAMS + 1, signature.max_width, signature.max_height);
+        fprintf(trick_set,"<EssentialProperty schemeIdUri=\"http://dashif.org/guidelines/trickmode\" value=\"0\"/>\n");
+        dash_content_protection(core, trick_set);
+        if (fclose(trick_set) != 0) {
+            return NULL;
+        }
+        for (i = 0; i < num_sources && i < MAX_VIDEO_SOURCES; i++) {
+            if (dash_render_trick(core, cache, sdata, i) != 0) {
+                return NULL;
+            }
+        }
+    }
+    cache->valid = 1;
+
+    return cache;
+}
+
+// the trick representations run on the same timeline as the video they were cut from
+static int dash_video_times(fillet_app_struct *core, source_context_struct *lsdata, int i, int64_t sfsn, int window_size,
+                            int64_t *times, int64_t *durations)
+{
+    int segment;
+    int count = 0;
+
+    for (segment = 0; segment < window_size; segment++) {
+        int64_t next_sequence_number = (sfsn + segment) % core->cd->rollover_size;
+
+        if (dash_chunked(core) && segment == window_size - 1) {
+            // still being written- the nominal length stands in for the duration
+            stream_struct *live = &core->hlsmux->video[i];
+            if (live->chunk_segment_sequence == live->media_sequence_number) {
+                times[count] = live->chunk_segment_time;
+                durations[count] = core->cd->segment_length * VIDEO_CLOCK;
+                count++;
+            }
+            continue;
+        }
+        times[count] = lsdata->full_time_video[next_sequence_number];
+        durations[count] = lsdata->full_duration_video[next_sequence_number];
+        count++;
+    }
+    return count;
+}
+
 static int write_dash_master_manifest(fillet_app_struct *core, source_context_struct *sdata)
 {
     struct stat sb;
     char master_manifest_filename[MAX_STREAM_NAME];
     FILE *master_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
     int i;
     struct tm tm_avail;
     time_t t_publish;
     struct tm tm_publish;
-    int max_width = 0;
-    int max_height = 0;
     source_context_struct *lsdata;
     stream_struct *stream = (stream_struct*)&core->hlsmux->video[0];
+    dash_cache_struct *cache;
+    int64_t times[MAX_ROLLOVER_SIZE];
+    int64_t durations[MAX_ROLLOVER_SIZE];
     int64_t starting_file_sequence_number;
-    int64_t starting_media_sequence_number;
-    char avail_time[MAX_STREAM_NAME];
-    char publish_time[MAX_STREAM_NAME];
+    int64_t sfsn;
+    char stream_dir[MAX_STREAM_NAME];
     int num_sources = core->num_sources;
+    int window_size = core->cd->window_size;
+    int segment;
+    int count;
 
 #if defined(ENABLE_TRANSCODE)
     if (core->transcode_enabled) {
@@ -1821,21 +4015,23 @@ static int write_dash_master_manifest(fillet_app_struct *core, source_context_st
     }
 #endif
 
-    gmtime_r(&core->t_avail, &tm_avail);
-    strftime(avail_time,MAX_STREAM_NAME-1,"%Y-%m-%dT%H:%M:%SZ", &tm_avail);
-
-    t_publish = time(NULL);
-    t_publish -= ((core->cd->window_size-1) * core->cd->segment_length);
-    //t_publish -= ((core->cd->window_size-1) * core->cd->segment_length);
-    //t_publish -= (core->cd->segment_length);
-    gmtime_r(&t_publish, &tm_publish);
-    strftime(publish_time,MAX_STREAM_NAME-1,"%Y-%m-%dT%H:%M:%SZ", &tm_publish);
+    if (window_size > MAX_ROLLOVER_SIZE) {
+        window_size = MAX_ROLLOVER_SIZE;
+    }
 
     starting_file_sequence_number = stream->file_sequence_number - core->cd->window_size;
+    if (dash_chunked(core)) {
+        // the window runs up to the segment still being chunked out
+        starting_file_sequence_number += 2;
+    }
     if (starting_file_sequence_number < 0) {
         starting_file_sequence_number += core->cd->rollover_size;
     }
-    starting_media_sequence_number = stream->media_sequence_number - core->cd->window_size;
+    starting_file_sequence_number %= core->cd->rollover_size;
+    sfsn = starting_file_sequence_number - 1;
+    if (sfsn < 0) {
+        sfsn = core->cd->rollover_size-1;
+    }
 
     if (stat(core->cd->manifest_directory, &sb) == 0 && S_ISDIR(sb.st_mode)) {
         fprintf(stderr,"STATUS: Manifest directory exists: %s\n", core->cd->manifest_directory);
@@ -1851,57 +4047,35 @@ static int write_dash_master_manifest(fillet_app_struct *core, source_context_st
         snprintf(master_manifest_filename,MAX_STREAM_NAME-1,"%s/%s",core->cd->manifest_directory,core->cd->manifest_dash);
     }
 
-    master_manifest = fopen(master_manifest_filename,"w");
-    if (!master_manifest) {
-        fprintf(stderr,"ERROR: Unable to create master manifest file - please check system configuration: %s\n", master_manifest_filename);
-        return -1;
+    // this write still carries the old availability time if it is the one that resets it
+    gmtime_r(&core->t_avail, &tm_avail);
+    //When the MPD is updated, the value of MPD@availabilityStartTime shall be the same in the original and the updated MPD.
+    //Segment availability start time = MPD@availabilityStartTime + PeriodStart + MediaSegment[i].startTime + MediaSegment[i].duration
+#if !defined(DISABLE_VIDEO)
+    if (num_sources > 0 && window_size > 0 && core->timeset == 0) {
+        // reset the AST
+        core->timeset = 1;
+        fprintf(stderr,"STATUS: Resetting the availability time\n");
+        core->t_avail = time(NULL);
+        core->t_avail -= ((core->cd->window_size-1) * core->cd->segment_length);
     }
+#endif
+    // why is it not media time vs system time
+    t_publish = time(NULL) + (core->cd->segment_length*(core->cd->window_size-1));
+    gmtime_r(&t_publish, &tm_publish);
 
-    lsdata = sdata;
-    for (i = 0; i < num_sources; i++) {
-        //video_stream_struct *vstream = (video_stream_struct*)core->source_stream[i].video_stream;
-
-        if (lsdata->width > max_width && lsdata->height > max_height) {
-            max_width = lsdata->width;
-            max_height = lsdata->height;
-        }
-        lsdata++;
+    cache = dash_cache(core, sdata, num_sources);
+    if (!cache) {
+        fprintf(stderr,"ERROR: Unable to render the DASH manifest\n");
+        return -1;
     }
 
-    //When the MPD is updated, the value of MPD@availabilityStartTime shall be the same in the original and the updated MPD.
-    //Segment availability start time = MPD@availabilityStartTime + PeriodStart + MediaSegment[i].startTime + MediaSegment[i].duration
-    {
-        int64_t pre_sfsn = starting_file_sequence_number - 1;
-        int segment;
-        if ((starting_file_sequence_number-1) < 0) {
-            pre_sfsn = core->cd->rollover_size-1;
-        }
-        for (segment = 0; segment < core->cd->window_size; segment++) {
-            //int64_t pre_next_sequence_number = (pre_sfsn + segment) % core->cd->rollover_size;
-            //int64_t media_time_passed = sdata->full_time_video[pre_next_sequence_number] / 90000;
-            if (segment == core->cd->window_size - 1) {
-                // why is it not media time vs system time
-                //t_publish = t_avail + media_time_passed + (core->cd->segment_length*(core->cd->window_size-1));
-                /*
-                FILE *trimfile;
-                int trim_count = 0;
-                trimfile = fopen("/var/tmp/trim.dat","r");
-                if (trimfile) {
-                    char trim_data_line[32];
-                    char *ptrim;
-                    memset(trim_data_line,0,sizeof(trim_data_line));
-                    ptrim = fgets(&trim_data_line[0], 8, trimfile);
-                    fclose(trimfile);
-                    trim_count = atoi(trim_data_line);
-                }
-                */
-                //t_publish = t_avail + media_time_passed + ((core->cd->segment_length*core->cd->window_size-1)) + trim_count;//works
-                t_publish = time(NULL) + (core->cd->segment_length*(core->cd->window_size-1));
-                gmtime_r(&t_publish, &tm_publish);
-                strftime(publish_time,MAX_STREAM_NAME-1,"%Y-%m-%dT%H:%M:%SZ", &tm_publish);
-            }
-        }
+    master_manifest = manifest_open(&manifest_buffer, &manifest_size);
+    if (!master_manifest) {
+        fprintf(stderr,"ERROR: Unable to create master manifest file - please check system configuration: %s\n", master_manifest_filename);
+        return -1;
     }
+
     //http://dashif.org/guidelines/dash-if-simple
 
     fprintf(master_manifest,"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
@@ -1910,150 +4084,42 @@ static int write_dash_master_manifest(fillet_app_struct *core, source_context_st
             tm_avail.tm_year + 1900, tm_avail.tm_mon + 1, tm_avail.tm_mday, tm_avail.tm_hour, tm_avail.tm_min, tm_avail.tm_sec,
             core->cd->window_size * core->cd->segment_length);
     fprintf(master_manifest,"<Period id=\"0\" start=\"PT0S\">\n");
+    // the segment still being chunked out has no cue recorded yet
+    write_dash_events(master_manifest, sdata, sfsn, dash_chunked(core) ? window_size - 1 : window_size, core->cd->rollover_size);
 
 #if !defined(DISABLE_VIDEO) // disable video
-#if defined(ENABLE_TRANSCODE)
-    if (core->transcode_enabled) {
-        fprintf(master_manifest,"<AdaptationSet id=\"0\" contentType=\"video\" segmentAlignment=\"true\" maxWidth=\"%d\" maxHeight=\"%d\" par=\"%d:%d\">\n",
-                max_width, max_height,
-                core->decoded_source_info.decoded_aspect_num, core->decoded_source_info.decoded_aspect_den);
-    } else {
-        fprintf(master_manifest,"<AdaptationSet id=\"0\" contentType=\"video\" segmentAlignment=\"true\" maxWidth=\"%d\" maxHeight=\"%d\" maxFrameRate=\"30000/1001\" par=\"16:9\">\n",
-                max_width, max_height);
-    }
-#else
-    fprintf(master_manifest,"<AdaptationSet id=\"0\" contentType=\"video\" segmentAlignment=\"true\" maxWidth=\"%d\" maxHeight=\"%d\" maxFrameRate=\"30000/1001\" par=\"16:9\">\n",
-            max_width, max_height);
-#endif
-    lsdata = sdata;
-    for (i = 0; i < num_sources; i++) {
-        video_stream_struct *vstream = (video_stream_struct*)core->source_video_stream[i].video_stream;
-        int segment;
-        int video_bitrate;
-        int fps_num;
-        int fps_den;
-
-        fps_num = 30000;
-        fps_den = 1001;
-
-#if defined(ENABLE_TRANSCODE)
-        if (core->transcode_enabled) {
-            video_bitrate = core->cd->transvideo_info[i].video_bitrate * 1000;
-            fps_num = core->decoded_source_info.decoded_fps_num;
-            fps_den = core->decoded_source_info.decoded_fps_den;
-        } else {
-            video_bitrate = vstream->video_bitrate;
-        }
-#else
-        video_bitrate = vstream->video_bitrate;
-#endif
+    fwrite(cache->video_set, 1, cache->video_set_size, master_manifest);
+    for (i = 0; i < num_sources && i < MAX_VIDEO_SOURCES; i++) {
+        lsdata = &sdata[i];
+        fwrite(cache->video_head[i], 1, cache->video_head_size[i], master_manifest);
 
-#if defined(ENABLE_TRANSCODE)
-        if (core->transcode_enabled) {
-            if (core->cd->transvideo_info[i].video_codec == STREAM_TYPE_HEVC) {
-                fprintf(master_manifest,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"hev1.1.2.L93.B0\" width=\"%d\" height=\"%d\" frameRate=\"%d/%d\" bandwidth=\"%d\">\n",
-                        i,
-                        lsdata->width, lsdata->height,
-                        fps_num, fps_den,
-                        video_bitrate);
-            } else {
-                fprintf(master_manifest,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"avc1.%2x%02x%02x\" width=\"%d\" height=\"%d\" frameRate=\"%d/%d\" bandwidth=\"%d\">\n",
-                        i,
-                        lsdata->h264_profile, //hex
-                        lsdata->midbyte,
-                        lsdata->h264_level,
-                        lsdata->width, lsdata->height,
-                        fps_num, fps_den,
-                        video_bitrate);
-            }
-        } else {
-            fprintf(master_manifest,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"avc1.%2x%02x%02x\" width=\"%d\" height=\"%d\" frameRate=\"%d/%d\" bandwidth=\"%d\">\n",
-                    i,
-                    lsdata->h264_profile, //hex
-                    lsdata->midbyte,
-                    lsdata->h264_level,
-                    lsdata->width, lsdata->height,
-                    fps_num, fps_den,
-                    video_bitrate);
-        }
-#else
+        count = dash_video_times(core, lsdata, i, sfsn, window_size, times, durations);
+        write_dash_timeline(master_manifest, times, durations, count);
 
-        if (lsdata->hevc_sps_size > 0 &&
-            lsdata->hevc_pps_size > 0 &&
-            lsdata->hevc_vps_size > 0) {
-            fprintf(master_manifest,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"hev1.1.2.L93.B0\" width=\"%d\" height=\"%d\" frameRate=\"%d/%d\" bandwidth=\"%d\">\n",
-                    i,
-                    lsdata->width, lsdata->height,
-                    fps_num, fps_den,
-                    video_bitrate);
+        fprintf(master_manifest,"</SegmentTimeline>\n");
+        if (byterange_enabled(core)) {
+            snprintf(stream_dir, MAX_STREAM_NAME-1, "video%d", i);
+            write_dash_segment_urls(master_manifest, core, &core->hlsmux->video[i], stream_dir, starting_file_sequence_number);
+            fprintf(master_manifest,"</SegmentList>\n");
         } else {
-            fprintf(master_manifest,"<Representation id=\"%d\" mimeType=\"video/mp4\" codecs=\"avc1.%2x%02x%02x\" width=\"%d\" height=\"%d\" frameRate=\"%d/%d\" bandwidth=\"%d\">\n",
-                    i,
-                    lsdata->h264_profile, //hex
-                    lsdata->midbyte,
-                    lsdata->h264_level,
-                    lsdata->width, lsdata->height,
-                    fps_num, fps_den,
-                    video_bitrate);
-        }
-#endif
-
-        for (segment = 0; segment < core->cd->window_size; segment++) {
-            int64_t next_sequence_number;
-            //int64_t next_next_sequence_number;
-            int64_t sfsn = starting_file_sequence_number - 1;
-            if ((starting_file_sequence_number-1) < 0) {
-                sfsn = core->cd->rollover_size-1;
-            }
-
-            next_sequence_number = (sfsn + segment) % core->cd->rollover_size;
-            if (lsdata->discontinuity[next_sequence_number]) {
-                // add discontinuity to file?
-            }
-            //next_next_sequence_number = (starting_file_sequence_number + segment) % core->cd->rollover_size;
-
-            if (segment == 0 && i == 0) {
-                /*
-                if (lsdata->pto_video < 0) {
-                    lsdata->pto_video++;
-                } else if (lsdata->pto_video == 0) {
-                    lsdata->pto_video = lsdata->full_time_video[next_sequence_number];
-                }*/
-                lsdata->pto_video = 0; // normalizing our time to 0
-
-                if (core->timeset == 0) {
-                    // reset the AST
-                    core->timeset = 1;
-                    fprintf(stderr,"STATUS: Resetting the availability time\n");
-                    core->t_avail = time(NULL);
-                    core->t_avail -= ((core->cd->window_size-1) * core->cd->segment_length);
-                    //t_avail -= ((core->cd->window_size+1) * core->cd->segment_length);
-                    //t_avail -= (core->cd->window_size * core->cd->segment_length);
-                }
-                gmtime_r(&core->t_avail, &tm_avail);
-                strftime(avail_time,MAX_STREAM_NAME-1,"%Y-%m-%dT%H:%M:%SZ", &tm_avail);
-            }
-            lsdata->pto_video = 0; // normalizing our time to 0
-            if (segment == 0) {
-                fprintf(master_manifest,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"video%d/init.mp4\" media=\"video%d/segment$Time$.mp4\">\n",
-                        lsdata->pto_video, VIDEO_CLOCK, i, i);
-                /*fprintf(master_manifest,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"video%ld/init.mp4\" media=\"video%d/segment$Time$.mp4\" startNumber=\"%ld\">\n",
-                  lsdata->pto_video, VIDEO_CLOCK, i, i, starting_media_sequence_number-1);*/
-                fprintf(master_manifest,"<SegmentTimeline>\n");
-            }
-
-            fprintf(master_manifest,"<S t=\"%ld\" d=\"%ld\"/>\n",
-                    lsdata->full_time_video[next_sequence_number],
-                    lsdata->full_duration_video[next_sequence_number]);
-            //lsdata->full_time_video[next_next_sequence_number] - lsdata->full_time_video[next_sequence_number]);
+            fprintf(master_manifest,"</SegmentTemplate>\n");
         }
-
-        fprintf(master_manifest,"</SegmentTimeline>\n");
-        fprintf(master_manifest,"</SegmentTemplate>\n");
         fprintf(master_manifest,"</Representation>\n");
-        lsdata++;
     }
     fprintf(master_manifest,"</AdaptationSet>\n");
+
+    if (cache->trick_set) {
+        fwrite(cache->trick_set, 1, cache->trick_set_size, master_manifest);
+        for (i = 0; i < num_sources && i < MAX_VIDEO_SOURCES; i++) {
+            fwrite(cache->trick_head[i], 1, cache->trick_head_size[i], master_manifest);
+            count = dash_video_times(core, &sdata[i], i, sfsn, window_size, times, durations);
+            write_dash_timeline(master_manifest, times, durations, count);
+            fprintf(master_manifest,"</SegmentTimeline>\n");
+            fprintf(master_manifest,"</SegmentTemplate>\n");
+            fprintf(master_manifest,"</Representation>\n");
+        }
+        fprintf(master_manifest,"</AdaptationSet>\n");
+    }
 #endif      // disable video
 
 #if !defined(DISABLE_AUDIO)     // disable audio
@@ -2061,81 +4127,64 @@ static int write_dash_master_manifest(fillet_app_struct *core, source_context_st
     int j;
     for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
         lsdata = sdata;
-        if (lsdata->start_time_audio[j] != -1) {
-            // FIX FIX FIX FIX FIX
-            audio_stream_struct *astream = (audio_stream_struct*)core->source_audio_stream[0].audio_stream;//[j];
-            int audio_bitrate;
-
-            fprintf(master_manifest,"<AdaptationSet id=\"%d\" contentType=\"audio\" segmentAlignment=\"true\">\n", j+1);
-#if defined(ENABLE_TRANSCODE)
-            if (core->transcode_enabled) {
-                audio_bitrate = core->cd->transaudio_info[j].audio_bitrate * 1000;
-            } else {
-                audio_bitrate = astream->audio_bitrate;
-            }
-#else
-            audio_bitrate = astream->audio_bitrate;
-#endif
-            fprintf(master_manifest,"<Representation id=\"%d\" bandwidth=\"%d\" codecs=\"mp4a.40.2\" mimeType=\"audio/mp4\" audioSamplingRate=\"48000\">\n", i+j, audio_bitrate);
-            fprintf(master_manifest,"<AudioChannelConfiguration schemeIdUri=\"urn:mpeg:dash:23003:3:audio_channel_configuration:2011\" value=\"2\"/>\n");
-
-            int segment;
-            for (segment = 0; segment < core->cd->window_size; segment++) {
-                int64_t next_sequence_number;
-                //int64_t next_next_sequence_number;
-                int64_t sfsn = starting_file_sequence_number - 1;
-                if ((starting_file_sequence_number-1) < 0) {
-                    sfsn = core->cd->rollover_size-1;
-                }
-
-                next_sequence_number = (sfsn + segment) % core->cd->rollover_size;
-                if (lsdata->discontinuity[next_sequence_number]) {
-                    // add discontinuity to file?
-                }
-                //next_next_sequence_number = (starting_file_sequence_number + segment) % core->cd->rollover_size;
-
-                if (segment == 0) {
-                    /*if (lsdata->pto_audio < 0) {
-                      lsdata->pto_audio++;
-                      } else if (lsdata->pto_audio == 0) {
-                      lsdata->pto_audio = lsdata->full_time_audio[next_sequence_number];
-                      }*/
-                    // we're actually normalizing our time to 0...
-                    lsdata->pto_audio = 0;
-                    fprintf(master_manifest,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"audio0_substream%d/init.mp4\" media=\"audio0_substream%d/segment$Time$.mp4\">\n",
-                            lsdata->pto_audio,
-                            AUDIO_CLOCK,
-                            j,
-                            j);
-                    /*fprintf(master_manifest,"<SegmentTemplate presentationTimeOffset=\"%ld\" timescale=\"%d\" initialization=\"audio0_substream%d/init.mp4\" media=\"audio0_substream%d/segment$Time$.mp4\" startNumber=\"%ld\">\n",
-                            lsdata->pto_audio,
-                            AUDIO_CLOCK,
-                            j,
-                            j,
-                            starting_media_sequence_number-1);*/
-                    fprintf(master_manifest,"<SegmentTimeline>\n");
+        if (!cache->signature.audio[j]) {
+            continue;
+        }
+        fwrite(cache->audio_head[j], 1, cache->audio_head_size[j], master_manifest);
+
+        count = 0;
+        for (segment = 0; segment < window_size; segment++) {
+            int64_t next_sequence_number = (sfsn + segment) % core->cd->rollover_size;
+
+            if (dash_chunked(core) && segment == window_size - 1) {
+                stream_struct *live = &core->hlsmux->audio[0][j];
+                if (live->chunk_segment_sequence == stream->media_sequence_number) {
+                    times[count] = live->chunk_segment_time;
+                    durations[count] = core->cd->segment_length * AUDIO_CLOCK;
+                    count++;
                 }
-
-                fprintf(master_manifest,"<S t=\"%ld\" d=\"%ld\"/>\n",
-                        lsdata->full_time_audio[next_sequence_number][j],
-                        lsdata->full_duration_audio[next_sequence_number][j]);
-                //lsdata->full_time_audio[next_next_sequence_number] - lsdata->full_time_audio[next_sequence_number]);
+                continue;
             }
+            times[count] = lsdata->full_time_audio[next_sequence_number][j];
+            durations[count] = lsdata->full_duration_audio[next_sequence_number][j];
+            count++;
+        }
+        write_dash_timeline(master_manifest, times, durations, count);
 
-            fprintf(master_manifest,"</SegmentTimeline>\n");
+        fprintf(master_manifest,"</SegmentTimeline>\n");
+        if (byterange_enabled(core)) {
+            snprintf(stream_dir, MAX_STREAM_NAME-1, "audio0_substream%d", j);
+            write_dash_segment_urls(master_manifest, core, &core->hlsmux->audio[0][j], stream_dir, starting_file_sequence_number);
+            fprintf(master_manifest,"</SegmentList>\n");
+        } else {
             fprintf(master_manifest,"</SegmentTemplate>\n");
-            fprintf(master_manifest,"</Representation>\n");
-            fprintf(master_manifest,"</AdaptationSet>\n");
         }
+        fprintf(master_manifest,"</Representation>\n");
+        fprintf(master_manifest,"</AdaptationSet>\n");
     } // loop end
 #endif // disable audio
 
     fprintf(master_manifest,"</Period>\n");
+    if (dash_chunked(core)) {
+        // low latency players need a clock to work out how far into the live segment they are
+        time_t t_now = time(NULL);
+        struct tm tm_now;
+
+        gmtime_r(&t_now, &tm_now);
+        fprintf(master_manifest,"<UTCTiming schemeIdUri=\"urn:mpeg:dash:utc:direct:2014\" value=\"%d-%02d-%02dT%02d:%02d:%02dZ\"/>\n",
+                tm_now.tm_year + 1900, tm_now.tm_mon + 1, tm_now.tm_mday, tm_now.tm_hour, tm_now.tm_min, tm_now.tm_sec);
+    }
     fprintf(master_manifest,"</MPD>\n");
 
-    fclose(master_manifest);
+    if (!core->hlsmux->dash_master_playlist) {
+        core->hlsmux->dash_master_playlist = playlist_create(0);
+    }
+    if (manifest_close(core, core->hlsmux->dash_master_playlist, master_manifest, &manifest_buffer, &manifest_size, master_manifest_filename) == 0) {
+        // unchanged since the last time it was published
+        return 0;
+    }
 
-    send_signal(core, SIGNAL_MANIFEST_WRITTEN, master_manifest_filename);
+    publish_file(core, SIGNAL_MANIFEST_WRITTEN, master_manifest_filename, 0);
 
     return 0;
 }
@@ -2145,8 +4194,13 @@ static int write_mp4_master_manifest(fillet_app_struct *core, source_context_str
     struct stat sb;
     char master_manifest_filename[MAX_STREAM_NAME];
     FILE *master_manifest;
+    char *manifest_buffer = NULL;
+    size_t manifest_size = 0;
     int i;
     int num_sources = core->num_sources;
+    int muxed_audio = mp4_audio_muxed(core, 0, 0);
+    const char *audio_codec = muxed_audio ? ",mp4a.40.2" : "";
+    const char *audio_group = muxed_audio ? "" : ",AUDIO=\"allaudio\"";
 
 #if defined(ENABLE_TRANSCODE)
     if (core->transcode_enabled) {
@@ -2166,7 +4220,7 @@ static int write_mp4_master_manifest(fillet_app_struct *core, source_context_str
 
     snprintf(master_manifest_filename,MAX_STREAM_NAME-1,"%s/%s",core->cd->manifest_directory,core->cd->manifest_fmp4);
 
-    master_manifest = fopen(master_manifest_filename,"w");
+    master_manifest = manifest_open(&manifest_buffer, &manifest_size);
     if (!master_manifest) {
         fprintf(stderr,"ERROR: Unable to create master manifest file - please check system configuration: %s\n", master_manifest_filename);
         return -1;
@@ -2176,7 +4230,9 @@ static int write_mp4_master_manifest(fillet_app_struct *core, source_context_str
     fprintf(master_manifest,"#EXTM3U\n");
     fprintf(master_manifest,"#EXT-X-VERSION:6\n");
     fprintf(master_manifest,"#EXT-X-INDEPENDENT-SEGMENTS\n");
-    if (strlen(sdata->lang_tag) > 0) {
+    if (muxed_audio) {
+        // the audio is a track of the video segments, the variants list it in their codecs
+    } else if (strlen(sdata->lang_tag) > 0) {
         fprintf(master_manifest,"#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"allaudio\",LANGUAGE=\"%s\",NAME=\"%s\",AUTOSELECT=YES,DEFAULT=YES,URI=\"audio%d_substream0_fmp4.m3u8\"\n",
                 sdata->lang_tag,
                 sdata->lang_tag,
@@ -2199,44 +4255,83 @@ static int write_mp4_master_manifest(fillet_app_struct *core, source_context_str
 #else
         video_bitrate = vstream->video_bitrate;
 #endif
+        if (muxed_audio) {
+            audio_stream_struct *astream = (audio_stream_struct*)core->source_audio_stream[0].audio_stream;
+
+#if defined(ENABLE_TRANSCODE)
+            if (core->transcode_enabled) {
+                video_bitrate += core->cd->transaudio_info[0].audio_bitrate * 1000;
+            } else {
+                video_bitrate += astream->audio_bitrate;
+            }
+#else
+            video_bitrate += astream->audio_bitrate;
+#endif
+        }
 
 #if defined(ENABLE_TRANSCODE)
         if (core->transcode_enabled) {
             if (core->cd->transvideo_info[i].video_codec == STREAM_TYPE_HEVC) {
-                fprintf(master_manifest,"#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"hev1.1.6.L63.90\",RESOLUTION=%dx%d,AUDIO=\"allaudio\"\n",
+                fprintf(master_manifest,"#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"hev1.1.6.L63.90%s\",RESOLUTION=%dx%d%s\n",
                         video_bitrate,
-                        sdata->width, sdata->height);
+                        audio_codec,
+                        sdata->width, sdata->height,
+                        audio_group);
             } else {
-                fprintf(master_manifest,"#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x\",RESOLUTION=%dx%d,AUDIO=\"allaudio\"\n",
+                fprintf(master_manifest,"#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x%s\",RESOLUTION=%dx%d%s\n",
                         video_bitrate,
                         sdata->h264_profile, //hex
                         sdata->midbyte,
                         sdata->h264_level,
-                        sdata->width, sdata->height);
+                        audio_codec,
+                        sdata->width, sdata->height,
+                        audio_group);
             }
         } else {
-            fprintf(master_manifest,"#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x\",RESOLUTION=%dx%d,AUDIO=\"allaudio\"\n",
+            fprintf(master_manifest,"#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x%s\",RESOLUTION=%dx%d%s\n",
                     video_bitrate,
                     sdata->h264_profile, //hex
                     sdata->midbyte,
                     sdata->h264_level,
-                    sdata->width, sdata->height);
+                    audio_codec,
+                    sdata->width, sdata->height,
+                    audio_group);
         }
 #else
-        fprintf(master_manifest,"#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x\",RESOLUTION=%dx%d,AUDIO=\"allaudio\"\n",
+        fprintf(master_manifest,"#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"avc1.%2x%02x%02x%s\",RESOLUTION=%dx%d%s\n",
                 video_bitrate,
                 sdata->h264_profile, //hex
                 sdata->midbyte,
                 sdata->h264_level,
-                sdata->width, sdata->height);
+                audio_codec,
+                sdata->width, sdata->height,
+                audio_group);
 #endif
         fprintf(master_manifest,"video%dfmp4.m3u8\n", i);
+        if (mp4_iframes_enabled(core)) {
+            stream_struct *stream = &core->hlsmux->video[i];
+            char uri[MAX_STREAM_NAME];
+            int hevc = 0;
+
+#if defined(ENABLE_TRANSCODE)
+            hevc = core->transcode_enabled && core->cd->transvideo_info[i].video_codec == STREAM_TYPE_HEVC;
+#endif
+            snprintf(uri, MAX_STREAM_NAME-1, "video%dfmp4_iframes.m3u8", i);
+            write_iframe_stream_inf(master_manifest, sdata, hevc,
+                                    stream->mp4_iframe_bandwidth > 0 ? stream->mp4_iframe_bandwidth : video_bitrate, uri);
+        }
         sdata++;
     }
 
-    fclose(master_manifest);
+    if (!core->hlsmux->fmp4_master_playlist) {
+        core->hlsmux->fmp4_master_playlist = playlist_create(0);
+    }
+    if (manifest_close(core, core->hlsmux->fmp4_master_playlist, master_manifest, &manifest_buffer, &manifest_size, master_manifest_filename) == 0) {
+        // unchanged since the last time it was published
+        return 0;
+    }
 
-    send_signal(core, SIGNAL_MANIFEST_WRITTEN, master_manifest_filename);
+    publish_file(core, SIGNAL_MANIFEST_WRITTEN, master_manifest_filename, 0);
 
     return 0;
 }
@@ -2246,6 +4341,18 @@ static int end_ts_fragment(fillet_app_struct *core, stream_struct *stream, int s
 {
     int cdn_upload = 0;
     char stream_name[MAX_STREAM_NAME];
+    if (byterange_enabled(core)) {
+        ts_container_name(core, stream_name, source, sub_stream, video, stream->ts_container);
+        if (stream->output_ts_file) {
+            mux_ts_finish(core, stream);
+            byterange_record(stream, stream->output_ts_file, stream->ts_ranges, stream->ts_container, &stream->ts_container_offset);
+            segwriter_close(core->hlsmux->writer, stream->output_ts_file);
+            stream->output_ts_file = NULL;
+            stream->fragments_published++;
+        }
+        publish_file(core, SIGNAL_SEGMENT_WRITTEN, stream_name, 0);
+        return 0;
+    }
     if (video) {
         snprintf(stream_name, MAX_STREAM_NAME-1, "%s/video_stream%d_%ld.ts", core->cd->manifest_directory, source, stream->file_sequence_number);
     } else {
@@ -2253,33 +4360,12 @@ static int end_ts_fragment(fillet_app_struct *core, stream_struct *stream, int s
     }
 
     if (stream->output_ts_file) {
-        fclose(stream->output_ts_file);
+        mux_ts_finish(core, stream);
+        segwriter_close(core->hlsmux->writer, stream->output_ts_file);
         stream->output_ts_file = NULL;
         stream->fragments_published++;
     }
-    send_signal(core, SIGNAL_SEGMENT_WRITTEN, stream_name);
-
-    if ((strlen(core->cd->cdn_server) > 0) && (strlen(core->cd->cdn_username) > 0) && (strlen(core->cd->cdn_password) > 0)) {
-        dataqueue_message_struct *msg;
-        //this is also done in the start_ts_fragment
-        //send message to webdav thread for upload
-        //base url is: core->cd->cdn_server        - it doesn't need to match the manifest directory tag since it can be uploaded anywhere and we are keeping the
-        //                                           manifest in the same directory as the transport files right now. this could be changed, to accommodate archival
-        //                                           but for now we'll keep it simple and straightforward to setup
-
-        msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
-        if (msg) {
-            snprintf(msg->smallbuf, MAX_SMALLBUF_SIZE-1, "%s", stream_name); // this is the directory on the local server which is what we want
-            msg->buffer = NULL;
-            msg->buffer_type = WEBDAV_UPLOAD;
-
-            dataqueue_put_front(core->webdav_queue, msg);
-        } else {
-            fprintf(stderr,"SESSION:%d (MAIN) ERROR: unable to obtain message! CHECK CPU RESOURCES!!! UNRECOVERABLE ERROR!!!\n",
-                    core->session_id);
-            exit(0);
-        }
-    }// end checking for cdn availability
+    publish_file(core, SIGNAL_SEGMENT_WRITTEN, stream_name, 1);
 
     return 0;
 }
@@ -2298,6 +4384,8 @@ void *mux_pump_thread(void *context)
     int manifest_written = 0;
     int sub_manifest_ready = 0;
     int64_t splice_duration = 0;
+    int64_t loop_start = 0;
+    int64_t loop_time;
 
     core->t_avail = 0;
     core->timeset = 0;
@@ -2328,7 +4416,11 @@ void *mux_pump_thread(void *context)
         memset(source_data[i].splice_duration, 0, sizeof(source_data[i].splice_duration));
         memset(source_data[i].splice_duration_remaining, 0, sizeof(source_data[i].splice_duration_remaining));
         memset(source_data[i].splice_elapsed_time, 0, sizeof(source_data[i].splice_elapsed_time));
+        memset(source_data[i].splice_start, 0, sizeof(source_data[i].splice_start));
         memset(source_data[i].discontinuity, 0, sizeof(source_data[i].discontinuity));
+        source_data[i].source_splice_start = 0;
+        source_data[i].splice_pending = 0;
+        source_data[i].program_time_base = 0;
         source_data[i].h264_sps_decoded = 0;
         source_data[i].h264_sps_size = 0;
         source_data[i].h264_pps_size = 0;
@@ -2352,9 +4444,8 @@ void *mux_pump_thread(void *context)
     for (i = 0; i < MAX_VIDEO_SOURCES; i++) {
         int j;
 
-        hlsmux->video[i].muxbuffer = (uint8_t*)malloc(MAX_VIDEO_MUX_BUFFER);
-        hlsmux->video[i].pesbuffer = (uint8_t*)malloc(MAX_VIDEO_PES_BUFFER);
-        hlsmux->video[i].packettable = (packet_struct*)malloc(sizeof(packet_struct)*(MAX_VIDEO_MUX_BUFFER/188));
+        hlsmux->video[i].muxbuffer = NULL;
+        hlsmux->video[i].mux_buffer_size = 0;
         hlsmux->video[i].packet_count = 0;
         hlsmux->video[i].output_ts_file = NULL;
         hlsmux->video[i].output_fmp4_file = NULL;
@@ -2374,9 +4465,8 @@ void *mux_pump_thread(void *context)
         }
 
         for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
-            hlsmux->audio[i][j].muxbuffer = (uint8_t*)malloc(MAX_VIDEO_MUX_BUFFER);
-            hlsmux->audio[i][j].pesbuffer = (uint8_t*)malloc(MAX_VIDEO_PES_BUFFER);
-            hlsmux->audio[i][j].packettable = (packet_struct*)malloc(sizeof(packet_struct)*(MAX_VIDEO_MUX_BUFFER/188));
+            hlsmux->audio[i][j].muxbuffer = NULL;
+            hlsmux->audio[i][j].mux_buffer_size = 0;
             hlsmux->audio[i][j].packet_count = 0;
             hlsmux->audio[i][j].output_ts_file = NULL;
             hlsmux->audio[i][j].output_fmp4_file = NULL;
@@ -2386,7 +4476,38 @@ void *mux_pump_thread(void *context)
             hlsmux->audio[i][j].fragments_published = 0;
             hlsmux->audio[i][j].discontinuity_adjustment = 0;
             hlsmux->audio[i][j].last_segment_time = 0;
+            hlsmux->audio[i][j].worker = NULL;
+        }
+        hlsmux->video[i].worker = NULL;
+    }
+
+    // a rendition's video and audio share a worker so a segment boundary only
+    // has to wait for that one queue- youtube output shares one fmp4 between them
+    hlsmux->worker_count = 0;
+    hlsmux->dash_manifest_pending = 0;
+    if (core->cd->mux_workers > 0 && !core->cd->enable_youtube_output) {
+        int worker_count = core->cd->mux_workers;
+
+        if (worker_count > num_sources) {
+            worker_count = num_sources;
+        }
+        for (i = 0; i < worker_count; i++) {
+            hlsmux->workers[i] = muxworker_create(i);
+            if (!hlsmux->workers[i]) {
+                fprintf(stderr,"HLSMUX: ERROR: unable to start mux worker %d, muxing the rest on the mux thread\n", i);
+                break;
+            }
+            hlsmux->worker_count++;
+        }
+        for (i = 0; i < num_sources && hlsmux->worker_count > 0; i++) {
+            int j;
+
+            hlsmux->video[i].worker = hlsmux->workers[i % hlsmux->worker_count];
+            for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
+                hlsmux->audio[i][j].worker = hlsmux->workers[i % hlsmux->worker_count];
+            }
         }
+        syslog(LOG_INFO,"HLSMUX: MUXING %d RENDITIONS ON %d WORKERS\n", num_sources, hlsmux->worker_count);
     }
 
     while (1) {
@@ -2417,6 +4538,28 @@ void *mux_pump_thread(void *context)
         }
 
         frame = (sorted_frame_struct*)msg->buffer;
+        loop_start = mux_now();
+
+        mux_bytes_ingested += frame->buffer_size;
+        mux_frames++;
+        if ((mux_frames % MUX_COPY_REPORT_INTERVAL) == 0 && mux_bytes_ingested > 0) {
+            int64_t fmp4_copied = fmp4_bytes_copied();
+            syslog(LOG_INFO,"HLSMUX: COPY STATS: ingested=%ld ts_copied=%ld fmp4_copied=%ld copied_per_byte=%.2f\n",
+                   mux_bytes_ingested, mux_bytes_copied, fmp4_copied,
+                   (double)(mux_bytes_copied + fmp4_copied) / (double)mux_bytes_ingested);
+            syslog(LOG_INFO,"HLSMUX: MEMORY: ts_buffers=%ld peak=%ld grows=%ld\n",
+                   mux_footprint_bytes, mux_footprint_peak, mux_buffer_grows);
+            syslog(LOG_INFO,"HLSMUX: LOOP LATENCY: p50=%ldus p99=%ldus max=%ldus\n",
+                   latency_histogram_percentile(mux_loop_latency, 50),
+                   latency_histogram_percentile(mux_loop_latency, 99),
+                   mux_loop_max);
+            memset(mux_loop_latency, 0, sizeof(mux_loop_latency));
+            mux_loop_max = 0;
+            segwriter_report(hlsmux->writer);
+            for (i = 0; i < hlsmux->worker_count; i++) {
+                muxworker_report(hlsmux->workers[i]);
+            }
+        }
 
         if (frame->splice_point > 0 && frame->frame_type == FRAME_TYPE_VIDEO) {
             syslog(LOG_INFO,"HLSMUX: SCTE35 SPLICE POINT FOUND: %d\n", frame->splice_point);
@@ -2430,16 +4573,11 @@ void *mux_pump_thread(void *context)
             source_discontinuity = msg->source_discontinuity;
         }
         if (source_discontinuity == 2 || source_discontinuity == 3) {
+            // the cue takes effect on the segment cut at the splice point
             for (i = 0; i < MAX_SOURCE_STREAMS; i++) {
-                int j;
-                source_data[i].source_discontinuity = source_discontinuity;
-                if (source_discontinuity == 2) {
-                    source_data[i].source_splice_elapsed_time = 0;
-                    source_data[i].source_splice_duration_remaining = splice_duration;
-                    source_data[i].source_splice_duration = splice_duration;
-                } else {
-                    // do nothing, let them resolve on their own
-                }
+                source_data[i].splice_pending = source_discontinuity;
+                source_data[i].splice_pending_time = frame->full_time;
+                source_data[i].splice_pending_duration = splice_duration;
             }
         }
         if (source_discontinuity == 1) {
@@ -2448,6 +4586,7 @@ void *mux_pump_thread(void *context)
             int available = 0;
 
             syslog(LOG_INFO,"HLSMUX: SOURCE DISCONTINUITY ENCOUNTERED\n");
+            mux_workers_wait(hlsmux);
             available = hlsmux_load_state(core, &source_data[0]);
 
             for (i = 0; i < MAX_SOURCE_STREAMS; i++) {
@@ -2470,6 +4609,7 @@ void *mux_pump_thread(void *context)
                 source_data[i].hevc_sps_size = 0;
                 source_data[i].hevc_pps_size = 0;
                 source_data[i].hevc_vps_size = 0;
+                source_data[i].splice_pending = 0;
                 if (available) {
                     source_data[i].source_discontinuity = source_discontinuity;
                     source_data[i].source_splice_duration = splice_duration;
@@ -2491,25 +4631,25 @@ void *mux_pump_thread(void *context)
                 if (core->cd->enable_ts_output) {
                     hlsmux->video[i].packet_count = 0;
                     if (hlsmux->video[i].output_ts_file) {
-                        fclose(hlsmux->video[i].output_ts_file);
+                        segwriter_close(hlsmux->writer, hlsmux->video[i].output_ts_file);
                         hlsmux->video[i].output_ts_file = NULL;
                     }
                     for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
                         hlsmux->audio[i][j].packet_count = 0;
                         if (hlsmux->audio[i][j].output_ts_file) {
-                            fclose(hlsmux->audio[i][j].output_ts_file);
+                            segwriter_close(hlsmux->writer, hlsmux->audio[i][j].output_ts_file);
                             hlsmux->audio[i][j].output_ts_file = NULL;
                         }
                     }
                 }
                 if (core->cd->enable_fmp4_output) {
                     if (hlsmux->video[i].output_fmp4_file) {
-                        fclose(hlsmux->video[i].output_fmp4_file);
+                        segwriter_close(hlsmux->writer, hlsmux->video[i].output_fmp4_file);
                         hlsmux->video[i].output_fmp4_file = NULL;
                     }
                     if (i == 0) {
                         if (hlsmux->video[i].output_webvtt_file) {
-                            fclose(hlsmux->video[i].output_webvtt_file);
+                            segwriter_close(hlsmux->writer, hlsmux->video[i].output_webvtt_file);
                             hlsmux->video[i].output_webvtt_file = NULL;
                         }
                     }
@@ -2517,9 +4657,13 @@ void *mux_pump_thread(void *context)
                         fmp4_file_finalize(hlsmux->video[i].fmp4);
                         hlsmux->video[i].fmp4 = NULL;
                     }
+                    if (hlsmux->video[i].fmp4_init) {
+                        fmp4_file_finalize(hlsmux->video[i].fmp4_init);
+                        hlsmux->video[i].fmp4_init = NULL;
+                    }
                     for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
                         if (hlsmux->audio[i][j].output_fmp4_file) {
-                            fclose(hlsmux->audio[i][j].output_fmp4_file);
+                            segwriter_close(hlsmux->writer, hlsmux->audio[i][j].output_fmp4_file);
                             hlsmux->audio[i][j].output_fmp4_file = NULL;
                         }
                         if (hlsmux->audio[i][j].fmp4) {
@@ -2825,11 +4969,14 @@ void *mux_pump_thread(void *context)
 
             if (frame->sync_frame) {
                 double frag_delta;
+                int regular_cut;
+                int splice_cut;
 
                 syslog(LOG_INFO,"HLSMUX(%d): SYNC FRAME FOUND: PTS: %ld DTS:%ld\n",
                        source, frame->pts, frame->dts);
 
                 if (source_data[source].start_time_video == -1) {
+                    mux_source_wait(hlsmux, source);
                     source_data[source].start_time_video = frame->full_time;
 
                     if (core->cd->enable_youtube_output) {
@@ -2964,6 +5111,7 @@ void *mux_pump_thread(void *context)
                             fprintf(stderr,"HLSMUX: UNSUPPORTED MEDIA TYPE\n");
                         }
 
+                        fmp4_set_encryption(hlsmux->video[source].fmp4, stream_fmp4_crypt(core, &hlsmux->video[source]));
                         start_init_mp4_fragment(core, &hlsmux->video[source], source, IS_VIDEO, NO_SUBSTREAM);  // no substream =-1
 
                         fmp4_output_header(hlsmux->video[source].fmp4, IS_VIDEO);
@@ -2983,10 +5131,22 @@ void *mux_pump_thread(void *context)
                             }
                         }
 #endif // DEBUG_MP4
-                        fwrite(hlsmux->video[source].fmp4->buffer, 1, hlsmux->video[source].fmp4->buffer_offset, hlsmux->video[source].output_fmp4_file);
+                        segwriter_write(hlsmux->writer, hlsmux->video[source].output_fmp4_file, hlsmux->video[source].fmp4->buffer, hlsmux->video[source].fmp4->buffer_offset);
                         end_init_mp4_fragment(core, &hlsmux->video[source], source);
 
-                        fmp4_file_finalize(hlsmux->video[source].fmp4);
+                        if (core->cd->enable_muxed_cmaf) {
+                            // written again once the audio joins
+                            if (hlsmux->video[source].fmp4_init) {
+                                fmp4_file_finalize(hlsmux->video[source].fmp4_init);
+                            }
+                            hlsmux->video[source].fmp4_init = hlsmux->video[source].fmp4;
+                            if (source_data[0].start_time_audio[0] != -1 && hlsmux->audio[0][0].mp4_audio_media_type) {
+                                // this rendition started after the audio
+                                mp4_muxed_audio_start(core, num_sources);
+                            }
+                        } else {
+                            fmp4_file_finalize(hlsmux->video[source].fmp4);
+                        }
                         hlsmux->video[source].fmp4 = NULL;
                     }
                 }
@@ -3000,13 +5160,22 @@ void *mux_pump_thread(void *context)
                        source_data[source].expected_video_duration,
                        fragment_length);*/
 
-                if (source_data[source].total_video_duration+frag_delta >= source_data[source].expected_video_duration+fragment_length) {
+                // a cue cuts on the first sync frame at or past its splice point
+                splice_cut = source_data[source].splice_pending && frame->full_time >= source_data[source].splice_pending_time;
+                if (splice_cut && frag_delta <= 0) {
+                    splice_begin(&source_data[source]);
+                    splice_cut = 0;
+                }
+
+                regular_cut = source_data[source].total_video_duration+frag_delta >= source_data[source].expected_video_duration+fragment_length;
+                if (regular_cut || splice_cut) {
                     int64_t sidx_time;
                     int64_t sidx_duration;
                     int64_t segment_time;
                     int64_t duration_time;
                     int j;
 
+                    mux_source_wait(hlsmux, source);
                     sidx_time = 0;
                     sidx_duration = 0;
                     if (core->cd->enable_ts_output) {
@@ -3025,30 +5194,38 @@ void *mux_pump_thread(void *context)
                     duration_time = (int64_t)((double)frag_delta * (double)VIDEO_CLOCK);
                     if (core->cd->enable_fmp4_output) {
                         if (hlsmux->video[source].fmp4) {
-                            fmp4_fragment_end(hlsmux->video[source].fmp4, &sidx_time, &sidx_duration,
-                                              source_data[source].total_video_duration * (double)VIDEO_CLOCK + hlsmux->video[source].discontinuity_adjustment,
-                                              frag_delta * (double)VIDEO_CLOCK,
-                                              hlsmux->video[source].media_sequence_number,
-                                              VIDEO_FRAGMENT);
+                            if (llhls_enabled(core) || dash_chunked(core)) {
+                                // the segment is the run of parts/chunks already written, only the last one is left
+                                write_mp4_part(core, &hlsmux->video[source], &source_data[source], source, NO_SUBSTREAM, IS_VIDEO,
+                                               source_data[source].total_video_duration * (double)VIDEO_CLOCK + hlsmux->video[source].discontinuity_adjustment,
+                                               1);
+                            } else {
+                                fmp4_fragment_end(hlsmux->video[source].fmp4, &sidx_time, &sidx_duration,
+                                                  source_data[source].total_video_duration * (double)VIDEO_CLOCK + hlsmux->video[source].discontinuity_adjustment,
+                                                  frag_delta * (double)VIDEO_CLOCK,
+                                                  hlsmux->video[source].media_sequence_number,
+                                                  VIDEO_FRAGMENT);
 
-                            /*syslog(LOG_INFO,"HLSMUX: ENDING PREVIOUS fMP4 VIDEO FRAGMENT(%d): SIZE:%d TF:%d\n",
-                                   source,
-                                   hlsmux->video[source].fmp4->buffer_offset,
-                                   hlsmux->video[source].fmp4->fragment_count);*/
+                                /*syslog(LOG_INFO,"HLSMUX: ENDING PREVIOUS fMP4 VIDEO FRAGMENT(%d): SIZE:%d TF:%d\n",
+                                       source,
+                                       hlsmux->video[source].fmp4->buffer_offset,
+                                       hlsmux->video[source].fmp4->fragment_count);*/
 
 #if defined(DEBUG_MP4)
-                            if (source == 0) {
-                                if (!debug_video_mp4) {
-                                    debug_video_mp4 = fopen("debugvideo.mp4","w");
-                                }
-                                if (debug_video_mp4) {
-                                    fwrite(hlsmux->video[source].fmp4->buffer, 1, hlsmux->video[source].fmp4->buffer_offset, debug_video_mp4);
-                                    fflush(debug_video_mp4);
+                                if (source == 0) {
+                                    if (!debug_video_mp4) {
+                                        debug_video_mp4 = fopen("debugvideo.mp4","w");
+                                    }
+                                    if (debug_video_mp4) {
+                                        fwrite(hlsmux->video[source].fmp4->buffer, 1, hlsmux->video[source].fmp4->buffer_offset, debug_video_mp4);
+                                        fflush(debug_video_mp4);
+                                    }
                                 }
-                            }
 #endif // DEBUG_MP4
 
-                            fwrite(hlsmux->video[source].fmp4->buffer, 1, hlsmux->video[source].fmp4->buffer_offset, hlsmux->video[source].output_fmp4_file);
+                                segwriter_write(hlsmux->writer, hlsmux->video[source].output_fmp4_file, hlsmux->video[source].fmp4->buffer, hlsmux->video[source].fmp4->buffer_offset);
+                                write_mp4_iframe(core, &hlsmux->video[source], source, segment_time);
+                            }
                             end_mp4_fragment(core, &hlsmux->video[source], source, NO_SUBSTREAM, IS_VIDEO, segment_time);
 
                             if (source == 0 && core->cd->enable_webvtt) { // webvtt
@@ -3056,7 +5233,7 @@ void *mux_pump_thread(void *context)
                                     fprintf(stderr,"WEBVTT CAPTION DATA\n");
                                     fprintf(stderr,"%s", hlsmux->video[0].textbuffer);
                                 }
-                                fprintf(hlsmux->video[source].output_webvtt_file, "%s", hlsmux->video[0].textbuffer);
+                                segwriter_write(hlsmux->writer, hlsmux->video[source].output_webvtt_file, (uint8_t*)hlsmux->video[0].textbuffer, strlen(hlsmux->video[0].textbuffer));
                                 memset(hlsmux->video[source].textbuffer, 0, MAX_TEXT_BUFFER);
                                 snprintf(hlsmux->video[source].textbuffer, MAX_TEXT_BUFFER-1, "WEBVTT\n\n");
                                 end_webvtt_fragment(core, &hlsmux->video[source], source, segment_time);
@@ -3074,6 +5251,13 @@ void *mux_pump_thread(void *context)
                     source_data[source].splice_elapsed_time[hlsmux->video[source].file_sequence_number] = source_data[source].source_splice_elapsed_time;
                     source_data[source].source_splice_elapsed_time += frag_delta;
                     source_data[source].source_splice_duration_remaining -= frag_delta;
+                    if (source_data[source].source_discontinuity == 2) {
+                        source_data[source].source_splice_start = segment_time;
+                    }
+                    source_data[source].splice_start[hlsmux->video[source].file_sequence_number] = source_data[source].source_splice_start;
+                    if (!source_data[source].program_time_base) {
+                        source_data[source].program_time_base = dvr_wallclock() - (segment_time + duration_time) / (VIDEO_CLOCK / 1000);
+                    }
 
                     source_data[source].full_time_video[hlsmux->video[source].file_sequence_number] = segment_time;
                     source_data[source].full_duration_video[hlsmux->video[source].file_sequence_number] = duration_time;
@@ -3084,8 +5268,14 @@ void *mux_pump_thread(void *context)
                             update_ts_video_manifest(core, &hlsmux->video[source], source,
                                                      source_data[source].source_discontinuity,
                                                      &source_data[source]);
+                            update_ts_iframe_manifest(core, &hlsmux->video[source], source, &source_data[source]);
                         }
-                        if (core->cd->enable_fmp4_output) {
+                        if (core->cd->enable_fmp4_output && llhls_enabled(core)) {
+                            update_mp4_llhls_manifest(core, &hlsmux->video[source], &source_data[source], source, NO_SUBSTREAM, IS_VIDEO,
+                                                      (hlsmux->video[source].file_sequence_number + 1) % core->cd->rollover_size,
+                                                      hlsmux->video[source].media_sequence_number + 1,
+                                                      0);
+                        } else if (core->cd->enable_fmp4_output) {
                             update_mp4_video_manifest(core, &hlsmux->video[source], source,
                                                       source_data[source].source_discontinuity,
                                                       &source_data[source]);
@@ -3095,12 +5285,16 @@ void *mux_pump_thread(void *context)
                             }
                             */
                         }
-                        source_data[source].source_discontinuity = 0;
-                        if (source_data[source].source_splice_duration_remaining <= 0) {
-                            source_data[source].source_splice_duration = 0;
+                        if (core->cd->enable_fmp4_output) {
+                            update_mp4_iframe_manifest(core, &hlsmux->video[source], source, &source_data[source]);
                         }
                         sub_manifest_ready = 1;
                     }
+                    // recorded against this segment, so it must not carry into the next one while the window fills
+                    source_data[source].source_discontinuity = 0;
+                    if (source_data[source].source_splice_duration_remaining <= 0) {
+                        source_data[source].source_splice_duration = 0;
+                    }
 
                     hlsmux->video[source].file_sequence_number = (hlsmux->video[source].file_sequence_number + 1) % core->cd->rollover_size;
                     hlsmux->video[source].media_sequence_number = (hlsmux->video[source].media_sequence_number + 1);
@@ -3117,7 +5311,13 @@ void *mux_pump_thread(void *context)
                            hlsmux->video[source].fragments_published);
 
                     source_data[source].total_video_duration += frag_delta;
-                    source_data[source].expected_video_duration += fragment_length;
+                    if (regular_cut) {
+                        // a splice cut on its own sits between the regular boundaries
+                        source_data[source].expected_video_duration += fragment_length;
+                    }
+                    if (splice_cut) {
+                        splice_begin(&source_data[source]);
+                    }
 
                     for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
                         source_data[source].video_fragment_ready[j] = 1;
@@ -3173,10 +5373,18 @@ void *mux_pump_thread(void *context)
                             if (frame->media_type == MEDIA_TYPE_H264) {
                                 int video_bitrate;
 
-                                hlsmux->video[source].fmp4 = fmp4_file_create(MEDIA_TYPE_H264,
-                                                                              VIDEO_CLOCK, // timescale for H264 video
-                                                                              0x157c, // english language code
-                                                                              fragment_length);  // fragment length in seconds
+                                if (core->cd->enable_muxed_cmaf) {
+                                    // the audio type is taken from the init when the track joins
+                                    hlsmux->video[source].fmp4 = fmp4_file_create_muxed(MEDIA_TYPE_H264, MEDIA_TYPE_AAC,
+                                                                                        VIDEO_CLOCK,
+                                                                                        0x157c,
+                                                                                        fragment_length);
+                                } else {
+                                    hlsmux->video[source].fmp4 = fmp4_file_create(MEDIA_TYPE_H264,
+                                                                                  VIDEO_CLOCK, // timescale for H264 video
+                                                                                  0x157c, // english language code
+                                                                                  fragment_length);  // fragment length in seconds
+                                }
 
 #if defined(ENABLE_TRANSCODE)
                                 if (core->transcode_enabled) {
@@ -3195,10 +5403,18 @@ void *mux_pump_thread(void *context)
                             } else if (frame->media_type == MEDIA_TYPE_HEVC) {
                                 int video_bitrate;
 
-                                hlsmux->video[source].fmp4 = fmp4_file_create(MEDIA_TYPE_HEVC,
-                                                                              VIDEO_CLOCK, // timescale for HEVC video
-                                                                              0x157c, // english language code
-                                                                              fragment_length);  // fragment length in seconds
+                                if (core->cd->enable_muxed_cmaf) {
+                                    // the audio type is taken from the init when the track joins
+                                    hlsmux->video[source].fmp4 = fmp4_file_create_muxed(MEDIA_TYPE_HEVC, MEDIA_TYPE_AAC,
+                                                                                        VIDEO_CLOCK,
+                                                                                        0x157c,
+                                                                                        fragment_length);
+                                } else {
+                                    hlsmux->video[source].fmp4 = fmp4_file_create(MEDIA_TYPE_HEVC,
+                                                                                  VIDEO_CLOCK, // timescale for HEVC video
+                                                                                  0x157c, // english language code
+                                                                                  fragment_length);  // fragment length in seconds
+                                }
 
 #if defined(ENABLE_TRANSCODE)
                                 if (core->transcode_enabled) {
@@ -3218,7 +5434,9 @@ void *mux_pump_thread(void *context)
                             } else {
                                 fprintf(stderr,"HLSMUX: UNSUPPORTED MEDIA TYPE\n");
                             }
+                            mp4_muxed_audio_join(&hlsmux->video[source]);
                         }
+                        fmp4_set_encryption(hlsmux->video[source].fmp4, stream_fmp4_crypt(core, &hlsmux->video[source]));
                     }
                 }
             }
@@ -3251,98 +5469,39 @@ void *mux_pump_thread(void *context)
                                             frame->buffer_size,
                                             fragment_timestamp,
                                             fragment_duration,
-                                            fragment_composition_time);
+                                            fragment_composition_time,
+                                            core->compressed_video_pool);
                 }
             }
-            if (core->cd->enable_fmp4_output) {
-                if (hlsmux->video[source].output_fmp4_file != NULL) {
-                    if (hlsmux->video[source].fmp4) {
-                        double fragment_timestamp;
-                        int fragment_duration;
-                        int64_t fragment_composition_time;
-
-                        if (frame->dts > 0) {
-                            //placeholder: check for overflow issue when one goes back to zero
-                            fragment_composition_time = frame->pts - frame->dts;
-                            fragment_timestamp = frame->dts;
-                        } else {
-                            fragment_composition_time = 0;
-                            fragment_timestamp = frame->pts;
-                        }
-
-                        fragment_duration = frame->duration;
-
-                        /*syslog(LOG_INFO,"HLSMUX: ADDING VIDEO FRAGMENT(%d):%d OFFSET:%d  DURATION:%ld CTS:%ld\n",
-                               source,
-                               hlsmux->video[source].fmp4->fragment_count,
-                               hlsmux->video[source].fmp4->buffer_offset,
-                               fragment_duration,
-                               fragment_composition_time);*/
-
-                        fmp4_video_fragment_add(hlsmux->video[source].fmp4,
-                                                frame->buffer,
-                                                frame->buffer_size,
-                                                fragment_timestamp,
-                                                fragment_duration,
-                                                fragment_composition_time);
-                    }
+            {
+                mux_job_struct job;
+
+                job.core = core;
+                job.stream = &hlsmux->video[source];
+                job.sdata = &source_data[source];
+                job.frame = *frame;
+                job.source = source;
+                job.sub_stream = NO_SUBSTREAM;
+                job.outputs = 0;
+                job.silence = 0;
+                job.segment_start = source_data[source].total_video_duration * (double)VIDEO_CLOCK + hlsmux->video[source].discontinuity_adjustment;
+                if (frame->dts > 0) {
+                    //placeholder: check for overflow issue when one goes back to zero
+                    job.composition_time = frame->pts - frame->dts;
+                    job.fragment_timestamp = frame->dts;
+                } else {
+                    job.composition_time = 0;
+                    job.fragment_timestamp = frame->pts;
                 }
-            }
-            if (core->cd->enable_ts_output) {
-                if (hlsmux->video[source].output_ts_file != NULL) {
-                    int s;
-                    uint8_t pat[188];
-                    uint8_t pmt[188];
-                    int64_t pc;
-
-                    muxpatsample(core, &hlsmux->video[source], &pat[0]);
-                    fwrite(pat, 1, 188, hlsmux->video[source].output_ts_file);
-                    muxpmtsample(core, &hlsmux->video[source], &pmt[0], VIDEO_PID, CODEC_H264);
-                    fwrite(pmt, 1, 188, hlsmux->video[source].output_ts_file);
-
-                    pc = muxvideosample(core, &hlsmux->video[source], frame);
-
-                    hlsmux->video[source].packet_count += pc;
-                    for (s = 0; s < pc; s++) {
-                        uint8_t *muxbuffer;
-                        muxbuffer = hlsmux->video[source].muxbuffer;
-                        if (s == 0 && (muxbuffer[5] == 0x10 || muxbuffer[5] == 0x50)) {
-                            int64_t base;
-                            int64_t ext;
-                            int64_t full;
-                            int64_t total_pc = hlsmux->video[source].packet_count;
-                            int64_t offset_count;
-                            int64_t timestamp;
-                            int64_t timestamp_offset;
-
-                            if (frame->dts > 0) {
-                                timestamp = frame->dts;
-                            } else {
-                                timestamp = frame->pts;
-                            }
-                            timestamp_offset = timestamp - VIDEO_OFFSET;
-                            if (timestamp_offset < 0) {
-                                timestamp_offset += 8589934592;
-                            }
-
-                            offset_count = (int64_t)(((double)(timestamp_offset)*(double)300.0*(double)20.0/(double)216) - (double)10)/(double)188;
-                            total_pc = offset_count;
-
-                            full = (int64_t)((int64_t)total_pc * (int64_t)40608) / (int64_t)20;
-                            full = full % (8589934592 * 300);
-                            base = full / 300;
-                            ext = full % 300;
+                job.fragment_duration = frame->duration;
 
-                            muxbuffer[6] = (0xff & (base >> 25));
-                            muxbuffer[7] = (0xff & (base >> 17));
-                            muxbuffer[8] = (0xff & (base >> 9));
-                            muxbuffer[9] = (0xff & (base >> 1));
-                            muxbuffer[10] = ((0x01 & base) << 7) | 0x7e | ((0x100 & ext) >> 8);
-                            muxbuffer[11] = (0xff & ext);
-                        }
-                        fwrite(&muxbuffer[s*188], 1, 188, hlsmux->video[source].output_ts_file);
-                    }
+                if (core->cd->enable_fmp4_output && hlsmux->video[source].output_fmp4_file != NULL && hlsmux->video[source].fmp4) {
+                    job.outputs |= MUX_OUTPUT_FMP4;
                 }
+                if (core->cd->enable_ts_output && hlsmux->video[source].output_ts_file != NULL) {
+                    job.outputs |= MUX_OUTPUT_TS;
+                }
+                mux_dispatch(&job, IS_VIDEO);
             }
         } else if (frame->frame_type == FRAME_TYPE_AUDIO) {
             double frag_delta;
@@ -3361,6 +5520,7 @@ void *mux_pump_thread(void *context)
             if (source_data[source].start_time_audio[sub_stream] == -1) {
                 int64_t start_delta;
 
+                mux_source_wait(hlsmux, source);
                 if (source_data[source].start_time_video == -1) {
                     fprintf(stderr,"HLSMUX: VIDEO START TIME NOT SET YET\n");
                     goto skip_sample;
@@ -3432,49 +5592,55 @@ void *mux_pump_thread(void *context)
                         astream->audio_samplerate = 48000;  // todo-fixme
                     }
 
-                    fprintf(stderr,"HLSMUX: CREATING FMP4 AUDIO: SOURCE:%d SUB_STREAM:%d AUDIOCH:%d FRAG_LENGTH:%ld\n",
-                            source,
-                            sub_stream,
-                            astream->audio_channels,
-                            fragment_length);
+                    if (mp4_audio_muxed(core, source, sub_stream)) {
+                        hlsmux->audio[source][sub_stream].mp4_audio_media_type = frame->media_type;
+                        mp4_muxed_audio_start(core, num_sources);
+                    } else {
+                        fprintf(stderr,"HLSMUX: CREATING FMP4 AUDIO: SOURCE:%d SUB_STREAM:%d AUDIOCH:%d FRAG_LENGTH:%ld\n",
+                                source,
+                                sub_stream,
+                                astream->audio_channels,
+                                fragment_length);
 
-                    hlsmux->audio[source][sub_stream].fmp4 = fmp4_file_create(frame->media_type,
-                                                                              AUDIO_CLOCK, //astream->audio_samplerate, // timescale for AAC audio (48kHz)
-                                                                              0x15c7,                    // english language code
-                                                                              fragment_length);          // fragment length in seconds
+                        hlsmux->audio[source][sub_stream].fmp4 = fmp4_file_create(frame->media_type,
+                                                                                  AUDIO_CLOCK, //astream->audio_samplerate, // timescale for AAC audio (48kHz)
+                                                                                  0x15c7,                    // english language code
+                                                                                  fragment_length);          // fragment length in seconds
 
-                    // todo-ac3 version of this is not finished
-                    fmp4_audio_track_create(hlsmux->audio[source][sub_stream].fmp4,
-                                            astream->audio_channels,
-                                            astream->audio_samplerate,
-                                            astream->audio_object_type,
-                                            astream->audio_bitrate);
+                        // todo-ac3 version of this is not finished
+                        fmp4_audio_track_create(hlsmux->audio[source][sub_stream].fmp4,
+                                                astream->audio_channels,
+                                                astream->audio_samplerate,
+                                                astream->audio_object_type,
+                                                astream->audio_bitrate);
 
-                    start_init_mp4_fragment(core, &hlsmux->audio[source][sub_stream], source, IS_AUDIO, sub_stream);
+                        fmp4_set_encryption(hlsmux->audio[source][sub_stream].fmp4, stream_fmp4_crypt(core, &hlsmux->audio[source][sub_stream]));
+                        start_init_mp4_fragment(core, &hlsmux->audio[source][sub_stream], source, IS_AUDIO, sub_stream);
 
-                    fmp4_output_header(hlsmux->audio[source][sub_stream].fmp4, IS_AUDIO);
+                        fmp4_output_header(hlsmux->audio[source][sub_stream].fmp4, IS_AUDIO);
 
-                    syslog(LOG_INFO,"HLSMUX: WRITING OUT AUDIO INIT FILE - FMP4(%d): %ld\n",
-                           source,
-                           hlsmux->audio[source][sub_stream].fmp4->buffer_offset);
+                        syslog(LOG_INFO,"HLSMUX: WRITING OUT AUDIO INIT FILE - FMP4(%d): %ld\n",
+                               source,
+                               hlsmux->audio[source][sub_stream].fmp4->buffer_offset);
 
 #if defined(DEBUG_MP4)
-                    if (source == 0 && sub_stream == 0) {
-                        if (!debug_audio_mp4) {
-                            debug_audio_mp4 = fopen("debugaudio.mp4","w");
-                        }
-                        if (debug_audio_mp4) {
-                            fwrite(hlsmux->audio[source][sub_stream].fmp4->buffer, 1, hlsmux->audio[source][sub_stream].fmp4->buffer_offset, debug_audio_mp4);
-                            fflush(debug_audio_mp4);
+                        if (source == 0 && sub_stream == 0) {
+                            if (!debug_audio_mp4) {
+                                debug_audio_mp4 = fopen("debugaudio.mp4","w");
+                            }
+                            if (debug_audio_mp4) {
+                                fwrite(hlsmux->audio[source][sub_stream].fmp4->buffer, 1, hlsmux->audio[source][sub_stream].fmp4->buffer_offset, debug_audio_mp4);
+                                fflush(debug_audio_mp4);
+                            }
                         }
-                    }
 #endif // DEBUG_MP4
 
-                    fwrite(hlsmux->audio[source][sub_stream].fmp4->buffer, 1, hlsmux->audio[source][sub_stream].fmp4->buffer_offset, hlsmux->audio[source][sub_stream].output_fmp4_file);
-                    end_init_mp4_fragment(core, &hlsmux->audio[source][sub_stream], source);
+                        segwriter_write(hlsmux->writer, hlsmux->audio[source][sub_stream].output_fmp4_file, hlsmux->audio[source][sub_stream].fmp4->buffer, hlsmux->audio[source][sub_stream].fmp4->buffer_offset);
+                        end_init_mp4_fragment(core, &hlsmux->audio[source][sub_stream], source);
 
-                    fmp4_file_finalize(hlsmux->audio[source][sub_stream].fmp4);
-                    hlsmux->audio[source][sub_stream].fmp4 = NULL;
+                        fmp4_file_finalize(hlsmux->audio[source][sub_stream].fmp4);
+                        hlsmux->audio[source][sub_stream].fmp4 = NULL;
+                    }
 
                     start_delta = (int64_t)source_data[source].start_time_video - (int64_t)source_data[source].start_time_audio[sub_stream];
                     fragment_duration = frame->duration * astream->audio_samplerate / AUDIO_CLOCK;
@@ -3514,7 +5680,8 @@ void *mux_pump_thread(void *context)
                 int64_t segment_time;
                 int64_t duration_time;
 
-                if (core->cd->enable_ts_output) {
+                mux_source_wait(hlsmux, source);
+                if (core->cd->enable_ts_output && !ts_audio_muxed(core, source, sub_stream)) {
                     end_ts_fragment(core, &hlsmux->audio[source][sub_stream], source, sub_stream, IS_AUDIO);
                 } else {
                     hlsmux->audio[source][sub_stream].fragments_published++;
@@ -3525,29 +5692,35 @@ void *mux_pump_thread(void *context)
                 duration_time = (int64_t)((double)frag_delta * (double)AUDIO_CLOCK);
                 if (core->cd->enable_fmp4_output) {
                     if (hlsmux->audio[source][sub_stream].fmp4) {
-                        fmp4_fragment_end(hlsmux->audio[source][sub_stream].fmp4, &sidx_time, &sidx_duration,
-                                          source_data[source].total_audio_duration[sub_stream] * (double)AUDIO_CLOCK + hlsmux->video[source].discontinuity_adjustment,
-                                          frag_delta * (double)AUDIO_CLOCK,
-                                          hlsmux->audio[source][sub_stream].media_sequence_number,
-                                          AUDIO_FRAGMENT);
+                        if (llhls_enabled(core) || dash_chunked(core)) {
+                            write_mp4_part(core, &hlsmux->audio[source][sub_stream], &source_data[source], source, sub_stream, IS_AUDIO,
+                                           source_data[source].total_audio_duration[sub_stream] * (double)AUDIO_CLOCK + hlsmux->video[source].discontinuity_adjustment,
+                                           1);
+                        } else {
+                            fmp4_fragment_end(hlsmux->audio[source][sub_stream].fmp4, &sidx_time, &sidx_duration,
+                                              source_data[source].total_audio_duration[sub_stream] * (double)AUDIO_CLOCK + hlsmux->video[source].discontinuity_adjustment,
+                                              frag_delta * (double)AUDIO_CLOCK,
+                                              hlsmux->audio[source][sub_stream].media_sequence_number,
+                                              AUDIO_FRAGMENT);
 
-                        syslog(LOG_INFO,"HLSMUX: ENDING PREVIOUS fMP4 AUDIO FRAGMENT(%d): SIZE:%ld\n",
-                               source,
-                               hlsmux->audio[source][sub_stream].fmp4->buffer_offset);
+                            syslog(LOG_INFO,"HLSMUX: ENDING PREVIOUS fMP4 AUDIO FRAGMENT(%d): SIZE:%ld\n",
+                                   source,
+                                   hlsmux->audio[source][sub_stream].fmp4->buffer_offset);
 
 #if defined(DEBUG_MP4)
-                        if (source == 0 && sub_stream == 0) {
-                            if (!debug_audio_mp4) {
-                                debug_audio_mp4 = fopen("debugaudio.mp4","w");
-                            }
-                            if (debug_audio_mp4) {
-                                fwrite(hlsmux->audio[source][sub_stream].fmp4->buffer, 1, hlsmux->audio[source][sub_stream].fmp4->buffer_offset, debug_audio_mp4);
-                                fflush(debug_audio_mp4);
+                            if (source == 0 && sub_stream == 0) {
+                                if (!debug_audio_mp4) {
+                                    debug_audio_mp4 = fopen("debugaudio.mp4","w");
+                                }
+                                if (debug_audio_mp4) {
+                                    fwrite(hlsmux->audio[source][sub_stream].fmp4->buffer, 1, hlsmux->audio[source][sub_stream].fmp4->buffer_offset, debug_audio_mp4);
+                                    fflush(debug_audio_mp4);
+                                }
                             }
-                        }
 #endif // DEBUG_MP4
 
-                        fwrite(hlsmux->audio[source][sub_stream].fmp4->buffer, 1, hlsmux->audio[source][sub_stream].fmp4->buffer_offset, hlsmux->audio[source][sub_stream].output_fmp4_file);
+                            segwriter_write(hlsmux->writer, hlsmux->audio[source][sub_stream].output_fmp4_file, hlsmux->audio[source][sub_stream].fmp4->buffer, hlsmux->audio[source][sub_stream].fmp4->buffer_offset);
+                        }
                         end_mp4_fragment(core, &hlsmux->audio[source][sub_stream], source, sub_stream, IS_AUDIO, segment_time);
                     }
                 }
@@ -3566,19 +5739,29 @@ void *mux_pump_thread(void *context)
 
                 if (hlsmux->audio[source][sub_stream].fragments_published > core->cd->window_size) {
                     fprintf(stderr,"\n\n\n\n\nHLSMUX: UPDATING AUDIO MANIFEST: SOURCE:%d SUB_STREAM:%d\n\n\n\n", source, sub_stream);
-                    update_ts_audio_manifest(core, &hlsmux->audio[source][sub_stream], source, sub_stream,
-                                             source_data[source].source_discontinuity,
-                                             &source_data[source]);
+                    if (!ts_audio_muxed(core, source, sub_stream)) {
+                        update_ts_audio_manifest(core, &hlsmux->audio[source][sub_stream], source, sub_stream,
+                                                 source_data[source].source_discontinuity,
+                                                 &source_data[source]);
+                    }
                     if (core->cd->enable_fmp4_output) {
-                        update_mp4_audio_manifest(core, &hlsmux->audio[source][sub_stream], source,
-                                                  sub_stream, source_data[source].source_discontinuity,
-                                                  &source_data[source]);
-                        if (source == 0 && hlsmux->video[source].fragments_published > (core->cd->window_size+2)) { // was+1?
+                        if (mp4_audio_muxed(core, source, sub_stream)) {
+                            // listed through the video playlists
+                        } else if (llhls_enabled(core)) {
+                            update_mp4_llhls_manifest(core, &hlsmux->audio[source][sub_stream], &source_data[source], source, sub_stream, IS_AUDIO,
+                                                      (hlsmux->audio[source][sub_stream].file_sequence_number + 1) % core->cd->rollover_size,
+                                                      hlsmux->audio[source][sub_stream].media_sequence_number + 1,
+                                                      0);
+                        } else {
+                            update_mp4_audio_manifest(core, &hlsmux->audio[source][sub_stream], source,
+                                                      sub_stream, source_data[source].source_discontinuity,
+                                                      &source_data[source]);
+                        }
+                        if (source == 0 && hlsmux->video[source].fragments_published > (core->cd->window_size+2) && !dash_chunked(core)) { // was+1?
                             write_dash_master_manifest(core, &source_data[0]);
                         }
                     }
-                    source_data[source].source_discontinuity = 0;
-                    //source_data[source].source_splice_duration = 0;
+                    // the video cut owns the cue flags, a splice may already be flagged for the next video segment
                     sub_manifest_ready = 1;
                 }
 
@@ -3602,10 +5785,10 @@ void *mux_pump_thread(void *context)
                 source_data[source].total_audio_duration[sub_stream] += frag_delta;
                 source_data[source].expected_audio_duration[sub_stream] += fragment_length;
 
-                if (core->cd->enable_ts_output) {
+                if (core->cd->enable_ts_output && !ts_audio_muxed(core, source, sub_stream)) {
                     start_ts_fragment(core, &hlsmux->audio[source][sub_stream], source, sub_stream, IS_AUDIO);  // start first audio fragment
                 }
-                if (core->cd->enable_fmp4_output) {
+                if (core->cd->enable_fmp4_output && !mp4_audio_muxed(core, source, sub_stream)) {
                     // FIX FIX FIX FIX FIX FIX
                     audio_stream_struct *astream = (audio_stream_struct*)core->source_audio_stream[source].audio_stream; //[sub_stream];
 
@@ -3636,6 +5819,7 @@ void *mux_pump_thread(void *context)
                                                 audio_bitrate);
 
                     }
+                    fmp4_set_encryption(hlsmux->audio[source][sub_stream].fmp4, stream_fmp4_crypt(core, &hlsmux->audio[source][sub_stream]));
                 }
             }
 
@@ -3652,124 +5836,91 @@ void *mux_pump_thread(void *context)
                                         frame->buffer,
                                         frame->buffer_size,
                                         fragment_timestamp,
-                                        fragment_duration);
+                                        fragment_duration,
+                                        core->compressed_audio_pool);
             }
             */
 
-            if (core->cd->enable_fmp4_output) {
-                if (hlsmux->audio[source][sub_stream].output_fmp4_file != NULL) {
-                    if (hlsmux->audio[source][sub_stream].fmp4) {
-                        // FIX FIX FIX FIX FIX
-                        audio_stream_struct *astream = (audio_stream_struct*)core->source_audio_stream[source].audio_stream;//[sub_stream];
-                        double fragment_timestamp = frame->pts;
-                        int fragment_duration = frame->duration * astream->audio_samplerate / (double)AUDIO_CLOCK;
-
-                        if (astream->audio_object_type == 5) { // sbr
-                            fragment_duration = fragment_duration << 1;
-                        }
+            {
+                mux_job_struct job;
+
+                job.core = core;
+                job.stream = &hlsmux->audio[source][sub_stream];
+                job.sdata = &source_data[source];
+                job.frame = *frame;
+                job.source = source;
+                job.sub_stream = sub_stream;
+                job.outputs = 0;
+                job.silence = 0;
+                job.segment_start = source_data[source].total_audio_duration[sub_stream] * (double)AUDIO_CLOCK + hlsmux->video[source].discontinuity_adjustment;
+                job.fragment_timestamp = frame->pts;
+                job.fragment_duration = 0;
+                job.composition_time = 0;
+
+                if (core->cd->enable_fmp4_output &&
+                    (mp4_audio_muxed(core, source, sub_stream) ||
+                     (hlsmux->audio[source][sub_stream].output_fmp4_file != NULL && hlsmux->audio[source][sub_stream].fmp4))) {
+                    // FIX FIX FIX FIX FIX
+                    audio_stream_struct *astream = (audio_stream_struct*)core->source_audio_stream[source].audio_stream;//[sub_stream];
+
+                    if (!mp4_audio_muxed(core, source, sub_stream)) {
+                        job.outputs |= MUX_OUTPUT_FMP4;
+                    }
+                    job.fragment_duration = frame->duration * astream->audio_samplerate / (double)AUDIO_CLOCK;
+                    if (astream->audio_object_type == 5) { // sbr
+                        job.fragment_duration = job.fragment_duration << 1;
+                    }
 
-                        /*syslog(LOG_INFO,"HLSMUX: ADDING AUDIO FRAGMENT(%d): %d  BUFFER:%p  OFFSET:%d   DURATION:%d\n",
-                               source,
-                               hlsmux->audio[source][sub_stream].fmp4->fragment_count,
-                               hlsmux->audio[source][sub_stream].fmp4->buffer,
-                               hlsmux->audio[source][sub_stream].fmp4->buffer_offset,
-                               fragment_duration);*/
-
-                        if (frame->media_type == MEDIA_TYPE_AAC) {
-                            if (astream->audio_samples_to_add > 0) {
-                                astream->audio_samples_to_add--;
-
-                                if (astream->audio_channels == 2) {
-                                    fmp4_audio_fragment_add(hlsmux->audio[source][sub_stream].fmp4,
-                                                            aac_quiet_2,
-                                                            sizeof(aac_quiet_2),
-                                                            fragment_timestamp,
-                                                            fragment_duration);
-                                } else if (astream->audio_channels == 6) {
-                                    fmp4_audio_fragment_add(hlsmux->audio[source][sub_stream].fmp4,
-                                                            aac_quiet_6,
-                                                            sizeof(aac_quiet_6),
-                                                            fragment_timestamp,
-                                                            fragment_duration);
-                                }
-                            }
-                        } else {
-                            //placeholder for adding ac3 audio silence samples 2/6 channel
+                    if (frame->media_type == MEDIA_TYPE_AAC) {
+                        if (astream->audio_samples_to_add > 0) {
+                            astream->audio_samples_to_add--;
+                            job.silence = astream->audio_channels;
                         }
-
-                        /*fprintf(stderr,"\n\nMP4 AUDIO FRAGMENT ADD (SOURCE=%d SUBSTREAM=%d): SIZE:%d TIMESTAMP:%f DURATION:%d\n\n",
-                                source,
-                                sub_stream,
-                                frame->buffer_size,
-                                fragment_timestamp,
-                                fragment_duration);
-                        */
-                        fmp4_audio_fragment_add(hlsmux->audio[source][sub_stream].fmp4,
-                                                frame->buffer,
-                                                frame->buffer_size,
-                                                fragment_timestamp,
-                                                fragment_duration);
+                    } else {
+                        //placeholder for adding ac3 audio silence samples 2/6 channel
                     }
                 }
-            }
+                if (core->cd->enable_ts_output && hlsmux->audio[source][sub_stream].output_ts_file != NULL) {
+                    job.outputs |= MUX_OUTPUT_TS;
+                }
+                mux_dispatch(&job, IS_AUDIO);
 
-            if (core->cd->enable_ts_output) {
-                if (hlsmux->audio[source][sub_stream].output_ts_file != NULL) {
-                    int s;
-                    uint8_t pat[188];
-                    uint8_t pmt[188];
-                    int64_t pc;
+                if (ts_audio_muxed(core, source, sub_stream) || mp4_audio_muxed(core, source, sub_stream)) {
+                    int n;
 
-                    muxpatsample(core, &hlsmux->audio[source][sub_stream], &pat[0]);
-                    fwrite(pat, 1, 188, hlsmux->audio[source][sub_stream].output_ts_file);
-                    if (frame->media_type == MEDIA_TYPE_AAC) {
-                        muxpmtsample(core, &hlsmux->audio[source][sub_stream], &pmt[0], AUDIO_BASE_PID, CODEC_AAC);
-                    } else if (frame->media_type == MEDIA_TYPE_AC3) {
-                        muxpmtsample(core, &hlsmux->audio[source][sub_stream], &pmt[0], AUDIO_BASE_PID, CODEC_AC3);
+                    // the audio track keeps the decode time of its own timeline, the video segment only knows the video's
+                    job.fragment_timestamp = job.segment_start + (double)(frame->full_time - source_data[source].start_time_audio[sub_stream]);
+                    if (mp4_audio_muxed(core, source, sub_stream)) {
+                        // both tracks of a muxed fragment share the video timescale
+                        job.fragment_duration = frame->duration;
                     }
-                    fwrite(pmt, 1, 188, hlsmux->audio[source][sub_stream].output_ts_file);
-
-                    pc = muxaudiosample(core, &hlsmux->audio[source][sub_stream], frame, 0);
-
-                    hlsmux->audio[source][sub_stream].packet_count += pc;
-                    for (s = 0; s < pc; s++) {
-                        uint8_t *muxbuffer;
-                        muxbuffer = hlsmux->audio[source][sub_stream].muxbuffer;
-                        if (s == 0 && (muxbuffer[5] == 0x10 || muxbuffer[5] == 0x50)) {
-                            int64_t base;
-                            int64_t ext;
-                            int64_t full;
-                            int64_t total_pc = hlsmux->audio[source][sub_stream].packet_count;
-                            int64_t offset_count;
-                            int64_t timestamp;
-                            int64_t timestamp_offset;
-
-                            timestamp = frame->pts;
-                            timestamp_offset = timestamp - AUDIO_OFFSET;
-                            if (timestamp_offset < 0) {
-                                timestamp_offset += 8589934592;
-                            }
-                            offset_count = (int64_t)(((double)(timestamp_offset)*(double)300.0*(double)20.0/(double)216) - (double)10)/(double)188;
-                            total_pc = offset_count;
-
-                            full = (int64_t)((int64_t)total_pc * (int64_t)40608) / (int64_t)20;
-                            full = full % (8589934592 * 300);
-                            base = full / 300;
-                            ext = full % 300;
-
-                            muxbuffer[6] = (0xff & (base >> 25));
-                            muxbuffer[7] = (0xff & (base >> 17));
-                            muxbuffer[8] = (0xff & (base >> 9));
-                            muxbuffer[9] = (0xff & (base >> 1));
-                            muxbuffer[10] = ((0x01 & base) << 7) | 0x7e | ((0x100 & ext) >> 8);
-                            muxbuffer[11] = (0xff & ext);
+
+                    // every video rendition carries its own copy, queued behind that rendition's samples
+                    for (n = 0; n < num_sources; n++) {
+                        job.stream = &hlsmux->video[n];
+                        job.outputs = 0;
+                        if (ts_audio_muxed(core, source, sub_stream) && hlsmux->video[n].output_ts_file != NULL) {
+                            job.outputs |= MUX_OUTPUT_TS_MUXED;
                         }
-                        fwrite(&muxbuffer[s*188], 1, 188, hlsmux->audio[source][sub_stream].output_ts_file);
+                        if (mp4_audio_muxed(core, source, sub_stream) && hlsmux->video[n].output_fmp4_file != NULL && hlsmux->video[n].fmp4) {
+                            job.outputs |= MUX_OUTPUT_FMP4_MUXED;
+                        }
+                        mux_dispatch(&job, IS_AUDIO);
                     }
                 }
             }
         }
 skip_sample:
+        if (hlsmux->dash_manifest_pending) {
+            mux_workers_wait(hlsmux);
+            __sync_lock_release(&hlsmux->dash_manifest_pending);
+            write_dash_master_manifest(core, &source_data[0]);
+        }
+        loop_time = mux_now() - loop_start;
+        latency_histogram_add(mux_loop_latency, loop_time);
+        if (loop_time > mux_loop_max) {
+            mux_loop_max = loop_time;
+        }
         if (frame->frame_type == FRAME_TYPE_VIDEO) {
             memory_return(core->compressed_video_pool, frame->buffer);
         } else {
@@ -3783,6 +5934,21 @@ skip_sample:
     }
 
 cleanup_mux_pump_thread:
+    // the workers finish what they were handed before the files are closed
+    for (i = 0; i < hlsmux->worker_count; i++) {
+        muxworker_destroy(hlsmux->workers[i]);
+        hlsmux->workers[i] = NULL;
+    }
+    hlsmux->worker_count = 0;
+    for (i = 0; i < MAX_VIDEO_SOURCES; i++) {
+        int j;
+
+        hlsmux->video[i].worker = NULL;
+        for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
+            hlsmux->audio[i][j].worker = NULL;
+        }
+    }
+
     // free all buffers in the queue
     msg = dataqueue_take_back(hlsmux->input_queue);
     while (msg) {
@@ -3807,29 +5973,33 @@ cleanup_mux_pump_thread:
         if (core->cd->enable_ts_output) {
             hlsmux->video[i].packet_count = 0;
             if (hlsmux->video[i].output_ts_file) {
-                fclose(hlsmux->video[i].output_ts_file);
+                segwriter_close(hlsmux->writer, hlsmux->video[i].output_ts_file);
                 hlsmux->video[i].output_ts_file = NULL;
             }
             for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
                 hlsmux->audio[i][j].packet_count = 0;
                 if (hlsmux->audio[i][j].output_ts_file) {
-                    fclose(hlsmux->audio[i][j].output_ts_file);
+                    segwriter_close(hlsmux->writer, hlsmux->audio[i][j].output_ts_file);
                     hlsmux->audio[i][j].output_ts_file = NULL;
                 }
             }
         }
         if (core->cd->enable_fmp4_output) {
             if (hlsmux->video[i].output_fmp4_file) {
-                fclose(hlsmux->video[i].output_fmp4_file);
+                segwriter_close(hlsmux->writer, hlsmux->video[i].output_fmp4_file);
                 hlsmux->video[i].output_fmp4_file = NULL;
             }
             if (hlsmux->video[i].fmp4) {
                 fmp4_file_finalize(hlsmux->video[i].fmp4);
                 hlsmux->video[i].fmp4 = NULL;
             }
+            if (hlsmux->video[i].fmp4_init) {
+                fmp4_file_finalize(hlsmux->video[i].fmp4_init);
+                hlsmux->video[i].fmp4_init = NULL;
+            }
             for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
                 if (hlsmux->audio[i][j].output_fmp4_file) {
-                    fclose(hlsmux->audio[i][j].output_fmp4_file);
+                    segwriter_close(hlsmux->writer, hlsmux->audio[i][j].output_fmp4_file);
                     hlsmux->audio[i][j].output_fmp4_file = NULL;
                 }
                 if (hlsmux->audio[i][j].fmp4) {
@@ -3843,26 +6013,41 @@ cleanup_mux_pump_thread:
     for (i = 0; i < MAX_VIDEO_SOURCES; i++) {
         int j;
 
-        free(hlsmux->video[i].pesbuffer);
-        hlsmux->video[i].pesbuffer = NULL;
-        free(hlsmux->video[i].muxbuffer);
-        hlsmux->video[i].muxbuffer = NULL;
-        free(hlsmux->video[i].packettable);
-        hlsmux->video[i].packettable = NULL;
+        mux_stream_release(&hlsmux->video[i]);
+        dvr_release(&hlsmux->video[i].ts_dvr);
+        dvr_release(&hlsmux->video[i].fmp4_dvr);
+        playlist_destroy(hlsmux->video[i].ts_playlist);
+        playlist_destroy(hlsmux->video[i].fmp4_playlist);
+        playlist_destroy(hlsmux->video[i].ts_iframe_playlist);
+        playlist_destroy(hlsmux->video[i].mp4_iframe_playlist);
+        hlsmux->video[i].ts_playlist = NULL;
+        hlsmux->video[i].fmp4_playlist = NULL;
+        hlsmux->video[i].ts_iframe_playlist = NULL;
+        hlsmux->video[i].mp4_iframe_playlist = NULL;
         if (i == 0) {
             free(hlsmux->video[i].textbuffer);
             hlsmux->video[i].textbuffer = NULL;
         }
 
         for (j = 0; j < MAX_AUDIO_STREAMS; j++) {
-            free(hlsmux->audio[i][j].pesbuffer);
-            hlsmux->audio[i][j].pesbuffer = NULL;
-            free(hlsmux->audio[i][j].muxbuffer);
-            hlsmux->audio[i][j].muxbuffer = NULL;
-            free(hlsmux->audio[i][j].packettable);
-            hlsmux->audio[i][j].packettable = NULL;
+            mux_stream_release(&hlsmux->audio[i][j]);
+            dvr_release(&hlsmux->audio[i][j].ts_dvr);
+            dvr_release(&hlsmux->audio[i][j].fmp4_dvr);
+            playlist_destroy(hlsmux->audio[i][j].ts_playlist);
+            playlist_destroy(hlsmux->audio[i][j].fmp4_playlist);
+            hlsmux->audio[i][j].ts_playlist = NULL;
+            hlsmux->audio[i][j].fmp4_playlist = NULL;
         }
     }
+    playlist_destroy(hlsmux->ts_master_playlist);
+    playlist_destroy(hlsmux->fmp4_master_playlist);
+    playlist_destroy(hlsmux->dash_master_playlist);
+    dash_cache_release((dash_cache_struct*)hlsmux->dash_cache);
+    free(hlsmux->dash_cache);
+    hlsmux->dash_cache = NULL;
+    hlsmux->ts_master_playlist = NULL;
+    hlsmux->fmp4_master_playlist = NULL;
+    hlsmux->dash_master_playlist = NULL;
 
     quit_mux_pump_thread = 0;
 
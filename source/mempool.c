@@ -28,6 +28,12 @@
 #include <stdint.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 #include "mempool.h"
 
@@ -35,9 +41,50 @@ typedef struct _memory_struct
 {
     int                        disponible;
     int                        owner;
+    volatile int               refcount;
     uint8_t                    *memory;
 } memory_struct;
 
+// variable size pools (size==0) are backed by a slab allocator with power of two
+// size classes- each class carves fixed size chunks out of large mmap'd arenas and
+// keeps them on a free list so steady state takes/returns never touch malloc
+#define SLAB_MIN_SHIFT       8                          // 256 bytes
+#define SLAB_MAX_SHIFT       23                         // 8MB
+#define SLAB_CLASSES         (SLAB_MAX_SHIFT-SLAB_MIN_SHIFT+1)
+#define SLAB_CLASS_LARGE     SLAB_CLASSES               // too big for any class, plain malloc
+#define SLAB_ARENA_SIZE      (2*1024*1024)
+#define SLAB_MAGIC_USED      0x534c4142
+#define SLAB_MAGIC_FREE      0x46524545
+
+typedef struct _slab_header_struct
+{
+    uint32_t                   magic;
+    uint32_t                   size_class;
+    uint32_t                   idx;
+    uint32_t                   reserved;
+} slab_header_struct;
+
+typedef struct _slab_arena_struct
+{
+    uint8_t                    *base;
+    size_t                     size;
+    struct _slab_arena_struct  *next;
+} slab_arena_struct;
+
+typedef struct _slab_class_struct
+{
+    size_t                     chunk_size;
+    uint8_t                    *free_list;
+    slab_arena_struct          *arenas;
+    int                        arena_count;
+    int64_t                    arena_bytes;
+    int                        in_use;
+    int                        peak;
+    int                        free_chunks;
+    int64_t                    takes;
+    int64_t                    requested_bytes;
+} slab_class_struct;
+
 typedef struct _memory_pool_struct
 {
     int                        count;
@@ -46,9 +93,395 @@ typedef struct _memory_pool_struct
     pthread_mutex_t            *reflock;
     memory_struct              *refs;
     uint8_t                    *data;
+    slab_class_struct          slab[SLAB_CLASSES+1];
+    int                        magazines_enabled;
+    volatile int               magazine_cached;
+    int                        magazine_limit;
+    volatile int               in_use;
+    int64_t                    lock_acquired;
+    int64_t                    lock_contended;
+    int64_t                    lock_wait_ns;
 } memory_pool_struct;
 
+// per-thread magazines let the hot message pools take/return without touching
+// the shared reflock- they refill from and spill back to the pool in batches
+#define MAGAZINE_SIZE        32
+#define MAX_THREAD_MAGAZINES 8
+
+typedef struct _memory_magazine_struct
+{
+    void                       *pool;
+    int                        count;
+    uint8_t                    *buffers[MAGAZINE_SIZE];
+} memory_magazine_struct;
+
+static __thread memory_magazine_struct thread_magazines[MAX_THREAD_MAGAZINES];
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_key_once = PTHREAD_ONCE_INIT;
+
 #define MEMORY_RESERVED      4
+#define SLAB_RESERVED        sizeof(slab_header_struct)
+
+// large blocks (slab arenas, fixed pool data, mux and mp4 buffers) come from
+// the arena layer- optionally hugetlb backed, bound to a numa node and prefaulted
+#define ARENA_MIN_SIZE       (2*1024*1024)
+#define ARENA_HUGEPAGE_SIZE  (2*1024*1024)
+#define ARENA_CACHE_SIZE     32
+#define ARENA_MPOL_BIND      2
+#define ARENA_MPOL_F_ADDR    2
+
+typedef struct _arena_cache_struct
+{
+    uint8_t                    *base;
+    size_t                     size;
+    int                        node;
+} arena_cache_struct;
+
+typedef struct _arena_stats_struct
+{
+    int64_t                    mapped_bytes;
+    int64_t                    hugetlb_bytes;
+    int64_t                    thp_bytes;
+    int64_t                    prefault_bytes;
+    int64_t                    hugetlb_failures;
+    int64_t                    bind_failures;
+    int64_t                    cache_hits;
+    int64_t                    allocations;
+} arena_stats_struct;
+
+static int arena_hugepages = 0;
+static int arena_numa_node = -1;
+static int arena_numa_enabled = 0;
+static int arena_prefault = 0;
+static int arena_tlb_fd = -1;
+static arena_cache_struct arena_cache[ARENA_CACHE_SIZE];
+static arena_stats_struct arena_stats;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int arena_current_node(void)
+{
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+
+    if (!arena_numa_enabled) {
+        return -1;
+    }
+    if (arena_numa_node >= 0) {
+        return arena_numa_node;
+    }
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) {
+        return -1;
+    }
+    return (int)node;
+}
+
+// the node a block was bound to when it was mapped- the freeing thread may run elsewhere
+static int arena_block_node(void *base)
+{
+    unsigned long nodemask = 0;
+    int mode = 0;
+    int node;
+
+    if (!arena_numa_enabled) {
+        return -1;
+    }
+    if (syscall(SYS_get_mempolicy, &mode, &nodemask, sizeof(nodemask)*8, base, ARENA_MPOL_F_ADDR) < 0 ||
+        mode != ARENA_MPOL_BIND || !nodemask) {
+        return -1;
+    }
+    for (node = 0; !(nodemask & (1UL << node)); node++);
+    return node;
+}
+
+static size_t arena_round_size(size_t size)
+{
+    if (arena_hugepages) {
+        return (size + ARENA_HUGEPAGE_SIZE - 1) & ~((size_t)ARENA_HUGEPAGE_SIZE - 1);
+    }
+    return size;
+}
+
+int memory_arena_config(int hugepages, int numa_node, int numa_enabled)
+{
+    struct perf_event_attr attr;
+
+    arena_hugepages = !!hugepages;
+    arena_numa_node = numa_node;
+    arena_numa_enabled = !!numa_enabled;
+    arena_prefault = arena_hugepages || arena_numa_enabled;
+
+    if (arena_prefault && arena_tlb_fd < 0) {
+        // count data tlb misses for the whole process, if the kernel lets us
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        arena_tlb_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (arena_tlb_fd < 0) {
+            fprintf(stderr,"STATUS: dTLB miss counter is not available on this system\n");
+        }
+    }
+
+    fprintf(stderr,"STATUS: Memory arenas configured: hugepages=%d numa=%d node=%d prefault=%d\n",
+            arena_hugepages, arena_numa_enabled, arena_numa_node, arena_prefault);
+    return 0;
+}
+
+// blocks always come back zeroed, the same as a fresh anonymous mapping,
+// whether they were just mapped or reused from the arena cache
+void *memory_arena_alloc(size_t size)
+{
+    uint8_t *base = NULL;
+    int node;
+    int i;
+
+    size = arena_round_size(size);
+    node = arena_current_node();
+
+    pthread_mutex_lock(&arena_lock);
+    arena_stats.allocations++;
+    for (i = 0; i < ARENA_CACHE_SIZE; i++) {
+        if (arena_cache[i].base && arena_cache[i].size == size && arena_cache[i].node == node) {
+            base = arena_cache[i].base;
+            arena_cache[i].base = NULL;
+            arena_stats.cache_hits++;
+            pthread_mutex_unlock(&arena_lock);
+            memset(base, 0, size);
+            return base;
+        }
+    }
+    pthread_mutex_unlock(&arena_lock);
+
+#if defined(MAP_HUGETLB)
+    if (arena_hugepages) {
+        base = (uint8_t*)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED) {
+            base = NULL;
+            __sync_fetch_and_add(&arena_stats.hugetlb_failures, 1);
+        } else {
+            __sync_fetch_and_add(&arena_stats.hugetlb_bytes, size);
+        }
+    }
+#endif
+    if (!base) {
+        base = (uint8_t*)mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+#if defined(MADV_HUGEPAGE)
+        // no hugetlb pages left- ask for transparent huge pages instead
+        if (arena_hugepages && madvise(base, size, MADV_HUGEPAGE) == 0) {
+            __sync_fetch_and_add(&arena_stats.thp_bytes, size);
+        }
+#endif
+    }
+
+    if (node >= 0) {
+        unsigned long nodemask = 1UL << node;
+        if (syscall(SYS_mbind, base, size, ARENA_MPOL_BIND, &nodemask, sizeof(nodemask)*8, 0) < 0) {
+            __sync_fetch_and_add(&arena_stats.bind_failures, 1);
+        }
+    }
+
+    if (arena_prefault) {
+        // touch every page now so the first frames don't take the page faults
+        memset(base, 0, size);
+        __sync_fetch_and_add(&arena_stats.prefault_bytes, size);
+    }
+    __sync_fetch_and_add(&arena_stats.mapped_bytes, size);
+
+    return base;
+}
+
+int memory_arena_free(void *memory, size_t size)
+{
+    int node;
+    int i;
+
+    if (!memory) {
+        return -1;
+    }
+    size = arena_round_size(size);
+    node = arena_block_node(memory);
+
+    pthread_mutex_lock(&arena_lock);
+    for (i = 0; i < ARENA_CACHE_SIZE; i++) {
+        if (!arena_cache[i].base) {
+            arena_cache[i].base = (uint8_t*)memory;
+            arena_cache[i].size = size;
+            arena_cache[i].node = node;
+            pthread_mutex_unlock(&arena_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&arena_lock);
+
+    munmap(memory, size);
+    __sync_fetch_and_sub(&arena_stats.mapped_bytes, size);
+    return 0;
+}
+
+static int64_t arena_read_kb(const char *filename, const char *field)
+{
+    char line[256];
+    int64_t value = -1;
+    size_t field_length = strlen(field);
+    FILE *stats_file;
+
+    stats_file = fopen(filename, "r");
+    if (!stats_file) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), stats_file)) {
+        if (strncmp(line, field, field_length) == 0) {
+            value = strtoll(line + field_length, NULL, 10);
+            break;
+        }
+    }
+    fclose(stats_file);
+    return value;
+}
+
+int memory_arena_report(void)
+{
+    int64_t tlb_misses = -1;
+    int64_t anon_huge_kb;
+    int64_t hugepages_free;
+
+    if (arena_tlb_fd >= 0) {
+        if (read(arena_tlb_fd, &tlb_misses, sizeof(tlb_misses)) != sizeof(tlb_misses)) {
+            tlb_misses = -1;
+        }
+    }
+    anon_huge_kb = arena_read_kb("/proc/self/smaps_rollup", "AnonHugePages:");
+    hugepages_free = arena_read_kb("/proc/meminfo", "HugePages_Free:");
+
+    syslog(LOG_INFO,"MEMARENA: mapped=%ld hugetlb=%ld thp=%ld prefault=%ld hugetlbfail=%ld bindfail=%ld allocs=%ld cachehits=%ld anonhugekb=%ld hugepagesfree=%ld dtlbmisses=%ld\n",
+           arena_stats.mapped_bytes, arena_stats.hugetlb_bytes, arena_stats.thp_bytes, arena_stats.prefault_bytes,
+           arena_stats.hugetlb_failures, arena_stats.bind_failures, arena_stats.allocations, arena_stats.cache_hits,
+           anon_huge_kb, hugepages_free, tlb_misses);
+    fprintf(stderr,"MEMARENA: mapped=%ld hugetlb=%ld thp=%ld prefault=%ld hugetlbfail=%ld bindfail=%ld allocs=%ld cachehits=%ld anonhugekb=%ld hugepagesfree=%ld dtlbmisses=%ld\n",
+            arena_stats.mapped_bytes, arena_stats.hugetlb_bytes, arena_stats.thp_bytes, arena_stats.prefault_bytes,
+            arena_stats.hugetlb_failures, arena_stats.bind_failures, arena_stats.allocations, arena_stats.cache_hits,
+            anon_huge_kb, hugepages_free, tlb_misses);
+    return 0;
+}
+
+static int slab_class_for_size(int size)
+{
+    size_t needed = (size_t)size + SLAB_RESERVED;
+    int size_class;
+
+    for (size_class = 0; size_class < SLAB_CLASSES; size_class++) {
+        if (needed <= ((size_t)1 << (size_class + SLAB_MIN_SHIFT))) {
+            return size_class;
+        }
+    }
+    return SLAB_CLASS_LARGE;
+}
+
+static int slab_grow(slab_class_struct *slab)
+{
+    slab_arena_struct *arena;
+    size_t arena_size;
+    uint8_t *chunk;
+    int chunks;
+    int i;
+
+    arena_size = SLAB_ARENA_SIZE;
+    if (slab->chunk_size * 2 > arena_size) {
+        arena_size = slab->chunk_size * 2;
+    }
+    chunks = arena_size / slab->chunk_size;
+
+    arena = (slab_arena_struct*)malloc(sizeof(slab_arena_struct));
+    if (!arena) {
+        return -1;
+    }
+    arena->base = (uint8_t*)memory_arena_alloc(arena_size);
+    if (!arena->base) {
+        free(arena);
+        return -1;
+    }
+    arena->size = arena_size;
+    arena->next = slab->arenas;
+    slab->arenas = arena;
+    slab->arena_count++;
+    slab->arena_bytes += arena_size;
+
+    chunk = arena->base;
+    for (i = 0; i < chunks; i++) {
+        slab_header_struct *header = (slab_header_struct*)chunk;
+        header->magic = SLAB_MAGIC_FREE;
+        *(uint8_t**)(chunk + SLAB_RESERVED) = slab->free_list;
+        slab->free_list = chunk;
+        chunk += slab->chunk_size;
+    }
+    slab->free_chunks += chunks;
+
+    return 0;
+}
+
+static uint8_t *slab_take(memory_pool_struct *memory_pool, int size, int idx)
+{
+    slab_header_struct *header;
+    slab_class_struct *slab;
+    uint8_t *chunk;
+    int size_class;
+
+    size_class = slab_class_for_size(size);
+    slab = &memory_pool->slab[size_class];
+    if (size_class == SLAB_CLASS_LARGE) {
+        chunk = (uint8_t*)malloc(size + SLAB_RESERVED);
+        if (!chunk) {
+            return NULL;
+        }
+    } else {
+        if (!slab->free_list) {
+            if (slab_grow(slab) < 0) {
+                return NULL;
+            }
+        }
+        chunk = slab->free_list;
+        slab->free_list = *(uint8_t**)(chunk + SLAB_RESERVED);
+        slab->free_chunks--;
+    }
+
+    header = (slab_header_struct*)chunk;
+    header->magic = SLAB_MAGIC_USED;
+    header->size_class = size_class;
+    header->idx = idx;
+
+    slab->in_use++;
+    if (slab->in_use > slab->peak) {
+        slab->peak = slab->in_use;
+    }
+    slab->takes++;
+    slab->requested_bytes += size;
+
+    return chunk + SLAB_RESERVED;
+}
+
+static void slab_return(memory_pool_struct *memory_pool, uint8_t *chunk)
+{
+    slab_header_struct *header = (slab_header_struct*)chunk;
+    slab_class_struct *slab = &memory_pool->slab[header->size_class];
+
+    header->magic = SLAB_MAGIC_FREE;
+    slab->in_use--;
+    if (header->size_class == SLAB_CLASS_LARGE) {
+        free(chunk);
+        return;
+    }
+    *(uint8_t**)(chunk + SLAB_RESERVED) = slab->free_list;
+    slab->free_list = chunk;
+    slab->free_chunks++;
+}
 
 int memory_reset(void *pool)
 {
@@ -61,6 +494,7 @@ int memory_reset(void *pool)
         int i;
 
         memory_pool->pos = 0;
+        memory_pool->in_use = 0;
         magicptr8 = memory_pool->data;
 
         memset(magicptr8, 0, count * (size+MEMORY_RESERVED));
@@ -73,6 +507,7 @@ int memory_reset(void *pool)
                 magicptr8 += (size+MEMORY_RESERVED);
             }
             memory_pool->refs[i].disponible = 1;
+            memory_pool->refs[i].refcount = 0;
         }
         return 0;
     }
@@ -111,7 +546,11 @@ void *memory_create(int count, int size)
         return NULL;
     }
     if (size > 0) {
-        memory_pool->data = (uint8_t*)malloc(chunk_size);
+        if (chunk_size >= ARENA_MIN_SIZE) {
+            memory_pool->data = (uint8_t*)memory_arena_alloc(chunk_size);
+        } else {
+            memory_pool->data = (uint8_t*)malloc(chunk_size);
+        }
         if (!memory_pool->data) {
             free(memory_pool->refs);
             free(memory_pool->reflock);
@@ -125,6 +564,10 @@ void *memory_create(int count, int size)
 
     pthread_mutex_init(memory_pool->reflock, NULL);
 
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        memory_pool->slab[i].chunk_size = (size_t)1 << (i + SLAB_MIN_SHIFT);
+    }
+
     magicptr8 = memory_pool->data;
     for (i = 0; i < count; i++) {
         if (size > 0) {
@@ -150,19 +593,41 @@ int memory_destroy(void *pool)
         return -1;
     }
 
-    free(memory_pool->data);
+    if (memory_pool->data) {
+        size_t chunk_size = (size_t)memory_pool->count * (memory_pool->size+MEMORY_RESERVED);
+        if (chunk_size >= ARENA_MIN_SIZE) {
+            memory_arena_free(memory_pool->data, chunk_size);
+        } else {
+            free(memory_pool->data);
+        }
+    }
     pthread_mutex_destroy(memory_pool->reflock);
     free(memory_pool->reflock);
     memory_pool->reflock = NULL;
 
     for (i = 0; i < memory_pool->count; i++)
     {
-        if (memory_pool->size > 0) {
-            free(memory_pool->refs[i].memory);
+        if (memory_pool->size == 0 && memory_pool->refs[i].memory &&
+            memory_pool->slab[SLAB_CLASS_LARGE].in_use > 0) {
+            slab_header_struct *header = (slab_header_struct*)memory_pool->refs[i].memory;
+            if (header->size_class == SLAB_CLASS_LARGE) {
+                free(memory_pool->refs[i].memory);
+            }
         }
         memory_pool->refs[i].memory = NULL;
     }
 
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        slab_arena_struct *arena = memory_pool->slab[i].arenas;
+        while (arena) {
+            slab_arena_struct *next = arena->next;
+            memory_arena_free(arena->base, arena->size);
+            free(arena);
+            arena = next;
+        }
+        memory_pool->slab[i].arenas = NULL;
+    }
+
     free(memory_pool->refs);
     free(memory_pool);
     memory_pool = NULL;
@@ -170,19 +635,37 @@ int memory_destroy(void *pool)
     return 0;
 }
 
-void *memory_take(void *pool, int owner)
+static uint32_t memory_index(memory_pool_struct *memory_pool, uint8_t *memory)
+{
+    if (memory_pool->size > 0) {
+        return *(uint32_t*)(memory - MEMORY_RESERVED);
+    }
+    return ((slab_header_struct*)(memory - SLAB_RESERVED))->idx;
+}
+
+static void memory_lock(memory_pool_struct *memory_pool)
+{
+    if (pthread_mutex_trylock(memory_pool->reflock) != 0) {
+        struct timespec wait_start;
+        struct timespec wait_end;
+
+        clock_gettime(CLOCK_MONOTONIC, &wait_start);
+        pthread_mutex_lock(memory_pool->reflock);
+        clock_gettime(CLOCK_MONOTONIC, &wait_end);
+        memory_pool->lock_wait_ns += (int64_t)(wait_end.tv_sec - wait_start.tv_sec) * 1000000000 +
+            (wait_end.tv_nsec - wait_start.tv_nsec);
+        memory_pool->lock_contended++;
+    }
+    memory_pool->lock_acquired++;
+}
+
+static uint8_t *memory_take_locked(memory_pool_struct *memory_pool, int owner)
 {
     uint8_t *taken = NULL;
     int pos;
-    int count = 0;
+    int count;
     int i;
-    memory_pool_struct *memory_pool = (memory_pool_struct *)pool;
-
-    if (!memory_pool) {
-        return NULL;
-    }
 
-    pthread_mutex_lock(memory_pool->reflock);
     count = memory_pool->count;
     for (i = 0; i < count; i++) {
         pos = memory_pool->pos;
@@ -190,28 +673,200 @@ void *memory_take(void *pool, int owner)
             memory_pool->refs[pos].disponible = 0;
             memory_pool->pos = (memory_pool->pos + 1) % count;
             memory_pool->refs[pos].owner = owner;
+            memory_pool->refs[pos].refcount = 1;
 
             if (memory_pool->size > 0) {
                 taken = memory_pool->refs[pos].memory + MEMORY_RESERVED;
             } else {
-                taken = (uint8_t*)malloc(owner);
-                memory_pool->refs[pos].memory = taken;
+                taken = slab_take(memory_pool, owner, pos);
+                if (!taken) {
+                    memory_pool->refs[pos].disponible = 1;
+                    return NULL;
+                }
+                memory_pool->refs[pos].memory = taken - SLAB_RESERVED;
             }
-            pthread_mutex_unlock(memory_pool->reflock);
-
+            memory_pool->in_use++;
             return taken;
         }
         memory_pool->pos = (memory_pool->pos + 1) % count;
     }
-    pthread_mutex_unlock(memory_pool->reflock);
     return NULL;
 }
 
-int memory_return(void *pool, void *memory)
+static int memory_return_locked(memory_pool_struct *memory_pool, uint8_t *memory)
 {
     uint8_t *returned;
-    uint32_t *magicptr32;
     uint32_t idx;
+
+    if (memory_pool->size > 0) {
+        returned = memory - MEMORY_RESERVED;
+        idx = *(uint32_t*)returned;
+
+        if (idx > memory_pool->count) {
+            return -1;
+        }
+        if (memory_pool->refs[idx].disponible != 0) {
+            return -1;
+        }
+        memory_pool->refs[idx].disponible = 1;
+    } else {
+        slab_header_struct *header;
+
+        returned = memory - SLAB_RESERVED;
+        header = (slab_header_struct*)returned;
+        idx = header->idx;
+        if (header->magic != SLAB_MAGIC_USED || idx >= memory_pool->count ||
+            memory_pool->refs[idx].memory != returned) {
+            fprintf(stderr,"FATAL ERROR: returning invalid buffer to pool!\n");
+            exit(0);
+        }
+        slab_return(memory_pool, returned);
+        memory_pool->refs[idx].memory = NULL;
+        memory_pool->refs[idx].disponible = 1;
+    }
+    memory_pool->in_use--;
+    return 0;
+}
+
+static void memory_magazine_flush(void *arg)
+{
+    memory_magazine_struct *magazines = (memory_magazine_struct*)arg;
+    int i;
+    int j;
+
+    for (i = 0; i < MAX_THREAD_MAGAZINES; i++) {
+        memory_pool_struct *memory_pool = (memory_pool_struct*)magazines[i].pool;
+        if (!memory_pool) {
+            continue;
+        }
+        memory_lock(memory_pool);
+        for (j = 0; j < magazines[i].count; j++) {
+            memory_return_locked(memory_pool, magazines[i].buffers[j]);
+        }
+        pthread_mutex_unlock(memory_pool->reflock);
+        __sync_fetch_and_sub(&memory_pool->magazine_cached, magazines[i].count);
+        magazines[i].count = 0;
+        magazines[i].pool = NULL;
+    }
+}
+
+static void memory_magazine_key_create(void)
+{
+    pthread_key_create(&magazine_key, memory_magazine_flush);
+}
+
+static memory_magazine_struct *memory_magazine_find(memory_pool_struct *memory_pool)
+{
+    int i;
+
+    for (i = 0; i < MAX_THREAD_MAGAZINES; i++) {
+        if (thread_magazines[i].pool == memory_pool) {
+            return &thread_magazines[i];
+        }
+    }
+    for (i = 0; i < MAX_THREAD_MAGAZINES; i++) {
+        if (!thread_magazines[i].pool) {
+            // first use of a magazine on this thread- make sure it gets flushed on thread exit
+            pthread_once(&magazine_key_once, memory_magazine_key_create);
+            pthread_setspecific(magazine_key, thread_magazines);
+            thread_magazines[i].pool = memory_pool;
+            thread_magazines[i].count = 0;
+            return &thread_magazines[i];
+        }
+    }
+    return NULL;
+}
+
+int memory_enable_magazines(void *pool)
+{
+    memory_pool_struct *memory_pool = (memory_pool_struct *)pool;
+
+    if (!memory_pool) {
+        return -1;
+    }
+    // a producer on one thread and a consumer on another would otherwise park
+    // a full magazine each- keep most of the pool where every thread can get it
+    memory_pool->magazine_limit = memory_pool->count / 4;
+    memory_pool->magazines_enabled = 1;
+    return 0;
+}
+
+void *memory_take(void *pool, int owner)
+{
+    uint8_t *taken = NULL;
+    memory_magazine_struct *magazine = NULL;
+    memory_pool_struct *memory_pool = (memory_pool_struct *)pool;
+
+    if (!memory_pool) {
+        return NULL;
+    }
+
+    if (memory_pool->magazines_enabled) {
+        magazine = memory_magazine_find(memory_pool);
+    }
+    if (magazine) {
+        if (magazine->count > 0) {
+            taken = magazine->buffers[magazine->count-1];
+            if (memory_pool->size == 0 &&
+                ((slab_header_struct*)(taken - SLAB_RESERVED))->size_class != slab_class_for_size(owner)) {
+                taken = NULL;
+            } else {
+                uint32_t idx = memory_index(memory_pool, taken);
+
+                magazine->count--;
+                __sync_fetch_and_sub(&memory_pool->magazine_cached, 1);
+                memory_pool->refs[idx].owner = owner;
+                memory_pool->refs[idx].refcount = 1;
+                return taken;
+            }
+        }
+
+        // refill half of the magazine while we are holding the lock anyway
+        memory_lock(memory_pool);
+        taken = memory_take_locked(memory_pool, owner);
+        if (taken && magazine->count == 0) {
+            int refill = 0;
+            while (refill < MAGAZINE_SIZE/2 &&
+                   memory_pool->magazine_cached + refill < memory_pool->magazine_limit) {
+                uint8_t *buffer = memory_take_locked(memory_pool, owner);
+                if (!buffer) {
+                    break;
+                }
+                magazine->buffers[magazine->count++] = buffer;
+                refill++;
+            }
+            __sync_fetch_and_add(&memory_pool->magazine_cached, refill);
+        }
+        pthread_mutex_unlock(memory_pool->reflock);
+        return taken;
+    }
+
+    memory_lock(memory_pool);
+    taken = memory_take_locked(memory_pool, owner);
+    pthread_mutex_unlock(memory_pool->reflock);
+    return taken;
+}
+
+int memory_ref(void *pool, void *memory)
+{
+    memory_pool_struct *memory_pool = (memory_pool_struct *)pool;
+    uint32_t idx;
+
+    if (!memory_pool || !memory) {
+        return -1;
+    }
+    idx = memory_index(memory_pool, (uint8_t*)memory);
+    if (idx >= memory_pool->count) {
+        return -1;
+    }
+    return __sync_add_and_fetch(&memory_pool->refs[idx].refcount, 1);
+}
+
+int memory_return(void *pool, void *memory)
+{
+    int retcode;
+    uint32_t idx;
+    memory_magazine_struct *magazine = NULL;
     memory_pool_struct *memory_pool;
 
     if (!memory) {
@@ -223,45 +878,49 @@ int memory_return(void *pool, void *memory)
         return -1;
     }
 
-    if (memory_pool->size > 0) {
-        returned = (uint8_t*)memory - MEMORY_RESERVED;
-        magicptr32 = (uint32_t*)returned;
-        idx = *magicptr32;
+    // shared buffers only go back to the pool when the last reference is dropped
+    idx = memory_index(memory_pool, (uint8_t*)memory);
+    if (idx < memory_pool->count) {
+        int refcount = __sync_sub_and_fetch(&memory_pool->refs[idx].refcount, 1);
 
-        pthread_mutex_lock(memory_pool->reflock);
-        if (idx > memory_pool->count) {
-            pthread_mutex_unlock(memory_pool->reflock);
+        if (refcount > 0) {
+            return 0;
+        }
+        if (refcount < 0) {
+            // already back in the pool or parked in a magazine
+            __sync_add_and_fetch(&memory_pool->refs[idx].refcount, 1);
+            fprintf(stderr,"MEMPOOL: ERROR - BUFFER RETURNED TWICE: %d\n", idx);
             return -1;
         }
+    }
 
-        if (memory_pool->refs[idx].disponible != 0) {
-            pthread_mutex_unlock(memory_pool->reflock);
-            return -1;
-        } else {
-            memory_pool->refs[idx].disponible = 1;
+    if (memory_pool->magazines_enabled) {
+        magazine = memory_magazine_find(memory_pool);
+    }
+    if (magazine) {
+        if (magazine->count < MAGAZINE_SIZE &&
+            memory_pool->magazine_cached < memory_pool->magazine_limit) {
+            magazine->buffers[magazine->count++] = (uint8_t*)memory;
+            __sync_fetch_and_add(&memory_pool->magazine_cached, 1);
+            return 0;
         }
 
-        pthread_mutex_unlock(memory_pool->reflock);
-    } else {
-        int found_buffer = 0;
-        pthread_mutex_lock(memory_pool->reflock);
-        for (idx = 0; idx < memory_pool->count; idx++) {
-            if (memory_pool->refs[idx].memory == memory) {
-                free(memory);
-                memory_pool->refs[idx].memory = NULL;
-                memory_pool->refs[idx].disponible = 1;
-                found_buffer = 1;
-                break;
-            }
+        // magazine is full or the pool is running short- hand half of it back in one go
+        memory_lock(memory_pool);
+        retcode = memory_return_locked(memory_pool, (uint8_t*)memory);
+        while (magazine->count > MAGAZINE_SIZE/2) {
+            memory_return_locked(memory_pool, magazine->buffers[--magazine->count]);
+            __sync_fetch_and_sub(&memory_pool->magazine_cached, 1);
         }
         pthread_mutex_unlock(memory_pool->reflock);
-        if (!found_buffer) {
-            fprintf(stderr,"FATAL ERROR: returning invalid buffer to pool!\n");
-            exit(0);
-        }
+        return retcode;
     }
 
-    return 0;
+    memory_lock(memory_pool);
+    retcode = memory_return_locked(memory_pool, (uint8_t*)memory);
+    pthread_mutex_unlock(memory_pool->reflock);
+
+    return retcode;
 }
 
 int memory_unused(void *pool)
@@ -279,8 +938,78 @@ int memory_unused(void *pool)
             unused += memory_pool->refs[i].disponible;
         }
         pthread_mutex_unlock(memory_pool->reflock);
+        unused += memory_pool->magazine_cached;
 
         return unused;
     }
     return 0;
 }
+
+// lock free estimate of how full the pool is, for callers that need to ask
+// per frame where memory_unused would walk every slot under the lock
+int memory_used_percent(void *pool)
+{
+    memory_pool_struct *memory_pool = (memory_pool_struct *)pool;
+
+    if (memory_pool && memory_pool->count > 0) {
+        int used = memory_pool->in_use - memory_pool->magazine_cached;
+        if (used < 0) {
+            used = 0;
+        }
+        return (int)(((int64_t)used * 100) / memory_pool->count);
+    }
+    return 0;
+}
+
+int memory_count(void *pool)
+{
+    memory_pool_struct *memory_pool = (memory_pool_struct *)pool;
+
+    if (memory_pool) {
+        return memory_pool->count;
+    }
+    return 0;
+}
+
+int memory_report(void *pool, const char *name)
+{
+    memory_pool_struct *memory_pool = (memory_pool_struct *)pool;
+    int i;
+
+    if (!memory_pool) {
+        return -1;
+    }
+
+    pthread_mutex_lock(memory_pool->reflock);
+    syslog(LOG_INFO,"MEMPOOL: %s locks=%ld contended=%ld lockwait=%ldus cached=%d\n",
+           name, memory_pool->lock_acquired, memory_pool->lock_contended,
+           memory_pool->lock_wait_ns / 1000, memory_pool->magazine_cached);
+    fprintf(stderr,"MEMPOOL: %s locks=%ld contended=%ld lockwait=%ldus cached=%d\n",
+            name, memory_pool->lock_acquired, memory_pool->lock_contended,
+            memory_pool->lock_wait_ns / 1000, memory_pool->magazine_cached);
+    for (i = 0; i <= SLAB_CLASSES; i++) {
+        slab_class_struct *slab = &memory_pool->slab[i];
+        int64_t average_size = 0;
+
+        if (slab->takes == 0) {
+            continue;
+        }
+        average_size = slab->requested_bytes / slab->takes;
+        if (i == SLAB_CLASS_LARGE) {
+            syslog(LOG_INFO,"MEMPOOL: %s class=large inuse=%d peak=%d takes=%ld avgsize=%ld\n",
+                   name, slab->in_use, slab->peak, slab->takes, average_size);
+            fprintf(stderr,"MEMPOOL: %s class=large inuse=%d peak=%d takes=%ld avgsize=%ld\n",
+                    name, slab->in_use, slab->peak, slab->takes, average_size);
+        } else {
+            syslog(LOG_INFO,"MEMPOOL: %s class=%ld inuse=%d peak=%d free=%d arenas=%d arenabytes=%ld takes=%ld avgsize=%ld\n",
+                   name, (long)(slab->chunk_size - SLAB_RESERVED), slab->in_use, slab->peak, slab->free_chunks,
+                   slab->arena_count, slab->arena_bytes, slab->takes, average_size);
+            fprintf(stderr,"MEMPOOL: %s class=%ld inuse=%d peak=%d free=%d arenas=%d arenabytes=%ld takes=%ld avgsize=%ld\n",
+                    name, (long)(slab->chunk_size - SLAB_RESERVED), slab->in_use, slab->peak, slab->free_chunks,
+                    slab->arena_count, slab->arena_bytes, slab->takes, average_size);
+        }
+    }
+    pthread_mutex_unlock(memory_pool->reflock);
+
+    return 0;
+}
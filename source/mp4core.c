@@ -22,6 +22,7 @@
 
 #include "fillet.h"
 #include "mp4core.h"
+#include "mempool.h"
 
 static int output8_raw(uint8_t *data, uint8_t code)
 {
@@ -129,6 +130,197 @@ static int output_raw_data(fragment_file_struct *fmp4, uint8_t *raw_data, int ra
     return raw_data_size;
 }
 
+#define NALSIZE_SIZE 4
+
+static int64_t fmp4_copied = 0;
+
+// a referenced frame stays pinned in the compressed pool until the segment is
+// written, so once the pool is getting full fall back to copying the frame out
+// and let the encoder have its buffer back straight away
+#define FRAGMENT_REF_MAX_USED_PERCENT 50
+
+static int fragment_can_ref(void *buffer_pool)
+{
+    return buffer_pool && memory_used_percent(buffer_pool) < FRAGMENT_REF_MAX_USED_PERCENT;
+}
+
+static int output_nal_with_size(uint8_t *input_buffer, int nal_size, uint8_t *output_buffer)
+{
+    if (output_buffer) {
+        *(output_buffer+0) = ((uint32_t)nal_size >> 24) & 0xff;
+        *(output_buffer+1) = ((uint32_t)nal_size >> 16) & 0xff;
+        *(output_buffer+2) = ((uint32_t)nal_size >> 8) & 0xff;
+        *(output_buffer+3) = (uint32_t)nal_size & 0xff;
+        memcpy(output_buffer + NALSIZE_SIZE, input_buffer, nal_size);
+    }
+    return nal_size + NALSIZE_SIZE;
+}
+
+static int annexb_startcode(uint8_t *input_buffer, int input_buffer_size, int read_pos)
+{
+    if (input_buffer[read_pos+0] == 0x00 &&
+        input_buffer[read_pos+1] == 0x00) {
+        if (input_buffer[read_pos+2] == 0x01) {
+            return 3;
+        } else if (read_pos + 4 <= input_buffer_size &&
+                   input_buffer[read_pos+2] == 0x00 &&
+                   input_buffer[read_pos+3] == 0x01) {
+            return 4;
+        }
+    }
+    return 0;
+}
+
+// walks the nal units an mp4 sample carries, the access unit delimiters are dropped
+static uint8_t *annexb_next_nal(uint8_t *input_buffer, int input_buffer_size, int *read_pos, int *nal_size, int is_hevc)
+{
+    int pos = *read_pos;
+    int startcode_size;
+    int nal_start;
+    int nal_type;
+
+    while (pos + 3 <= input_buffer_size) {
+        startcode_size = annexb_startcode(input_buffer, input_buffer_size, pos);
+        if (!startcode_size) {
+            pos++;
+            continue;
+        }
+        pos += startcode_size;
+        if (pos >= input_buffer_size) {
+            break;
+        }
+
+        nal_start = pos;
+        while (pos + 3 <= input_buffer_size && !annexb_startcode(input_buffer, input_buffer_size, pos)) {
+            pos++;
+        }
+        if (pos + 3 > input_buffer_size) {
+            pos = input_buffer_size;
+        }
+
+        if (is_hevc) {
+            nal_type = (input_buffer[nal_start] & 0x7f) >> 1;
+            if (nal_type == 35) { //aud
+                continue;
+            }
+        } else {
+            nal_type = input_buffer[nal_start] & 0x1f;
+            if (nal_type == 9) {
+                continue;
+            }
+        }
+        *read_pos = pos;
+        *nal_size = pos - nal_start;
+        return input_buffer + nal_start;
+    }
+    *read_pos = input_buffer_size;
+    return NULL;
+}
+
+// converts annexb start codes into nal size prefixes and drops the access unit delimiters
+// when output_buffer is NULL this only returns the size the converted sample will have
+static int replace_startcode_with_size(uint8_t *input_buffer, int input_buffer_size, uint8_t *output_buffer, int is_hevc)
+{
+    int read_pos = 0;
+    int write_pos = 0;
+    int nal_size;
+    uint8_t *nal;
+
+    while ((nal = annexb_next_nal(input_buffer, input_buffer_size, &read_pos, &nal_size, is_hevc)) != NULL) {
+        write_pos += output_nal_with_size(nal, nal_size, output_buffer ? output_buffer + write_pos : NULL);
+    }
+    return write_pos;
+}
+
+// a sample's aux info size is a single byte in the saiz, which bounds its subsamples
+#define MAX_SUBSAMPLES      ((255 - SEGCRYPT_SAMPLE_IV_SIZE - 2) / 6)
+#define MAX_CLEAR_BYTES     0xffff
+
+static int subsample_add(fragment_file_struct *fmp4, fragment_struct *fragment, int clear_bytes, int protected_bytes)
+{
+    do {
+        segcrypt_subsample_struct *subsample;
+
+        if (fmp4->subsample_count >= fmp4->subsample_size) {
+            int new_size = fmp4->subsample_size ? fmp4->subsample_size * 2 : 1024;
+            segcrypt_subsample_struct *subsamples;
+
+            subsamples = (segcrypt_subsample_struct*)realloc(fmp4->subsamples, new_size * sizeof(segcrypt_subsample_struct));
+            if (!subsamples) {
+                fprintf(stderr,"MP4CORE: ERROR - UNABLE TO GROW THE SUBSAMPLE MAP TO %d\n", new_size);
+                return -1;
+            }
+            fmp4->subsamples = subsamples;
+            fmp4->subsample_size = new_size;
+        }
+        subsample = &fmp4->subsamples[fmp4->subsample_count++];
+        fragment->subsample_count++;
+        if (clear_bytes > MAX_CLEAR_BYTES) {
+            subsample->clear_bytes = MAX_CLEAR_BYTES;
+            subsample->protected_bytes = 0;
+            clear_bytes -= MAX_CLEAR_BYTES;
+            continue;
+        }
+        subsample->clear_bytes = clear_bytes;
+        subsample->protected_bytes = protected_bytes;
+        clear_bytes = 0;
+    } while (clear_bytes > 0);
+
+    return 0;
+}
+
+// maps the clear and protected runs of a sample from its annexb source- the clear nal units
+// fold into the clear part of the next subsample and the size prefixes count as clear
+static int subsample_map(fragment_file_struct *fmp4, fragment_struct *fragment, uint8_t *input_buffer, int input_buffer_size, int is_hevc)
+{
+    int read_pos = 0;
+    int nal_size;
+    int clear = 0;
+    int clear_bytes;
+    int protected_bytes;
+    uint8_t *nal;
+
+    fragment->subsample_first = fmp4->subsample_count;
+    fragment->subsample_count = 0;
+    while ((nal = annexb_next_nal(input_buffer, input_buffer_size, &read_pos, &nal_size, is_hevc)) != NULL) {
+        segcrypt_subsamples(fmp4->video_media_type, nal, nal_size, &clear_bytes, &protected_bytes);
+        clear += NALSIZE_SIZE + clear_bytes;
+        if (protected_bytes == 0) {
+            continue;
+        }
+        // leave room for the rest of the sample to go out clear
+        if (fragment->subsample_count + clear / MAX_CLEAR_BYTES + 2 + (input_buffer_size - read_pos) / MAX_CLEAR_BYTES + 1 > MAX_SUBSAMPLES) {
+            clear += protected_bytes;
+            continue;
+        }
+        if (subsample_add(fmp4, fragment, clear, protected_bytes) < 0) {
+            return -1;
+        }
+        clear = 0;
+    }
+    if (clear > 0) {
+        return subsample_add(fmp4, fragment, clear, 0);
+    }
+    return 0;
+}
+
+static void release_fragment(fragment_struct *fragment)
+{
+    if (fragment->fragment_pool) {
+        memory_return(fragment->fragment_pool, fragment->fragment_base);
+    } else {
+        free(fragment->fragment_base);
+    }
+    fragment->fragment_pool = NULL;
+    fragment->fragment_base = NULL;
+    fragment->fragment_buffer = NULL;
+}
+
+int64_t fmp4_bytes_copied(void)
+{
+    return fmp4_copied;
+}
+
 static int output_fmp4_4cc(fragment_file_struct *fmp4, char *cc)
 {
     uint8_t *data;
@@ -617,6 +809,128 @@ static int output_fmp4_avcc(fragment_file_struct *fmp4)
     return buffer_offset;
 }
 
+static int output_fmp4_frma(fragment_file_struct *fmp4, char *original_format)
+{
+    uint8_t *data;
+    int buffer_offset;
+
+    data = fmp4->buffer + fmp4->buffer_offset;
+
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"frma");
+    buffer_offset += output_fmp4_4cc(fmp4, original_format);
+
+    output32_raw(data, buffer_offset);
+
+    return buffer_offset;
+}
+
+static int output_fmp4_schm(fragment_file_struct *fmp4)
+{
+    uint8_t *data;
+    int buffer_offset;
+
+    data = fmp4->buffer + fmp4->buffer_offset;
+
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"schm");
+    buffer_offset += output32(fmp4, 0);
+    if (segcrypt_get_scheme(fmp4->crypt) == SEGCRYPT_SCHEME_CBCS) {
+        buffer_offset += output_fmp4_4cc(fmp4,"cbcs");
+    } else {
+        buffer_offset += output_fmp4_4cc(fmp4,"cenc");
+    }
+    buffer_offset += output32(fmp4, 0x00010000);  // scheme version 1.0
+
+    output32_raw(data, buffer_offset);
+
+    return buffer_offset;
+}
+
+static int output_fmp4_tenc(fragment_file_struct *fmp4, int is_video)
+{
+    uint8_t *data;
+    int buffer_offset;
+    segcrypt_key_struct *key = segcrypt_get_key(fmp4->crypt);
+
+    data = fmp4->buffer + fmp4->buffer_offset;
+
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"tenc");
+    if (segcrypt_get_scheme(fmp4->crypt) == SEGCRYPT_SCHEME_CBCS) {
+        // version 1 for the pattern, the iv is constant so none goes into the senc
+        buffer_offset += output32(fmp4, 0x01000000);
+        buffer_offset += output8(fmp4, 0);
+        buffer_offset += output8(fmp4, is_video ? 0x19 : 0x00);  // 1 encrypted block, 9 skipped
+        buffer_offset += output8(fmp4, 1);  // is protected
+        buffer_offset += output8(fmp4, 0);  // per sample iv size
+        buffer_offset += output_raw_data(fmp4, key->kid, SEGCRYPT_KEY_SIZE);
+        buffer_offset += output8(fmp4, SEGCRYPT_KEY_SIZE);
+        buffer_offset += output_raw_data(fmp4, key->iv, SEGCRYPT_KEY_SIZE);
+    } else {
+        buffer_offset += output32(fmp4, 0);
+        buffer_offset += output8(fmp4, 0);
+        buffer_offset += output8(fmp4, 0);
+        buffer_offset += output8(fmp4, 1);  // is protected
+        buffer_offset += output8(fmp4, SEGCRYPT_SAMPLE_IV_SIZE);
+        buffer_offset += output_raw_data(fmp4, key->kid, SEGCRYPT_KEY_SIZE);
+    }
+
+    output32_raw(data, buffer_offset);
+
+    return buffer_offset;
+}
+
+static int output_fmp4_sinf(fragment_file_struct *fmp4, char *original_format, int is_video)
+{
+    uint8_t *data;
+    uint8_t *schi;
+    int buffer_offset;
+    int schi_offset;
+
+    data = fmp4->buffer + fmp4->buffer_offset;
+
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"sinf");
+    buffer_offset += output_fmp4_frma(fmp4, original_format);
+    buffer_offset += output_fmp4_schm(fmp4);
+
+    schi = fmp4->buffer + fmp4->buffer_offset;
+    schi_offset = output32(fmp4, 0);
+    schi_offset += output_fmp4_4cc(fmp4,"schi");
+    schi_offset += output_fmp4_tenc(fmp4, is_video);
+    output32_raw(schi, schi_offset);
+    buffer_offset += schi_offset;
+
+    output32_raw(data, buffer_offset);
+
+    return buffer_offset;
+}
+
+// common system pssh with the key id, players that have the key out of band need nothing more
+static int output_fmp4_pssh(fragment_file_struct *fmp4)
+{
+    static uint8_t common_system_id[16] = { 0x10, 0x77, 0xef, 0xec, 0xc0, 0xb2, 0x4d, 0x02,
+                                            0xac, 0xe3, 0x3c, 0x1e, 0x52, 0xe2, 0xfb, 0x4b };
+    uint8_t *data;
+    int buffer_offset;
+    segcrypt_key_struct *key = segcrypt_get_key(fmp4->crypt);
+
+    data = fmp4->buffer + fmp4->buffer_offset;
+
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"pssh");
+    buffer_offset += output32(fmp4, 0x01000000);
+    buffer_offset += output_raw_data(fmp4, common_system_id, sizeof(common_system_id));
+    buffer_offset += output32(fmp4, 1);  // kid count
+    buffer_offset += output_raw_data(fmp4, key->kid, SEGCRYPT_KEY_SIZE);
+    buffer_offset += output32(fmp4, 0);  // data size
+
+    output32_raw(data, buffer_offset);
+
+    return buffer_offset;
+}
+
 static int output_fmp4_vse(fragment_file_struct *fmp4)
 {
     uint8_t *data;
@@ -625,7 +939,9 @@ static int output_fmp4_vse(fragment_file_struct *fmp4)
     data = fmp4->buffer + fmp4->buffer_offset;
 
     buffer_offset = output32(fmp4, 0);
-    if (fmp4->video_media_type == MEDIA_TYPE_H264) {
+    if (fmp4->crypt) {
+        buffer_offset += output_fmp4_4cc(fmp4,"encv");
+    } else if (fmp4->video_media_type == MEDIA_TYPE_H264) {
         buffer_offset += output_fmp4_4cc(fmp4,"avc1");
     } else if (fmp4->video_media_type == MEDIA_TYPE_HEVC) {
         buffer_offset += output_fmp4_4cc(fmp4,"hvc1");
@@ -660,6 +976,9 @@ static int output_fmp4_vse(fragment_file_struct *fmp4)
     } else {
         buffer_offset += output_fmp4_hvcc(fmp4);
     }
+    if (fmp4->crypt) {
+        buffer_offset += output_fmp4_sinf(fmp4, fmp4->video_media_type == MEDIA_TYPE_H264 ? "avc1" : "hvc1", 1);
+    }
 
     output32_raw(data, buffer_offset);
 
@@ -733,7 +1052,7 @@ static int output_fmp4_ase(fragment_file_struct *fmp4)
     data = fmp4->buffer + fmp4->buffer_offset;
 
     buffer_offset = output32(fmp4, 0);
-    buffer_offset += output_fmp4_4cc(fmp4,"mp4a");
+    buffer_offset += output_fmp4_4cc(fmp4, fmp4->crypt ? "enca" : "mp4a");
     buffer_offset += output32(fmp4, 0);  //reserved
     buffer_offset += output16(fmp4, 0);  //reserved
 
@@ -749,6 +1068,9 @@ static int output_fmp4_ase(fragment_file_struct *fmp4)
     buffer_offset += output16(fmp4, 0); // reservd
 
     buffer_offset += output_fmp4_esds(fmp4);
+    if (fmp4->crypt) {
+        buffer_offset += output_fmp4_sinf(fmp4, "mp4a", 0);
+    }
 
     output32_raw(data, buffer_offset);
 
@@ -980,7 +1302,7 @@ static int output_fmp4_moov(fragment_file_struct *fmp4)
     buffer_offset = output32(fmp4, 0);
     buffer_offset += output_fmp4_4cc(fmp4,"moov");
     buffer_offset += output_fmp4_mvhd(fmp4);
-    if (fmp4->enable_youtube) {
+    if (fmp4->enable_youtube || fmp4->enable_muxed) {
         int current_track;
         for (current_track = 0; current_track < fmp4->track_count; current_track++) {
             buffer_offset += output_fmp4_trak(fmp4, (track_struct*)&fmp4->track_data[current_track]);
@@ -989,6 +1311,9 @@ static int output_fmp4_moov(fragment_file_struct *fmp4)
         buffer_offset += output_fmp4_trak(fmp4, (track_struct*)&fmp4->track_data[0]);
     }
     buffer_offset += output_fmp4_mvex(fmp4);
+    if (fmp4->crypt) {
+        buffer_offset += output_fmp4_pssh(fmp4);
+    }
 
     output32_raw(data, buffer_offset);
 
@@ -1060,6 +1385,9 @@ static int output_fmp4_tfdt(fragment_file_struct *fmp4, double start_time, track
     if (!fmp4->enable_youtube) {
         if (track_data->track_type == TRACK_TYPE_VIDEO) {
             fragment_duration = (uint64_t)((int64_t)start_time - (int64_t)track_data->fragments[0].fragment_composition_time);
+        } else if (fmp4->enable_muxed) {
+            // the segment time belongs to the video, audio keeps the decode time it was added with
+            fragment_duration = (uint64_t)(track_data->fragment_start_timestamp / fmp4->timescale);
         } else {
             fragment_duration = (uint64_t)start_time;
         }
@@ -1102,7 +1430,7 @@ static int output_fmp4_trun(fragment_file_struct *fmp4, track_struct *track_data
             buffer_offset += output32(fmp4, track_data->fragments[frag].fragment_duration);
             total_duration += track_data->fragments[frag].fragment_duration;
             buffer_offset += output32(fmp4, track_data->fragments[frag].fragment_buffer_size);
-            if (frag == 0) {
+            if (frag == 0 && track_data->part_count == 0) {
                 buffer_offset += output32(fmp4, 0x2000000);  // sync sample
             } else {
                 buffer_offset += output32(fmp4, 0x1000000);
@@ -1115,31 +1443,55 @@ static int output_fmp4_trun(fragment_file_struct *fmp4, track_struct *track_data
     track_data->total_duration = total_duration;
 
     output32_raw(data, buffer_offset);
-    track_data->sidx_buffer_offset = fmp4->buffer_offset + 8;
-    output32_raw(data_start, fmp4->buffer_offset + 8 - fmp4->initial_offset);
+    track_data->data_offset_position = data_start - fmp4->buffer;
 
     return buffer_offset;
 }
 
-static int output_fmp4_traf(fragment_file_struct *fmp4, double start_time, track_struct *track_data)
+// cbcs audio has neither a per sample iv nor subsamples, so there is no aux info to carry
+static int track_aux_info(fragment_file_struct *fmp4, track_struct *track_data)
+{
+    return fmp4->crypt && (segcrypt_get_scheme(fmp4->crypt) == SEGCRYPT_SCHEME_CENC || track_data->track_type == TRACK_TYPE_VIDEO);
+}
+
+static int sample_aux_size(fragment_file_struct *fmp4, track_struct *track_data, fragment_struct *fragment)
+{
+    int size = segcrypt_get_scheme(fmp4->crypt) == SEGCRYPT_SCHEME_CENC ? SEGCRYPT_SAMPLE_IV_SIZE : 0;
+
+    if (track_data->track_type == TRACK_TYPE_VIDEO) {
+        size += 2 + fragment->subsample_count * 6;
+    }
+    return size;
+}
+
+static int output_fmp4_saiz(fragment_file_struct *fmp4, track_struct *track_data)
 {
     uint8_t *data;
     int buffer_offset;
+    int frag;
 
     data = fmp4->buffer + fmp4->buffer_offset;
 
     buffer_offset = output32(fmp4, 0);
-    buffer_offset += output_fmp4_4cc(fmp4,"traf");
-    buffer_offset += output_fmp4_tfhd(fmp4, track_data);
-    buffer_offset += output_fmp4_tfdt(fmp4, start_time, track_data);
-    buffer_offset += output_fmp4_trun(fmp4, track_data);
+    buffer_offset += output_fmp4_4cc(fmp4,"saiz");
+    buffer_offset += output32(fmp4, 0);
+    if (track_data->track_type == TRACK_TYPE_VIDEO) {
+        buffer_offset += output8(fmp4, 0);  // sizes vary with the subsamples
+        buffer_offset += output32(fmp4, track_data->fragment_count);
+        for (frag = 0; frag < track_data->fragment_count; frag++) {
+            buffer_offset += output8(fmp4, sample_aux_size(fmp4, track_data, &track_data->fragments[frag]));
+        }
+    } else {
+        buffer_offset += output8(fmp4, SEGCRYPT_SAMPLE_IV_SIZE);
+        buffer_offset += output32(fmp4, track_data->fragment_count);
+    }
 
     output32_raw(data, buffer_offset);
 
     return buffer_offset;
 }
 
-static int output_fmp4_moof(fragment_file_struct *fmp4, double start_time, track_struct *track_data)
+static int output_fmp4_saio(fragment_file_struct *fmp4, int64_t *offset_position)
 {
     uint8_t *data;
     int buffer_offset;
@@ -1147,98 +1499,310 @@ static int output_fmp4_moof(fragment_file_struct *fmp4, double start_time, track
     data = fmp4->buffer + fmp4->buffer_offset;
 
     buffer_offset = output32(fmp4, 0);
-    buffer_offset += output_fmp4_4cc(fmp4,"moof");
-    buffer_offset += output_fmp4_mfhd(fmp4, track_data);
-    buffer_offset += output_fmp4_traf(fmp4, start_time, track_data);
+    buffer_offset += output_fmp4_4cc(fmp4,"saio");
+    buffer_offset += output32(fmp4, 0);
+    buffer_offset += output32(fmp4, 1);  // entry count
+    *offset_position = fmp4->buffer_offset;
+    buffer_offset += output32(fmp4, 0);  // filled in once the senc is written
 
     output32_raw(data, buffer_offset);
 
     return buffer_offset;
 }
 
-static int output_fmp4_mdat(fragment_file_struct *fmp4, track_struct *track_data)
+// the per sample ivs are handed out here and used again when the mdat is encrypted
+static int output_fmp4_senc(fragment_file_struct *fmp4, track_struct *track_data, int64_t *info_position)
 {
     uint8_t *data;
     int buffer_offset;
     int frag;
-    int64_t total_fragsize = 0;
+    int sub;
 
     data = fmp4->buffer + fmp4->buffer_offset;
 
     buffer_offset = output32(fmp4, 0);
-    buffer_offset += output_fmp4_4cc(fmp4,"mdat");
-
+    buffer_offset += output_fmp4_4cc(fmp4,"senc");
+    buffer_offset += output32(fmp4, track_data->track_type == TRACK_TYPE_VIDEO ? 0x000002 : 0);  // subsamples
+    buffer_offset += output32(fmp4, track_data->fragment_count);
+    *info_position = fmp4->buffer_offset;
     for (frag = 0; frag < track_data->fragment_count; frag++) {
-        //uint32_t *fragsize = (uint32_t*)fmp4->fragments[frag].fragment_buffer;
-        //fprintf(stderr,"writing frag size: %u\n", ntohl(*fragsize));
-        //total_fragsize += ntohl(*fragsize);
-        buffer_offset += output_raw_data(fmp4, track_data->fragments[frag].fragment_buffer, track_data->fragments[frag].fragment_buffer_size);
-        total_fragsize += track_data->fragments[frag].fragment_buffer_size;
-        free(track_data->fragments[frag].fragment_buffer);
+        fragment_struct *fragment = &track_data->fragments[frag];
+        int iv_size;
+
+        if (track_data->iframe_reuse_iv) {
+            // the trick fragment carries a sample that is already encrypted
+            iv_size = segcrypt_get_scheme(fmp4->crypt) == SEGCRYPT_SCHEME_CENC ? SEGCRYPT_SAMPLE_IV_SIZE : 0;
+        } else {
+            iv_size = segcrypt_sample_iv(fmp4->crypt, fragment->sample_iv);
+        }
+
+        buffer_offset += output_raw_data(fmp4, fragment->sample_iv, iv_size);
+        if (track_data->track_type == TRACK_TYPE_VIDEO) {
+            buffer_offset += output16(fmp4, fragment->subsample_count);
+            for (sub = 0; sub < fragment->subsample_count; sub++) {
+                segcrypt_subsample_struct *subsample = &fmp4->subsamples[fragment->subsample_first + sub];
+
+                buffer_offset += output16(fmp4, subsample->clear_bytes);
+                buffer_offset += output32(fmp4, subsample->protected_bytes);
+            }
+        }
     }
-    fprintf(stderr,"writing fmp4 data: %ld\n", total_fragsize);
 
     output32_raw(data, buffer_offset);
 
     return buffer_offset;
 }
 
-fragment_file_struct *fmp4_file_create(int media_type, int timescale, int lang_code, int frag_duration)
+static int output_fmp4_traf(fragment_file_struct *fmp4, double start_time, track_struct *track_data)
 {
-    fragment_file_struct *fmp4;
-    fmp4 = (fragment_file_struct*)malloc(sizeof(fragment_file_struct));
-    if (!fmp4) {
-        return NULL;
-    }
-    track_struct *track_data = (track_struct*)&fmp4->track_data[0];
+    uint8_t *data;
+    int buffer_offset;
 
-    memset(fmp4, 0, sizeof(fragment_file_struct));
+    data = fmp4->buffer + fmp4->buffer_offset;
 
-    fmp4->audio_media_type = media_type;
-    fmp4->video_media_type = media_type;
-    fmp4->buffer = (uint8_t*)malloc(MAX_MP4_SIZE);
-    if (!fmp4->buffer) {
-        free(fmp4);
-        return NULL;
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"traf");
+    buffer_offset += output_fmp4_tfhd(fmp4, track_data);
+    buffer_offset += output_fmp4_tfdt(fmp4, start_time, track_data);
+    buffer_offset += output_fmp4_trun(fmp4, track_data);
+    if (track_aux_info(fmp4, track_data)) {
+        int64_t offset_position;
+        int64_t info_position;
+
+        buffer_offset += output_fmp4_saiz(fmp4, track_data);
+        buffer_offset += output_fmp4_saio(fmp4, &offset_position);
+        buffer_offset += output_fmp4_senc(fmp4, track_data, &info_position);
+        output32_raw(fmp4->buffer + offset_position, info_position - fmp4->initial_offset);
     }
-    memset(fmp4->buffer, 0, MAX_MP4_SIZE);
-
-    fmp4->buffer_offset = 0;
-    fmp4->next_track_id = 2;
-    fmp4->video_track_id = 1;
-    fmp4->audio_track_id = 1;
-    fmp4->track_count = 0;
-    fmp4->timescale = timescale;
-    fmp4->lang_code = lang_code;
-    fmp4->enable_youtube = 0;
 
-    track_data->sequence_number = 0;
-    track_data->frag_duration = frag_duration;
-    track_data->total_duration = 0;
+    output32_raw(data, buffer_offset);
 
-    return fmp4;
+    return buffer_offset;
 }
 
-fragment_file_struct *fmp4_file_create_youtube(int video_media_type, int audio_media_type, int timescale, int lang_code, int frag_duration)
+static int output_fmp4_moof(fragment_file_struct *fmp4, double start_time, track_struct *track_data)
 {
-    fragment_file_struct *fmp4;
+    uint8_t *data;
+    int buffer_offset;
 
-    fmp4 = (fragment_file_struct*)malloc(sizeof(fragment_file_struct));
-    if (!fmp4) {
-        return NULL;
-    }
-    memset(fmp4, 0, sizeof(fragment_file_struct));
+    data = fmp4->buffer + fmp4->buffer_offset;
 
-    fmp4->video_media_type = video_media_type;
-    fmp4->audio_media_type = audio_media_type;
-    fmp4->buffer = (uint8_t*)malloc(MAX_MP4_SIZE);
-    if (!fmp4->buffer) {
-        free(fmp4);
-        return NULL;
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"moof");
+    buffer_offset += output_fmp4_mfhd(fmp4, track_data);
+    buffer_offset += output_fmp4_traf(fmp4, start_time, track_data);
+
+    output32_raw(data, buffer_offset);
+
+    if (track_data->track_type == TRACK_TYPE_VIDEO && track_data->part_count == 0) {
+        track_data->iframe_time = start_time;
     }
-    memset(fmp4->buffer, 0, MAX_MP4_SIZE);
 
-    fmp4->buffer_offset = 0;
+    // the samples start past the whole moof, encryption boxes included
+    track_data->sidx_buffer_offset = fmp4->buffer_offset + 8;
+    output32_raw(fmp4->buffer + track_data->data_offset_position, fmp4->buffer_offset + 8 - fmp4->initial_offset);
+
+    return buffer_offset;
+}
+
+static int output_fmp4_samples(fragment_file_struct *fmp4, track_struct *track_data)
+{
+    int buffer_offset = 0;
+    int frag;
+    int64_t total_fragsize = 0;
+
+    for (frag = 0; frag < track_data->fragment_count; frag++) {
+        //uint32_t *fragsize = (uint32_t*)fmp4->fragments[frag].fragment_buffer;
+        //fprintf(stderr,"writing frag size: %u\n", ntohl(*fragsize));
+        //total_fragsize += ntohl(*fragsize);
+        fragment_struct *fragment = &track_data->fragments[frag];
+        uint8_t *sample = fmp4->buffer + fmp4->buffer_offset;
+        if (fragment->fragment_convert != FRAGMENT_CONVERT_NONE) {
+            replace_startcode_with_size(fragment->fragment_buffer, fragment->fragment_source_size,
+                                        fmp4->buffer + fmp4->buffer_offset,
+                                        fragment->fragment_convert == FRAGMENT_CONVERT_HEVC);
+            fmp4->buffer_offset += fragment->fragment_buffer_size;
+            buffer_offset += fragment->fragment_buffer_size;
+        } else {
+            buffer_offset += output_raw_data(fmp4, fragment->fragment_buffer, fragment->fragment_buffer_size);
+        }
+        if (fmp4->crypt) {
+            // in place, the sample is already where it is going out from
+            segcrypt_sample(fmp4->crypt, sample, fragment->fragment_buffer_size,
+                            fmp4->subsamples + fragment->subsample_first, fragment->subsample_count,
+                            fragment->sample_iv);
+        }
+        if (frag == 0 && track_data->part_count == 0 && track_data->track_type == TRACK_TYPE_VIDEO) {
+            track_data->iframe_position = sample - fmp4->buffer;
+            track_data->iframe_size = fragment->fragment_buffer_size;
+        }
+        __sync_fetch_and_add(&fmp4_copied, fragment->fragment_buffer_size);
+        total_fragsize += fragment->fragment_buffer_size;
+        release_fragment(fragment);
+    }
+    fprintf(stderr,"writing fmp4 data: %ld\n", total_fragsize);
+
+    return buffer_offset;
+}
+
+static int output_fmp4_mdat(fragment_file_struct *fmp4, track_struct *track_data)
+{
+    uint8_t *data;
+    int buffer_offset;
+
+    data = fmp4->buffer + fmp4->buffer_offset;
+
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"mdat");
+    buffer_offset += output_fmp4_samples(fmp4, track_data);
+
+    output32_raw(data, buffer_offset);
+
+    return buffer_offset;
+}
+
+// one moof with a traf for each track holding samples, and a single mdat carrying the
+// tracks back to back in the same order.  the sidx refers to the video track
+static int output_fmp4_muxed(fragment_file_struct *fmp4, int64_t *sidx_time, int64_t *sidx_duration, double start_time, double frag_length, uint32_t sequence_number)
+{
+    track_struct *video_track = (track_struct*)&fmp4->track_data[fmp4->video_track_id-1];
+    uint8_t *data;
+    int64_t sidx_position;
+    int64_t moof_position;
+    int64_t data_offset;
+    int buffer_offset;
+    int track;
+
+    video_track->sequence_number = sequence_number;
+    sidx_position = fmp4->buffer_offset;
+    fmp4->initial_offset += output_fmp4_sidx(fmp4, sidx_time, sidx_duration, start_time, frag_length, video_track, fmp4->video_track_id);
+
+    moof_position = fmp4->buffer_offset;
+    data = fmp4->buffer + fmp4->buffer_offset;
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"moof");
+    buffer_offset += output_fmp4_mfhd(fmp4, video_track);
+    for (track = 0; track < fmp4->track_count; track++) {
+        if (fmp4->track_data[track].fragment_count > 0) {
+            buffer_offset += output_fmp4_traf(fmp4, start_time, (track_struct*)&fmp4->track_data[track]);
+        }
+    }
+    output32_raw(data, buffer_offset);
+    if (video_track->part_count == 0) {
+        video_track->iframe_time = start_time;
+    }
+    video_track->sidx_buffer_offset = fmp4->buffer_offset + 8;
+
+    // trun data offsets are from the start of the moof
+    data = fmp4->buffer + fmp4->buffer_offset;
+    data_offset = buffer_offset + 8;
+    buffer_offset = output32(fmp4, 0);
+    buffer_offset += output_fmp4_4cc(fmp4,"mdat");
+    for (track = 0; track < fmp4->track_count; track++) {
+        track_struct *track_data = (track_struct*)&fmp4->track_data[track];
+        int sample_bytes;
+
+        if (track_data->fragment_count > 0) {
+            output32_raw(fmp4->buffer + track_data->data_offset_position, data_offset);
+            sample_bytes = output_fmp4_samples(fmp4, track_data);
+            data_offset += sample_bytes;
+            buffer_offset += sample_bytes;
+            track_data->fragment_count = 0;
+        }
+    }
+    output32_raw(data, buffer_offset);
+
+    // the reference covers exactly the moof and mdat
+    output32_raw(fmp4->buffer + sidx_position + 36, fmp4->buffer_offset - moof_position);
+    video_track->sequence_number++;
+
+    return 0;
+}
+
+// track ids are handed out from 1, the table grows to hold whichever id is asked for
+static track_struct *track_slot(fragment_file_struct *fmp4, int track_id)
+{
+    track_struct *track_data;
+
+    if (track_id < 1) {
+        return NULL;
+    }
+    if (track_id > fmp4->track_slots) {
+        track_data = (track_struct*)realloc(fmp4->track_data, sizeof(track_struct) * track_id);
+        if (!track_data) {
+            fprintf(stderr,"MP4CORE: ERROR - UNABLE TO ALLOCATE TRACK: %d\n", track_id);
+            return NULL;
+        }
+        memset(track_data + fmp4->track_slots, 0, sizeof(track_struct) * (track_id - fmp4->track_slots));
+        fmp4->track_data = track_data;
+        fmp4->track_slots = track_id;
+    }
+    return (track_struct*)&fmp4->track_data[track_id-1];
+}
+
+fragment_file_struct *fmp4_file_create(int media_type, int timescale, int lang_code, int frag_duration)
+{
+    fragment_file_struct *fmp4;
+    track_struct *track_data;
+
+    fmp4 = (fragment_file_struct*)malloc(sizeof(fragment_file_struct));
+    if (!fmp4) {
+        return NULL;
+    }
+    memset(fmp4, 0, sizeof(fragment_file_struct));
+
+    track_data = track_slot(fmp4, 1);
+    if (!track_data) {
+        free(fmp4);
+        return NULL;
+    }
+
+    fmp4->audio_media_type = media_type;
+    fmp4->video_media_type = media_type;
+    fmp4->buffer = (uint8_t*)memory_arena_alloc(MAX_MP4_SIZE);
+    if (!fmp4->buffer) {
+        free(fmp4->track_data);
+        free(fmp4);
+        return NULL;
+    }
+    memset(fmp4->buffer, 0, MAX_MP4_SIZE);
+
+    fmp4->buffer_offset = 0;
+    fmp4->next_track_id = 2;
+    fmp4->video_track_id = 1;
+    fmp4->audio_track_id = 1;
+    fmp4->track_count = 0;
+    fmp4->timescale = timescale;
+    fmp4->lang_code = lang_code;
+    fmp4->enable_youtube = 0;
+
+    track_data->sequence_number = 0;
+    track_data->frag_duration = frag_duration;
+    track_data->total_duration = 0;
+
+    return fmp4;
+}
+
+fragment_file_struct *fmp4_file_create_youtube(int video_media_type, int audio_media_type, int timescale, int lang_code, int frag_duration)
+{
+    fragment_file_struct *fmp4;
+
+    fmp4 = (fragment_file_struct*)malloc(sizeof(fragment_file_struct));
+    if (!fmp4) {
+        return NULL;
+    }
+    memset(fmp4, 0, sizeof(fragment_file_struct));
+
+    fmp4->video_media_type = video_media_type;
+    fmp4->audio_media_type = audio_media_type;
+    fmp4->buffer = (uint8_t*)memory_arena_alloc(MAX_MP4_SIZE);
+    if (!fmp4->buffer) {
+        free(fmp4);
+        return NULL;
+    }
+    memset(fmp4->buffer, 0, MAX_MP4_SIZE);
+
+    fmp4->buffer_offset = 0;
     fmp4->next_track_id = 3;
     fmp4->video_track_id = 1;
     fmp4->audio_track_id = 2;
@@ -1250,14 +1814,72 @@ fragment_file_struct *fmp4_file_create_youtube(int video_media_type, int audio_m
     return fmp4;
 }
 
+// video and audio as separate tracks of one file, written out together in each fragment
+fragment_file_struct *fmp4_file_create_muxed(int video_media_type, int audio_media_type, int timescale, int lang_code, int frag_duration)
+{
+    fragment_file_struct *fmp4;
+    track_struct *track_data;
+
+    fmp4 = (fragment_file_struct*)malloc(sizeof(fragment_file_struct));
+    if (!fmp4) {
+        return NULL;
+    }
+    memset(fmp4, 0, sizeof(fragment_file_struct));
+
+    track_data = track_slot(fmp4, 1);
+    if (!track_data) {
+        free(fmp4);
+        return NULL;
+    }
+
+    fmp4->video_media_type = video_media_type;
+    fmp4->audio_media_type = audio_media_type;
+    fmp4->buffer = (uint8_t*)memory_arena_alloc(MAX_MP4_SIZE);
+    if (!fmp4->buffer) {
+        free(fmp4->track_data);
+        free(fmp4);
+        return NULL;
+    }
+    memset(fmp4->buffer, 0, MAX_MP4_SIZE);
+
+    fmp4->buffer_offset = 0;
+    fmp4->next_track_id = 3;
+    fmp4->video_track_id = 1;
+    fmp4->audio_track_id = 2;
+    fmp4->track_count = 0;
+    fmp4->timescale = timescale;
+    fmp4->lang_code = lang_code;
+    fmp4->enable_muxed = 1;
+
+    track_data->sequence_number = 0;
+    track_data->frag_duration = frag_duration;
+    track_data->total_duration = 0;
+
+    return fmp4;
+}
+
 int fmp4_file_finalize(fragment_file_struct *fmp4)
 {
+    int track;
+    int frag;
+
     if (!fmp4) {
         return -1;
     }
 
-    free(fmp4->buffer);
+    // drop any frame references still held by fragments that were never written out
+    for (track = 0; track < fmp4->track_slots; track++) {
+        for (frag = 0; frag < fmp4->track_data[track].fragment_count; frag++) {
+            if (fmp4->track_data[track].fragments[frag].fragment_base) {
+                release_fragment(&fmp4->track_data[track].fragments[frag]);
+            }
+        }
+    }
+
+    memory_arena_free(fmp4->buffer, MAX_MP4_SIZE);
     fmp4->buffer = NULL;
+    free(fmp4->subsamples);
+    free(fmp4->track_data);
     free(fmp4);
 
     return 0;
@@ -1293,6 +1915,8 @@ int fmp4_fragment_end(fragment_file_struct *fmp4, int64_t *sidx_time, int64_t *s
             fmp4->track_data[atid].sequence_number++;
             fmp4->track_data[atid].fragment_count = 0;
         }
+    } else if (fmp4->enable_muxed) {
+        output_fmp4_muxed(fmp4, sidx_time, sidx_duration, start_time, frag_length, sequence_number);
     } else {
         fmp4->track_data[0].sequence_number = sequence_number;
         // video and audio track id are the same
@@ -1306,6 +1930,97 @@ int fmp4_fragment_end(fragment_file_struct *fmp4, int64_t *sidx_time, int64_t *s
     return 0;
 }
 
+// writes the samples queued since the previous part as a single moof/mdat pair- the first
+// part of a segment carries the styp so the parts of a segment concatenate into the segment
+int fmp4_fragment_part(fragment_file_struct *fmp4, double start_time, int fragment_type, int end_of_segment)
+{
+    track_struct *track_data = (track_struct*)&fmp4->track_data[0];
+    double part_time;
+    int64_t part_duration = 0;
+    int frag;
+
+    if (fmp4->enable_youtube || fmp4->enable_muxed) {
+        return -1;
+    }
+
+    fmp4->buffer_offset = 0;
+    fmp4->initial_offset = 0;
+    if (track_data->fragment_count > 0) {
+        if (track_data->part_count == 0) {
+            fmp4->initial_offset = output_fmp4_styp(fmp4, fragment_type);
+            if (track_data->track_type == TRACK_TYPE_VIDEO) {
+                track_data->part_decode_time = start_time - (double)track_data->fragments[0].fragment_composition_time;
+            } else {
+                track_data->part_decode_time = start_time;
+            }
+        }
+
+        part_time = track_data->part_decode_time;
+        if (track_data->track_type == TRACK_TYPE_VIDEO) {
+            part_time += (double)track_data->fragments[0].fragment_composition_time;  // tfdt takes it back off
+            for (frag = 0; frag < track_data->fragment_count; frag++) {
+                part_duration += track_data->fragments[frag].fragment_duration;
+            }
+        } else {
+            // same per sample duration as the tfhd default
+            part_duration = (int64_t)track_data->fragment_count * ((int64_t)track_data->fragments[0].fragment_duration * 90000 / 48000);
+        }
+
+        track_data->sequence_number++;
+        output_fmp4_moof(fmp4, part_time, track_data);
+        output_fmp4_mdat(fmp4, track_data);
+        track_data->part_decode_time += (double)part_duration;
+        track_data->part_count++;
+        track_data->fragment_count = 0;
+    }
+
+    if (end_of_segment) {
+        track_data->part_count = 0;
+    }
+
+    return 0;
+}
+
+// wraps the sync sample that opened the segment just written in a styp/moof/mdat header of
+// its own, built past the segment in the buffer- the sample itself is not copied again
+int fmp4_iframe_fragment(fragment_file_struct *fmp4, int64_t *header_offset, int *header_size, int64_t *sample_offset, int *sample_size)
+{
+    track_struct *track_data = (track_struct*)&fmp4->track_data[0];
+    int64_t saved_buffer_offset = fmp4->buffer_offset;
+    int64_t saved_initial_offset = fmp4->initial_offset;
+    int64_t saved_sidx_offset = track_data->sidx_buffer_offset;
+    int saved_fragment_count = track_data->fragment_count;
+    int saved_part_count = track_data->part_count;
+    int64_t mdat_size;
+
+    if (fmp4->enable_youtube || track_data->track_type != TRACK_TYPE_VIDEO || track_data->iframe_size <= 0) {
+        return 0;
+    }
+
+    *header_offset = fmp4->buffer_offset;
+    fmp4->initial_offset = fmp4->buffer_offset + output_fmp4_styp(fmp4, VIDEO_FRAGMENT);
+    track_data->fragment_count = 1;
+    track_data->part_count = 0;
+    track_data->iframe_reuse_iv = 1;
+    output_fmp4_moof(fmp4, track_data->iframe_time, track_data);
+    mdat_size = 8 + track_data->iframe_size;
+    output32(fmp4, mdat_size);
+    output_fmp4_4cc(fmp4,"mdat");
+    *header_size = fmp4->buffer_offset - *header_offset;
+    *sample_offset = track_data->iframe_position;
+    *sample_size = track_data->iframe_size;
+
+    fmp4->buffer_offset = saved_buffer_offset;
+    fmp4->initial_offset = saved_initial_offset;
+    track_data->sidx_buffer_offset = saved_sidx_offset;
+    track_data->fragment_count = saved_fragment_count;
+    track_data->part_count = saved_part_count;
+    track_data->iframe_reuse_iv = 0;
+    track_data->iframe_size = 0;
+
+    return 1;
+}
+
 int fmp4_video_set_pps(fragment_file_struct *fmp4, uint8_t *pps, int pps_size)
 {
     if (!fmp4) {
@@ -1379,6 +2094,9 @@ int fmp4_video_track_create(fragment_file_struct *fmp4, int video_width, int vid
     }
     int vtid = fmp4->video_track_id-1;
 
+    if (!track_slot(fmp4, fmp4->video_track_id)) {
+        return -1;
+    }
     fmp4->track_count++;
 
     fmp4->track_data[vtid].fragment_count = 0;
@@ -1392,6 +2110,16 @@ int fmp4_video_track_create(fragment_file_struct *fmp4, int video_width, int vid
     return 0;
 }
 
+// the init segment and the media segments of a rendition share the segcrypt handle
+int fmp4_set_encryption(fragment_file_struct *fmp4, void *crypt)
+{
+    if (!fmp4) {
+        return -1;
+    }
+    fmp4->crypt = crypt;
+    return 0;
+}
+
 uint8_t *fmp4_get_fragment(fragment_file_struct *fmp4, int *fragment_size)
 {
     if (!fragment_size) {
@@ -1409,6 +2137,9 @@ int fmp4_audio_track_create(fragment_file_struct *fmp4, int audio_channels, int
     }
     int atid = fmp4->audio_track_id-1;
 
+    if (!track_slot(fmp4, fmp4->audio_track_id)) {
+        return -1;
+    }
     fmp4->track_count++;
 
     fmp4->track_data[atid].fragment_count = 0;
@@ -1435,215 +2166,21 @@ int fmp4_audio_track_create(fragment_file_struct *fmp4, int audio_channels, int
     return 0;
 }
 
-#define NALSIZE_SIZE 4
-
-static int replace_startcode_with_size_hevc(uint8_t *input_buffer, int input_buffer_size, uint8_t *output_buffer, int max_output_buffer_size)
-{
-    int parsing_sample = 0;
-    uint8_t *sample_buffer = output_buffer;
-    int saved_position = 0;
-    int sample_size;
-    int read_pos = 0;
-    int write_pos = 0;
-    int nal_type;
-
-    while (read_pos < input_buffer_size) {
-        if (input_buffer[read_pos+0] == 0x00 &&
-            input_buffer[read_pos+1] == 0x00 &&
-            input_buffer[read_pos+2] == 0x00 &&
-            input_buffer[read_pos+3] == 0x01) {
-
-            nal_type = (input_buffer[read_pos+4] & 0x7f) >> 1;
-            if (parsing_sample) {
-                sample_size = write_pos - saved_position - NALSIZE_SIZE;
-                *(sample_buffer+saved_position+0) = (sample_size >> 24) & 0xff;
-                *(sample_buffer+saved_position+1) = (sample_size >> 16) & 0xff;
-                *(sample_buffer+saved_position+2) = (sample_size >> 8) & 0xff;
-                *(sample_buffer+saved_position+3) = sample_size & 0xff;
-                parsing_sample = 0;
-            }
-
-            if (nal_type == 35) {//aud
-                parsing_sample = 0;
-                read_pos += 4;
-                continue;
-            }
-
-            if (nal_type == 32 || nal_type == 33 || nal_type == 34) {  // nal_type == 20
-                fprintf(stderr,"replace_startcode_with_size_hevc: nal_type=0x%x  pos=%d\n", nal_type, write_pos);
-            }
-
-            saved_position = write_pos;
-            *(sample_buffer+write_pos+0) = 0xf0;
-            *(sample_buffer+write_pos+1) = 0x0d;
-            *(sample_buffer+write_pos+2) = 0xf0;
-            *(sample_buffer+write_pos+3) = 0x0d;
-            parsing_sample = 1;
-            read_pos += 4;
-            write_pos += NALSIZE_SIZE;
-        } else if (input_buffer[read_pos+0] == 0x00 &&
-                   input_buffer[read_pos+1] == 0x00 &&
-                   input_buffer[read_pos+2] == 0x01) {
-
-            nal_type = (input_buffer[read_pos+3] & 0x7f) >> 1;
-            if (parsing_sample) {
-                sample_size = write_pos - saved_position - NALSIZE_SIZE;
-                *(sample_buffer+saved_position+0) = (sample_size >> 24) & 0xff;
-                *(sample_buffer+saved_position+1) = (sample_size >> 16) & 0xff;
-                *(sample_buffer+saved_position+2) = (sample_size >> 8) & 0xff;
-                *(sample_buffer+saved_position+3) = sample_size & 0xff;
-                parsing_sample = 0;
-            }
-
-            if (nal_type == 35) {//aud
-                parsing_sample = 0;
-                read_pos += 3;
-                continue;
-            }
-
-            if (nal_type == 32 || nal_type == 33 || nal_type == 34) {
-                fprintf(stderr,"replace_startcode_with_size_hevc: nal_type=0x%x  pos=%d\n", nal_type, write_pos);
-            }
-            saved_position = write_pos;
-            *(sample_buffer+write_pos+0) = 0xf0;
-            *(sample_buffer+write_pos+1) = 0x0d;
-            *(sample_buffer+write_pos+2) = 0xf0;
-            *(sample_buffer+write_pos+3) = 0x0d;
-            parsing_sample = 1;
-            read_pos += 3;
-            write_pos += NALSIZE_SIZE;
-        } else {
-            if (parsing_sample) {
-                sample_buffer[write_pos] = input_buffer[read_pos];
-                write_pos++;
-            }
-            read_pos++;
-        }
-    }
-    if (parsing_sample) {
-        sample_size = write_pos - saved_position - NALSIZE_SIZE;
-        *(sample_buffer+saved_position+0) = ((uint32_t)sample_size >> 24) & 0xff;
-        *(sample_buffer+saved_position+1) = ((uint32_t)sample_size >> 16) & 0xff;
-        *(sample_buffer+saved_position+2) = ((uint32_t)sample_size >> 8) & 0xff;
-        *(sample_buffer+saved_position+3) = (uint32_t)sample_size & 0xff;
-    }
-    return write_pos;
-}
-
-static int replace_startcode_with_size_h264(uint8_t *input_buffer, int input_buffer_size, uint8_t *output_buffer, int max_output_buffer_size)
-{
-    int parsing_sample = 0;
-    uint8_t *sample_buffer = output_buffer;
-    int saved_position = 0;
-    int sample_size;
-    int read_pos = 0;
-    int write_pos = 0;
-
-    while (read_pos < input_buffer_size) {
-        if (input_buffer[read_pos+0] == 0x00 &&
-            input_buffer[read_pos+1] == 0x00 &&
-            input_buffer[read_pos+2] == 0x00 &&
-            input_buffer[read_pos+3] == 0x01) {
-            int nal_type = input_buffer[read_pos+4] & 0x1f;
-            if (parsing_sample) {
-                sample_size = write_pos - saved_position - NALSIZE_SIZE;
-                *(sample_buffer+saved_position+0) = (sample_size >> 24) & 0xff;
-                *(sample_buffer+saved_position+1) = (sample_size >> 16) & 0xff;
-                *(sample_buffer+saved_position+2) = (sample_size >> 8) & 0xff;
-                *(sample_buffer+saved_position+3) = sample_size & 0xff;
-                parsing_sample = 0;
-            }
-            if (nal_type == 9) {
-                parsing_sample = 0;
-                read_pos += 4;
-                continue;
-            }
-
-            // enable this code to skip including sps/pps inline with the content, it doesn't hurt to have it there
-            /*if (nal_type == 7 || nal_type == 8) {  // skip out on the sps/pps
-                parsing_sample = 0;
-                read_pos += 4;
-                continue;
-            }*/
-
-            if (nal_type == 7 || nal_type == 8 || nal_type == 5) {
-                fprintf(stderr,"replace_startcode_with_size_h264: nal_type=0x%x  pos=%d\n", nal_type, write_pos);
-            }
-            saved_position = write_pos;
-            *(sample_buffer+write_pos+0) = 0x00;
-            *(sample_buffer+write_pos+1) = 0x00;
-            *(sample_buffer+write_pos+2) = 0x00;
-            *(sample_buffer+write_pos+3) = 0x01;
-            parsing_sample = 1;
-            read_pos += 4;
-            write_pos += NALSIZE_SIZE;
-        } else if (input_buffer[read_pos+0] == 0x00 &&
-                   input_buffer[read_pos+1] == 0x00 &&
-                   input_buffer[read_pos+2] == 0x01) {
-            int nal_type = input_buffer[read_pos+3] & 0x1f;
-            if (parsing_sample) {
-                sample_size = write_pos - saved_position - NALSIZE_SIZE;
-                *(sample_buffer+saved_position+0) = (sample_size >> 24) & 0xff;
-                *(sample_buffer+saved_position+1) = (sample_size >> 16) & 0xff;
-                *(sample_buffer+saved_position+2) = (sample_size >> 8) & 0xff;
-                *(sample_buffer+saved_position+3) = sample_size & 0xff;
-                parsing_sample = 0;
-            }
-
-            if (nal_type == 9) {
-                parsing_sample = 0;
-                read_pos += 3;
-                continue;
-            }
-
-            // enable this code to skip including sps/pps inline with the content- it doesn't hurt to have it there
-            /*if (nal_type == 7 || nal_type == 8) {  // skip out on the sps/pps
-                parsing_sample = 0;
-                read_pos += 3;
-                continue;
-            }*/
-
-            if (nal_type == 7 || nal_type == 8 || nal_type == 5) {
-                fprintf(stderr,"replace_startcode_with_size_h264: nal_type=0x%x  pos=%d\n", nal_type, write_pos);
-            }
-            saved_position = write_pos;
-            *(sample_buffer+write_pos+0) = 0x00;
-            *(sample_buffer+write_pos+1) = 0x00;
-            *(sample_buffer+write_pos+2) = 0x00;
-            *(sample_buffer+write_pos+3) = 0x01;
-            parsing_sample = 1;
-            read_pos += 3;
-            write_pos += NALSIZE_SIZE;
-        } else {
-            if (parsing_sample) {
-                sample_buffer[write_pos] = input_buffer[read_pos];
-                write_pos++;
-            }
-            read_pos++;
-        }
-    }
-    if (parsing_sample) {
-        sample_size = write_pos - saved_position - NALSIZE_SIZE;
-        *(sample_buffer+saved_position+0) = ((uint32_t)sample_size >> 24) & 0xff;
-        *(sample_buffer+saved_position+1) = ((uint32_t)sample_size >> 16) & 0xff;
-        *(sample_buffer+saved_position+2) = ((uint32_t)sample_size >> 8) & 0xff;
-        *(sample_buffer+saved_position+3) = (uint32_t)sample_size & 0xff;
-    }
-    return write_pos;
-}
 
 int fmp4_video_fragment_add(fragment_file_struct *fmp4,
                             uint8_t *fragment_buffer,
                             int fragment_buffer_size,
                             double fragment_timestamp,
                             int fragment_duration,
-                            int64_t fragment_composition_time)
+                            int64_t fragment_composition_time,
+                            void *buffer_pool)
 {
     int vtid = fmp4->video_track_id-1;
     track_struct *track_data = (track_struct*)&fmp4->track_data[vtid];
     int frag = track_data->fragment_count;
     uint8_t *new_frag;
     int updated_fragment_buffer_size;
+    int is_hevc;
 
     if (frag >= MAX_FRAGMENTS) {
         fprintf(stderr,"MP4CORE: ERROR - EXCEEDED NUMBER OF VIDEO FRAGMENTS: %d!  VTID:%d\n", frag, vtid);
@@ -1652,31 +2189,38 @@ int fmp4_video_fragment_add(fragment_file_struct *fmp4,
 
     if (frag == 0) {
         track_data->fragment_start_timestamp = fragment_timestamp * fmp4->timescale;
+        fmp4->subsample_count = 0;
     }
 
-    new_frag = (uint8_t*)malloc(fragment_buffer_size*2);
-
-    memset(new_frag,0,fragment_buffer_size*2); // debugging
-
-    if (fmp4->video_media_type == MEDIA_TYPE_HEVC) {
-        updated_fragment_buffer_size = replace_startcode_with_size_hevc(fragment_buffer, fragment_buffer_size, new_frag, fragment_buffer_size*2);
-    } else {
-        updated_fragment_buffer_size = replace_startcode_with_size_h264(fragment_buffer, fragment_buffer_size, new_frag, fragment_buffer_size*2);
-    }
-
-    /*
-    static FILE *temp = NULL;
-    if (!temp) {
-        temp = fopen("debug.264","w");
+    is_hevc = (fmp4->video_media_type == MEDIA_TYPE_HEVC);
+    track_data->fragments[frag].subsample_count = 0;
+    if (fmp4->crypt && subsample_map(fmp4, &track_data->fragments[frag], fragment_buffer, fragment_buffer_size, is_hevc) < 0) {
+        return -1;
     }
-    if (temp) {
-        fwrite(new_frag, 1, updated_fragment_buffer_size, temp);
-        //fwrite(fragment_buffer, 1, fragment_buffer_size, temp);
-        fflush(temp);
+    if (fragment_can_ref(buffer_pool)) {
+        // hold a reference on the frame and convert it straight into the mdat later
+        memory_ref(buffer_pool, fragment_buffer);
+        track_data->fragments[frag].fragment_base = fragment_buffer;
+        track_data->fragments[frag].fragment_pool = buffer_pool;
+        track_data->fragments[frag].fragment_buffer = fragment_buffer;
+        track_data->fragments[frag].fragment_source_size = fragment_buffer_size;
+        track_data->fragments[frag].fragment_convert = is_hevc ? FRAGMENT_CONVERT_HEVC : FRAGMENT_CONVERT_H264;
+        updated_fragment_buffer_size = replace_startcode_with_size(fragment_buffer, fragment_buffer_size, NULL, is_hevc);
+    } else {
+        new_frag = (uint8_t*)malloc(replace_startcode_with_size(fragment_buffer, fragment_buffer_size, NULL, is_hevc));
+        if (!new_frag) {
+            fprintf(stderr,"MP4CORE: ERROR - UNABLE TO ALLOCATE VIDEO FRAGMENT! VTID:%d\n", vtid);
+            return -1;
+        }
+        updated_fragment_buffer_size = replace_startcode_with_size(fragment_buffer, fragment_buffer_size, new_frag, is_hevc);
+        __sync_fetch_and_add(&fmp4_copied, updated_fragment_buffer_size);
+        track_data->fragments[frag].fragment_base = new_frag;
+        track_data->fragments[frag].fragment_pool = NULL;
+        track_data->fragments[frag].fragment_buffer = new_frag;
+        track_data->fragments[frag].fragment_source_size = updated_fragment_buffer_size;
+        track_data->fragments[frag].fragment_convert = FRAGMENT_CONVERT_NONE;
     }
-    */
 
-    track_data->fragments[frag].fragment_buffer = new_frag;
     track_data->fragments[frag].fragment_buffer_size = updated_fragment_buffer_size;
     track_data->fragments[frag].fragment_duration = fragment_duration;
     track_data->fragments[frag].fragment_timestamp = fragment_timestamp * fmp4->timescale;
@@ -1691,7 +2235,8 @@ int fmp4_audio_fragment_add(fragment_file_struct *fmp4,
                             uint8_t *fragment_buffer,
                             int fragment_buffer_size,
                             double fragment_timestamp,
-                            int fragment_duration)
+                            int fragment_duration,
+                            void *buffer_pool)
 {
     uint8_t *new_frag;
     int header_size;
@@ -1699,8 +2244,12 @@ int fmp4_audio_fragment_add(fragment_file_struct *fmp4,
 
     int atid = fmp4->audio_track_id-1;
     track_struct *track_data = (track_struct*)&fmp4->track_data[atid];
-    int frag = track_data->fragment_count;
+    int frag;
 
+    if (atid >= fmp4->track_slots) {
+        return -1;
+    }
+    frag = track_data->fragment_count;
     if (frag >= MAX_FRAGMENTS) {
         fprintf(stderr,"MP4CORE: ERROR - EXCEEDED NUMBER OF AUDIO FRAGMENTS: %d!  ATID:%d\n", frag, atid);
         exit(0);
@@ -1710,22 +2259,341 @@ int fmp4_audio_fragment_add(fragment_file_struct *fmp4,
         track_data->fragment_start_timestamp = fragment_timestamp * fmp4->timescale; // should this be sampling rate instead?
     }
 
-    new_frag = (uint8_t*)malloc(fragment_buffer_size*2);
-
-    memset(new_frag,0,fragment_buffer_size*2);  // debugging
-
     header_size = ADTS_HEADER_SIZE + ((fragment_buffer[1] & 0x01) ? 0 : 2);  // check for crc
 
     fragment_buffer_size -= header_size;
-    memcpy(new_frag, fragment_buffer + header_size, fragment_buffer_size);
+    if (fragment_can_ref(buffer_pool)) {
+        // reference the raw aac payload behind the adts header
+        memory_ref(buffer_pool, fragment_buffer);
+        track_data->fragments[frag].fragment_base = fragment_buffer;
+        track_data->fragments[frag].fragment_pool = buffer_pool;
+        track_data->fragments[frag].fragment_buffer = fragment_buffer + header_size;
+    } else {
+        new_frag = (uint8_t*)malloc(fragment_buffer_size);
+        if (!new_frag) {
+            fprintf(stderr,"MP4CORE: ERROR - UNABLE TO ALLOCATE AUDIO FRAGMENT! ATID:%d\n", atid);
+            return -1;
+        }
+        memcpy(new_frag, fragment_buffer + header_size, fragment_buffer_size);
+        __sync_fetch_and_add(&fmp4_copied, fragment_buffer_size);
+        track_data->fragments[frag].fragment_base = new_frag;
+        track_data->fragments[frag].fragment_pool = NULL;
+        track_data->fragments[frag].fragment_buffer = new_frag;
+    }
+    track_data->fragments[frag].fragment_source_size = fragment_buffer_size;
+    track_data->fragments[frag].fragment_convert = FRAGMENT_CONVERT_NONE;
 
-    track_data->fragments[frag].fragment_buffer = new_frag;
     track_data->fragments[frag].fragment_buffer_size = fragment_buffer_size;
     track_data->fragments[frag].fragment_duration = fragment_duration;
     track_data->fragments[frag].fragment_timestamp = fragment_timestamp * fmp4->timescale;  // should this be sampling rate?
     track_data->fragments[frag].fragment_composition_time = 0;
+    track_data->fragments[frag].subsample_count = 0;  // the whole frame is protected
 
     track_data->fragment_count++;
 
     return 0;
 }
+
+static uint32_t input32_raw(uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+}
+
+static uint64_t input64_raw(uint8_t *data)
+{
+    return ((uint64_t)input32_raw(data) << 32) | (uint64_t)input32_raw(data + 4);
+}
+
+typedef struct _trim_sample_struct_ {
+    uint8_t                 *data;
+    int                     size;
+    int                     duration;
+    int64_t                 decode_time;
+    int64_t                 composition_time;
+} trim_sample_struct;
+
+static int sample_is_idr(uint8_t *data, int size, int is_hevc)
+{
+    int pos = 0;
+
+    while (pos + NALSIZE_SIZE < size) {
+        int nal_size = (int)input32_raw(data + pos);
+        int nal_type;
+
+        pos += NALSIZE_SIZE;
+        if (is_hevc) {
+            nal_type = (data[pos] & 0x7f) >> 1;
+            if (nal_type >= 16 && nal_type <= 21) {
+                return 1;
+            }
+        } else {
+            nal_type = data[pos] & 0x1f;
+            if (nal_type == 5) {
+                return 1;
+            }
+        }
+        pos += nal_size;
+    }
+    return 0;
+}
+
+// collects the samples of one track of our own media segments, styp/sidx then one moof/mdat per part
+static int trim_parse(uint8_t *segment, int segment_size, int track_id, trim_sample_struct *samples, int *is_hevc, uint32_t *sequence_number)
+{
+    int sample_count = 0;
+    int pos = 0;
+
+    while (pos + 8 <= segment_size) {
+        uint32_t box_size = input32_raw(segment + pos);
+        uint8_t *box = segment + pos;
+        uint32_t default_duration = 0;
+        int64_t decode_time = 0;
+        int other_track = 0;
+        int inner;
+
+        if (box_size < 8 || pos + box_size > segment_size) {
+            return -1;
+        }
+        if (memcmp(box + 4, "styp", 4) == 0) {
+            for (inner = 16; inner + 4 <= box_size; inner += 4) {
+                if (memcmp(box + inner, "hvc1", 4) == 0) {
+                    *is_hevc = 1;
+                }
+            }
+        }
+        if (memcmp(box + 4, "moof", 4) != 0) {
+            pos += box_size;
+            continue;
+        }
+        for (inner = 8; inner + 8 <= box_size; inner += input32_raw(box + inner)) {
+            uint8_t *child = box + inner;
+            int traf_pos;
+
+            if (input32_raw(child) < 8 || inner + input32_raw(child) > box_size) {
+                return -1;
+            }
+            if (memcmp(child + 4, "mfhd", 4) == 0) {
+                *sequence_number = input32_raw(child + 12);
+                continue;
+            }
+            if (memcmp(child + 4, "traf", 4) != 0) {
+                continue;
+            }
+            for (traf_pos = 8; traf_pos + 8 <= input32_raw(child); traf_pos += input32_raw(child + traf_pos)) {
+                uint8_t *leaf = child + traf_pos;
+                uint32_t flags = input32_raw(leaf + 8) & 0xffffff;
+
+                if (input32_raw(leaf) < 16 || traf_pos + input32_raw(leaf) > input32_raw(child)) {
+                    return -1;
+                }
+                if (memcmp(leaf + 4, "tfhd", 4) == 0) {
+                    uint8_t *field = leaf + 16;
+
+                    other_track = (input32_raw(leaf + 12) != track_id);
+
+                    if (flags & 0x01) field += 8;
+                    if (flags & 0x02) field += 4;
+                    if (flags & 0x08 && !other_track) default_duration = input32_raw(field);
+                } else if (memcmp(leaf + 4, "tfdt", 4) == 0 && !other_track) {
+                    decode_time = leaf[8] == 1 ? (int64_t)input64_raw(leaf + 12) : (int64_t)input32_raw(leaf + 12);
+                } else if (memcmp(leaf + 4, "trun", 4) == 0 && !other_track) {
+                    uint32_t count = input32_raw(leaf + 12);
+                    uint8_t *field = leaf + 16;
+                    uint8_t *data = box;
+                    uint32_t sample;
+
+                    if (flags & 0x01) {
+                        data = box + (int32_t)input32_raw(field);
+                        field += 4;
+                    }
+                    if (flags & 0x04) field += 4;
+                    for (sample = 0; sample < count; sample++) {
+                        trim_sample_struct *current = &samples[sample_count];
+
+                        if (sample_count >= MAX_FRAGMENTS) {
+                            return -1;
+                        }
+                        current->duration = default_duration;
+                        current->composition_time = 0;
+                        if (flags & 0x100) { current->duration = input32_raw(field); field += 4; }
+                        if (flags & 0x200) { current->size = input32_raw(field); field += 4; }
+                        if (flags & 0x400) field += 4;
+                        if (flags & 0x800) { current->composition_time = (int32_t)input32_raw(field); field += 4; }
+                        if (data < segment || data + current->size > segment + segment_size) {
+                            return -1;
+                        }
+                        current->data = data;
+                        current->decode_time = decode_time;
+                        data += current->size;
+                        decode_time += current->duration;
+                        sample_count++;
+                    }
+                }
+            }
+        }
+        pos += box_size;
+    }
+    return sample_count;
+}
+
+// copies samples [first, last) of a parsed segment into the fragments of a track
+static int trim_fragments(track_struct *track_data, trim_sample_struct *samples, int first, int last, int fragment_type)
+{
+    int sample;
+
+    for (sample = first; sample < last; sample++) {
+        fragment_struct *fragment = &track_data->fragments[track_data->fragment_count];
+        uint8_t *copy = (uint8_t*)malloc(samples[sample].size);
+
+        if (!copy) {
+            return -1;
+        }
+        memcpy(copy, samples[sample].data, samples[sample].size);
+        __sync_fetch_and_add(&fmp4_copied, samples[sample].size);
+        fragment->fragment_base = copy;
+        fragment->fragment_pool = NULL;
+        fragment->fragment_buffer = copy;
+        fragment->fragment_source_size = samples[sample].size;
+        fragment->fragment_buffer_size = samples[sample].size;
+        fragment->fragment_convert = FRAGMENT_CONVERT_NONE;
+        fragment->fragment_timestamp = samples[sample].decode_time;
+        fragment->fragment_composition_time = samples[sample].composition_time;
+        if (fragment_type == VIDEO_FRAGMENT) {
+            fragment->fragment_duration = samples[sample].duration;
+        } else {
+            // the tfhd default is written back out in 90kHz from 48kHz samples
+            fragment->fragment_duration = (int)(((int64_t)samples[sample].duration * 48000 + 45000) / 90000);
+        }
+        track_data->fragment_count++;
+    }
+    track_data->part_count = 0;
+
+    return 0;
+}
+
+static void trim_release(fragment_file_struct *fmp4)
+{
+    int track;
+
+    for (track = 0; track < fmp4->track_slots; track++) {
+        track_struct *track_data = (track_struct*)&fmp4->track_data[track];
+
+        while (track_data->fragment_count > 0) {
+            release_fragment(&track_data->fragments[--track_data->fragment_count]);
+        }
+    }
+}
+
+// rebuilds one of our own media segments with only the samples decoded between *from and *to
+// (90kHz ticks after the first sample, *to < 0 runs to the end) as a single moof/mdat.  the cut
+// moves to the nearest sync sample, or frame for the end of a segment, and the times actually
+// used are handed back.  a muxed file keeps the audio decoded inside the video span as its
+// second traf.  returns 1 when no samples are left
+int fmp4_segment_trim(fragment_file_struct *fmp4, uint8_t *segment, int segment_size, int64_t *from, int64_t *to, int fragment_type)
+{
+    trim_sample_struct *samples;
+    track_struct *track_data = (track_struct*)&fmp4->track_data[0];
+    uint32_t sequence_number = 0;
+    int is_hevc = 0;
+    int64_t sidx_time;
+    int64_t sidx_duration;
+    int64_t best;
+    int sample_count;
+    int first = 0;
+    int last;
+    int sample;
+
+    samples = (trim_sample_struct*)malloc(sizeof(trim_sample_struct) * MAX_FRAGMENTS);
+    if (!samples) {
+        return -1;
+    }
+    sample_count = trim_parse(segment, segment_size, fmp4->video_track_id, samples, &is_hevc, &sequence_number);
+    if (sample_count <= 0) {
+        free(samples);
+        return -1;
+    }
+    if (fragment_type == VIDEO_FRAGMENT) {
+        fmp4->video_media_type = is_hevc ? MEDIA_TYPE_HEVC : MEDIA_TYPE_H264;
+    }
+    last = sample_count;
+
+    best = -1;
+    for (sample = 0; sample < sample_count && *from > 0; sample++) {
+        int64_t distance = llabs(samples[sample].decode_time - samples[0].decode_time - *from);
+
+        if (fragment_type == VIDEO_FRAGMENT && !sample_is_idr(samples[sample].data, samples[sample].size, is_hevc)) {
+            continue;
+        }
+        if (best < 0 || distance < best) {
+            best = distance;
+            first = sample;
+        }
+    }
+    best = -1;
+    for (sample = first + 1; sample <= sample_count && *to >= 0; sample++) {
+        int64_t end_time = sample < sample_count ? samples[sample].decode_time : samples[sample-1].decode_time + samples[sample-1].duration;
+        int64_t distance = llabs(end_time - samples[0].decode_time - *to);
+
+        if (best < 0 || distance < best) {
+            best = distance;
+            last = sample;
+        }
+    }
+    *from = samples[first].decode_time - samples[0].decode_time;
+    *to = samples[last-1].decode_time + samples[last-1].duration - samples[0].decode_time;
+    if (*to - *from <= 0) {
+        free(samples);
+        return 1;
+    }
+
+    if (trim_fragments(track_data, samples, first, last, fragment_type) < 0) {
+        trim_release(fmp4);
+        free(samples);
+        return -1;
+    }
+
+    if (fmp4->enable_muxed) {
+        trim_sample_struct *audio = (trim_sample_struct*)malloc(sizeof(trim_sample_struct) * MAX_FRAGMENTS);
+        track_struct *audio_track = (track_struct*)&fmp4->track_data[fmp4->audio_track_id-1];
+        int64_t span_start = samples[first].decode_time;
+        int64_t span_end = samples[last-1].decode_time + samples[last-1].duration;
+        int audio_count;
+        int audio_first = -1;
+        int audio_last = 0;
+
+        audio_count = audio ? trim_parse(segment, segment_size, fmp4->audio_track_id, audio, &is_hevc, &sequence_number) : -1;
+        if (audio_count < 0 || fmp4->audio_track_id > fmp4->track_slots) {
+            trim_release(fmp4);
+            free(audio);
+            free(samples);
+            return -1;
+        }
+        for (sample = 0; sample < audio_count; sample++) {
+            if (audio[sample].decode_time >= span_start && audio[sample].decode_time < span_end) {
+                if (audio_first < 0) {
+                    audio_first = sample;
+                }
+                audio_last = sample + 1;
+            }
+        }
+        // the audio tfdt is taken from the start timestamp rather than the segment time
+        if (audio_first >= 0) {
+            if (trim_fragments(audio_track, audio, audio_first, audio_last, AUDIO_FRAGMENT) < 0) {
+                trim_release(fmp4);
+                free(audio);
+                free(samples);
+                return -1;
+            }
+            audio_track->fragment_start_timestamp = audio[audio_first].decode_time * fmp4->timescale;
+        }
+        free(audio);
+    }
+
+    // the tfdt is written as start time less the first composition offset
+    fmp4_fragment_end(fmp4, &sidx_time, &sidx_duration,
+                      (double)(samples[first].decode_time + (fragment_type == VIDEO_FRAGMENT ? samples[first].composition_time : 0)),
+                      (double)(*to - *from), sequence_number, fragment_type);
+    free(samples);
+
+    return 0;
+}
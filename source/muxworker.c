@@ -0,0 +1,222 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <syslog.h>
+#include "muxworker.h"
+
+typedef struct _muxworker_slot_struct_ {
+    muxworker_job       job;
+    uint8_t             context[MUXWORKER_JOB_SIZE];
+} muxworker_slot_struct;
+
+// jobs for one worker run in the order they were submitted, so everything
+// for a rendition goes to the same worker
+typedef struct _muxworker_struct_ {
+    int                     index;
+    pthread_mutex_t         lock;
+    pthread_cond_t          ready;
+    pthread_cond_t          done;
+    muxworker_slot_struct   slots[MUXWORKER_QUEUE_SIZE];
+    int                     head;
+    int                     count;
+    int                     quit;
+    pthread_t               worker_thread_id;
+
+    int64_t                 jobs;
+    int64_t                 busy_usec;
+    int64_t                 full_stalls;
+    int64_t                 waits;
+    int64_t                 wait_usec;
+    int64_t                 started;
+} muxworker_struct;
+
+static int64_t muxworker_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void *muxworker_thread(void *context)
+{
+    muxworker_struct *worker = (muxworker_struct*)context;
+    muxworker_slot_struct *slot;
+    int64_t start_time;
+
+    pthread_mutex_lock(&worker->lock);
+    while (1) {
+        while (worker->count == 0 && !worker->quit) {
+            pthread_cond_wait(&worker->ready, &worker->lock);
+        }
+        if (worker->count == 0) {
+            break;
+        }
+        slot = &worker->slots[worker->head];
+        pthread_mutex_unlock(&worker->lock);
+
+        start_time = muxworker_now();
+        slot->job(slot->context);
+
+        pthread_mutex_lock(&worker->lock);
+        worker->busy_usec += muxworker_now() - start_time;
+        worker->jobs++;
+        // the slot is only handed back once the job is finished with its context
+        worker->head = (worker->head + 1) % MUXWORKER_QUEUE_SIZE;
+        worker->count--;
+        pthread_cond_broadcast(&worker->done);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+void *muxworker_create(int index)
+{
+    muxworker_struct *worker;
+
+    worker = (muxworker_struct*)malloc(sizeof(muxworker_struct));
+    if (!worker) {
+        return NULL;
+    }
+    memset(worker, 0, sizeof(muxworker_struct));
+    worker->index = index;
+    worker->started = muxworker_now();
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->ready, NULL);
+    pthread_cond_init(&worker->done, NULL);
+    if (pthread_create(&worker->worker_thread_id, NULL, muxworker_thread, (void*)worker) != 0) {
+        pthread_cond_destroy(&worker->done);
+        pthread_cond_destroy(&worker->ready);
+        pthread_mutex_destroy(&worker->lock);
+        free(worker);
+        return NULL;
+    }
+
+    return (void*)worker;
+}
+
+void muxworker_destroy(void *worker)
+{
+    muxworker_struct *worker1 = (muxworker_struct*)worker;
+
+    if (!worker1) {
+        return;
+    }
+
+    // queued jobs still run, they hold buffer references that have to be dropped
+    pthread_mutex_lock(&worker1->lock);
+    worker1->quit = 1;
+    pthread_cond_signal(&worker1->ready);
+    pthread_mutex_unlock(&worker1->lock);
+    pthread_join(worker1->worker_thread_id, NULL);
+
+    pthread_cond_destroy(&worker1->done);
+    pthread_cond_destroy(&worker1->ready);
+    pthread_mutex_destroy(&worker1->lock);
+    free(worker1);
+}
+
+int muxworker_submit(void *worker, muxworker_job job, const void *context, int context_size)
+{
+    muxworker_struct *worker1 = (muxworker_struct*)worker;
+    muxworker_slot_struct *slot;
+
+    if (context_size > MUXWORKER_JOB_SIZE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&worker1->lock);
+    if (worker1->count == MUXWORKER_QUEUE_SIZE) {
+        worker1->full_stalls++;
+        while (worker1->count == MUXWORKER_QUEUE_SIZE) {
+            pthread_cond_wait(&worker1->done, &worker1->lock);
+        }
+    }
+    slot = &worker1->slots[(worker1->head + worker1->count) % MUXWORKER_QUEUE_SIZE];
+    slot->job = job;
+    memcpy(slot->context, context, context_size);
+    worker1->count++;
+    pthread_cond_signal(&worker1->ready);
+    pthread_mutex_unlock(&worker1->lock);
+
+    return 0;
+}
+
+// returns once every job submitted so far has run
+int muxworker_wait(void *worker)
+{
+    muxworker_struct *worker1 = (muxworker_struct*)worker;
+    int64_t start_time;
+
+    if (!worker1) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&worker1->lock);
+    if (worker1->count > 0) {
+        start_time = muxworker_now();
+        while (worker1->count > 0) {
+            pthread_cond_wait(&worker1->done, &worker1->lock);
+        }
+        worker1->waits++;
+        worker1->wait_usec += muxworker_now() - start_time;
+    }
+    pthread_mutex_unlock(&worker1->lock);
+
+    return 0;
+}
+
+void muxworker_report(void *worker)
+{
+    muxworker_struct *worker1 = (muxworker_struct*)worker;
+    int64_t elapsed;
+
+    if (!worker1) {
+        return;
+    }
+
+    pthread_mutex_lock(&worker1->lock);
+    elapsed = muxworker_now() - worker1->started;
+    syslog(LOG_INFO,"MUXWORKER(%d): JOBS:%ld QUEUED:%d BUSY:%.1f%% FULL STALLS:%ld WAITS:%ld WAITED:%ldus\n",
+           worker1->index,
+           worker1->jobs,
+           worker1->count,
+           elapsed > 0 ? (double)worker1->busy_usec * 100.0 / (double)elapsed : 0.0,
+           worker1->full_stalls,
+           worker1->waits,
+           worker1->wait_usec);
+    worker1->jobs = 0;
+    worker1->busy_usec = 0;
+    worker1->full_stalls = 0;
+    worker1->waits = 0;
+    worker1->wait_usec = 0;
+    worker1->started = muxworker_now();
+    pthread_mutex_unlock(&worker1->lock);
+}
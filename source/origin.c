@@ -0,0 +1,1235 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "fillet.h"
+#include "origin.h"
+#include "clipexport.h"
+
+struct _origin_struct_;
+
+typedef struct _origin_object_struct_ {
+    int                 fd;
+    int64_t             size;
+    int64_t             cached;
+    struct _origin_struct_ *origin;
+    time_t              modified;
+    uint32_t            generation;
+    int                 flags;
+    int                 refcount;
+    int                 failed;
+    int64_t             media_sequence;     // newest part listed in a playlist, -1 otherwise
+    int                 part;
+    char                name[ORIGIN_MAX_NAME];
+} origin_object_struct;
+
+typedef struct _origin_entry_struct_ {
+    char                            name[ORIGIN_MAX_NAME];
+    origin_object_struct            *object;
+    struct _origin_entry_struct_    *hash_next;
+    struct _origin_entry_struct_    *older;
+    struct _origin_entry_struct_    *newer;
+} origin_entry_struct;
+
+typedef struct _origin_struct_ {
+    pthread_mutex_t         lock;
+    pthread_cond_t          published;
+    origin_entry_struct     *hash[ORIGIN_HASH_SIZE];
+    origin_entry_struct     *oldest;
+    origin_entry_struct     *newest;
+    int64_t                 cache_bytes;
+    int64_t                 cache_limit;
+    int                     entry_count;
+    uint32_t                generation;
+
+    int                     port;
+    int                     server;
+    volatile int            quit;
+    pthread_t               server_thread_id;
+    int                     clients[ORIGIN_MAX_CONNECTIONS];
+    volatile int            connections;
+    int                     hold_ms;
+
+    int64_t                 requests;
+    int64_t                 hits;
+    int64_t                 not_modified;
+    int64_t                 misses;
+    int64_t                 rejected;
+    int64_t                 blocked;
+    int64_t                 timeouts;
+    int64_t                 chunked;
+    int64_t                 evictions;
+    int64_t                 bytes_sent;
+    int64_t                 archive_hits;
+
+    char                    archive_root[ORIGIN_MAX_NAME];   // byte ranges older than the cache are read from here
+} origin_struct;
+
+typedef struct _origin_client_struct_ {
+    origin_struct       *origin;
+    int                 slot;
+    int                 client;
+} origin_client_struct;
+
+static uint32_t origin_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash % ORIGIN_HASH_SIZE;
+}
+
+// called with the lock held
+static void release_object(origin_struct *origin, origin_object_struct *object)
+{
+    object->refcount--;
+    if (object->refcount == 0) {
+        origin->cache_bytes -= object->cached;
+        close(object->fd);
+        free(object);
+    }
+}
+
+static origin_entry_struct *find_entry(origin_struct *origin, const char *name, origin_entry_struct ***link)
+{
+    origin_entry_struct **next = &origin->hash[origin_hash(name)];
+
+    while (*next) {
+        if (strcmp((*next)->name, name) == 0) {
+            break;
+        }
+        next = &(*next)->hash_next;
+    }
+    if (link) {
+        *link = next;
+    }
+    return *next;
+}
+
+static void remove_entry(origin_struct *origin, origin_entry_struct *entry)
+{
+    origin_entry_struct **link;
+
+    find_entry(origin, entry->name, &link);
+    *link = entry->hash_next;
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        origin->oldest = entry->newer;
+    }
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        origin->newest = entry->older;
+    }
+    origin->entry_count--;
+    release_object(origin, entry->object);
+    free(entry);
+}
+
+// publishes the object under name, takes over one reference
+static int insert_entry(origin_struct *origin, const char *name, origin_object_struct *object)
+{
+    origin_entry_struct *entry;
+    origin_entry_struct *previous;
+    origin_entry_struct *next;
+
+    entry = (origin_entry_struct*)malloc(sizeof(origin_entry_struct));
+    if (!entry) {
+        release_object(origin, object);
+        return -1;
+    }
+    memset(entry, 0, sizeof(origin_entry_struct));
+    snprintf(entry->name, ORIGIN_MAX_NAME-1, "%s", name);
+    entry->object = object;
+
+    previous = find_entry(origin, entry->name, NULL);
+    if (previous) {
+        remove_entry(origin, previous);
+    }
+    entry->hash_next = origin->hash[origin_hash(entry->name)];
+    origin->hash[origin_hash(entry->name)] = entry;
+    entry->older = origin->newest;
+    if (origin->newest) {
+        origin->newest->newer = entry;
+    } else {
+        origin->oldest = entry;
+    }
+    origin->newest = entry;
+    origin->entry_count++;
+    pthread_cond_broadcast(&origin->published);
+
+    // the oldest segments fall out of the window first, playlists and init segments stay
+    entry = origin->oldest;
+    while (entry && origin->cache_bytes > origin->cache_limit) {
+        next = entry->newer;
+        if (!(entry->object->flags & (ORIGIN_FLAG_PINNED | ORIGIN_FLAG_GROWING)) && entry != origin->newest) {
+            remove_entry(origin, entry);
+            origin->evictions++;
+        }
+        entry = next;
+    }
+
+    return 0;
+}
+
+void *origin_open(void *origin, const char *name, int flags)
+{
+    origin_object_struct *object;
+
+    if (!origin) {
+        return NULL;
+    }
+
+    object = (origin_object_struct*)malloc(sizeof(origin_object_struct));
+    if (!object) {
+        return NULL;
+    }
+    memset(object, 0, sizeof(origin_object_struct));
+    object->fd = memfd_create("origin", MFD_CLOEXEC);
+    if (object->fd < 0) {
+        syslog(LOG_ERR,"ORIGIN: UNABLE TO CREATE SEGMENT STORE OBJECT FOR %s (%s)\n", name, strerror(errno));
+        free(object);
+        return NULL;
+    }
+    object->flags = flags;
+    object->refcount = 1;
+    object->media_sequence = -1;
+    object->part = -1;
+    object->origin = (origin_struct*)origin;
+    snprintf(object->name, ORIGIN_MAX_NAME-1, "%s", name);
+
+    if (flags & ORIGIN_FLAG_GROWING) {
+        // listed straight away, the writer keeps its own reference until origin_close
+        origin_struct *origin1 = (origin_struct*)origin;
+
+        object->modified = time(NULL);
+        pthread_mutex_lock(&origin1->lock);
+        object->refcount++;
+        insert_entry(origin1, object->name, object);
+        pthread_mutex_unlock(&origin1->lock);
+    }
+
+    return (void*)object;
+}
+
+int origin_write(void *object, const struct iovec *iov, int iov_count)
+{
+    origin_object_struct *object1 = (origin_object_struct*)object;
+    int i;
+
+    if (!object1 || object1->failed) {
+        return -1;
+    }
+
+    for (i = 0; i < iov_count; i++) {
+        const uint8_t *buffer = (const uint8_t*)iov[i].iov_base;
+        size_t remaining = iov[i].iov_len;
+
+        while (remaining > 0) {
+            ssize_t written = write(object1->fd, buffer, remaining);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                object1->failed = 1;
+                return -1;
+            }
+            buffer += written;
+            remaining -= written;
+            if (object1->flags & ORIGIN_FLAG_GROWING) {
+                pthread_mutex_lock(&object1->origin->lock);
+                object1->size += written;
+                pthread_cond_broadcast(&object1->origin->published);
+                pthread_mutex_unlock(&object1->origin->lock);
+            } else {
+                object1->size += written;
+            }
+        }
+    }
+    return 0;
+}
+
+int origin_close(void *origin, void *object)
+{
+    origin_struct *origin1 = (origin_struct*)origin;
+    origin_object_struct *object1 = (origin_object_struct*)object;
+    int retval;
+
+    if (!origin1 || !object1) {
+        return -1;
+    }
+    if (object1->flags & ORIGIN_FLAG_GROWING) {
+        // readers holding the object see it complete, a failed write just ends it short
+        pthread_mutex_lock(&origin1->lock);
+        object1->modified = time(NULL);
+        object1->generation = ++origin1->generation;
+        object1->flags &= ~ORIGIN_FLAG_GROWING;
+        object1->cached = object1->size;
+        origin1->cache_bytes += object1->size;
+        pthread_cond_broadcast(&origin1->published);
+        release_object(origin1, object1);
+        pthread_mutex_unlock(&origin1->lock);
+        return 0;
+    }
+    if (object1->failed) {
+        close(object1->fd);
+        free(object1);
+        return -1;
+    }
+
+    object1->modified = time(NULL);
+    pthread_mutex_lock(&origin1->lock);
+    object1->generation = ++origin1->generation;
+    object1->cached = object1->size;
+    origin1->cache_bytes += object1->size;
+    retval = insert_entry(origin1, object1->name, object1);
+    pthread_mutex_unlock(&origin1->lock);
+
+    return retval;
+}
+
+int origin_put(void *origin, const char *name, const char *buffer, int buffer_size, int flags, int64_t media_sequence, int part)
+{
+    origin_object_struct *object;
+    struct iovec iov;
+
+    object = (origin_object_struct*)origin_open(origin, name, flags);
+    if (!object) {
+        return -1;
+    }
+    object->media_sequence = media_sequence;
+    object->part = part;
+    iov.iov_base = (void*)buffer;
+    iov.iov_len = buffer_size;
+    origin_write(object, &iov, 1);
+    return origin_close(origin, object);
+}
+
+int origin_alias(void *origin, const char *name, const char *alias)
+{
+    origin_struct *origin1 = (origin_struct*)origin;
+    origin_entry_struct *entry;
+    int retval = -1;
+
+    if (!origin1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&origin1->lock);
+    entry = find_entry(origin1, name, NULL);
+    if (entry) {
+        entry->object->refcount++;
+        retval = insert_entry(origin1, alias, entry->object);
+    }
+    pthread_mutex_unlock(&origin1->lock);
+
+    return retval;
+}
+
+static origin_object_struct *origin_lookup(origin_struct *origin, const char *name)
+{
+    origin_entry_struct *entry;
+    origin_object_struct *object = NULL;
+
+    pthread_mutex_lock(&origin->lock);
+    entry = find_entry(origin, name, NULL);
+    if (entry) {
+        object = entry->object;
+        object->refcount++;
+    }
+    pthread_mutex_unlock(&origin->lock);
+
+    return object;
+}
+
+static void origin_release(origin_struct *origin, origin_object_struct *object)
+{
+    pthread_mutex_lock(&origin->lock);
+    release_object(origin, object);
+    pthread_mutex_unlock(&origin->lock);
+}
+
+static int position_reached(origin_object_struct *object, int64_t media_sequence, int part)
+{
+    if (media_sequence < 0 || object->media_sequence < 0) {
+        return 1;
+    }
+    if (object->media_sequence > media_sequence) {
+        return 1;
+    }
+    return object->media_sequence == media_sequence && part >= 0 && object->part >= part;
+}
+
+// holds low-latency requests until the part or the playlist listing it has been published,
+// status is set to the error to return when no object comes back
+static origin_object_struct *origin_wait(origin_struct *origin, const char *name, int64_t media_sequence, int part, int skip, int blocking, int *status)
+{
+    origin_entry_struct *entry;
+    origin_object_struct *object = NULL;
+    char delta_name[ORIGIN_MAX_NAME];
+    struct timespec deadline;
+    int waited = 0;
+
+    snprintf(delta_name, ORIGIN_MAX_NAME-1, "%s%s", name, ORIGIN_SKIP_SUFFIX);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += origin->hold_ms / 1000;
+    deadline.tv_nsec += (origin->hold_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&origin->lock);
+    while (1) {
+        entry = skip ? find_entry(origin, delta_name, NULL) : NULL;
+        if (!entry) {
+            entry = find_entry(origin, name, NULL);
+        }
+        if (entry) {
+            if (position_reached(entry->object, media_sequence, part)) {
+                object = entry->object;
+                object->refcount++;
+                break;
+            }
+            // playlists carry the segment in progress, so the last complete one is a sequence behind
+            if (media_sequence > entry->object->media_sequence + 1) {
+                *status = 400;
+                break;
+            }
+        }
+        *status = entry ? 503 : 404;
+        if (!blocking || origin->hold_ms <= 0 || origin->quit) {
+            break;
+        }
+        if (!waited) {
+            waited = 1;
+            origin->blocked++;
+        }
+        if (pthread_cond_timedwait(&origin->published, &origin->lock, &deadline) == ETIMEDOUT) {
+            origin->timeouts++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&origin->lock);
+
+    return object;
+}
+
+static const char *content_type(const char *name)
+{
+    const char *extension = strrchr(name, '.');
+
+    if (!extension) {
+        return "application/octet-stream";
+    }
+    if (strcmp(extension, ".m3u8") == 0) {
+        return "application/vnd.apple.mpegurl";
+    }
+    if (strcmp(extension, ".mpd") == 0) {
+        return "application/dash+xml";
+    }
+    if (strcmp(extension, ".ts") == 0) {
+        return "video/mp2t";
+    }
+    if (strcmp(extension, ".mp4") == 0 || strcmp(extension, ".m4s") == 0) {
+        return "video/mp4";
+    }
+    if (strcmp(extension, ".vtt") == 0) {
+        return "text/vtt";
+    }
+    return "application/octet-stream";
+}
+
+static int is_playlist(const char *name)
+{
+    const char *extension = strrchr(name, '.');
+
+    return extension && (strcmp(extension, ".m3u8") == 0 || strcmp(extension, ".mpd") == 0);
+}
+
+static int send_all(int client, const char *buffer, int buffer_size)
+{
+    while (buffer_size > 0) {
+        ssize_t sent = send(client, buffer, buffer_size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += sent;
+        buffer_size -= sent;
+    }
+    return 0;
+}
+
+static int send_object(origin_struct *origin, int client, origin_object_struct *object, int64_t first, int64_t length)
+{
+    off_t offset = first;
+    off_t end = first + length;
+
+    while (offset < end) {
+        ssize_t sent = sendfile(client, object->fd, &offset, end - offset);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            return -1;
+        }
+    }
+    __sync_fetch_and_add(&origin->bytes_sent, length);
+    return 0;
+}
+
+// streams an object that is still being written as http chunks, one per wakeup
+static int send_growing(origin_struct *origin, int client, origin_object_struct *object)
+{
+    off_t offset = 0;
+    int64_t size;
+    int growing;
+    char chunk_header[32];
+
+    while (1) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ORIGIN_KEEPALIVE_TIMEOUT;
+        pthread_mutex_lock(&origin->lock);
+        while (object->size == offset && (object->flags & ORIGIN_FLAG_GROWING) && !origin->quit) {
+            if (pthread_cond_timedwait(&origin->published, &origin->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        size = object->size;
+        growing = object->flags & ORIGIN_FLAG_GROWING;
+        pthread_mutex_unlock(&origin->lock);
+
+        if (size == offset) {
+            if (growing) {
+                // the writer stalled or we are shutting down- drop the connection without the last chunk
+                return -1;
+            }
+            break;
+        }
+
+        snprintf(chunk_header, sizeof(chunk_header), "%lx\r\n", (long)(size - offset));
+        if (send_all(client, chunk_header, strlen(chunk_header)) < 0) {
+            return -1;
+        }
+        while (offset < size) {
+            ssize_t sent = sendfile(client, object->fd, &offset, size - offset);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            if (sent == 0) {
+                return -1;
+            }
+        }
+        if (send_all(client, "\r\n", 2) < 0) {
+            return -1;
+        }
+    }
+    __sync_fetch_and_add(&origin->bytes_sent, offset);
+
+    return send_all(client, "0\r\n\r\n", 5);
+}
+
+static int send_status(int client, int code, const char *reason, int keepalive)
+{
+    char response[ORIGIN_MAX_REQUEST_SIZE];
+
+    snprintf(response, ORIGIN_MAX_REQUEST_SIZE-1,
+             "HTTP/1.1 %d %s\r\n"
+             "Server: fillet\r\n"
+             "Content-Length: 0\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             code, reason,
+             keepalive ? "keep-alive" : "close");
+    return send_all(client, response, strlen(response));
+}
+
+static const char *find_header(const char *request, const char *header, char *value, int value_size)
+{
+    const char *line = strstr(request, "\r\n");
+    int length = strlen(header);
+
+    while (line && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        if (strncasecmp(line, header, length) == 0 && line[length] == ':') {
+            const char *start = line + length + 1;
+            const char *end = strstr(start, "\r\n");
+            int size;
+
+            while (*start == ' ') {
+                start++;
+            }
+            size = end ? (int)(end - start) : (int)strlen(start);
+            if (size >= value_size) {
+                size = value_size - 1;
+            }
+            memcpy(value, start, size);
+            value[size] = '\0';
+            return value;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+// single "bytes=first-last" or "bytes=first-" ranges only, last is -1 when open ended
+static int parse_range(const char *value, int64_t *first, int64_t *last)
+{
+    char *end;
+
+    if (strncmp(value, "bytes=", 6) != 0) {
+        return -1;
+    }
+    value += 6;
+    *first = strtoll(value, &end, 10);
+    if (end == value || *end != '-' || *first < 0) {
+        return -1;
+    }
+    value = end + 1;
+    if (*value == '\0') {
+        *last = -1;
+        return 0;
+    }
+    *last = strtoll(value, &end, 10);
+    if (end == value || *end != '\0' || *last < *first) {
+        return -1;
+    }
+    return 0;
+}
+
+// dvr windows run past the cache, older ranges come straight from the container on disk,
+// as do exported clips (first < 0 sends the whole file).  returns 1 when the file is not there
+static int send_archive(origin_struct *origin, int client, const char *name, int64_t first, int64_t last, int head, int keepalive)
+{
+    char filename[ORIGIN_MAX_NAME * 2];
+    char response[ORIGIN_MAX_REQUEST_SIZE];
+    struct stat sb;
+    off_t offset = first;
+    int64_t length;
+    int whole = first < 0;
+    int retval;
+    int fd;
+
+    snprintf(filename, sizeof(filename), "%s/%s", origin->archive_root, name);
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    if (whole) {
+        first = 0;
+        offset = 0;
+    }
+    if (fstat(fd, &sb) < 0 || (first >= sb.st_size && !whole)) {
+        close(fd);
+        return send_status(client, 416, "Range Not Satisfiable", keepalive);
+    }
+    if (last < 0 || last >= sb.st_size) {
+        last = sb.st_size - 1;
+    }
+    length = last - first + 1;
+
+    __sync_fetch_and_add(&origin->archive_hits, 1);
+    if (whole) {
+        snprintf(response, ORIGIN_MAX_REQUEST_SIZE-1,
+                 "HTTP/1.1 200 OK\r\n"
+                 "Server: fillet\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %ld\r\n"
+                 "Accept-Ranges: bytes\r\n"
+                 "Cache-Control: max-age=3600\r\n"
+                 "Access-Control-Allow-Origin: *\r\n"
+                 "Connection: %s\r\n"
+                 "\r\n",
+                 content_type(name),
+                 length,
+                 keepalive ? "keep-alive" : "close");
+    } else {
+        snprintf(response, ORIGIN_MAX_REQUEST_SIZE-1,
+                 "HTTP/1.1 206 Partial Content\r\n"
+                 "Server: fillet\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %ld\r\n"
+                 "Content-Range: bytes %ld-%ld/*\r\n"
+                 "Cache-Control: max-age=3600\r\n"
+                 "Access-Control-Allow-Origin: *\r\n"
+                 "Connection: %s\r\n"
+                 "\r\n",
+                 content_type(name),
+                 length,
+                 first, last,
+                 keepalive ? "keep-alive" : "close");
+    }
+    retval = send_all(client, response, strlen(response));
+    while (retval == 0 && !head && offset <= last) {
+        ssize_t sent = sendfile(client, fd, &offset, last + 1 - offset);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            retval = -1;
+        }
+    }
+    if (retval == 0 && !head) {
+        __sync_fetch_and_add(&origin->bytes_sent, length);
+    }
+    close(fd);
+
+    return retval;
+}
+
+static int handle_request(origin_struct *origin, int client, char *request, int *keepalive)
+{
+    char method[16];
+    char url[ORIGIN_MAX_NAME];
+    char version[16];
+    char value[ORIGIN_MAX_NAME];
+    char etag[64];
+    char modified[64];
+    char response[ORIGIN_MAX_REQUEST_SIZE];
+    char *name;
+    char *query;
+    origin_object_struct *object;
+    struct tm tm_modified;
+    int64_t media_sequence = -1;
+    int64_t range_first = -1;
+    int64_t range_last = -1;
+    int64_t range_base = 0;
+    int appended = 0;
+    int64_t first = 0;
+    int64_t length;
+    int part = -1;
+    int skip = 0;
+    int status = 404;
+    int head;
+    int not_modified = 0;
+    int growing;
+    int retval;
+
+    __sync_fetch_and_add(&origin->requests, 1);
+
+    if (sscanf(request, "%15s %255s HTTP/%15s", method, url, version) != 3) {
+        *keepalive = 0;
+        return send_status(client, 400, "Bad Request", 0);
+    }
+
+    *keepalive = (strcmp(version, "1.1") == 0);
+    if (find_header(request, "Connection", value, sizeof(value))) {
+        if (strcasecmp(value, "close") == 0) {
+            *keepalive = 0;
+        } else if (strcasecmp(value, "keep-alive") == 0) {
+            *keepalive = 1;
+        }
+    }
+
+    head = (strcmp(method, "HEAD") == 0);
+    if (!head && strcmp(method, "GET") != 0) {
+        return send_status(client, 405, "Method Not Allowed", *keepalive);
+    }
+
+    name = url;
+    while (*name == '/') {
+        name++;
+    }
+    query = strchr(name, '?');
+    if (query) {
+        char *parameter;
+        char *next;
+
+        *query++ = '\0';
+        for (parameter = strtok_r(query, "&", &next); parameter; parameter = strtok_r(NULL, "&", &next)) {
+            if (strncmp(parameter, "_HLS_msn=", 9) == 0) {
+                media_sequence = strtoll(parameter + 9, NULL, 10);
+            } else if (strncmp(parameter, "_HLS_part=", 10) == 0) {
+                part = atoi(parameter + 10);
+            } else if (strcmp(parameter, "_HLS_skip=YES") == 0 || strcmp(parameter, "_HLS_skip=v2") == 0) {
+                skip = 1;
+            }
+        }
+    }
+    if (strstr(name, "..") || media_sequence < -1 || part < -1 || (part >= 0 && media_sequence < 0)) {
+        return send_status(client, 400, "Bad Request", *keepalive);
+    }
+
+    if (find_header(request, "Range", value, sizeof(value)) && parse_range(value, &range_first, &range_last) < 0) {
+        range_first = -1;
+    }
+
+    object = NULL;
+    if (range_first >= 0 && !is_playlist(name)) {
+        char range_name[ORIGIN_MAX_NAME];
+
+        // byte-range containers are published one appended range at a time, keyed by where it starts
+        snprintf(range_name, ORIGIN_MAX_NAME-1, "%s@%ld", name, range_first);
+        object = origin_lookup(origin, range_name);
+        if (object) {
+            range_base = range_first;
+            appended = 1;
+        }
+    }
+    if (object) {
+        // found the appended range
+    } else if (media_sequence >= 0 || skip || (origin->hold_ms > 0 && !is_playlist(name))) {
+        object = origin_wait(origin, name, media_sequence, part, skip, media_sequence >= 0 || !is_playlist(name), &status);
+    } else {
+        object = origin_lookup(origin, name);
+    }
+    if (!object && origin->archive_root[0] &&
+        ((range_first >= 0 && !is_playlist(name)) || strncmp(name, CLIP_FILE_PREFIX, strlen(CLIP_FILE_PREFIX)) == 0)) {
+        retval = send_archive(origin, client, name, range_first, range_last, head, *keepalive);
+        if (retval <= 0) {
+            return retval;
+        }
+    }
+    if (!object) {
+        __sync_fetch_and_add(&origin->misses, 1);
+        if (status == 400) {
+            return send_status(client, 400, "Bad Request", *keepalive);
+        } else if (status == 503) {
+            return send_status(client, 503, "Service Unavailable", *keepalive);
+        }
+        return send_status(client, 404, "Not Found", *keepalive);
+    }
+
+    pthread_mutex_lock(&origin->lock);
+    growing = object->flags & ORIGIN_FLAG_GROWING;
+    pthread_mutex_unlock(&origin->lock);
+    if (growing) {
+        // no length or validators yet, http/1.0 clients get it once it is complete
+        if (strcmp(version, "1.1") != 0) {
+            pthread_mutex_lock(&origin->lock);
+            while ((object->flags & ORIGIN_FLAG_GROWING) && !origin->quit) {
+                pthread_cond_wait(&origin->published, &origin->lock);
+            }
+            pthread_mutex_unlock(&origin->lock);
+        } else {
+            __sync_fetch_and_add(&origin->hits, 1);
+            __sync_fetch_and_add(&origin->chunked, 1);
+            snprintf(response, ORIGIN_MAX_REQUEST_SIZE-1,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Server: fillet\r\n"
+                     "Content-Type: %s\r\n"
+                     "Transfer-Encoding: chunked\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "Access-Control-Allow-Origin: *\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     content_type(name),
+                     *keepalive ? "keep-alive" : "close");
+            retval = send_all(client, response, strlen(response));
+            if (retval == 0 && !head) {
+                retval = send_growing(origin, client, object);
+            }
+            origin_release(origin, object);
+            return retval;
+        }
+    }
+
+    snprintf(etag, sizeof(etag), "\"%x-%lx\"", object->generation, object->size);
+    gmtime_r(&object->modified, &tm_modified);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm_modified);
+
+    if (find_header(request, "If-None-Match", value, sizeof(value))) {
+        not_modified = (strcmp(value, etag) == 0);
+    } else if (find_header(request, "If-Modified-Since", value, sizeof(value))) {
+        not_modified = (strcmp(value, modified) == 0);
+    }
+
+    length = object->size;
+    if (range_first >= 0 && !not_modified) {
+        first = range_first - range_base;
+        if (first >= object->size) {
+            snprintf(response, ORIGIN_MAX_REQUEST_SIZE-1,
+                     "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                     "Server: fillet\r\n"
+                     "Content-Range: bytes */%ld\r\n"
+                     "Content-Length: 0\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n",
+                     object->size,
+                     *keepalive ? "keep-alive" : "close");
+            retval = send_all(client, response, strlen(response));
+            origin_release(origin, object);
+            return retval;
+        }
+        // a range running past this object is cut short, the client asks again for the rest
+        length = object->size - first;
+        if (range_last >= 0 && range_last - range_base < object->size) {
+            length = range_last - range_base - first + 1;
+        }
+    }
+
+    if (not_modified) {
+        __sync_fetch_and_add(&origin->not_modified, 1);
+        snprintf(response, ORIGIN_MAX_REQUEST_SIZE-1,
+                 "HTTP/1.1 304 Not Modified\r\n"
+                 "Server: fillet\r\n"
+                 "ETag: %s\r\n"
+                 "Last-Modified: %s\r\n"
+                 "Connection: %s\r\n"
+                 "\r\n",
+                 etag, modified,
+                 *keepalive ? "keep-alive" : "close");
+        retval = send_all(client, response, strlen(response));
+        origin_release(origin, object);
+        return retval;
+    }
+
+    __sync_fetch_and_add(&origin->hits, 1);
+    if (range_first >= 0) {
+        char total[32];
+
+        // the full length of a container is not known until it is rotated
+        if (appended) {
+            snprintf(total, sizeof(total), "*");
+        } else {
+            snprintf(total, sizeof(total), "%ld", object->size);
+        }
+        snprintf(response, ORIGIN_MAX_REQUEST_SIZE-1,
+                 "HTTP/1.1 206 Partial Content\r\n"
+                 "Server: fillet\r\n"
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %ld\r\n"
+                 "Content-Range: bytes %ld-%ld/%s\r\n"
+                 "ETag: %s\r\n"
+                 "Last-Modified: %s\r\n"
+                 "Cache-Control: max-age=%d\r\n"
+                 "Access-Control-Allow-Origin: *\r\n"
+                 "Connection: %s\r\n"
+                 "\r\n",
+                 content_type(name),
+                 length,
+                 range_base + first, range_base + first + length - 1, total,
+                 etag, modified,
+                 is_playlist(name) ? 1 : 3600,
+                 *keepalive ? "keep-alive" : "close");
+        retval = send_all(client, response, strlen(response));
+        if (retval == 0 && !head) {
+            retval = send_object(origin, client, object, first, length);
+        }
+        origin_release(origin, object);
+        return retval;
+    }
+    snprintf(response, ORIGIN_MAX_REQUEST_SIZE-1,
+             "HTTP/1.1 200 OK\r\n"
+             "Server: fillet\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %ld\r\n"
+             "ETag: %s\r\n"
+             "Last-Modified: %s\r\n"
+             "Cache-Control: max-age=%d\r\n"
+             "Accept-Ranges: bytes\r\n"
+             "Access-Control-Allow-Origin: *\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             content_type(name),
+             object->size,
+             etag, modified,
+             is_playlist(name) ? 1 : 3600,
+             *keepalive ? "keep-alive" : "close");
+    retval = send_all(client, response, strlen(response));
+    if (retval == 0 && !head) {
+        retval = send_object(origin, client, object, 0, object->size);
+    }
+    origin_release(origin, object);
+
+    return retval;
+}
+
+static void *origin_client_thread(void *context)
+{
+    origin_client_struct *connection = (origin_client_struct*)context;
+    origin_struct *origin = connection->origin;
+    int client = connection->client;
+    char request[ORIGIN_MAX_REQUEST_SIZE];
+    int request_size = 0;
+    int keepalive = 1;
+    struct timeval timeout;
+    int yesflag = 1;
+
+    timeout.tv_sec = ORIGIN_KEEPALIVE_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (char*)&yesflag, sizeof(yesflag));
+
+    while (keepalive && !origin->quit) {
+        char *end;
+        int used;
+
+        request[request_size] = '\0';
+        end = strstr(request, "\r\n\r\n");
+        if (!end) {
+            ssize_t received;
+
+            if (request_size >= ORIGIN_MAX_REQUEST_SIZE - 1) {
+                send_status(client, 431, "Request Header Fields Too Large", 0);
+                break;
+            }
+            received = recv(client, request + request_size, ORIGIN_MAX_REQUEST_SIZE - 1 - request_size, 0);
+            if (received <= 0) {
+                break;
+            }
+            request_size += received;
+            continue;
+        }
+
+        end[2] = '\0';
+        used = (int)(end - request) + 4;
+        if (handle_request(origin, client, request, &keepalive) < 0) {
+            break;
+        }
+        // keep any pipelined requests
+        memmove(request, request + used, request_size - used);
+        request_size -= used;
+    }
+
+    pthread_mutex_lock(&origin->lock);
+    origin->clients[connection->slot] = -1;
+    origin->connections--;
+    pthread_mutex_unlock(&origin->lock);
+    close(client);
+    free(connection);
+
+    return NULL;
+}
+
+static void *origin_server_thread(void *context)
+{
+    origin_struct *origin = (origin_struct*)context;
+    struct pollfd server_poll;
+
+    server_poll.fd = origin->server;
+    server_poll.events = POLLIN;
+
+    while (!origin->quit) {
+        origin_client_struct *connection;
+        pthread_t client_thread_id;
+        int client;
+        int slot;
+
+        if (poll(&server_poll, 1, 150) <= 0) {
+            continue;
+        }
+        client = accept(origin->server, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&origin->lock);
+        for (slot = 0; slot < ORIGIN_MAX_CONNECTIONS; slot++) {
+            if (origin->clients[slot] == -1) {
+                break;
+            }
+        }
+        if (slot == ORIGIN_MAX_CONNECTIONS) {
+            pthread_mutex_unlock(&origin->lock);
+            __sync_fetch_and_add(&origin->rejected, 1);
+            send_status(client, 503, "Service Unavailable", 0);
+            close(client);
+            continue;
+        }
+        origin->clients[slot] = client;
+        origin->connections++;
+        pthread_mutex_unlock(&origin->lock);
+
+        connection = (origin_client_struct*)malloc(sizeof(origin_client_struct));
+        if (connection) {
+            connection->origin = origin;
+            connection->slot = slot;
+            connection->client = client;
+        }
+        if (!connection || pthread_create(&client_thread_id, NULL, origin_client_thread, (void*)connection) != 0) {
+            pthread_mutex_lock(&origin->lock);
+            origin->clients[slot] = -1;
+            origin->connections--;
+            pthread_mutex_unlock(&origin->lock);
+            close(client);
+            free(connection);
+            continue;
+        }
+        pthread_detach(client_thread_id);
+    }
+
+    return NULL;
+}
+
+int start_origin_server(fillet_app_struct *core)
+{
+    origin_struct *origin;
+    struct sockaddr_in origin_address;
+    pthread_condattr_t published_attr;
+    int yesflag = 1;
+    int i;
+
+    if (core->cd->origin_port <= 0) {
+        return 0;
+    }
+
+    origin = (origin_struct*)malloc(sizeof(origin_struct));
+    if (!origin) {
+        return -1;
+    }
+    memset(origin, 0, sizeof(origin_struct));
+    pthread_mutex_init(&origin->lock, NULL);
+    pthread_condattr_init(&published_attr);
+    pthread_condattr_setclock(&published_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&origin->published, &published_attr);
+    pthread_condattr_destroy(&published_attr);
+    origin->port = core->cd->origin_port;
+    origin->cache_limit = (int64_t)core->cd->origin_cache_mb * 1024 * 1024;
+    if (core->cd->dvr_window_minutes > 0) {
+        snprintf(origin->archive_root, ORIGIN_MAX_NAME-1, "%s", core->cd->manifest_directory);
+    }
+    if (core->cd->part_length_ms > 0 || core->cd->chunk_frames > 0) {
+        // blocking reloads are answered within three target durations
+        origin->hold_ms = core->cd->segment_length * 3000;
+    }
+    for (i = 0; i < ORIGIN_MAX_CONNECTIONS; i++) {
+        origin->clients[i] = -1;
+    }
+
+    origin->server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (origin->server < 0) {
+        syslog(LOG_ERR,"SESSION:%d (ORIGIN) FATAL ERROR: UNABLE TO OPEN ORIGIN SOCKET\n", core->session_id);
+        free(origin);
+        return -1;
+    }
+
+    memset(&origin_address, 0, sizeof(origin_address));
+    origin_address.sin_family = AF_INET;
+    origin_address.sin_port = htons(origin->port);
+    origin_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(origin->server, SOL_SOCKET, SO_REUSEADDR, (char*)&yesflag, sizeof(yesflag));
+
+    if (bind(origin->server, (struct sockaddr*)&origin_address, sizeof(origin_address)) < 0 ||
+        listen(origin->server, ORIGIN_MAX_CONNECTIONS) < 0) {
+        syslog(LOG_ERR,"SESSION:%d (ORIGIN) FATAL ERROR: UNABLE TO LISTEN ON PORT %d (%s)\n",
+               core->session_id, origin->port, strerror(errno));
+        fprintf(stderr,"ERROR: UNABLE TO START ORIGIN SERVER ON PORT %d\n", origin->port);
+        close(origin->server);
+        free(origin);
+        return -1;
+    }
+
+    pthread_create(&origin->server_thread_id, NULL, origin_server_thread, (void*)origin);
+    core->origin = (void*)origin;
+    syslog(LOG_INFO,"SESSION:%d (ORIGIN) STATUS: SERVING FROM MEMORY ON PORT %d (CACHE:%dMB)\n",
+           core->session_id, origin->port, core->cd->origin_cache_mb);
+
+    return 0;
+}
+
+int stop_origin_server(fillet_app_struct *core)
+{
+    origin_struct *origin = (origin_struct*)core->origin;
+    int i;
+
+    if (!origin) {
+        return 0;
+    }
+
+    origin->quit = 1;
+    pthread_join(origin->server_thread_id, NULL);
+    close(origin->server);
+
+    pthread_mutex_lock(&origin->lock);
+    pthread_cond_broadcast(&origin->published);
+    for (i = 0; i < ORIGIN_MAX_CONNECTIONS; i++) {
+        if (origin->clients[i] != -1) {
+            shutdown(origin->clients[i], SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&origin->lock);
+    while (origin->connections > 0) {
+        usleep(1000);
+    }
+
+    while (origin->oldest) {
+        remove_entry(origin, origin->oldest);
+    }
+    pthread_cond_destroy(&origin->published);
+    pthread_mutex_destroy(&origin->lock);
+    free(origin);
+    core->origin = NULL;
+
+    return 0;
+}
+
+void origin_report(void *origin)
+{
+    origin_struct *origin1 = (origin_struct*)origin;
+
+    if (!origin1) {
+        return;
+    }
+
+    pthread_mutex_lock(&origin1->lock);
+    syslog(LOG_INFO,"ORIGIN: ENTRIES:%d CACHE:%ld/%ld BYTES CONNECTIONS:%d REQUESTS:%ld HITS:%ld NOT_MODIFIED:%ld MISSES:%ld REJECTED:%ld BLOCKED:%ld TIMEOUTS:%ld CHUNKED:%ld EVICTIONS:%ld ARCHIVE:%ld SENT:%ld\n",
+           origin1->entry_count,
+           origin1->cache_bytes,
+           origin1->cache_limit,
+           origin1->connections,
+           origin1->requests,
+           origin1->hits,
+           origin1->not_modified,
+           origin1->misses,
+           origin1->rejected,
+           origin1->blocked,
+           origin1->timeouts,
+           origin1->chunked,
+           origin1->evictions,
+           origin1->archive_hits,
+           origin1->bytes_sent);
+    pthread_mutex_unlock(&origin1->lock);
+}
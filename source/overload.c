@@ -0,0 +1,392 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <syslog.h>
+#include "fillet.h"
+#include "dataqueue.h"
+#include "mempool.h"
+#include "tsdecode.h"
+#include "esignal.h"
+#include "overload.h"
+#if defined(ENABLE_TRANSCODE)
+#include "transvideo.h"
+#endif
+
+#define OVERLOAD_QUEUE_FAIL_DEPTH  30
+#define OVERLOAD_CHECK_INTERVAL_MS 250
+
+typedef struct _overload_struct_ {
+    pthread_mutex_t     lock;
+    volatile int        level;
+    int                 usage;
+    int                 peak_usage;
+    const char          *pressure;
+    int64_t             check_time;
+    int64_t             level_time;
+    int64_t             escalate_time;
+    int64_t             below_low_time;
+    int64_t             exhausted_time;
+
+    int64_t             exhausted_events;
+    int64_t             dropped_nonref;
+    int64_t             dropped_rendition;
+    int64_t             dropped_thumbnails;
+} overload_struct;
+
+static const char *level_names[] = {"NORMAL", "SHED_THUMBNAILS", "SHED_NONREF", "SHED_RENDITIONS", "MINIMAL"};
+
+static int64_t overload_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int pool_usage(void *pool)
+{
+    int count = memory_count(pool);
+
+    if (count <= 0) {
+        return 0;
+    }
+    return ((count - memory_unused(pool)) * 100) / count;
+}
+
+static void overload_set_level(fillet_app_struct *core, overload_struct *overload, int level, int64_t now)
+{
+    char signal_msg[MAX_STR_SIZE];
+    int previous = overload->level;
+
+    if (level < OVERLOAD_LEVEL_NORMAL) {
+        level = OVERLOAD_LEVEL_NORMAL;
+    }
+    if (level > OVERLOAD_LEVEL_MINIMAL) {
+        level = OVERLOAD_LEVEL_MINIMAL;
+    }
+    if (level == previous) {
+        return;
+    }
+    overload->level = level;
+    overload->level_time = now;
+    overload->escalate_time = now;
+    overload->below_low_time = now;
+
+    syslog(LOG_INFO,"SESSION:%d (OVERLOAD) STATUS: level %s -> %s, usage=%d%% (%s), exhausted=%ld, nonref=%ld, rendition=%ld, thumbnails=%ld\n",
+           core->session_id,
+           level_names[previous], level_names[level],
+           overload->usage, overload->pressure ? overload->pressure : "none",
+           overload->exhausted_events, overload->dropped_nonref,
+           overload->dropped_rendition, overload->dropped_thumbnails);
+    fprintf(stderr,"SESSION:%d (OVERLOAD) STATUS: level %s -> %s, usage=%d%% (%s)\n",
+            core->session_id,
+            level_names[previous], level_names[level],
+            overload->usage, overload->pressure ? overload->pressure : "none");
+
+    if (level > previous) {
+        snprintf(signal_msg, MAX_STR_SIZE-1, "Overload Shedding Load (%s), %s at %d%% - Check CPU Resources!",
+                 level_names[level], overload->pressure ? overload->pressure : "pool", overload->usage);
+    } else {
+        snprintf(signal_msg, MAX_STR_SIZE-1, "Overload Recovering (%s), usage at %d%%",
+                 level_names[level], overload->usage);
+    }
+    send_signal(core, SIGNAL_HIGH_CPU, signal_msg);
+}
+
+void *overload_create(fillet_app_struct *core)
+{
+    overload_struct *overload;
+
+    overload = (overload_struct*)malloc(sizeof(overload_struct));
+    if (!overload) {
+        return NULL;
+    }
+    memset(overload, 0, sizeof(overload_struct));
+    pthread_mutex_init(&overload->lock, NULL);
+    overload->level = OVERLOAD_LEVEL_NORMAL;
+    overload->level_time = overload_now();
+    overload->below_low_time = overload->level_time;
+    return (void*)overload;
+}
+
+void overload_destroy(void *overload)
+{
+    overload_struct *ol = (overload_struct*)overload;
+
+    if (ol) {
+        pthread_mutex_destroy(&ol->lock);
+        free(ol);
+    }
+}
+
+int overload_level(fillet_app_struct *core)
+{
+    overload_struct *overload = (overload_struct*)core->overload;
+
+    if (!overload) {
+        return OVERLOAD_LEVEL_NORMAL;
+    }
+    return overload->level;
+}
+
+int overload_update(fillet_app_struct *core)
+{
+    overload_struct *overload = (overload_struct*)core->overload;
+    struct {
+        void       *pool;
+        const char *name;
+    } pools[] = {
+        {core->fillet_msg_pool, "message pool"},
+        {core->frame_msg_pool, "frame pool"},
+        {core->compressed_video_pool, "compressed video pool"},
+        {core->compressed_audio_pool, "compressed audio pool"},
+        {core->raw_video_pool, "raw video pool"},
+        {core->raw_audio_pool, "raw audio pool"}
+    };
+    int64_t now;
+    int usage = 0;
+    const char *pressure = NULL;
+    int i;
+
+    if (!overload) {
+        return -1;
+    }
+
+    now = overload_now();
+    if (now - overload->check_time < OVERLOAD_CHECK_INTERVAL_MS) {
+        return overload->level;
+    }
+    overload->check_time = now;
+
+    for (i = 0; i < (int)(sizeof(pools)/sizeof(pools[0])); i++) {
+        int pool_used;
+
+        if (!pools[i].pool) {
+            continue;
+        }
+        pool_used = pool_usage(pools[i].pool);
+        if (pool_used > usage) {
+            usage = pool_used;
+            pressure = pools[i].name;
+        }
+    }
+#if defined(ENABLE_TRANSCODE)
+    if (core->transcode_enabled && core->encodevideo) {
+        for (i = 0; i < core->cd->num_outputs; i++) {
+            int queue_used = (dataqueue_get_size(core->encodevideo->input_queue[i]) * 100) / OVERLOAD_QUEUE_FAIL_DEPTH;
+
+            if (queue_used > usage) {
+                usage = queue_used;
+                pressure = "encoder queue";
+            }
+        }
+    }
+#endif
+
+    pthread_mutex_lock(&overload->lock);
+    overload->usage = usage;
+    overload->pressure = pressure;
+    if (usage > overload->peak_usage) {
+        overload->peak_usage = usage;
+    }
+
+    if (usage >= OVERLOAD_HIGH_WATERMARK) {
+        overload->below_low_time = now;
+        if (now - overload->escalate_time >= OVERLOAD_ESCALATE_INTERVAL_MS) {
+            overload->escalate_time = now;
+            overload_set_level(core, overload, overload->level + 1, now);
+        }
+    } else if (usage > OVERLOAD_LOW_WATERMARK) {
+        overload->below_low_time = now;
+        overload->escalate_time = now;
+    } else {
+        overload->escalate_time = now;
+        if (overload->level > OVERLOAD_LEVEL_NORMAL &&
+            now - overload->below_low_time >= OVERLOAD_RECOVER_INTERVAL_MS &&
+            now - overload->exhausted_time >= OVERLOAD_RECOVER_INTERVAL_MS) {
+            overload_set_level(core, overload, overload->level - 1, now);
+        }
+    }
+
+    if (overload->level == OVERLOAD_LEVEL_MINIMAL &&
+        overload->exhausted_time > overload->level_time &&
+        now - overload->level_time >= OVERLOAD_FATAL_INTERVAL_MS &&
+        now - overload->exhausted_time < OVERLOAD_ESCALATE_INTERVAL_MS) {
+        pthread_mutex_unlock(&overload->lock);
+        fprintf(stderr,"SESSION:%d (OVERLOAD) STATUS: still exhausted after %d seconds at minimal load, restarting service\n",
+                core->session_id, OVERLOAD_FATAL_INTERVAL_MS / 1000);
+        send_direct_error(core, SIGNAL_DIRECT_ERROR_CPU, "Unable To Recover From Overload - Check CPU Resources!");
+        _Exit(0);
+    }
+    pthread_mutex_unlock(&overload->lock);
+
+    return overload->level;
+}
+
+int overload_exhausted(fillet_app_struct *core, const char *what)
+{
+    overload_struct *overload = (overload_struct*)core->overload;
+    int64_t now;
+
+    if (!overload) {
+        return -1;
+    }
+
+    now = overload_now();
+    __sync_fetch_and_add(&overload->exhausted_events, 1);
+
+    pthread_mutex_lock(&overload->lock);
+    overload->exhausted_time = now;
+    overload->below_low_time = now;
+    if (now - overload->escalate_time >= OVERLOAD_CHECK_INTERVAL_MS) {
+        fprintf(stderr,"SESSION:%d (OVERLOAD) STATUS: %s exhausted, dropping data\n",
+                core->session_id, what);
+        overload->usage = 100;
+        overload->pressure = what;
+        overload_set_level(core, overload, overload->level + 1, now);
+        overload->escalate_time = now;
+    }
+    pthread_mutex_unlock(&overload->lock);
+
+    return overload->level;
+}
+
+int overload_shed_thumbnails(fillet_app_struct *core)
+{
+    overload_struct *overload = (overload_struct*)core->overload;
+
+    if (overload && overload->level >= OVERLOAD_LEVEL_SHED_THUMBNAILS) {
+        __sync_fetch_and_add(&overload->dropped_thumbnails, 1);
+        return 1;
+    }
+    return 0;
+}
+
+static int64_t rendition_bitrate(fillet_app_struct *core, int index)
+{
+#if defined(ENABLE_TRANSCODE)
+    if (core->transcode_enabled) {
+        return core->cd->transvideo_info[index].video_bitrate;
+    }
+#endif
+    if (!core->source_video_stream[index].video_stream) {
+        return 0;
+    }
+    return ((video_stream_struct*)core->source_video_stream[index].video_stream)->video_bitrate;
+}
+
+int overload_rendition_shed(fillet_app_struct *core, int index, int count)
+{
+    overload_struct *overload = (overload_struct*)core->overload;
+    int64_t bitrate;
+    int lower = 0;
+    int shed;
+    int i;
+
+    if (!overload || count <= 1 || overload->level < OVERLOAD_LEVEL_SHED_RENDITIONS) {
+        return 0;
+    }
+
+    // rank by bitrate, ties broken by index so every rendition has a distinct position
+    bitrate = rendition_bitrate(core, index);
+    for (i = 0; i < count; i++) {
+        int64_t other = rendition_bitrate(core, i);
+        if (other < bitrate || (other == bitrate && i < index)) {
+            lower++;
+        }
+    }
+
+    if (overload->level >= OVERLOAD_LEVEL_MINIMAL) {
+        // keep only the cheapest rendition moving, it is the segment clock for audio
+        shed = lower != 0;
+    } else {
+        shed = lower < count / 2;
+    }
+    if (shed) {
+        __sync_fetch_and_add(&overload->dropped_rendition, 1);
+    }
+    return shed;
+}
+
+static int video_frame_nonref(uint8_t *buffer, int buffer_size, int sample_type)
+{
+    int i;
+
+    for (i = 0; i + 4 < buffer_size; i++) {
+        if (buffer[i] == 0x00 && buffer[i+1] == 0x00 && buffer[i+2] == 0x01) {
+            uint8_t nal = buffer[i+3];
+
+            if (sample_type == STREAM_TYPE_H264) {
+                int nal_type = nal & 0x1f;
+                if (nal_type == 5) {
+                    return 0;
+                }
+                if (nal_type == 1) {
+                    return ((nal >> 5) & 0x03) == 0;
+                }
+            } else if (sample_type == STREAM_TYPE_HEVC) {
+                int nal_type = (nal >> 1) & 0x3f;
+                if (nal_type < 32) {
+                    // sub-layer non-reference pictures are the even types below RSV_VCL_N14
+                    return nal_type <= 14 && (nal_type & 1) == 0;
+                }
+            } else {
+                return 0;
+            }
+            i += 2;
+        }
+    }
+    return 0;
+}
+
+int overload_drop_video(fillet_app_struct *core, int source, uint8_t *buffer, int buffer_size, int sample_type, int sync_frame)
+{
+    overload_struct *overload = (overload_struct*)core->overload;
+    int level;
+
+    if (!overload) {
+        return 0;
+    }
+
+    // repackaged video goes out on the source timeline, a dropped frame or rendition
+    // would leave a gap in the segments and playlists- only the decoder input of a
+    // transcode is thinned out, the a/v sync stage repeats frames over the holes
+    if (!core->transcode_enabled) {
+        return 0;
+    }
+
+    level = overload->level;
+    if (level >= OVERLOAD_LEVEL_SHED_NONREF && !sync_frame) {
+        if (video_frame_nonref(buffer, buffer_size, sample_type)) {
+            __sync_fetch_and_add(&overload->dropped_nonref, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,291 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "playlist.h"
+
+typedef struct _playlist_entry_struct_ {
+    int             valid;
+    int64_t         media_sequence;
+    int64_t         file_sequence;
+    int             length;
+    char            text[PLAYLIST_MAX_ENTRY_SIZE];
+} playlist_entry_struct;
+
+// a sliding window of pre-rendered segment entries, each segment is
+// rendered once when it enters the window and dropped when it falls out
+typedef struct _playlist_struct_ {
+    int                     window_size;
+    playlist_entry_struct   *entries;
+    playlist_entry_struct   *pending;
+
+    char                    *published;
+    size_t                  published_size;
+
+    // archive mode, entries sit back to back so a long window goes out with one copy
+    int                     archive_size;
+    int                     archive_count;
+    int                     archive_head;
+    int                     *archive_lengths;
+    char                    *archive_text;
+    size_t                  archive_start;
+    size_t                  archive_end;
+    size_t                  archive_capacity;
+} playlist_struct;
+
+static playlist_entry_struct *playlist_slot(playlist_struct *playlist, int64_t media_sequence)
+{
+    int64_t slot = media_sequence % playlist->window_size;
+
+    if (slot < 0) {
+        slot += playlist->window_size;
+    }
+    return &playlist->entries[slot];
+}
+
+void *playlist_create(int window_size)
+{
+    playlist_struct *playlist;
+
+    playlist = (playlist_struct*)malloc(sizeof(playlist_struct));
+    if (!playlist) {
+        return NULL;
+    }
+    memset(playlist, 0, sizeof(playlist_struct));
+
+    if (window_size > 0) {
+        playlist->window_size = window_size;
+        playlist->entries = (playlist_entry_struct*)malloc(sizeof(playlist_entry_struct) * window_size);
+        if (!playlist->entries) {
+            free(playlist);
+            return NULL;
+        }
+        memset(playlist->entries, 0, sizeof(playlist_entry_struct) * window_size);
+    }
+
+    return (void*)playlist;
+}
+
+void playlist_destroy(void *playlist)
+{
+    playlist_struct *playlist1 = (playlist_struct*)playlist;
+
+    if (playlist1) {
+        free(playlist1->archive_lengths);
+        free(playlist1->archive_text);
+        free(playlist1->entries);
+        free(playlist1->published);
+        free(playlist1);
+    }
+}
+
+// returns NULL when the entry is already in the window
+FILE *playlist_begin_entry(void *playlist, int64_t media_sequence, int64_t file_sequence)
+{
+    playlist_struct *playlist1 = (playlist_struct*)playlist;
+    playlist_entry_struct *entry;
+    FILE *output;
+
+    if (!playlist1 || playlist1->window_size == 0) {
+        return NULL;
+    }
+
+    entry = playlist_slot(playlist1, media_sequence);
+    if (entry->valid && entry->media_sequence == media_sequence && entry->file_sequence == file_sequence) {
+        return NULL;
+    }
+
+    entry->valid = 0;
+    entry->media_sequence = media_sequence;
+    entry->file_sequence = file_sequence;
+    entry->length = 0;
+    output = fmemopen(entry->text, PLAYLIST_MAX_ENTRY_SIZE, "w");
+    if (output) {
+        playlist1->pending = entry;
+    }
+    return output;
+}
+
+int playlist_end_entry(void *playlist, FILE *output)
+{
+    playlist_struct *playlist1 = (playlist_struct*)playlist;
+    playlist_entry_struct *entry = playlist1->pending;
+    long length;
+
+    fflush(output);
+    length = ftell(output);
+    fclose(output);
+    if (!entry || length < 0) {
+        return -1;
+    }
+    if (length >= PLAYLIST_MAX_ENTRY_SIZE) {
+        length = PLAYLIST_MAX_ENTRY_SIZE - 1;
+    }
+    entry->length = length;
+    entry->valid = 1;
+    playlist1->pending = NULL;
+
+    return 0;
+}
+
+int playlist_write(void *playlist, FILE *manifest, int64_t media_sequence, int count)
+{
+    playlist_struct *playlist1 = (playlist_struct*)playlist;
+    int i;
+
+    if (count > playlist1->window_size) {
+        count = playlist1->window_size;
+    }
+    for (i = 0; i < count; i++) {
+        playlist_entry_struct *entry = playlist_slot(playlist1, media_sequence + i);
+        if (entry->valid && entry->media_sequence == media_sequence + i) {
+            fwrite(entry->text, 1, entry->length, manifest);
+        }
+    }
+
+    return 0;
+}
+
+// remembers the last published copy, returns 0 when nothing changed
+int playlist_changed(void *playlist, const char *buffer, size_t buffer_size)
+{
+    playlist_struct *playlist1 = (playlist_struct*)playlist;
+    char *published;
+
+    if (!playlist1) {
+        return 1;
+    }
+    if (playlist1->published && playlist1->published_size == buffer_size &&
+        memcmp(playlist1->published, buffer, buffer_size) == 0) {
+        return 0;
+    }
+
+    published = (char*)realloc(playlist1->published, buffer_size + 1);
+    if (!published) {
+        return 1;
+    }
+    memcpy(published, buffer, buffer_size);
+    published[buffer_size] = '\0';
+    playlist1->published = published;
+    playlist1->published_size = buffer_size;
+
+    return 1;
+}
+
+void *playlist_create_archive(int max_entries)
+{
+    playlist_struct *playlist;
+
+    playlist = (playlist_struct*)playlist_create(0);
+    if (!playlist) {
+        return NULL;
+    }
+    playlist->archive_size = max_entries;
+    playlist->archive_lengths = (int*)malloc(sizeof(int) * max_entries);
+    if (!playlist->archive_lengths) {
+        playlist_destroy(playlist);
+        return NULL;
+    }
+    return (void*)playlist;
+}
+
+// adds the newest entry, the oldest one falls out once the archive is full
+int playlist_append(void *playlist, const char *text, int length)
+{
+    playlist_struct *playlist1 = (playlist_struct*)playlist;
+    size_t used;
+
+    if (!playlist1 || !playlist1->archive_lengths || length < 0) {
+        return -1;
+    }
+
+    if (playlist1->archive_count == playlist1->archive_size) {
+        playlist1->archive_start += playlist1->archive_lengths[playlist1->archive_head];
+        playlist1->archive_head = (playlist1->archive_head + 1) % playlist1->archive_size;
+        playlist1->archive_count--;
+    }
+
+    used = playlist1->archive_end - playlist1->archive_start;
+    if (playlist1->archive_end + length > playlist1->archive_capacity) {
+        if (used + length <= playlist1->archive_capacity / 2) {
+            // slide the live entries back to the front, at most once per half a buffer of appends
+            memmove(playlist1->archive_text, playlist1->archive_text + playlist1->archive_start, used);
+        } else {
+            size_t capacity = (used + length) * 2 + PLAYLIST_MAX_ENTRY_SIZE;
+            char *text1 = (char*)malloc(capacity);
+
+            if (!text1) {
+                return -1;
+            }
+            if (used > 0) {
+                memcpy(text1, playlist1->archive_text + playlist1->archive_start, used);
+            }
+            free(playlist1->archive_text);
+            playlist1->archive_text = text1;
+            playlist1->archive_capacity = capacity;
+        }
+        playlist1->archive_start = 0;
+        playlist1->archive_end = used;
+    }
+
+    memcpy(playlist1->archive_text + playlist1->archive_end, text, length);
+    playlist1->archive_end += length;
+    playlist1->archive_lengths[(playlist1->archive_head + playlist1->archive_count) % playlist1->archive_size] = length;
+    playlist1->archive_count++;
+
+    return 0;
+}
+
+int playlist_entries(void *playlist)
+{
+    playlist_struct *playlist1 = (playlist_struct*)playlist;
+
+    if (!playlist1) {
+        return 0;
+    }
+    return playlist1->archive_count;
+}
+
+// header followed by every archived entry, the caller owns the returned buffer
+char *playlist_render(void *playlist, const char *header, size_t header_size, size_t *size)
+{
+    playlist_struct *playlist1 = (playlist_struct*)playlist;
+    size_t used = playlist1->archive_end - playlist1->archive_start;
+    char *buffer;
+
+    buffer = (char*)malloc(header_size + used + 1);
+    if (!buffer) {
+        return NULL;
+    }
+    memcpy(buffer, header, header_size);
+    if (used > 0) {
+        memcpy(buffer + header_size, playlist1->archive_text + playlist1->archive_start, used);
+    }
+    buffer[header_size + used] = '\0';
+    *size = header_size + used;
+
+    return buffer;
+}
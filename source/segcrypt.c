@@ -0,0 +1,703 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include "mp4core.h"
+#include "segcrypt.h"
+#include "cJSON.h"
+#include "curl.h"
+
+#define SEGCRYPT_MAX_RESPONSE        65536
+#define SEGCRYPT_PATTERN_SKIP        9
+#define SEGCRYPT_MIN_NAL             48
+#define SEGCRYPT_AAC_LEADER          16
+
+typedef struct _segcrypt_struct_ {
+    int                      scheme;
+    segcrypt_key_struct      key;
+    EVP_CIPHER_CTX           *cbc;
+    EVP_CIPHER_CTX           *ctr;
+
+    uint8_t                  segment_iv[SEGCRYPT_BLOCK_SIZE];
+    uint8_t                  pending[SEGCRYPT_BLOCK_SIZE];
+    int                      pending_size;
+
+    uint64_t                 sample_counter;
+
+    uint8_t                  *scratch;
+    int                      scratch_size;
+    uint8_t                  *rbsp;
+    int                      rbsp_size;
+    int                      warned;
+} segcrypt_struct;
+
+typedef struct _segcrypt_response_struct_ {
+    char                     *buffer;
+    int                      size;
+} segcrypt_response_struct;
+
+int segcrypt_scheme(const char *name)
+{
+    if (strcmp(name, "aes128") == 0 || strcmp(name, "aes-128") == 0) {
+        return SEGCRYPT_SCHEME_AES128;
+    } else if (strcmp(name, "sample-aes") == 0) {
+        return SEGCRYPT_SCHEME_SAMPLE_AES;
+    } else if (strcmp(name, "cenc") == 0) {
+        return SEGCRYPT_SCHEME_CENC;
+    } else if (strcmp(name, "cbcs") == 0) {
+        return SEGCRYPT_SCHEME_CBCS;
+    }
+    return -1;
+}
+
+const char *segcrypt_scheme_name(int scheme)
+{
+    switch (scheme) {
+    case SEGCRYPT_SCHEME_AES128:
+        return "aes128";
+    case SEGCRYPT_SCHEME_SAMPLE_AES:
+        return "sample-aes";
+    case SEGCRYPT_SCHEME_CENC:
+        return "cenc";
+    case SEGCRYPT_SCHEME_CBCS:
+        return "cbcs";
+    }
+    return "none";
+}
+
+// hex with or without dashes, as uuids and 0x prefixed values come from a kms
+static int parse_hex(const char *text, uint8_t *output, int output_size)
+{
+    int count = 0;
+    int nibble = -1;
+
+    if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+        text += 2;
+    }
+    for (; *text; text++) {
+        int value;
+
+        if (*text == '-' || isspace((unsigned char)*text)) {
+            continue;
+        }
+        if (!isxdigit((unsigned char)*text) || count >= output_size) {
+            return -1;
+        }
+        value = isdigit((unsigned char)*text) ? *text - '0' : (tolower((unsigned char)*text) - 'a' + 10);
+        if (nibble < 0) {
+            nibble = value;
+        } else {
+            output[count++] = (nibble << 4) | value;
+            nibble = -1;
+        }
+    }
+    return (count == output_size && nibble < 0) ? 0 : -1;
+}
+
+static int parse_key(const char *text, int text_size, segcrypt_key_struct *key, int *have_kid, int *have_iv)
+{
+    cJSON *json;
+    cJSON *item;
+    char hex[SEGCRYPT_MAX_SOURCE];
+
+    if (text_size == SEGCRYPT_KEY_SIZE) {
+        // a raw key file, the same bytes an identity key uri hands out
+        memcpy(key->key, text, SEGCRYPT_KEY_SIZE);
+        return 0;
+    }
+    while (text_size > 0 && isspace((unsigned char)*text)) {
+        text++;
+        text_size--;
+    }
+    if (text_size > 0 && *text != '{') {
+        snprintf(hex, sizeof(hex), "%.*s", text_size, text);
+        return parse_hex(hex, key->key, SEGCRYPT_KEY_SIZE);
+    }
+
+    json = cJSON_Parse(text);
+    if (!json) {
+        return -1;
+    }
+    item = cJSON_GetObjectItem(json, "key");
+    if (!cJSON_IsString(item) || parse_hex(item->valuestring, key->key, SEGCRYPT_KEY_SIZE) < 0) {
+        cJSON_Delete(json);
+        return -1;
+    }
+    item = cJSON_GetObjectItem(json, "kid");
+    if (cJSON_IsString(item)) {
+        if (parse_hex(item->valuestring, key->kid, SEGCRYPT_KEY_SIZE) < 0) {
+            cJSON_Delete(json);
+            return -1;
+        }
+        *have_kid = 1;
+    }
+    item = cJSON_GetObjectItem(json, "iv");
+    if (cJSON_IsString(item)) {
+        if (parse_hex(item->valuestring, key->iv, SEGCRYPT_KEY_SIZE) < 0) {
+            cJSON_Delete(json);
+            return -1;
+        }
+        *have_iv = 1;
+    }
+    cJSON_Delete(json);
+    return 0;
+}
+
+static size_t key_response(void *data, size_t size, size_t count, void *context)
+{
+    segcrypt_response_struct *response = (segcrypt_response_struct*)context;
+    size_t bytes = size * count;
+
+    if (response->size + bytes >= SEGCRYPT_MAX_RESPONSE) {
+        return 0;
+    }
+    memcpy(response->buffer + response->size, data, bytes);
+    response->size += bytes;
+    response->buffer[response->size] = '\0';
+    return bytes;
+}
+
+static int fetch_key(const char *url, segcrypt_response_struct *response)
+{
+    CURL *curl;
+    CURLcode result;
+    long http_code = 0;
+
+    curl = curl_easy_init();
+    if (!curl) {
+        return -1;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, key_response);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 2);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+    result = curl_easy_perform(curl);
+    if (result == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    }
+    curl_easy_cleanup(curl);
+
+    if (result != CURLE_OK || http_code != 200) {
+        fprintf(stderr,"SEGCRYPT: ERROR: key request to %s failed (%s, http %ld)\n", url, curl_easy_strerror(result), http_code);
+        return -1;
+    }
+    return 0;
+}
+
+// a key is a raw 16 byte file, a hex string or a json object {"kid","key","iv"} from a
+// file or a kms endpoint- a missing kid or iv is derived from the key so restarts agree
+int segcrypt_load_key(const char *source, segcrypt_key_struct *key)
+{
+    segcrypt_response_struct response;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    int have_kid = 0;
+    int have_iv = 0;
+    int retval;
+
+    memset(key, 0, sizeof(segcrypt_key_struct));
+    response.buffer = (char*)malloc(SEGCRYPT_MAX_RESPONSE);
+    if (!response.buffer) {
+        return -1;
+    }
+    response.size = 0;
+    response.buffer[0] = '\0';
+
+    if (strncmp(source, "http://", 7) == 0 || strncmp(source, "https://", 8) == 0) {
+        retval = fetch_key(source, &response);
+    } else {
+        FILE *key_file = fopen(source, "rb");
+
+        retval = -1;
+        if (key_file) {
+            response.size = fread(response.buffer, 1, SEGCRYPT_MAX_RESPONSE - 1, key_file);
+            response.buffer[response.size] = '\0';
+            fclose(key_file);
+            retval = 0;
+        }
+    }
+    if (retval == 0) {
+        retval = parse_key(response.buffer, response.size, key, &have_kid, &have_iv);
+    }
+    free(response.buffer);
+    if (retval < 0) {
+        fprintf(stderr,"SEGCRYPT: ERROR: unable to load a content key from %s\n", source);
+        return -1;
+    }
+
+    SHA256(key->key, SEGCRYPT_KEY_SIZE, digest);
+    if (!have_kid) {
+        memcpy(key->kid, digest, SEGCRYPT_KEY_SIZE);
+    }
+    if (!have_iv) {
+        memcpy(key->iv, digest + SEGCRYPT_KEY_SIZE, SEGCRYPT_KEY_SIZE);
+    }
+    return 0;
+}
+
+int segcrypt_uuid(const uint8_t *kid, char *text, int text_size)
+{
+    return snprintf(text, text_size,
+                    "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                    kid[0], kid[1], kid[2], kid[3], kid[4], kid[5], kid[6], kid[7],
+                    kid[8], kid[9], kid[10], kid[11], kid[12], kid[13], kid[14], kid[15]);
+}
+
+void *segcrypt_create(int scheme, segcrypt_key_struct *key)
+{
+    segcrypt_struct *crypt;
+    uint8_t zero[SEGCRYPT_BLOCK_SIZE];
+
+    crypt = (segcrypt_struct*)malloc(sizeof(segcrypt_struct));
+    if (!crypt) {
+        return NULL;
+    }
+    memset(crypt, 0, sizeof(segcrypt_struct));
+    memset(zero, 0, sizeof(zero));
+    crypt->scheme = scheme;
+    memcpy(&crypt->key, key, sizeof(segcrypt_key_struct));
+
+    // the key schedule is done once here, samples and segments only reset the iv
+    crypt->cbc = EVP_CIPHER_CTX_new();
+    crypt->ctr = EVP_CIPHER_CTX_new();
+    if (!crypt->cbc || !crypt->ctr ||
+        EVP_EncryptInit_ex(crypt->cbc, EVP_aes_128_cbc(), NULL, key->key, zero) != 1 ||
+        EVP_EncryptInit_ex(crypt->ctr, EVP_aes_128_ctr(), NULL, key->key, zero) != 1) {
+        fprintf(stderr,"SEGCRYPT: ERROR: unable to set up the aes-128 cipher\n");
+        segcrypt_destroy(crypt);
+        return NULL;
+    }
+    EVP_CIPHER_CTX_set_padding(crypt->cbc, 0);
+
+    // a random start for the per sample ivs so a restart never reuses keystream
+    if (RAND_bytes((uint8_t*)&crypt->sample_counter, sizeof(crypt->sample_counter)) != 1) {
+        fprintf(stderr,"SEGCRYPT: ERROR: unable to seed the sample iv counter\n");
+        segcrypt_destroy(crypt);
+        return NULL;
+    }
+
+    return crypt;
+}
+
+void segcrypt_destroy(void *crypt)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+
+    if (!segcrypt) {
+        return;
+    }
+    if (segcrypt->cbc) {
+        EVP_CIPHER_CTX_free(segcrypt->cbc);
+    }
+    if (segcrypt->ctr) {
+        EVP_CIPHER_CTX_free(segcrypt->ctr);
+    }
+    free(segcrypt->scratch);
+    free(segcrypt->rbsp);
+    memset(segcrypt, 0, sizeof(segcrypt_struct));
+    free(segcrypt);
+}
+
+int segcrypt_get_scheme(void *crypt)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+
+    if (!segcrypt) {
+        return SEGCRYPT_SCHEME_NONE;
+    }
+    return segcrypt->scheme;
+}
+
+segcrypt_key_struct *segcrypt_get_key(void *crypt)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+
+    return &segcrypt->key;
+}
+
+static void cbc_reset(segcrypt_struct *segcrypt, uint8_t *iv)
+{
+    EVP_EncryptInit_ex(segcrypt->cbc, NULL, NULL, NULL, iv);
+}
+
+static void cbc_blocks(segcrypt_struct *segcrypt, uint8_t *data, int size)
+{
+    int output_size;
+
+    EVP_EncryptUpdate(segcrypt->cbc, data, &output_size, data, size);
+}
+
+// the iv of a segment is its media sequence number, as the playlist implies it
+int segcrypt_segment_start(void *crypt, int64_t media_sequence)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+    int i;
+
+    memset(segcrypt->segment_iv, 0, SEGCRYPT_BLOCK_SIZE);
+    for (i = 0; i < 8; i++) {
+        segcrypt->segment_iv[SEGCRYPT_BLOCK_SIZE - 1 - i] = (media_sequence >> (i * 8)) & 0xff;
+    }
+    segcrypt->pending_size = 0;
+    cbc_reset(segcrypt, segcrypt->segment_iv);
+
+    return 0;
+}
+
+// encrypts the buffer in place for aes-128- a write rarely ends on a block boundary, so the
+// last partial block is held back and goes out next time as the lead block ahead of the body
+int segcrypt_segment_update(void *crypt, uint8_t *buffer, int buffer_size, uint8_t *lead, int *lead_size, uint8_t **body)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+    int whole;
+
+    *lead_size = 0;
+    if (segcrypt->pending_size > 0) {
+        int take = SEGCRYPT_BLOCK_SIZE - segcrypt->pending_size;
+
+        if (take > buffer_size) {
+            take = buffer_size;
+        }
+        memcpy(segcrypt->pending + segcrypt->pending_size, buffer, take);
+        segcrypt->pending_size += take;
+        buffer += take;
+        buffer_size -= take;
+        if (segcrypt->pending_size < SEGCRYPT_BLOCK_SIZE) {
+            *body = buffer;
+            return 0;
+        }
+        memcpy(lead, segcrypt->pending, SEGCRYPT_BLOCK_SIZE);
+        cbc_blocks(segcrypt, lead, SEGCRYPT_BLOCK_SIZE);
+        *lead_size = SEGCRYPT_BLOCK_SIZE;
+        segcrypt->pending_size = 0;
+    }
+
+    whole = buffer_size & ~(SEGCRYPT_BLOCK_SIZE - 1);
+    if (whole > 0) {
+        cbc_blocks(segcrypt, buffer, whole);
+    }
+    memcpy(segcrypt->pending, buffer + whole, buffer_size - whole);
+    segcrypt->pending_size = buffer_size - whole;
+    *body = buffer;
+
+    return whole;
+}
+
+// pkcs7 pads what is left into the final block of the segment
+int segcrypt_segment_end(void *crypt, uint8_t *block)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+    int padding = SEGCRYPT_BLOCK_SIZE - segcrypt->pending_size;
+
+    memcpy(block, segcrypt->pending, segcrypt->pending_size);
+    memset(block + segcrypt->pending_size, padding, padding);
+    cbc_blocks(segcrypt, block, SEGCRYPT_BLOCK_SIZE);
+    segcrypt->pending_size = 0;
+
+    return SEGCRYPT_BLOCK_SIZE;
+}
+
+static int scratch_reserve(uint8_t **buffer, int *buffer_size, int size)
+{
+    uint8_t *new_buffer;
+
+    if (size <= *buffer_size) {
+        return 0;
+    }
+    new_buffer = (uint8_t*)realloc(*buffer, size);
+    if (!new_buffer) {
+        fprintf(stderr,"SEGCRYPT: ERROR: unable to grow the scratch buffer to %d bytes\n", size);
+        return -1;
+    }
+    *buffer = new_buffer;
+    *buffer_size = size;
+    return 0;
+}
+
+static int find_startcode(uint8_t *data, int size, int pos)
+{
+    while (pos + 3 <= size) {
+        if (data[pos+2] > 1) {
+            pos += 3;
+        } else if (data[pos] == 0x00 && data[pos+1] == 0x00 && data[pos+2] == 0x01) {
+            return pos;
+        } else {
+            pos++;
+        }
+    }
+    return size;
+}
+
+// sample-aes works on the nal with the emulation prevention taken out and puts it back
+// afterwards, the ciphertext can form start code patterns of its own
+static int sample_aes_nal(segcrypt_struct *segcrypt, uint8_t *nal, int nal_size, uint8_t *output)
+{
+    uint8_t *rbsp = segcrypt->rbsp;
+    int rbsp_size = 0;
+    int zeros = 0;
+    int out = 0;
+    int pos;
+    int i;
+
+    for (i = 0; i < nal_size; i++) {
+        if (zeros >= 2 && nal[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        rbsp[rbsp_size++] = nal[i];
+        zeros = nal[i] == 0x00 ? zeros + 1 : 0;
+    }
+
+    cbc_reset(segcrypt, segcrypt->segment_iv);
+    pos = SEGCRYPT_CLEAR_LEADER;
+    while (pos < rbsp_size) {
+        int skip;
+
+        if (rbsp_size - pos > SEGCRYPT_BLOCK_SIZE) {
+            cbc_blocks(segcrypt, rbsp + pos, SEGCRYPT_BLOCK_SIZE);
+            pos += SEGCRYPT_BLOCK_SIZE;
+        }
+        skip = rbsp_size - pos;
+        if (skip > SEGCRYPT_PATTERN_SKIP * SEGCRYPT_BLOCK_SIZE) {
+            skip = SEGCRYPT_PATTERN_SKIP * SEGCRYPT_BLOCK_SIZE;
+        }
+        pos += skip;
+    }
+
+    zeros = 0;
+    for (i = 0; i < rbsp_size; i++) {
+        if (zeros >= 2 && rbsp[i] <= 0x03) {
+            output[out++] = 0x03;
+            zeros = 0;
+        }
+        output[out++] = rbsp[i];
+        zeros = rbsp[i] == 0x00 ? zeros + 1 : 0;
+    }
+    if (zeros > 0) {
+        output[out++] = 0x03;
+    }
+    return out;
+}
+
+static int sample_aes_video(segcrypt_struct *segcrypt, uint8_t *sample, int sample_size)
+{
+    int out = 0;
+    int next;
+
+    // re-escaping the ciphertext can at worst add a byte for every two
+    if (scratch_reserve(&segcrypt->scratch, &segcrypt->scratch_size, sample_size + sample_size / 2 + SEGCRYPT_BLOCK_SIZE) < 0 ||
+        scratch_reserve(&segcrypt->rbsp, &segcrypt->rbsp_size, sample_size) < 0) {
+        return -1;
+    }
+
+    next = find_startcode(sample, sample_size, 0);
+    memcpy(segcrypt->scratch, sample, next);
+    out = next;
+    while (next < sample_size) {
+        int nal_start = next + 3;
+        int nal_end;
+        int nal_type;
+
+        next = find_startcode(sample, sample_size, nal_start);
+        nal_end = next;
+        while (nal_end > nal_start && sample[nal_end-1] == 0x00) {
+            nal_end--;
+        }
+
+        memcpy(segcrypt->scratch + out, sample + nal_start - 3, 3);
+        out += 3;
+        nal_type = nal_start < sample_size ? sample[nal_start] & 0x1f : 0;
+        if ((nal_type == 1 || nal_type == 5) && nal_end - nal_start > SEGCRYPT_MIN_NAL) {
+            out += sample_aes_nal(segcrypt, sample + nal_start, nal_end - nal_start, segcrypt->scratch + out);
+        } else {
+            memcpy(segcrypt->scratch + out, sample + nal_start, nal_end - nal_start);
+            out += nal_end - nal_start;
+        }
+        memcpy(segcrypt->scratch + out, sample + nal_end, next - nal_end);
+        out += next - nal_end;
+    }
+    return out;
+}
+
+static int sample_aes_audio(segcrypt_struct *segcrypt, uint8_t *sample, int sample_size)
+{
+    uint8_t *output;
+    int pos = 0;
+
+    if (scratch_reserve(&segcrypt->scratch, &segcrypt->scratch_size, sample_size) < 0) {
+        return -1;
+    }
+    output = segcrypt->scratch;
+    memcpy(output, sample, sample_size);
+
+    // every adts frame keeps its header and the first 16 bytes clear, the trailing partial block too
+    while (pos + 7 <= sample_size && output[pos] == 0xff && (output[pos+1] & 0xf0) == 0xf0) {
+        int header_size = (output[pos+1] & 0x01) ? 7 : 9;
+        int frame_size = ((output[pos+3] & 0x03) << 11) | (output[pos+4] << 3) | (output[pos+5] >> 5);
+        int encrypted;
+
+        if (frame_size < header_size || pos + frame_size > sample_size) {
+            break;
+        }
+        encrypted = (frame_size - header_size - SEGCRYPT_AAC_LEADER) & ~(SEGCRYPT_BLOCK_SIZE - 1);
+        if (encrypted > 0) {
+            cbc_reset(segcrypt, segcrypt->segment_iv);
+            cbc_blocks(segcrypt, output + pos + header_size + SEGCRYPT_AAC_LEADER, encrypted);
+        }
+        pos += frame_size;
+    }
+    return sample_size;
+}
+
+// the frame is shared with the other outputs, so the protected copy goes into scratch
+int segcrypt_sample_aes(void *crypt, int media_type, uint8_t *sample, int sample_size, uint8_t **output)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+    int output_size = -1;
+
+    if (media_type == MEDIA_TYPE_H264) {
+        output_size = sample_aes_video(segcrypt, sample, sample_size);
+    } else if (media_type == MEDIA_TYPE_AAC) {
+        output_size = sample_aes_audio(segcrypt, sample, sample_size);
+    } else {
+        if (!segcrypt->warned) {
+            syslog(LOG_WARNING,"SEGCRYPT: sample-aes in ts covers h264 and aac only, media type 0x%x stays clear\n", media_type);
+            segcrypt->warned = 1;
+        }
+        *output = sample;
+        return sample_size;
+    }
+    if (output_size < 0) {
+        return -1;
+    }
+    *output = segcrypt->scratch;
+    return output_size;
+}
+
+// only slice data is protected, past the clear leader and in whole blocks with any
+// remainder added to the clear part so both schemes can share the same map
+int segcrypt_subsamples(int media_type, uint8_t *nal, int nal_size, int *clear_bytes, int *protected_bytes)
+{
+    int vcl;
+
+    if (media_type == MEDIA_TYPE_HEVC) {
+        vcl = ((nal[0] >> 1) & 0x3f) < 32;
+    } else {
+        int nal_type = nal[0] & 0x1f;
+        vcl = nal_type >= 1 && nal_type <= 5;
+    }
+    if (!vcl || nal_size <= SEGCRYPT_MIN_NAL) {
+        *clear_bytes = nal_size;
+        *protected_bytes = 0;
+        return 0;
+    }
+    *protected_bytes = (nal_size - SEGCRYPT_CLEAR_LEADER) & ~(SEGCRYPT_BLOCK_SIZE - 1);
+    *clear_bytes = nal_size - *protected_bytes;
+    return 1;
+}
+
+// cenc carries an 8 byte iv per sample, cbcs has the constant iv in the tenc and none here
+int segcrypt_sample_iv(void *crypt, uint8_t *iv)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+    uint64_t counter;
+    int i;
+
+    if (segcrypt->scheme != SEGCRYPT_SCHEME_CENC) {
+        return 0;
+    }
+    counter = segcrypt->sample_counter++;
+    for (i = 0; i < SEGCRYPT_SAMPLE_IV_SIZE; i++) {
+        iv[SEGCRYPT_SAMPLE_IV_SIZE - 1 - i] = (counter >> (i * 8)) & 0xff;
+    }
+    return SEGCRYPT_SAMPLE_IV_SIZE;
+}
+
+static void cbcs_range(segcrypt_struct *segcrypt, uint8_t *data, int size, int pattern)
+{
+    int blocks = size / SEGCRYPT_BLOCK_SIZE;
+    int block;
+
+    cbc_reset(segcrypt, segcrypt->key.iv);
+    if (!pattern) {
+        if (blocks > 0) {
+            cbc_blocks(segcrypt, data, blocks * SEGCRYPT_BLOCK_SIZE);
+        }
+        return;
+    }
+    for (block = 0; block < blocks; block += 1 + SEGCRYPT_PATTERN_SKIP) {
+        cbc_blocks(segcrypt, data + block * SEGCRYPT_BLOCK_SIZE, SEGCRYPT_BLOCK_SIZE);
+    }
+}
+
+// encrypts a sample in place inside the mdat- without subsamples the whole sample is
+// protected, which is how audio goes out
+int segcrypt_sample(void *crypt, uint8_t *sample, int sample_size, segcrypt_subsample_struct *subsamples, int subsample_count, uint8_t *iv)
+{
+    segcrypt_struct *segcrypt = (segcrypt_struct*)crypt;
+    int output_size;
+    int pos = 0;
+    int i;
+
+    if (segcrypt->scheme == SEGCRYPT_SCHEME_CENC) {
+        uint8_t counter[SEGCRYPT_BLOCK_SIZE];
+
+        memset(counter, 0, sizeof(counter));
+        memcpy(counter, iv, SEGCRYPT_SAMPLE_IV_SIZE);
+        EVP_EncryptInit_ex(segcrypt->ctr, NULL, NULL, NULL, counter);
+        if (subsample_count == 0) {
+            EVP_EncryptUpdate(segcrypt->ctr, sample, &output_size, sample, sample_size);
+            return 0;
+        }
+        // the keystream runs on across the protected ranges of the sample
+        for (i = 0; i < subsample_count; i++) {
+            pos += subsamples[i].clear_bytes;
+            if (subsamples[i].protected_bytes > 0) {
+                EVP_EncryptUpdate(segcrypt->ctr, sample + pos, &output_size, sample + pos, subsamples[i].protected_bytes);
+                pos += subsamples[i].protected_bytes;
+            }
+        }
+    } else if (segcrypt->scheme == SEGCRYPT_SCHEME_CBCS) {
+        if (subsample_count == 0) {
+            cbcs_range(segcrypt, sample, sample_size, 0);
+            return 0;
+        }
+        for (i = 0; i < subsample_count; i++) {
+            pos += subsamples[i].clear_bytes;
+            if (subsamples[i].protected_bytes > 0) {
+                cbcs_range(segcrypt, sample + pos, subsamples[i].protected_bytes, 1);
+                pos += subsamples[i].protected_bytes;
+            }
+        }
+    }
+    return 0;
+}
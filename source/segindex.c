@@ -0,0 +1,332 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "segindex.h"
+
+#define SEGINDEX_READ_RETRIES           100000
+
+typedef struct _segindex_header_struct_ {
+    uint32_t                magic;
+    uint32_t                version;
+    int32_t                 record_size;
+    int32_t                 capacity;
+    int64_t                 first;
+    int64_t                 count;
+    int64_t                 next_sequence;
+    volatile int64_t        generation;         // odd while an append is moving the window
+    int64_t                 reserved[2];
+} segindex_header_struct;
+
+// a fixed ring of segment records mapped from disk, the archive outlives a restart
+// and appending a record is a memory copy instead of a write call
+typedef struct _segindex_struct_ {
+    int                         fd;
+    int                         capacity;
+    int                         readonly;
+    size_t                      map_size;
+    segindex_header_struct      *header;
+    segindex_record_struct      *records;
+    char                        filename[SEGINDEX_MAX_NAME];
+} segindex_struct;
+
+static void reset_header(segindex_header_struct *header, int capacity)
+{
+    memset(header, 0, sizeof(segindex_header_struct));
+    header->magic = SEGINDEX_MAGIC;
+    header->version = SEGINDEX_VERSION;
+    header->record_size = sizeof(segindex_record_struct);
+    header->capacity = capacity;
+}
+
+static int header_valid(segindex_header_struct *header, int capacity)
+{
+    return header->magic == SEGINDEX_MAGIC &&
+           header->version == SEGINDEX_VERSION &&
+           header->record_size == sizeof(segindex_record_struct) &&
+           header->capacity == capacity &&
+           header->first >= 0 && header->first < capacity &&
+           header->count >= 0 && header->count <= capacity;
+}
+
+void *segindex_create(const char *filename, int capacity)
+{
+    segindex_struct *index;
+    struct stat sb;
+    void *map;
+
+    if (capacity <= 0) {
+        return NULL;
+    }
+
+    index = (segindex_struct*)malloc(sizeof(segindex_struct));
+    if (!index) {
+        return NULL;
+    }
+    memset(index, 0, sizeof(segindex_struct));
+    snprintf(index->filename, SEGINDEX_MAX_NAME-1, "%s", filename);
+    index->capacity = capacity;
+    index->map_size = sizeof(segindex_header_struct) + (size_t)capacity * sizeof(segindex_record_struct);
+
+    index->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (index->fd < 0) {
+        syslog(LOG_ERR,"SEGINDEX: UNABLE TO OPEN %s (%s)\n", filename, strerror(errno));
+        free(index);
+        return NULL;
+    }
+    if (fstat(index->fd, &sb) < 0 || (sb.st_size != (off_t)index->map_size && ftruncate(index->fd, index->map_size) < 0)) {
+        syslog(LOG_ERR,"SEGINDEX: UNABLE TO SIZE %s (%s)\n", filename, strerror(errno));
+        close(index->fd);
+        free(index);
+        return NULL;
+    }
+
+    map = mmap(NULL, index->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR,"SEGINDEX: UNABLE TO MAP %s (%s)\n", filename, strerror(errno));
+        close(index->fd);
+        free(index);
+        return NULL;
+    }
+    index->header = (segindex_header_struct*)map;
+    index->records = (segindex_record_struct*)((uint8_t*)map + sizeof(segindex_header_struct));
+
+    if (!header_valid(index->header, capacity)) {
+        if (index->header->magic == SEGINDEX_MAGIC) {
+            syslog(LOG_INFO,"SEGINDEX: %s DOES NOT MATCH THE WINDOW, STARTING A NEW ARCHIVE\n", filename);
+        }
+        reset_header(index->header, capacity);
+    } else {
+        // an append cut short by a crash never bumped the count, only the generation is left odd
+        index->header->generation += index->header->generation & 1;
+        syslog(LOG_INFO,"SEGINDEX: RESUMING %s WITH %ld SEGMENTS\n", filename, index->header->count);
+    }
+
+    return (void*)index;
+}
+
+// read-only view of an index another thread or process is appending to, the capacity
+// comes from the file instead of the window
+void *segindex_open(const char *filename)
+{
+    segindex_struct *index;
+    segindex_header_struct header;
+    struct stat sb;
+    void *map;
+
+    index = (segindex_struct*)malloc(sizeof(segindex_struct));
+    if (!index) {
+        return NULL;
+    }
+    memset(index, 0, sizeof(segindex_struct));
+    snprintf(index->filename, SEGINDEX_MAX_NAME-1, "%s", filename);
+
+    index->fd = open(filename, O_RDONLY);
+    if (index->fd < 0) {
+        free(index);
+        return NULL;
+    }
+    if (pread(index->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.capacity <= 0 || !header_valid(&header, header.capacity) ||
+        fstat(index->fd, &sb) < 0) {
+        close(index->fd);
+        free(index);
+        return NULL;
+    }
+    index->capacity = header.capacity;
+    index->map_size = sizeof(segindex_header_struct) + (size_t)index->capacity * sizeof(segindex_record_struct);
+    if (sb.st_size < (off_t)index->map_size) {
+        close(index->fd);
+        free(index);
+        return NULL;
+    }
+
+    map = mmap(NULL, index->map_size, PROT_READ, MAP_SHARED, index->fd, 0);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR,"SEGINDEX: UNABLE TO MAP %s (%s)\n", filename, strerror(errno));
+        close(index->fd);
+        free(index);
+        return NULL;
+    }
+    index->readonly = 1;
+    index->header = (segindex_header_struct*)map;
+    index->records = (segindex_record_struct*)((uint8_t*)map + sizeof(segindex_header_struct));
+
+    return (void*)index;
+}
+
+void segindex_destroy(void *index)
+{
+    segindex_struct *index1 = (segindex_struct*)index;
+
+    if (!index1) {
+        return;
+    }
+    if (!index1->readonly) {
+        msync(index1->header, index1->map_size, MS_ASYNC);
+    }
+    munmap(index1->header, index1->map_size);
+    close(index1->fd);
+    free(index1);
+}
+
+// the oldest record is dropped once the ring is full, returns the sequence given to the record
+int64_t segindex_append(void *index, segindex_record_struct *record)
+{
+    segindex_struct *index1 = (segindex_struct*)index;
+    segindex_header_struct *header = index1->header;
+    int64_t slot;
+
+    // seqlock around the whole update, first and count move together and the
+    // slot being reused may be the one a reader is looking at
+    header->generation++;
+    __sync_synchronize();
+    if (header->count == index1->capacity) {
+        header->first = (header->first + 1) % index1->capacity;
+        header->count--;
+    }
+    slot = (header->first + header->count) % index1->capacity;
+    record->sequence = header->next_sequence;
+    index1->records[slot] = *record;
+    header->count++;
+    header->next_sequence++;
+    __sync_synchronize();
+    header->generation++;
+
+    return record->sequence;
+}
+
+// consistent (first, count) pair from the writer, returns the generation it was read
+// at or -1 if the writer never finished its append
+static int64_t segindex_window(segindex_struct *index1, int64_t *first, int64_t *count)
+{
+    segindex_header_struct *header = index1->header;
+    int64_t generation;
+    int retries;
+
+    for (retries = 0; retries < SEGINDEX_READ_RETRIES; retries++) {
+        generation = header->generation;
+        __sync_synchronize();
+        *first = header->first;
+        *count = header->count;
+        __sync_synchronize();
+        if (!(generation & 1) && generation == header->generation) {
+            return generation;
+        }
+        sched_yield();
+    }
+    return -1;
+}
+
+static int segindex_moved(segindex_struct *index1, int64_t generation)
+{
+    __sync_synchronize();
+    return index1->header->generation != generation;
+}
+
+int segindex_count(void *index)
+{
+    segindex_struct *index1 = (segindex_struct*)index;
+    int64_t first;
+    int64_t count;
+
+    if (!index1 || segindex_window(index1, &first, &count) < 0) {
+        return 0;
+    }
+    return (int)count;
+}
+
+// position 0 is the oldest record, the pointer stays valid until the slot is reused
+segindex_record_struct *segindex_record(void *index, int position)
+{
+    segindex_struct *index1 = (segindex_struct*)index;
+    int64_t first;
+    int64_t count;
+
+    if (!index1 || segindex_window(index1, &first, &count) < 0 ||
+        position < 0 || position >= count) {
+        return NULL;
+    }
+    return &index1->records[(first + position) % index1->capacity];
+}
+
+// binary search over one window, started over if an append moved it part way through
+static int segindex_search(segindex_struct *index1, int64_t value, int by_pts)
+{
+    int64_t generation;
+    int64_t first;
+    int64_t count;
+    int found;
+
+    do {
+        int low = 0;
+        int high;
+
+        generation = segindex_window(index1, &first, &count);
+        if (generation < 0) {
+            return -1;
+        }
+        found = -1;
+        high = (int)count - 1;
+        while (low <= high) {
+            int middle = low + (high - low) / 2;
+            segindex_record_struct *record = &index1->records[(first + middle) % index1->capacity];
+
+            if ((by_pts ? record->pts : record->program_time) <= value) {
+                found = middle;
+                low = middle + 1;
+            } else {
+                high = middle - 1;
+            }
+        }
+    } while (segindex_moved(index1, generation));
+
+    return found;
+}
+
+// position of the segment playing at program_time, -1 if it is older than the archive
+int segindex_find(void *index, int64_t program_time)
+{
+    if (!index) {
+        return -1;
+    }
+    return segindex_search((segindex_struct*)index, program_time, 0);
+}
+
+// same search on the 90kHz timeline, which only runs forward between restarts
+int segindex_find_pts(void *index, int64_t pts)
+{
+    if (!index) {
+        return -1;
+    }
+    return segindex_search((segindex_struct*)index, pts, 1);
+}
@@ -0,0 +1,375 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include "segstore.h"
+
+typedef struct _segstore_slot_struct_ {
+    int                 fd;
+    int                 busy;
+    ino_t               inode;
+    int64_t             size;
+    char                path[SEGSTORE_MAX_NAME];
+    int                 name_count;
+    char                names[SEGSTORE_MAX_LINKS][SEGSTORE_MAX_NAME];
+} segstore_slot_struct;
+
+// one ring per stream, a segment name with its sequence number taken out is the key
+typedef struct _segstore_ring_struct_ {
+    char                    key[SEGSTORE_MAX_NAME];
+    int                     next;
+    segstore_slot_struct    *slots;
+} segstore_ring_struct;
+
+// segments are written into a fixed set of preallocated files and published
+// under their real names as hard links, so no inode is created or freed per segment
+typedef struct _segstore_struct_ {
+    pthread_mutex_t         lock;
+    char                    directory[SEGSTORE_MAX_NAME];
+    int                     slot_count;
+    int64_t                 slot_bytes;
+    int                     memory_backed;
+    segstore_ring_struct    rings[SEGSTORE_MAX_RINGS];
+    int                     ring_count;
+
+    int64_t                 live_bytes;
+    int64_t                 live_segments;
+    int64_t                 published;
+    int64_t                 evictions;
+    int64_t                 overflows;
+    int64_t                 fallbacks;
+    int64_t                 errors;
+} segstore_struct;
+
+static void segstore_key(const char *filename, char *key)
+{
+    const char *dot = strrchr(filename, '.');
+    const char *digits;
+    const char *slash = strrchr(filename, '/');
+
+    if (!dot || (slash && dot < slash)) {
+        dot = filename + strlen(filename);
+    }
+    digits = dot;
+    while (digits > filename && digits[-1] >= '0' && digits[-1] <= '9') {
+        digits--;
+    }
+    snprintf(key, SEGSTORE_MAX_NAME-1, "%.*s#%s", (int)(digits - filename), filename, dot);
+}
+
+// the name is swapped over to the slot in one step, readers see the old file or the new one
+static int segstore_publish(segstore_struct *segstore, segstore_slot_struct *slot, const char *filename)
+{
+    char temp_name[SEGSTORE_MAX_NAME+8];
+
+    snprintf(temp_name, sizeof(temp_name), "%s.store", filename);
+    unlink(temp_name);
+    if (link(slot->path, temp_name) < 0 || rename(temp_name, filename) < 0) {
+        segstore->errors++;
+        syslog(LOG_ERR,"SEGSTORE: UNABLE TO PUBLISH %s (%s)\n", filename, strerror(errno));
+        unlink(temp_name);
+        return -1;
+    }
+    return 0;
+}
+
+// names that were since published from another slot are left alone
+static void segstore_evict(segstore_struct *segstore, segstore_slot_struct *slot)
+{
+    struct stat sb;
+    int i;
+
+    if (slot->name_count == 0) {
+        return;
+    }
+    for (i = 0; i < slot->name_count; i++) {
+        if (lstat(slot->names[i], &sb) == 0 && sb.st_ino == slot->inode) {
+            unlink(slot->names[i]);
+        }
+    }
+    slot->name_count = 0;
+    segstore->evictions++;
+    segstore->live_segments--;
+    segstore->live_bytes -= slot->size;
+    if (!segstore->memory_backed) {
+        // written back long ago, the cached copy is not going to be read again
+        posix_fadvise(slot->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+}
+
+static segstore_ring_struct *segstore_ring(segstore_struct *segstore, const char *filename)
+{
+    char key[SEGSTORE_MAX_NAME];
+    segstore_ring_struct *ring;
+    int i;
+
+    segstore_key(filename, key);
+    for (i = 0; i < segstore->ring_count; i++) {
+        if (strcmp(segstore->rings[i].key, key) == 0) {
+            return &segstore->rings[i];
+        }
+    }
+    return NULL;
+}
+
+static segstore_ring_struct *segstore_ring_create(segstore_struct *segstore, const char *filename)
+{
+    segstore_ring_struct *ring;
+    struct stat sb;
+    int i;
+
+    if (segstore->ring_count == SEGSTORE_MAX_RINGS) {
+        return NULL;
+    }
+    ring = &segstore->rings[segstore->ring_count];
+    ring->slots = (segstore_slot_struct*)malloc(sizeof(segstore_slot_struct) * segstore->slot_count);
+    if (!ring->slots) {
+        return NULL;
+    }
+    memset(ring->slots, 0, sizeof(segstore_slot_struct) * segstore->slot_count);
+    segstore_key(filename, ring->key);
+    ring->next = 0;
+
+    for (i = 0; i < segstore->slot_count; i++) {
+        segstore_slot_struct *slot = &ring->slots[i];
+
+        snprintf(slot->path, SEGSTORE_MAX_NAME-1, "%s/%d.%d", segstore->directory, segstore->ring_count, i);
+        slot->fd = open(slot->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (slot->fd < 0) {
+            syslog(LOG_ERR,"SEGSTORE: UNABLE TO CREATE %s (%s)\n", slot->path, strerror(errno));
+            break;
+        }
+        if (fallocate(slot->fd, FALLOC_FL_KEEP_SIZE, 0, segstore->slot_bytes) < 0) {
+            syslog(LOG_WARNING,"SEGSTORE: UNABLE TO PREALLOCATE %s (%s)\n", slot->path, strerror(errno));
+        }
+        fstat(slot->fd, &sb);
+        slot->inode = sb.st_ino;
+    }
+    if (i < segstore->slot_count) {
+        while (i-- > 0) {
+            close(ring->slots[i].fd);
+        }
+        free(ring->slots);
+        ring->slots = NULL;
+        return NULL;
+    }
+
+    syslog(LOG_INFO,"SEGSTORE: RING %d FOR %s: %d SLOTS OF %ld BYTES\n",
+           segstore->ring_count, ring->key, segstore->slot_count, segstore->slot_bytes);
+    segstore->ring_count++;
+    return ring;
+}
+
+void *segstore_create(const char *directory, int slot_count, int64_t slot_bytes)
+{
+    segstore_struct *segstore;
+    struct statfs fs;
+    struct dirent *entry;
+    DIR *dir;
+
+    mkdir(directory, 0755);
+    dir = opendir(directory);
+    if (!dir) {
+        syslog(LOG_ERR,"SEGSTORE: UNABLE TO OPEN %s (%s)\n", directory, strerror(errno));
+        return NULL;
+    }
+    // slots left over from an earlier run may still be linked from old names
+    while ((entry = readdir(dir)) != NULL) {
+        char path[SEGSTORE_MAX_NAME];
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, SEGSTORE_MAX_NAME-1, "%s/%s", directory, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+
+    segstore = (segstore_struct*)malloc(sizeof(segstore_struct));
+    if (!segstore) {
+        return NULL;
+    }
+    memset(segstore, 0, sizeof(segstore_struct));
+    pthread_mutex_init(&segstore->lock, NULL);
+    snprintf(segstore->directory, SEGSTORE_MAX_NAME-1, "%s", directory);
+    segstore->slot_count = slot_count;
+    segstore->slot_bytes = slot_bytes;
+    if (statfs(directory, &fs) == 0 && (fs.f_type == TMPFS_MAGIC || fs.f_type == RAMFS_MAGIC)) {
+        segstore->memory_backed = 1;
+    }
+
+    return (void*)segstore;
+}
+
+void segstore_destroy(void *store)
+{
+    segstore_struct *segstore = (segstore_struct*)store;
+    int i;
+    int j;
+
+    if (!segstore) {
+        return;
+    }
+    for (i = 0; i < segstore->ring_count; i++) {
+        for (j = 0; j < segstore->slot_count; j++) {
+            close(segstore->rings[i].slots[j].fd);
+        }
+        free(segstore->rings[i].slots);
+    }
+    pthread_mutex_destroy(&segstore->lock);
+    free(segstore);
+}
+
+// returns the slot taking the segment, NULL means the caller writes it the usual way
+void *segstore_open(void *store, const char *filename, int *fd)
+{
+    segstore_struct *segstore = (segstore_struct*)store;
+    segstore_ring_struct *ring;
+    segstore_slot_struct *slot;
+
+    pthread_mutex_lock(&segstore->lock);
+    ring = segstore_ring(segstore, filename);
+    if (!ring) {
+        ring = segstore_ring_create(segstore, filename);
+    }
+    if (!ring || ring->slots[ring->next].busy) {
+        segstore->fallbacks++;
+        pthread_mutex_unlock(&segstore->lock);
+        return NULL;
+    }
+    slot = &ring->slots[ring->next];
+    ring->next = (ring->next + 1) % segstore->slot_count;
+
+    segstore_evict(segstore, slot);
+    lseek(slot->fd, 0, SEEK_SET);
+    slot->busy = 1;
+    slot->size = 0;
+    snprintf(slot->names[0], SEGSTORE_MAX_NAME-1, "%s", filename);
+    slot->name_count = 1;
+    segstore->live_segments++;
+    *fd = slot->fd;
+    pthread_mutex_unlock(&segstore->lock);
+
+    return (void*)slot;
+}
+
+int segstore_close(void *store, void *slot)
+{
+    segstore_struct *segstore = (segstore_struct*)store;
+    segstore_slot_struct *slot1 = (segstore_slot_struct*)slot;
+    struct stat sb;
+    off_t size;
+    int retcode;
+
+    pthread_mutex_lock(&segstore->lock);
+    size = lseek(slot1->fd, 0, SEEK_CUR);
+    if (fstat(slot1->fd, &sb) == 0 && sb.st_size > size) {
+        // trimming gives back the blocks past the end, take the reservation back up
+        ftruncate(slot1->fd, size);
+        fallocate(slot1->fd, FALLOC_FL_KEEP_SIZE, 0, segstore->slot_bytes);
+    }
+    if (size > segstore->slot_bytes) {
+        segstore->overflows++;
+    }
+    if (!segstore->memory_backed) {
+        sync_file_range(slot1->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    slot1->size = size;
+    slot1->busy = 0;
+    segstore->live_bytes += size;
+    segstore->published++;
+    retcode = segstore_publish(segstore, slot1, slot1->names[0]);
+    pthread_mutex_unlock(&segstore->lock);
+
+    return retcode;
+}
+
+// extra names for a stored segment are hard links evicted along with it, -1 if it is not stored
+int segstore_link(void *store, const char *target, const char *linkname)
+{
+    segstore_struct *segstore = (segstore_struct*)store;
+    segstore_ring_struct *ring;
+    segstore_slot_struct *slot = NULL;
+    int retcode;
+    int i;
+
+    pthread_mutex_lock(&segstore->lock);
+    ring = segstore_ring(segstore, target);
+    if (ring) {
+        for (i = 1; i <= segstore->slot_count; i++) {
+            segstore_slot_struct *candidate = &ring->slots[(ring->next - i + segstore->slot_count) % segstore->slot_count];
+            if (candidate->name_count > 0 && strcmp(candidate->names[0], target) == 0) {
+                slot = candidate;
+                break;
+            }
+        }
+    }
+    if (!slot) {
+        pthread_mutex_unlock(&segstore->lock);
+        return -1;
+    }
+    if (slot->name_count < SEGSTORE_MAX_LINKS) {
+        snprintf(slot->names[slot->name_count], SEGSTORE_MAX_NAME-1, "%s", linkname);
+        slot->name_count++;
+    }
+    retcode = segstore_publish(segstore, slot, linkname);
+    pthread_mutex_unlock(&segstore->lock);
+
+    return retcode;
+}
+
+void segstore_report(void *store)
+{
+    segstore_struct *segstore = (segstore_struct*)store;
+
+    if (!segstore) {
+        return;
+    }
+
+    pthread_mutex_lock(&segstore->lock);
+    syslog(LOG_INFO,"SEGSTORE(%s): RINGS:%d SLOTS:%ld/%d LIVE:%ld RESERVED:%ld PUBLISHED:%ld EVICTIONS:%ld OVERFLOWS:%ld FALLBACKS:%ld ERRORS:%ld\n",
+           segstore->memory_backed ? "MEMORY" : "DISK",
+           segstore->ring_count,
+           segstore->live_segments,
+           segstore->ring_count * segstore->slot_count,
+           segstore->live_bytes,
+           (int64_t)segstore->ring_count * segstore->slot_count * segstore->slot_bytes,
+           segstore->published,
+           segstore->evictions,
+           segstore->overflows,
+           segstore->fallbacks,
+           segstore->errors);
+    pthread_mutex_unlock(&segstore->lock);
+}
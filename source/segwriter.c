@@ -0,0 +1,785 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/uio.h>
+#include "fillet.h"
+#include "segwriter.h"
+#include "origin.h"
+#include "segstore.h"
+
+#define SEGWRITER_OP_OPEN      1
+#define SEGWRITER_OP_WRITE     2
+#define SEGWRITER_OP_CLOSE     3
+#define SEGWRITER_OP_FILE      4
+#define SEGWRITER_OP_SYMLINK   5
+#define SEGWRITER_OP_NOTIFY    6
+
+typedef struct _segwriter_file_struct_ {
+    int                 fd;
+    int                 failed;
+    int                 flags;
+    char                filename[SEGWRITER_MAX_NAME];
+    void                *origin_object;
+    void                *store_slot;
+    int64_t             offset;
+    int64_t             written;
+
+    uint8_t             *chunk;
+    int                 chunk_used;
+    int                 chunk_size;
+    struct iovec        iov[SEGWRITER_MAX_IOV];
+    int                 iov_count;
+    int64_t             iov_bytes;
+} segwriter_file_struct;
+
+typedef struct _segwriter_op_struct_ {
+    int                             op;
+    segwriter_file_struct           *file;
+    struct iovec                    iov[SEGWRITER_MAX_IOV];
+    uint8_t                         *chunks[SEGWRITER_MAX_IOV];
+    int                             iov_count;
+    int64_t                         bytes;
+    char                            filename[SEGWRITER_MAX_NAME];
+    char                            linkname[SEGWRITER_MAX_NAME];
+    int                             flags;
+    int64_t                         media_sequence;
+    int                             part;
+    segwriter_callback              callback;
+    void                            *context;
+    int                             event;
+    struct _segwriter_op_struct_    *next;
+} segwriter_op_struct;
+
+typedef struct _segwriter_struct_ {
+    pthread_mutex_t         lock;
+    pthread_cond_t          ready;
+    pthread_cond_t          drained;
+    segwriter_op_struct     *head;
+    segwriter_op_struct     *tail;
+    int                     depth;
+    int                     peak_depth;
+    int64_t                 pending_bytes;
+    int                     busy;
+    int                     quit;
+    pthread_t               writer_thread_id;
+
+    void                    *origin;
+    char                    origin_root[SEGWRITER_MAX_NAME];
+    int                     origin_root_length;
+    void                    *store;
+
+    int64_t                 bytes_written;
+    int64_t                 writev_calls;
+    int64_t                 files_written;
+    int64_t                 write_errors;
+    int64_t                 stalls;
+    int64_t                 op_latency[SEGWRITER_HISTOGRAM_BUCKETS];
+} segwriter_struct;
+
+static int64_t segwriter_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void latency_histogram_add(int64_t *histogram, int64_t usec)
+{
+    int bucket = 0;
+
+    while (usec > 1 && bucket < SEGWRITER_HISTOGRAM_BUCKETS - 1) {
+        usec >>= 1;
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+int64_t latency_histogram_percentile(int64_t *histogram, int percentile)
+{
+    int64_t total = 0;
+    int64_t target;
+    int64_t seen = 0;
+    int i;
+
+    for (i = 0; i < SEGWRITER_HISTOGRAM_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    target = (total * percentile + 99) / 100;
+    for (i = 0; i < SEGWRITER_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen >= target) {
+            break;
+        }
+    }
+    return (int64_t)1 << (i + 1);  // upper bound of the bucket in usec
+}
+
+static int write_iov(int fd, struct iovec *iov, int iov_count)
+{
+    while (iov_count > 0) {
+        ssize_t written = writev(fd, iov, iov_count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iov_count > 0 && written >= (ssize_t)iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// name of the file relative to the served directory, NULL if it is outside of it
+static const char *origin_name(segwriter_struct *segwriter, const char *filename)
+{
+    if (!segwriter->origin || strncmp(filename, segwriter->origin_root, segwriter->origin_root_length) != 0) {
+        return NULL;
+    }
+    filename += segwriter->origin_root_length;
+    while (*filename == '/') {
+        filename++;
+    }
+    return filename;
+}
+
+static void run_op(segwriter_struct *segwriter, segwriter_op_struct *op)
+{
+    segwriter_file_struct *file = op->file;
+    const char *name;
+    const char *alias;
+    int fd;
+    int i;
+
+    switch (op->op) {
+    case SEGWRITER_OP_OPEN:
+        name = origin_name(segwriter, file->filename);
+        if (name && (file->flags & SEGWRITER_FLAG_APPEND)) {
+            char range_name[SEGWRITER_MAX_NAME];
+
+            // each appended range is its own object, the origin finds it from the Range offset
+            snprintf(range_name, SEGWRITER_MAX_NAME-1, "%s@%ld", name, file->offset);
+            file->origin_object = origin_open(segwriter->origin, range_name, 0);
+        } else if (name) {
+            file->origin_object = origin_open(segwriter->origin, name,
+                                              (file->flags & SEGWRITER_FLAG_PINNED ? ORIGIN_FLAG_PINNED : 0) |
+                                              (file->flags & SEGWRITER_FLAG_GROWING ? ORIGIN_FLAG_GROWING : 0));
+        }
+        if (file->origin_object && (file->flags & SEGWRITER_FLAG_MEMORY)) {
+            break;
+        }
+        if (file->flags & SEGWRITER_FLAG_APPEND) {
+            file->fd = open(file->filename, O_WRONLY | O_CREAT | O_APPEND | (file->offset == 0 ? O_TRUNC : 0), 0644);
+            if (file->fd < 0) {
+                file->failed = 1;
+                segwriter->write_errors++;
+                syslog(LOG_ERR,"SEGWRITER: UNABLE TO OPEN %s (%s)\n", file->filename, strerror(errno));
+            }
+            break;
+        }
+        if (segwriter->store && !(file->flags & (SEGWRITER_FLAG_PINNED | SEGWRITER_FLAG_MEMORY))) {
+            file->store_slot = segstore_open(segwriter->store, file->filename, &file->fd);
+            if (file->store_slot) {
+                break;
+            }
+        }
+        file->fd = open(file->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file->fd < 0) {
+            file->failed = 1;
+            segwriter->write_errors++;
+            syslog(LOG_ERR,"SEGWRITER: UNABLE TO OPEN %s (%s)\n", file->filename, strerror(errno));
+        }
+        break;
+    case SEGWRITER_OP_WRITE:
+        if (file->origin_object) {
+            origin_write(file->origin_object, op->iov, op->iov_count);
+        }
+        if (!file->failed && file->fd >= 0) {
+            segwriter->writev_calls++;
+            if (write_iov(file->fd, op->iov, op->iov_count) < 0) {
+                file->failed = 1;
+                segwriter->write_errors++;
+                syslog(LOG_ERR,"SEGWRITER: UNABLE TO WRITE %s (%s)\n", file->filename, strerror(errno));
+            } else {
+                segwriter->bytes_written += op->bytes;
+            }
+        }
+        break;
+    case SEGWRITER_OP_CLOSE:
+        if (file->origin_object) {
+            origin_close(segwriter->origin, file->origin_object);
+        }
+        if (file->store_slot) {
+            segstore_close(segwriter->store, file->store_slot);
+            segwriter->files_written++;
+        } else if (file->fd >= 0) {
+            close(file->fd);
+            segwriter->files_written++;
+        }
+        free(file);
+        op->file = NULL;
+        break;
+    case SEGWRITER_OP_FILE:
+        name = origin_name(segwriter, op->filename);
+        if (name) {
+            origin_put(segwriter->origin, name, op->iov[0].iov_base, op->iov[0].iov_len, ORIGIN_FLAG_PINNED, op->media_sequence, op->part);
+            if (op->flags & SEGWRITER_FLAG_MEMORY) {
+                break;
+            }
+        }
+        // written next to the target and renamed over it so readers never see a partial file
+        snprintf(op->linkname, SEGWRITER_MAX_NAME-1, "%s.tmp", op->filename);
+        fd = open(op->linkname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write_iov(fd, op->iov, op->iov_count) < 0) {
+            segwriter->write_errors++;
+            syslog(LOG_ERR,"SEGWRITER: UNABLE TO WRITE %s (%s)\n", op->linkname, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+                unlink(op->linkname);
+            }
+            break;
+        }
+        close(fd);
+        if (rename(op->linkname, op->filename) < 0) {
+            segwriter->write_errors++;
+            syslog(LOG_ERR,"SEGWRITER: UNABLE TO RENAME %s (%s)\n", op->linkname, strerror(errno));
+            unlink(op->linkname);
+            break;
+        }
+        segwriter->bytes_written += op->bytes;
+        segwriter->files_written++;
+        break;
+    case SEGWRITER_OP_SYMLINK:
+        name = origin_name(segwriter, op->filename);
+        alias = origin_name(segwriter, op->linkname);
+        if (name && alias) {
+            origin_alias(segwriter->origin, name, alias);
+        }
+        if (segwriter->store && segstore_link(segwriter->store, op->filename, op->linkname) == 0) {
+            break;
+        }
+        symlink(op->filename, op->linkname);
+        break;
+    case SEGWRITER_OP_NOTIFY:
+        op->callback(op->context, op->event, op->filename);
+        break;
+    }
+
+    if (op->op == SEGWRITER_OP_WRITE || op->op == SEGWRITER_OP_FILE) {
+        // iov bases may have been advanced by partial writes
+        for (i = 0; i < op->iov_count; i++) {
+            free(op->chunks[i]);
+        }
+    }
+}
+
+static void *segwriter_thread(void *context)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)context;
+    segwriter_op_struct *op;
+    int64_t start_time;
+
+    pthread_mutex_lock(&segwriter->lock);
+    while (1) {
+        while (!segwriter->head && !segwriter->quit) {
+            pthread_cond_wait(&segwriter->ready, &segwriter->lock);
+        }
+        if (!segwriter->head) {
+            break;
+        }
+        op = segwriter->head;
+        segwriter->head = op->next;
+        if (!segwriter->head) {
+            segwriter->tail = NULL;
+        }
+        segwriter->depth--;
+        segwriter->busy = 1;
+        pthread_mutex_unlock(&segwriter->lock);
+
+        start_time = segwriter_now();
+        run_op(segwriter, op);
+
+        pthread_mutex_lock(&segwriter->lock);
+        latency_histogram_add(segwriter->op_latency, segwriter_now() - start_time);
+        segwriter->pending_bytes -= op->bytes;
+        segwriter->busy = 0;
+        pthread_cond_broadcast(&segwriter->drained);
+        free(op);
+    }
+    pthread_mutex_unlock(&segwriter->lock);
+
+    return NULL;
+}
+
+static segwriter_op_struct *new_op(int type, segwriter_file_struct *file)
+{
+    segwriter_op_struct *op;
+
+    op = (segwriter_op_struct*)malloc(sizeof(segwriter_op_struct));
+    if (!op) {
+        return NULL;
+    }
+    memset(op, 0, sizeof(segwriter_op_struct));
+    op->op = type;
+    op->file = file;
+    return op;
+}
+
+static void submit_op(segwriter_struct *segwriter, segwriter_op_struct *op)
+{
+    pthread_mutex_lock(&segwriter->lock);
+    if (op->bytes > 0 && segwriter->pending_bytes + op->bytes > SEGWRITER_MAX_PENDING) {
+        // the disk is not keeping up- hold the producer rather than growing without bound
+        segwriter->stalls++;
+        syslog(LOG_WARNING,"SEGWRITER: WRITE BACKLOG OF %ld BYTES, WAITING FOR DISK\n", segwriter->pending_bytes);
+        while (segwriter->pending_bytes > 0 && segwriter->pending_bytes + op->bytes > SEGWRITER_MAX_PENDING) {
+            pthread_cond_wait(&segwriter->drained, &segwriter->lock);
+        }
+    }
+    segwriter->pending_bytes += op->bytes;
+    if (segwriter->tail) {
+        segwriter->tail->next = op;
+    } else {
+        segwriter->head = op;
+    }
+    segwriter->tail = op;
+    segwriter->depth++;
+    if (segwriter->depth > segwriter->peak_depth) {
+        segwriter->peak_depth = segwriter->depth;
+    }
+    pthread_cond_signal(&segwriter->ready);
+    pthread_mutex_unlock(&segwriter->lock);
+}
+
+static int add_iov(segwriter_op_struct *op, uint8_t *buffer, int buffer_size)
+{
+    op->chunks[op->iov_count] = buffer;
+    op->iov[op->iov_count].iov_base = buffer;
+    op->iov[op->iov_count].iov_len = buffer_size;
+    op->iov_count++;
+    op->bytes += buffer_size;
+    return 0;
+}
+
+static int submit_staged(segwriter_struct *segwriter, segwriter_file_struct *file)
+{
+    segwriter_op_struct *op;
+    int i;
+
+    if (file->chunk && file->chunk_used > 0) {
+        file->iov[file->iov_count].iov_base = file->chunk;
+        file->iov[file->iov_count].iov_len = file->chunk_used;
+        file->iov_count++;
+        file->chunk = NULL;
+        file->chunk_used = 0;
+    }
+    if (file->iov_count == 0) {
+        return 0;
+    }
+
+    op = new_op(SEGWRITER_OP_WRITE, file);
+    if (!op) {
+        for (i = 0; i < file->iov_count; i++) {
+            free(file->iov[i].iov_base);
+        }
+        file->iov_count = 0;
+        return -1;
+    }
+    for (i = 0; i < file->iov_count; i++) {
+        add_iov(op, file->iov[i].iov_base, file->iov[i].iov_len);
+    }
+    file->iov_count = 0;
+    submit_op(segwriter, op);
+    return 0;
+}
+
+// moves the current chunk onto the iov list, the batch is handed over once the list is full
+static void stage_chunk(segwriter_struct *segwriter, segwriter_file_struct *file)
+{
+    if (!file->chunk) {
+        return;
+    }
+    if (file->chunk_used == 0) {
+        free(file->chunk);
+        file->chunk = NULL;
+        return;
+    }
+    file->iov[file->iov_count].iov_base = file->chunk;
+    file->iov[file->iov_count].iov_len = file->chunk_used;
+    file->iov_count++;
+    file->chunk = NULL;
+    file->chunk_used = 0;
+    if (file->iov_count == SEGWRITER_MAX_IOV) {
+        submit_staged(segwriter, file);
+    }
+}
+
+static int new_chunk(segwriter_file_struct *file, int size)
+{
+    file->chunk_size = size > SEGWRITER_CHUNK_SIZE ? size : SEGWRITER_CHUNK_SIZE;
+    file->chunk = (uint8_t*)malloc(file->chunk_size);
+    file->chunk_used = 0;
+    return file->chunk ? 0 : -1;
+}
+
+void *segwriter_create(void)
+{
+    segwriter_struct *segwriter;
+
+    segwriter = (segwriter_struct*)malloc(sizeof(segwriter_struct));
+    if (!segwriter) {
+        return NULL;
+    }
+    memset(segwriter, 0, sizeof(segwriter_struct));
+    pthread_mutex_init(&segwriter->lock, NULL);
+    pthread_cond_init(&segwriter->ready, NULL);
+    pthread_cond_init(&segwriter->drained, NULL);
+    if (pthread_create(&segwriter->writer_thread_id, NULL, segwriter_thread, (void*)segwriter) != 0) {
+        free(segwriter);
+        return NULL;
+    }
+
+    return (void*)segwriter;
+}
+
+void segwriter_destroy(void *writer)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+
+    if (!segwriter) {
+        return;
+    }
+
+    // everything already queued is written out before the thread exits
+    pthread_mutex_lock(&segwriter->lock);
+    segwriter->quit = 1;
+    pthread_cond_signal(&segwriter->ready);
+    pthread_mutex_unlock(&segwriter->lock);
+    pthread_join(segwriter->writer_thread_id, NULL);
+
+    segstore_destroy(segwriter->store);
+    pthread_cond_destroy(&segwriter->drained);
+    pthread_cond_destroy(&segwriter->ready);
+    pthread_mutex_destroy(&segwriter->lock);
+    free(segwriter);
+}
+
+int segwriter_set_origin(void *writer, void *origin, const char *root_directory)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+
+    pthread_mutex_lock(&segwriter->lock);
+    segwriter->origin = origin;
+    snprintf(segwriter->origin_root, SEGWRITER_MAX_NAME-1, "%s", root_directory);
+    segwriter->origin_root_length = strlen(segwriter->origin_root);
+    pthread_mutex_unlock(&segwriter->lock);
+
+    return 0;
+}
+
+// segments go into a fixed ring of preallocated files instead of being created and removed
+int segwriter_set_store(void *writer, const char *directory, int slot_count, int64_t slot_bytes)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    void *store;
+
+    store = segstore_create(directory, slot_count, slot_bytes);
+    if (!store) {
+        return -1;
+    }
+    pthread_mutex_lock(&segwriter->lock);
+    segwriter->store = store;
+    pthread_mutex_unlock(&segwriter->lock);
+
+    return 0;
+}
+
+static void *open_file(void *writer, const char *filename, int flags, int64_t offset)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_file_struct *file;
+    segwriter_op_struct *op;
+
+    file = (segwriter_file_struct*)malloc(sizeof(segwriter_file_struct));
+    if (!file) {
+        return NULL;
+    }
+    memset(file, 0, sizeof(segwriter_file_struct));
+    file->fd = -1;
+    file->flags = flags;
+    file->offset = offset;
+    snprintf(file->filename, SEGWRITER_MAX_NAME-1, "%s", filename);
+
+    op = new_op(SEGWRITER_OP_OPEN, file);
+    if (!op) {
+        free(file);
+        return NULL;
+    }
+    submit_op(segwriter, op);
+
+    return (void*)file;
+}
+
+void *segwriter_open(void *writer, const char *filename, int flags)
+{
+    return open_file(writer, filename, flags, 0);
+}
+
+// offset is where the container ends now, 0 starts a fresh container
+void *segwriter_append(void *writer, const char *filename, int flags, int64_t offset)
+{
+    return open_file(writer, filename, flags | SEGWRITER_FLAG_APPEND, offset);
+}
+
+// bytes handed to the writer so far, the length of an appended range once it is complete
+int64_t segwriter_tell(void *handle)
+{
+    segwriter_file_struct *file = (segwriter_file_struct*)handle;
+
+    if (!file) {
+        return 0;
+    }
+    return file->written;
+}
+
+int segwriter_write(void *writer, void *handle, const uint8_t *buffer, int buffer_size)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_file_struct *file = (segwriter_file_struct*)handle;
+
+    if (!file || buffer_size <= 0) {
+        return 0;
+    }
+    file->written += buffer_size;
+
+    if (buffer_size >= SEGWRITER_CHUNK_SIZE) {
+        uint8_t *copy = (uint8_t*)malloc(buffer_size);
+        if (!copy) {
+            return -1;
+        }
+        memcpy(copy, buffer, buffer_size);
+        stage_chunk(segwriter, file);
+        file->iov[file->iov_count].iov_base = copy;
+        file->iov[file->iov_count].iov_len = buffer_size;
+        file->iov_count++;
+    } else {
+        while (buffer_size > 0) {
+            int space;
+
+            if (!file->chunk && new_chunk(file, SEGWRITER_CHUNK_SIZE) < 0) {
+                return -1;
+            }
+            space = file->chunk_size - file->chunk_used;
+            if (space > buffer_size) {
+                space = buffer_size;
+            }
+            memcpy(file->chunk + file->chunk_used, buffer, space);
+            file->chunk_used += space;
+            buffer += space;
+            buffer_size -= space;
+            if (file->chunk_used == file->chunk_size) {
+                stage_chunk(segwriter, file);
+            }
+        }
+    }
+
+    if (file->iov_count >= SEGWRITER_BATCH_CHUNKS) {
+        return submit_staged(segwriter, file);
+    }
+    return 0;
+}
+
+// room for size bytes at the end of the staged chunk, so a producer can build its
+// output in place instead of handing over a buffer to be copied- nothing is written
+// until segwriter_commit says how much of it was used
+uint8_t *segwriter_reserve(void *writer, void *handle, int size)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_file_struct *file = (segwriter_file_struct*)handle;
+
+    if (!file || size <= 0) {
+        return NULL;
+    }
+    if (file->chunk && file->chunk_size - file->chunk_used < size) {
+        stage_chunk(segwriter, file);
+    }
+    if (!file->chunk && new_chunk(file, size) < 0) {
+        return NULL;
+    }
+    return file->chunk + file->chunk_used;
+}
+
+int segwriter_commit(void *writer, void *handle, int size)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_file_struct *file = (segwriter_file_struct*)handle;
+
+    if (!file || !file->chunk || size <= 0) {
+        return 0;
+    }
+    file->chunk_used += size;
+    file->written += size;
+    if (file->chunk_used == file->chunk_size) {
+        stage_chunk(segwriter, file);
+    }
+    if (file->iov_count >= SEGWRITER_BATCH_CHUNKS) {
+        return submit_staged(segwriter, file);
+    }
+    return 0;
+}
+
+// hands everything staged so far to the writer thread instead of waiting for a full batch
+int segwriter_flush(void *writer, void *handle)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_file_struct *file = (segwriter_file_struct*)handle;
+
+    if (!file) {
+        return 0;
+    }
+    return submit_staged(segwriter, file);
+}
+
+int segwriter_close(void *writer, void *handle)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_file_struct *file = (segwriter_file_struct*)handle;
+    segwriter_op_struct *op;
+
+    if (!file) {
+        return 0;
+    }
+
+    submit_staged(segwriter, file);
+    free(file->chunk);  // reserved but never committed
+    op = new_op(SEGWRITER_OP_CLOSE, file);
+    if (!op) {
+        return -1;
+    }
+    submit_op(segwriter, op);
+    return 0;
+}
+
+int segwriter_file(void *writer, const char *filename, char *buffer, int buffer_size)
+{
+    return segwriter_playlist(writer, filename, buffer, buffer_size, 0, -1, -1);
+}
+
+// media_sequence/part is the newest part listed, the origin holds blocking reloads on it
+int segwriter_playlist(void *writer, const char *filename, char *buffer, int buffer_size, int flags, int64_t media_sequence, int part)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_op_struct *op;
+
+    op = new_op(SEGWRITER_OP_FILE, NULL);
+    if (!op) {
+        free(buffer);
+        return -1;
+    }
+    snprintf(op->filename, SEGWRITER_MAX_NAME-1, "%s", filename);
+    op->flags = flags;
+    op->media_sequence = media_sequence;
+    op->part = part;
+    add_iov(op, (uint8_t*)buffer, buffer_size);
+    submit_op(segwriter, op);
+    return 0;
+}
+
+int segwriter_symlink(void *writer, const char *target, const char *linkname)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_op_struct *op;
+
+    op = new_op(SEGWRITER_OP_SYMLINK, NULL);
+    if (!op) {
+        return -1;
+    }
+    snprintf(op->filename, SEGWRITER_MAX_NAME-1, "%s", target);
+    snprintf(op->linkname, SEGWRITER_MAX_NAME-1, "%s", linkname);
+    submit_op(segwriter, op);
+    return 0;
+}
+
+int segwriter_notify(void *writer, segwriter_callback callback, void *context, int event, const char *filename)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+    segwriter_op_struct *op;
+
+    op = new_op(SEGWRITER_OP_NOTIFY, NULL);
+    if (!op) {
+        return -1;
+    }
+    op->callback = callback;
+    op->context = context;
+    op->event = event;
+    snprintf(op->filename, SEGWRITER_MAX_NAME-1, "%s", filename);
+    submit_op(segwriter, op);
+    return 0;
+}
+
+void segwriter_report(void *writer)
+{
+    segwriter_struct *segwriter = (segwriter_struct*)writer;
+
+    if (!segwriter) {
+        return;
+    }
+
+    pthread_mutex_lock(&segwriter->lock);
+    syslog(LOG_INFO,"SEGWRITER: QUEUE:%d PEAK:%d PENDING:%ld BYTES:%ld FILES:%ld WRITEV:%ld STALLS:%ld ERRORS:%ld OP P50:%ldus P99:%ldus\n",
+           segwriter->depth,
+           segwriter->peak_depth,
+           segwriter->pending_bytes,
+           segwriter->bytes_written,
+           segwriter->files_written,
+           segwriter->writev_calls,
+           segwriter->stalls,
+           segwriter->write_errors,
+           latency_histogram_percentile(segwriter->op_latency, 50),
+           latency_histogram_percentile(segwriter->op_latency, 99));
+    memset(segwriter->op_latency, 0, sizeof(segwriter->op_latency));
+    segwriter->peak_depth = segwriter->depth;
+    pthread_mutex_unlock(&segwriter->lock);
+
+    segstore_report(segwriter->store);
+}
@@ -39,6 +39,7 @@
 #include "dataqueue.h"
 #include "transvideo.h"
 #include "esignal.h"
+#include "overload.h"
 
 #if defined(ENABLE_TRANSCODE)
 
@@ -63,6 +64,9 @@
 #define MAX_B_FRAMES 3
 #endif
 
+// frames the encoder can hold before the splice data for one comes back out
+#define MAX_ENCODE_SIGNAL_WINDOW 180
+
 static volatile int video_decode_thread_running = 0;
 static volatile int video_scale_thread_running = 0;
 static volatile int video_monitor_thread_running = 0;
@@ -268,8 +272,6 @@ void *video_encode_thread_nvenc(void *context)
     dataqueue_message_struct *msg;
     int current_encoder = start->index;
     gpu_encoder_struct gpu_data[MAX_TRANS_OUTPUTS];
-
-#define MAX_ENCODE_SIGNAL_WINDOW 180
     encoder_opaque_struct signal_data[MAX_ENCODE_SIGNAL_WINDOW];
     int signal_write_index = 0;
 
@@ -734,8 +736,11 @@ void *video_encode_thread_x265(void *context)
     dataqueue_message_struct *msg;
     int current_encoder = start->index;
     x265_encoder_struct x265_data[MAX_TRANS_OUTPUTS];
+    encoder_opaque_struct signal_data[MAX_ENCODE_SIGNAL_WINDOW];
+    int signal_write_index = 0;
 
     free(start);
+    memset(signal_data, 0, sizeof(signal_data));
     x265_data[current_encoder].api = NULL;
     x265_data[current_encoder].encoder = NULL;
     x265_data[current_encoder].param = NULL;
@@ -967,6 +972,21 @@ void *video_encode_thread_x265(void *context)
             x265_data[current_encoder].pic_in->planes[2] = x265_data[current_encoder].pic_in->planes[1] + (owhalf*ohhalf);
             x265_data[current_encoder].pic_in->pts = x265_data[current_encoder].frame_count_pts;
 
+            // the splice data comes back out with the frame it was sent in with
+            signal_data[signal_write_index].frame_count_pts = x265_data[current_encoder].frame_count_pts;
+            signal_data[signal_write_index].splice_point = splice_point;
+            signal_data[signal_write_index].splice_duration = splice_duration;
+            signal_data[signal_write_index].splice_duration_remaining = splice_duration_remaining;
+            signal_write_index = (signal_write_index + 1) % MAX_ENCODE_SIGNAL_WINDOW;
+
+            if (splice_point == SPLICE_CUE_OUT || splice_point == SPLICE_CUE_IN) {
+                syslog(LOG_INFO,"SCTE35(%d)- INSERTING IDR FRAME DURING SPLICE POINT: %d\n",
+                       current_encoder, splice_point);
+                x265_data[current_encoder].pic_in->sliceType = X265_TYPE_IDR;
+            } else {
+                x265_data[current_encoder].pic_in->sliceType = X265_TYPE_AUTO;
+            }
+
             nal_count = 0;
             frames = x265_data[current_encoder].api->encoder_encode(x265_data[current_encoder].encoder,
                                                                     &x265_data[current_encoder].p_nal,
@@ -1064,10 +1084,21 @@ void *video_encode_thread_x265(void *context)
                 dts = (int64_t)((double)x265_data[current_encoder].frame_count_dts * (double)ticks_per_frame_double) + (int64_t)vstream->first_timestamp;
 
                 x265_data[current_encoder].frame_count_dts++;
-                //need to pass this data through
                 splice_point = 0;
                 splice_duration = 0;
                 splice_duration_remaining = 0;
+                {
+                    int lookup;
+
+                    for (lookup = 0; lookup < MAX_ENCODE_SIGNAL_WINDOW; lookup++) {
+                        if (signal_data[lookup].frame_count_pts == x265_data[current_encoder].pic_recon->pts) {
+                            splice_point = signal_data[lookup].splice_point;
+                            splice_duration = signal_data[lookup].splice_duration;
+                            splice_duration_remaining = signal_data[lookup].splice_duration_remaining;
+                            break;
+                        }
+                    }
+                }
                 output_size = nalsize;
 
 #if defined(DEBUG_NALTYPE)
@@ -1441,6 +1472,8 @@ void *video_encode_thread_x264(void *context)
                     splice_duration_remaining = opaque_output->splice_duration_remaining;
                     opaque_int64 = opaque_output->frame_count_pts;
                     //int64_t opaque_int64 = (int64_t)x264_data[current_encoder].pic_out.opaque;
+                    free(opaque_output);
+                    x264_data[current_encoder].pic_out.opaque = NULL;
                 }
                 double opaque_double = (double)opaque_int64;
 
@@ -1501,6 +1534,15 @@ void copy_image_data_to_ffmpeg(uint8_t *source, int source_width, int source_hei
     }
 }
 
+static void drop_scaled_output(dataqueue_message_struct *msg, int current_output, int num_outputs)
+{
+    // the last output normally inherits the caption buffer
+    if (current_output == num_outputs-1 && msg->caption_size > 0) {
+        free(msg->caption_buffer);
+        msg->caption_buffer = NULL;
+    }
+}
+
 void *video_scale_thread(void *context)
 {
     fillet_app_struct *core = (fillet_app_struct*)context;
@@ -1559,26 +1601,31 @@ void *video_scale_thread(void *context)
                 int video_frame_size = 3 * output_height * output_width / 2;
                 int row;
 
-                if (output_scaler[current_output] == NULL) {
-                    output_scaler[current_output] = sws_getContext(width, height, AV_PIX_FMT_YUV420P,
-                                                                   output_width, output_height, AV_PIX_FMT_YUV420P,
-                                                                   SWS_BICUBIC, NULL, NULL, NULL);
-                    av_image_alloc(scaled_output[current_output].output_data,
-                                   scaled_output[current_output].output_stride,
-                                   output_width, output_height, AV_PIX_FMT_YUV420P, 1);
-                }
-
-                fprintf(stderr,"video_scale_thread: output=%d, scaling output to %d x %d\n",
-                        current_output,
-                        output_width,
-                        output_height);
+                // a shed rendition keeps its timeline and playlist going on its last picture,
+                // which skips the scaling and encodes as skip blocks
+                if (!overload_rendition_shed(core, current_output, num_outputs) ||
+                    output_scaler[current_output] == NULL) {
+                    if (output_scaler[current_output] == NULL) {
+                        output_scaler[current_output] = sws_getContext(width, height, AV_PIX_FMT_YUV420P,
+                                                                       output_width, output_height, AV_PIX_FMT_YUV420P,
+                                                                       SWS_BICUBIC, NULL, NULL, NULL);
+                        av_image_alloc(scaled_output[current_output].output_data,
+                                       scaled_output[current_output].output_stride,
+                                       output_width, output_height, AV_PIX_FMT_YUV420P, 1);
+                    }
 
-                sws_scale(output_scaler[current_output],
-                          (const uint8_t * const*)deinterlaced_frame->data,
-                          deinterlaced_frame->linesize,
-                          0, height,
-                          scaled_output[current_output].output_data,
-                          scaled_output[current_output].output_stride);
+                    fprintf(stderr,"video_scale_thread: output=%d, scaling output to %d x %d\n",
+                            current_output,
+                            output_width,
+                            output_height);
+
+                    sws_scale(output_scaler[current_output],
+                              (const uint8_t * const*)deinterlaced_frame->data,
+                              deinterlaced_frame->linesize,
+                              0, height,
+                              scaled_output[current_output].output_data,
+                              scaled_output[current_output].output_stride);
+                }
 
                 uint8_t *outputy;
                 uint8_t *outputu;
@@ -1609,10 +1656,12 @@ void *video_scale_thread(void *context)
                     for (n = 0; n < core->cd->num_outputs; n++) {
                         vefw += dataqueue_get_size(core->encodevideo->input_queue[n]);
                     }
-                    snprintf(errormsg, MAX_MESSAGE_SIZE-1, "Out of Uncompressed Video Buffers (SCALE), Restarting Service, vefw=%d, vdinfw=%d, vdecfw=%d, rap=%d, rvp=%d, s35p=%d, cap=%d, cvp=%d, fmp=%d, smp=%d",
+                    snprintf(errormsg, MAX_MESSAGE_SIZE-1, "Out of Uncompressed Video Buffers (SCALE), Dropping Frame, vefw=%d, vdinfw=%d, vdecfw=%d, rap=%d, rvp=%d, s35p=%d, cap=%d, cvp=%d, fmp=%d, smp=%d",
                              vefw, vdinfw, vdecfw, rap, rvp, s35p, cap, cvp, fmp, smp);
-                    send_direct_error(core, SIGNAL_DIRECT_ERROR_RAWPOOL, errormsg);
-                    _Exit(0);
+                    fprintf(stderr,"%s\n", errormsg);
+                    drop_scaled_output(msg, current_output, num_outputs);
+                    overload_exhausted(core, "raw video pool");
+                    continue;
                 }
                 sourcey = (uint8_t*)scaled_output[current_output].output_data[0];
                 sourceu = (uint8_t*)scaled_output[current_output].output_data[1];
@@ -1641,9 +1690,11 @@ void *video_scale_thread(void *context)
 
                 encode_msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
                 if (!encode_msg) {
-                    fprintf(stderr,"FATAL ERROR: unable to obtain encode_msg!!\n");
-                    send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Message Buffers (SCALE) - Restarting Service");
-                    _Exit(0);
+                    fprintf(stderr,"ERROR: unable to obtain encode_msg, dropping frame\n");
+                    memory_return(core->raw_video_pool, deinterlaced_buffer);
+                    drop_scaled_output(msg, current_output, num_outputs);
+                    overload_exhausted(core, "message pool");
+                    continue;
                 }
                 encode_msg->buffer = deinterlaced_buffer;
                 encode_msg->buffer_size = video_frame_size;
@@ -2190,9 +2241,20 @@ void *video_prepare_thread(void *context)
                     }
 
                     thumbnail_count++;
+                    if (thumbnail_count == 150 && overload_shed_thumbnails(core)) {
+                        thumbnail_count = 0;
+                    }
                     if (thumbnail_count == 150) {
                         dataqueue_message_struct *thumbnail_msg;
 
+                        thumbnail_msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
+                        if (!thumbnail_msg) {
+                            fprintf(stderr,"ERROR: unable to obtain thumbnail_msg, skipping thumbnail\n");
+                            overload_exhausted(core, "message pool");
+                            thumbnail_count = 0;
+                            goto skip_thumbnail;
+                        }
+
                         thumbnail_output = (scale_struct*)malloc(sizeof(scale_struct));
                         av_image_alloc(thumbnail_output->output_data,
                                        thumbnail_output->output_stride,
@@ -2205,17 +2267,12 @@ void *video_prepare_thread(void *context)
                                   thumbnail_output->output_data,
                                   thumbnail_output->output_stride);
 
-                        thumbnail_msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
-                        if (!thumbnail_msg) {
-                            fprintf(stderr,"FATAL ERROR: unable to obtain thumbnail_msg!!\n");
-                            send_direct_error(core, SIGNAL_DIRECT_ERROR_MSGPOOL, "Out of Message Buffers (Thumbnail) - Restarting Service");
-                            _Exit(0);
-                        }
                         thumbnail_msg->buffer = thumbnail_output;
                         dataqueue_put_front(core->encodevideo->thumbnail_queue, thumbnail_msg);
                         thumbnail_output = NULL;
                         thumbnail_count = 0;
                     }
+skip_thumbnail:
 
                     {
                         uint8_t *outputy;
@@ -0,0 +1,337 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// chunked cmaf first byte latency- last frame of a chunk in, its bytes at the player
+//
+// the muxer source is built into this tool so its fmp4 segment path can be fed
+// directly. 30fps video goes in on the wall clock through the chunked segment
+// output, the segment writer and the in-memory origin. a client asks for one
+// segment by its $Time$ name before it exists and decodes the chunked response
+// as it arrives. for every chunk the time from its last frame being queued to
+// its last byte reaching the client is reported, and the decoded body is
+// compared with the finished segment on disk
+//
+// usage: chunklatency [frames per chunk] [port]
+
+#define _GNU_SOURCE
+#include "../source/hlsmux.c"
+#include <netinet/in.h>
+
+#define CHUNKLATENCY_SEGMENTS      4
+#define CHUNKLATENCY_WATCH         2
+#define CHUNKLATENCY_FPS           30
+#define CHUNKLATENCY_MAX_CHUNKS    1024
+#define CHUNKLATENCY_MAX_RECV      65536
+#define CHUNKLATENCY_MAX_BODY      (4*1024*1024)
+
+typedef struct _chunk_client_struct
+{
+    pthread_t           thread;
+    int                 port;
+    int64_t             segment_time;
+    int64_t             recv_time[CHUNKLATENCY_MAX_RECV];
+    int64_t             recv_decoded[CHUNKLATENCY_MAX_RECV];
+    int                 recv_count;
+    uint8_t             *body;
+    int64_t             body_size;
+    int                 complete;
+} chunk_client_struct;
+
+static char directory[] = "/tmp/chunklatencyXXXXXX";
+
+static int64_t chunk_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// decodes as much of the chunked transfer as has arrived, returns 1 once the last chunk is seen
+static int chunk_decode(chunk_client_struct *client, uint8_t *raw, int raw_size, int *raw_used)
+{
+    while (*raw_used < raw_size) {
+        uint8_t *start = raw + *raw_used;
+        uint8_t *line_end = (uint8_t*)memmem(start, raw_size - *raw_used, "\r\n", 2);
+        long length;
+
+        if (!line_end) {
+            return 0;
+        }
+        length = strtol((char*)start, NULL, 16);
+        if (length == 0) {
+            return 1;
+        }
+        if ((line_end + 2 + length + 2) - raw > raw_size) {
+            int partial = raw_size - (line_end + 2 - raw);
+
+            // count what is already here, it is at the player
+            if (partial > length) {
+                partial = length;
+            }
+            client->recv_decoded[client->recv_count] = client->body_size + partial;
+            return 0;
+        }
+        if (client->body_size + length > CHUNKLATENCY_MAX_BODY) {
+            return -1;
+        }
+        memcpy(client->body + client->body_size, line_end + 2, length);
+        client->body_size += length;
+        *raw_used = (line_end + 2 + length + 2) - raw;
+        client->recv_decoded[client->recv_count] = client->body_size;
+    }
+    return 0;
+}
+
+static void *client_thread(void *context)
+{
+    chunk_client_struct *client = (chunk_client_struct*)context;
+    uint8_t *raw = (uint8_t*)malloc(CHUNKLATENCY_MAX_BODY * 2);
+    struct sockaddr_in address;
+    char request[256];
+    int raw_size = 0;
+    int raw_used = 0;
+    int header_done = 0;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(client->port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(sock);
+        free(raw);
+        return NULL;
+    }
+    snprintf(request, sizeof(request)-1, "GET /video0/segment%ld.mp4 HTTP/1.1\r\nHost: localhost\r\n\r\n", client->segment_time);
+    send(sock, request, strlen(request), 0);
+
+    while (client->recv_count < CHUNKLATENCY_MAX_RECV && raw_size < CHUNKLATENCY_MAX_BODY * 2) {
+        int bytes = recv(sock, raw + raw_size, CHUNKLATENCY_MAX_BODY * 2 - raw_size, 0);
+        int decoded;
+
+        if (bytes <= 0) {
+            break;
+        }
+        client->recv_time[client->recv_count] = chunk_now();
+        client->recv_decoded[client->recv_count] = client->body_size;
+        raw_size += bytes;
+        if (!header_done) {
+            uint8_t *header_end = (uint8_t*)memmem(raw, raw_size, "\r\n\r\n", 4);
+
+            if (!header_end) {
+                continue;
+            }
+            if (!memmem(raw, header_end - raw, "Transfer-Encoding: chunked", 26)) {
+                fprintf(stderr,"CHUNKLATENCY: ERROR - THE SEGMENT WAS NOT SENT CHUNKED\n");
+                break;
+            }
+            raw_used = header_end + 4 - raw;
+            header_done = 1;
+        }
+        decoded = chunk_decode(client, raw, raw_size, &raw_used);
+        client->recv_count++;
+        if (decoded != 0) {
+            client->complete = decoded > 0;
+            break;
+        }
+    }
+
+    close(sock);
+    free(raw);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    static fillet_app_struct core_data;
+    static config_options_struct cd;
+    static hlsmux_struct hlsmux;
+    static source_context_struct sdata;
+    static chunk_client_struct client;
+    static int64_t chunk_time[CHUNKLATENCY_MAX_CHUNKS];
+    static int64_t chunk_end[CHUNKLATENCY_MAX_CHUNKS];
+    fillet_app_struct *core = &core_data;
+    stream_struct *stream = &hlsmux.video[0];
+    uint8_t frame[20000];
+    char filename[MAX_STREAM_NAME];
+    int64_t segment_bytes = 0;
+    int64_t latency_sum = 0;
+    int64_t latency_min = -1;
+    int64_t latency_max = 0;
+    int64_t start;
+    int chunk_count = 0;
+    int matched = 0;
+    int identical = 0;
+    int frame_number = 0;
+    int segment;
+    int port = 18082;
+    int i;
+
+    memset(frame, 0x5a, sizeof(frame));
+    frame[0] = 0x00;
+    frame[1] = 0x00;
+    frame[2] = 0x00;
+    frame[3] = 0x01;
+    frame[4] = 0x65;
+
+    core->cd = &cd;
+    core->hlsmux = &hlsmux;
+    cd.chunk_frames = 3;
+    if (argc > 1) {
+        cd.chunk_frames = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        port = atoi(argv[2]);
+    }
+    if (cd.chunk_frames < 1 || cd.chunk_frames > CHUNKLATENCY_FPS * 2) {
+        fprintf(stderr,"usage: %s [frames per chunk 1-%d] [port]\n", argv[0], CHUNKLATENCY_FPS * 2);
+        return 1;
+    }
+    if (!mkdtemp(directory)) {
+        fprintf(stderr,"CHUNKLATENCY: ERROR - UNABLE TO CREATE %s\n", directory);
+        return 1;
+    }
+    snprintf(cd.manifest_directory, sizeof(cd.manifest_directory), "%s", directory);
+    cd.window_size = 3;
+    cd.segment_length = 2;
+    cd.rollover_size = 32;
+    cd.enable_fmp4_output = 1;
+    cd.origin_port = port;
+    cd.origin_cache_mb = 64;
+
+    if (start_origin_server(core) < 0) {
+        fprintf(stderr,"CHUNKLATENCY: ERROR - UNABLE TO START THE ORIGIN ON PORT %d\n", port);
+        return 1;
+    }
+    hlsmux.writer = segwriter_create();
+    segwriter_set_origin(hlsmux.writer, core->origin, cd.manifest_directory);
+
+    stream->fmp4 = fmp4_file_create(MEDIA_TYPE_H264, VIDEO_CLOCK, 0x15c7, cd.segment_length);
+    fmp4_video_track_create(stream->fmp4, 1280, 720, 3000);
+    start_mp4_fragment(core, stream, 0, IS_VIDEO, NO_SUBSTREAM);
+
+    client.port = port;
+    client.segment_time = (int64_t)CHUNKLATENCY_WATCH * cd.segment_length * VIDEO_CLOCK;
+    client.body = (uint8_t*)malloc(CHUNKLATENCY_MAX_BODY);
+
+    start = chunk_now();
+    for (segment = 0; segment < CHUNKLATENCY_SEGMENTS; segment++) {
+        int segment_frames = cd.segment_length * CHUNKLATENCY_FPS;
+        int part_count;
+        int size;
+
+        // the request goes out a segment early and is held until the first chunk exists
+        if (segment == CHUNKLATENCY_WATCH - 1) {
+            pthread_create(&client.thread, NULL, client_thread, &client);
+        }
+        for (i = 0; i < segment_frames; i++, frame_number++) {
+            int64_t target = start + (int64_t)frame_number * 1000000 / CHUNKLATENCY_FPS;
+            int64_t received;
+
+            while (chunk_now() < target) {
+                usleep(200);
+            }
+            received = chunk_now();
+            fmp4_video_fragment_add(stream->fmp4, frame, 1000 + (frame_number % 7) * 100,
+                                    frame_number * 3000.0, 3000, 0, NULL);
+            part_count = stream->part_count;
+            mp4_chunk_sample(core, stream, &sdata, 0, NO_SUBSTREAM, IS_VIDEO, sdata.total_video_duration * VIDEO_CLOCK);
+            if (segment == CHUNKLATENCY_WATCH && stream->part_count != part_count && chunk_count < CHUNKLATENCY_MAX_CHUNKS) {
+                fmp4_get_fragment(stream->fmp4, &size);
+                segment_bytes += size;
+                chunk_time[chunk_count] = received;
+                chunk_end[chunk_count] = segment_bytes;
+                chunk_count++;
+            }
+        }
+        part_count = stream->part_count;
+        write_mp4_part(core, stream, &sdata, 0, NO_SUBSTREAM, IS_VIDEO, sdata.total_video_duration * VIDEO_CLOCK, 1);
+        if (segment == CHUNKLATENCY_WATCH && stream->part_count != part_count && chunk_count < CHUNKLATENCY_MAX_CHUNKS) {
+            fmp4_get_fragment(stream->fmp4, &size);
+            segment_bytes += size;
+            chunk_time[chunk_count] = chunk_now();
+            chunk_end[chunk_count] = segment_bytes;
+            chunk_count++;
+        }
+        end_mp4_fragment(core, stream, 0, NO_SUBSTREAM, IS_VIDEO, (int64_t)(sdata.total_video_duration * VIDEO_CLOCK));
+        stream->fragments_published++;
+        stream->file_sequence_number = (stream->file_sequence_number + 1) % cd.rollover_size;
+        stream->media_sequence_number++;
+        sdata.total_video_duration += cd.segment_length;
+        start_mp4_fragment(core, stream, 0, IS_VIDEO, NO_SUBSTREAM);
+    }
+    pthread_join(client.thread, NULL);
+    segwriter_destroy(hlsmux.writer);
+
+    for (i = 0; i < chunk_count; i++) {
+        int r;
+
+        for (r = 0; r < client.recv_count; r++) {
+            if (client.recv_decoded[r] >= chunk_end[i]) {
+                int64_t latency = client.recv_time[r] - chunk_time[i];
+
+                latency_sum += latency;
+                if (latency_min < 0 || latency < latency_min) {
+                    latency_min = latency;
+                }
+                if (latency > latency_max) {
+                    latency_max = latency;
+                }
+                matched++;
+                break;
+            }
+        }
+    }
+
+    snprintf(filename, MAX_STREAM_NAME-1, "%s/video0/segment%d.mp4", directory, CHUNKLATENCY_WATCH);
+    {
+        FILE *segment_file = fopen(filename, "r");
+
+        if (segment_file) {
+            uint8_t *disk = (uint8_t*)malloc(CHUNKLATENCY_MAX_BODY);
+            int64_t disk_size = fread(disk, 1, CHUNKLATENCY_MAX_BODY, segment_file);
+
+            identical = disk_size == client.body_size && memcmp(disk, client.body, disk_size) == 0;
+            fclose(segment_file);
+            free(disk);
+        }
+    }
+
+    stop_origin_server(core);
+    snprintf(filename, MAX_STREAM_NAME-1, "rm -rf %s", directory);
+    if (system(filename) != 0) {
+        fprintf(stderr,"CHUNKLATENCY: unable to remove %s\n", directory);
+    }
+
+    fprintf(stderr,"CHUNKLATENCY: frames/chunk=%d chunks=%d body=%ld bytes complete=%d identical to disk=%d\n",
+            cd.chunk_frames, chunk_count, client.body_size, client.complete, identical);
+    if (matched != chunk_count || matched == 0 || !client.complete || !identical) {
+        fprintf(stderr,"CHUNKLATENCY: FAIL - %d of %d chunks reached the client\n", matched, chunk_count);
+        return 1;
+    }
+    fprintf(stderr,"CHUNKLATENCY: PASS - last frame of a chunk to its bytes at the client: min %.2fms avg %.2fms max %.2fms\n",
+            latency_min / 1000.0, latency_sum / (double)matched / 1000.0, latency_max / 1000.0);
+
+    return 0;
+}
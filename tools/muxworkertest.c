@@ -0,0 +1,355 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// mux workers against the inline mux thread- same output, byte for byte
+//
+// frames go through the real mux thread the way the encoders hand them over:
+// 30fps h.264 with a 2 second gop on every rendition and an aac track beside
+// each one, ts and fmp4 with ll-hls parts, so the workers build part playlists
+// from the segment tables while the mux thread cuts segments. every rendition
+// count is run once inline and once on workers and the two output directories
+// have to match file for file, bar the wall clock in the init segments. the
+// wall time to drain the run and the process cpu are printed for both, on a
+// multi-core host that is the scaling figure
+//
+// usage: muxworkertest [max renditions] [workers] [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "fillet.h"
+#include "dataqueue.h"
+#include "mempool.h"
+#include "hlsmux.h"
+
+#define MUXWORKERTEST_FPS            30
+#define MUXWORKERTEST_GOP            60
+#define MUXWORKERTEST_SEGMENT        2
+#define MUXWORKERTEST_PART_MS        500
+#define MUXWORKERTEST_WINDOW         5
+#define MUXWORKERTEST_SECONDS        30
+#define MUXWORKERTEST_BASE           900000
+#define MUXWORKERTEST_IDENTITY       7747
+#define MUXWORKERTEST_MAX_NAME       256
+
+static char directory[] = "/tmp/muxworkertestXXXXXX";
+
+// 1280x720 baseline sps and its pps, carried in front of every idr
+static const uint8_t parameter_sets[] = {
+    0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x1f, 0xda, 0x01, 0x40, 0x16, 0xe4,
+    0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80
+};
+
+static int64_t test_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t test_cpu(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void push_frame(fillet_app_struct *core, int source, int frame_type, int64_t timestamp, int sync_frame)
+{
+    hlsmux_struct *hlsmux = (hlsmux_struct*)core->hlsmux;
+    int video = frame_type == FRAME_TYPE_VIDEO;
+    int frame_number = (int)((timestamp - MUXWORKERTEST_BASE) / (video ? 90000 / MUXWORKERTEST_FPS : 1920));
+    int size;
+    sorted_frame_struct *frame;
+    dataqueue_message_struct *msg;
+    void *pool = video ? core->compressed_video_pool : core->compressed_audio_pool;
+    int i;
+
+    // the lower renditions carry more bytes, the idr more than the rest of its gop
+    if (video) {
+        size = (sync_frame ? 60000 : 8000 + (frame_number * 7919) % 8000) / (source + 1);
+    } else {
+        size = 300 + (frame_number * 31) % 200;
+    }
+
+    // the mux thread holds fmp4 samples until their segment is out, wait for it rather than drop
+    while (!(frame = (sorted_frame_struct*)memory_take(core->frame_msg_pool, sizeof(sorted_frame_struct)))) {
+        usleep(100);
+    }
+    while (!(msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct)))) {
+        usleep(100);
+    }
+    memset(frame, 0, sizeof(sorted_frame_struct));
+    memset(msg, 0, sizeof(dataqueue_message_struct));
+
+    while (!(frame->buffer = (uint8_t*)memory_take(pool, size))) {
+        usleep(100);
+    }
+    for (i = 0; i < size; i++) {
+        frame->buffer[i] = (uint8_t)(i + frame_number + source);
+    }
+    if (video) {
+        uint8_t *slice = frame->buffer;
+
+        if (sync_frame) {
+            memcpy(frame->buffer, parameter_sets, sizeof(parameter_sets));
+            slice += sizeof(parameter_sets);
+        }
+        // start code + idr or non-idr slice nal header
+        slice[0] = 0x00;
+        slice[1] = 0x00;
+        slice[2] = 0x00;
+        slice[3] = 0x01;
+        slice[4] = sync_frame ? 0x65 : 0x41;
+    } else {
+        // adts, aac lc 48khz stereo
+        frame->buffer[0] = 0xff;
+        frame->buffer[1] = 0xf1;
+        frame->buffer[2] = 0x4c;
+        frame->buffer[3] = 0x80;
+        frame->buffer[4] = (size >> 3) & 0xff;
+        frame->buffer[5] = ((size & 0x07) << 5) | 0x1f;
+        frame->buffer[6] = 0xfc;
+    }
+    frame->buffer_size = size;
+    frame->pts = timestamp;
+    frame->dts = timestamp;
+    frame->full_time = timestamp;
+    frame->frame_type = frame_type;
+    frame->sync_frame = sync_frame;
+    frame->media_type = video ? MEDIA_TYPE_H264 : MEDIA_TYPE_AAC;
+    frame->duration = video ? 90000 / MUXWORKERTEST_FPS : 1920;
+    frame->source = source;
+
+    msg->buffer = frame;
+    dataqueue_put_front(hlsmux->input_queue, msg);
+}
+
+// init.mp4 carries the wall clock in tkhd and mdhd, clear it so two runs can be compared
+static void clear_init_times(const char *name, int renditions)
+{
+    char path[MUXWORKERTEST_MAX_NAME];
+    uint8_t init[4096];
+    FILE *file;
+    int source;
+    int media;
+    int size;
+    int i;
+
+    for (source = 0; source < renditions; source++) {
+        for (media = 0; media < 2; media++) {
+            if (media == 0) {
+                snprintf(path, MUXWORKERTEST_MAX_NAME-1, "%s/%s/video%d/init.mp4", directory, name, source);
+            } else {
+                snprintf(path, MUXWORKERTEST_MAX_NAME-1, "%s/%s/audio%d_substream0/init.mp4", directory, name, source);
+            }
+            file = fopen(path, "r+b");
+            if (!file) {
+                continue;
+            }
+            size = fread(init, 1, sizeof(init), file);
+            for (i = 4; i + 16 <= size; i++) {
+                // version 0 boxes: 4cc, version/flags, creation_time, modification_time
+                if (!memcmp(init + i, "tkhd", 4) || !memcmp(init + i, "mdhd", 4)) {
+                    memset(init + i + 8, 0, 8);
+                }
+            }
+            fseek(file, 0, SEEK_SET);
+            fwrite(init, 1, size, file);
+            fclose(file);
+        }
+    }
+}
+
+// one run of the muxer into directory/name, returns the wall time to drain it
+static int64_t mux_run(fillet_app_struct *core, int renditions, int workers, int seconds, const char *name, int64_t *cpu)
+{
+    config_options_struct *cd = core->cd;
+    char state[MUXWORKERTEST_MAX_NAME];
+    int64_t video_time = 0;
+    int64_t audio_time = 0;
+    int64_t start;
+    int64_t cpu_start;
+    int frame_count = 0;
+    int source;
+
+    snprintf(state, MUXWORKERTEST_MAX_NAME-1, "/var/tmp/hlsmux_state_%d", MUXWORKERTEST_IDENTITY);
+    unlink(state);
+    snprintf(cd->manifest_directory, sizeof(cd->manifest_directory), "%s/%s", directory, name);
+    mkdir(cd->manifest_directory, 0755);
+    cd->mux_workers = workers;
+    core->num_sources = renditions;
+
+    if (!hlsmux_create(core)) {
+        fprintf(stderr,"MUXWORKERTEST: ERROR - UNABLE TO START THE MUXER\n");
+        exit(1);
+    }
+
+    start = test_now();
+    cpu_start = test_cpu();
+    while (video_time < (int64_t)seconds * 90000) {
+        while (audio_time <= video_time) {
+            for (source = 0; source < renditions; source++) {
+                push_frame(core, source, FRAME_TYPE_AUDIO, MUXWORKERTEST_BASE + audio_time, 1);
+            }
+            audio_time += 1920;
+        }
+        for (source = 0; source < renditions; source++) {
+            push_frame(core, source, FRAME_TYPE_VIDEO, MUXWORKERTEST_BASE + video_time,
+                       (frame_count % MUXWORKERTEST_GOP) == 0);
+        }
+        video_time += 90000 / MUXWORKERTEST_FPS;
+        frame_count++;
+    }
+    // the mux thread drops whatever is still queued once it is told to quit
+    while (dataqueue_get_size(((hlsmux_struct*)core->hlsmux)->input_queue) > 0) {
+        usleep(1000);
+    }
+    hlsmux_destroy(core->hlsmux);
+    core->hlsmux = NULL;
+    *cpu = test_cpu() - cpu_start;
+
+    return test_now() - start;
+}
+
+int main(int argc, char **argv)
+{
+    static fillet_app_struct core_data;
+    static config_options_struct cd;
+    static video_stream_struct vstream[MAX_VIDEO_SOURCES];
+    static audio_stream_struct astream[MAX_VIDEO_SOURCES];
+    static source_stream_struct video_source[MAX_VIDEO_SOURCES];
+    static source_stream_struct audio_source[MAX_VIDEO_SOURCES];
+    fillet_app_struct *core = &core_data;
+    char command[MUXWORKERTEST_MAX_NAME*2];
+    int max_renditions = 8;
+    int workers = 0;
+    int seconds = MUXWORKERTEST_SECONDS;
+    int failures = 0;
+    int renditions;
+    int i;
+
+    if (argc > 1) {
+        max_renditions = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        workers = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        seconds = atoi(argv[3]);
+    }
+    if (max_renditions < 1 || max_renditions > MAX_VIDEO_SOURCES || workers < 0 || workers > MAX_MUX_WORKERS ||
+        seconds < MUXWORKERTEST_SEGMENT * (MUXWORKERTEST_WINDOW + 2)) {
+        fprintf(stderr,"usage: %s [max renditions 1-%d] [workers, 0 for one per rendition] [seconds]\n",
+                argv[0], MAX_VIDEO_SOURCES);
+        return 1;
+    }
+    if (!mkdtemp(directory)) {
+        fprintf(stderr,"MUXWORKERTEST: ERROR - UNABLE TO CREATE %s\n", directory);
+        return 1;
+    }
+
+    core->cd = &cd;
+    snprintf(cd.manifest_hls, sizeof(cd.manifest_hls), "master.m3u8");
+    snprintf(cd.manifest_fmp4, sizeof(cd.manifest_fmp4), "masterfmp4.m3u8");
+    cd.identity = MUXWORKERTEST_IDENTITY;
+    cd.window_size = MUXWORKERTEST_WINDOW;
+    cd.segment_length = MUXWORKERTEST_SEGMENT;
+    cd.rollover_size = MAX_ROLLOVER_SIZE;
+    cd.enable_ts_output = 1;
+    cd.enable_fmp4_output = 1;
+    cd.part_length_ms = MUXWORKERTEST_PART_MS;
+
+    for (i = 0; i < MAX_VIDEO_SOURCES; i++) {
+        vstream[i].video_bitrate = 3000000 / (i + 1);
+        astream[i].audio_bitrate = 128;
+        astream[i].audio_channels = 2;
+        astream[i].audio_samplerate = 48000;
+        astream[i].audio_object_type = 2;
+        video_source[i].video_stream = &vstream[i];
+        audio_source[i].audio_stream = &astream[i];
+    }
+    core->source_video_stream = video_source;
+    core->source_audio_stream = audio_source;
+    core->fillet_msg_pool = memory_create(MAX_MSG_BUFFERS, sizeof(dataqueue_message_struct));
+    core->frame_msg_pool = memory_create(MAX_FRAME_BUFFERS, sizeof(sorted_frame_struct));
+    core->compressed_video_pool = memory_create(MAX_VIDEO_COMPRESSED_BUFFERS, 0);
+    core->compressed_audio_pool = memory_create(MAX_AUDIO_COMPRESSED_BUFFERS, 0);
+
+    for (renditions = 1; renditions <= max_renditions; renditions *= 2) {
+        int run_workers = workers ? workers : renditions;
+        int64_t inline_cpu;
+        int64_t worker_cpu;
+        int64_t inline_wall;
+        int64_t worker_wall;
+        int identical;
+
+        inline_wall = mux_run(core, renditions, 0, seconds, "inline", &inline_cpu);
+        worker_wall = mux_run(core, renditions, run_workers, seconds, "workers", &worker_cpu);
+
+        clear_init_times("inline", renditions);
+        clear_init_times("workers", renditions);
+        snprintf(command, sizeof(command)-1, "diff -rq %s/inline %s/workers", directory, directory);
+        identical = system(command) == 0;
+        if (!identical) {
+            fprintf(stderr,"MUXWORKERTEST: FAIL - %d RENDITIONS ON %d WORKERS DID NOT MATCH THE INLINE OUTPUT\n",
+                    renditions, run_workers);
+            failures++;
+        }
+        fprintf(stderr,"MUXWORKERTEST: renditions=%d workers=%d frames=%d inline wall=%.0fms cpu=%.0fms workers wall=%.0fms cpu=%.0fms speedup=%.2f identical=%d\n",
+                renditions, run_workers, seconds * MUXWORKERTEST_FPS * renditions,
+                inline_wall / 1000.0, inline_cpu / 1000.0, worker_wall / 1000.0, worker_cpu / 1000.0,
+                (double)inline_wall / (double)worker_wall, identical);
+
+        snprintf(command, sizeof(command)-1, "rm -rf %s/inline %s/workers", directory, directory);
+        if (system(command) != 0) {
+            fprintf(stderr,"MUXWORKERTEST: unable to clear %s\n", directory);
+        }
+        if (memory_unused(core->compressed_video_pool) != memory_count(core->compressed_video_pool) ||
+            memory_unused(core->compressed_audio_pool) != memory_count(core->compressed_audio_pool)) {
+            fprintf(stderr,"MUXWORKERTEST: FAIL - SAMPLE BUFFERS WERE NOT RETURNED: video=%d/%d audio=%d/%d\n",
+                    memory_unused(core->compressed_video_pool), memory_count(core->compressed_video_pool),
+                    memory_unused(core->compressed_audio_pool), memory_count(core->compressed_audio_pool));
+            failures++;
+        }
+    }
+
+    snprintf(command, sizeof(command)-1, "/var/tmp/hlsmux_state_%d", MUXWORKERTEST_IDENTITY);
+    unlink(command);
+    snprintf(command, sizeof(command)-1, "rm -rf %s", directory);
+    if (system(command) != 0) {
+        fprintf(stderr,"MUXWORKERTEST: unable to remove %s\n", directory);
+    }
+    fprintf(stderr,"MUXWORKERTEST: %s - %d failures\n", failures ? "FAIL" : "PASS", failures);
+
+    return failures ? 1 : 0;
+}
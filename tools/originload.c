@@ -0,0 +1,308 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// origin load test- keep-alive clients against the in-memory origin
+//
+// an origin is started in process and a playlist, an init section and a set of
+// 2MB segments are published into it through the segment writer, the same path
+// the muxer uses. each client thread holds one keep-alive connection and asks
+// for the playlist, with every Nth request going to a segment instead, reading
+// each response to its content length and checking the status and size.
+// requests/s, MB/s and the p50/p99 request time are reported
+//
+// usage: originload [connections] [seconds] [segment every N requests] [port]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "fillet.h"
+#include "segwriter.h"
+#include "origin.h"
+
+#define ORIGINLOAD_SEGMENTS        20
+#define ORIGINLOAD_SEGMENT_SIZE    (2*1024*1024)
+#define ORIGINLOAD_MAX_CLIENTS     256
+#define ORIGINLOAD_BUFFER_SIZE     (64*1024)
+
+typedef struct _originload_client_struct
+{
+    pthread_t           thread;
+    int64_t             requests;
+    int64_t             bytes;
+    int64_t             errors;
+    int64_t             histogram[SEGWRITER_HISTOGRAM_BUCKETS];
+} originload_client_struct;
+
+static char directory[] = "/tmp/originloadXXXXXX";
+static const char playlist[] =
+    "#EXTM3U\n"
+    "#EXT-X-VERSION:3\n"
+    "#EXT-X-TARGETDURATION:2\n"
+    "#EXT-X-MEDIA-SEQUENCE:1000\n";
+static volatile int running = 1;
+static int port = 18080;
+static int segment_every = 0;
+static int playlist_size = 0;
+
+static int64_t load_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int publish(fillet_app_struct *core)
+{
+    static uint8_t segment[ORIGINLOAD_SEGMENT_SIZE];
+    char filename[SEGWRITER_MAX_NAME];
+    char *manifest;
+    void *writer;
+    void *file;
+    int i;
+
+    writer = segwriter_create();
+    if (!writer) {
+        return -1;
+    }
+    segwriter_set_origin(writer, core->origin, directory);
+    for (i = 0; i < ORIGINLOAD_SEGMENT_SIZE; i++) {
+        segment[i] = i * 7;
+    }
+
+    snprintf(filename, SEGWRITER_MAX_NAME-1, "%s/init.mp4", directory);
+    file = segwriter_open(writer, filename, SEGWRITER_FLAG_PINNED | SEGWRITER_FLAG_MEMORY);
+    segwriter_write(writer, file, segment, 1000);
+    segwriter_close(writer, file);
+
+    for (i = 0; i < ORIGINLOAD_SEGMENTS; i++) {
+        snprintf(filename, SEGWRITER_MAX_NAME-1, "%s/video_stream0_%d.ts", directory, i);
+        file = segwriter_open(writer, filename, SEGWRITER_FLAG_MEMORY);
+        segwriter_write(writer, file, segment, ORIGINLOAD_SEGMENT_SIZE);
+        segwriter_close(writer, file);
+    }
+
+    // the writer owns the manifest buffer once it is queued
+    playlist_size = strlen(playlist);
+    manifest = strdup(playlist);
+    snprintf(filename, SEGWRITER_MAX_NAME-1, "%s/video0.m3u8", directory);
+    segwriter_playlist(writer, filename, manifest, playlist_size, SEGWRITER_FLAG_MEMORY, -1, -1);
+
+    segwriter_destroy(writer);
+    return 0;
+}
+
+static int read_response(int sock, uint8_t *buffer, int64_t *body_size)
+{
+    int64_t content_length = -1;
+    int64_t body_read;
+    int status = 0;
+    int filled = 0;
+    char *header_end = NULL;
+
+    while (!header_end) {
+        int bytes = read(sock, buffer + filled, ORIGINLOAD_BUFFER_SIZE - 1 - filled);
+
+        if (bytes <= 0) {
+            return -1;
+        }
+        filled += bytes;
+        buffer[filled] = 0;
+        header_end = strstr((char*)buffer, "\r\n\r\n");
+        if (!header_end && filled >= ORIGINLOAD_BUFFER_SIZE - 1) {
+            return -1;
+        }
+    }
+    *header_end = 0;
+    sscanf((char*)buffer, "HTTP/1.%*d %d", &status);
+    {
+        char *length = strstr((char*)buffer, "Content-Length:");
+
+        if (length) {
+            content_length = atoll(length + 15);
+        }
+    }
+    if (content_length < 0) {
+        return -1;
+    }
+
+    body_read = filled - ((uint8_t*)header_end + 4 - buffer);
+    while (body_read < content_length) {
+        int64_t want = content_length - body_read;
+        int bytes = read(sock, buffer, want < ORIGINLOAD_BUFFER_SIZE ? want : ORIGINLOAD_BUFFER_SIZE);
+
+        if (bytes <= 0) {
+            return -1;
+        }
+        body_read += bytes;
+    }
+    *body_size = content_length;
+
+    return status;
+}
+
+static void *client_thread(void *context)
+{
+    originload_client_struct *client = (originload_client_struct*)context;
+    uint8_t *buffer = (uint8_t*)malloc(ORIGINLOAD_BUFFER_SIZE);
+    struct sockaddr_in address;
+    int64_t count = 0;
+    int flag = 1;
+    int sock;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (connect(sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        client->errors++;
+        close(sock);
+        free(buffer);
+        return NULL;
+    }
+
+    while (running) {
+        char request[256];
+        int segment = segment_every > 0 && (count % segment_every) == segment_every - 1;
+        int64_t expected = segment ? ORIGINLOAD_SEGMENT_SIZE : playlist_size;
+        int64_t body_size = 0;
+        int64_t start = load_now();
+        int status;
+
+        if (segment) {
+            snprintf(request, sizeof(request)-1, "GET /video_stream0_%d.ts HTTP/1.1\r\nHost: localhost\r\n\r\n",
+                     (int)(count % ORIGINLOAD_SEGMENTS));
+        } else {
+            snprintf(request, sizeof(request)-1, "GET /video0.m3u8 HTTP/1.1\r\nHost: localhost\r\n\r\n");
+        }
+        if (write(sock, request, strlen(request)) <= 0) {
+            client->errors++;
+            break;
+        }
+        status = read_response(sock, buffer, &body_size);
+        if (status < 0) {
+            client->errors++;
+            break;
+        }
+        if (status != 200 || body_size != expected) {
+            client->errors++;
+        }
+        latency_histogram_add(client->histogram, load_now() - start);
+        client->requests++;
+        client->bytes += body_size;
+        count++;
+    }
+
+    close(sock);
+    free(buffer);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    static fillet_app_struct core;
+    static config_options_struct cd;
+    static originload_client_struct clients[ORIGINLOAD_MAX_CLIENTS];
+    int64_t histogram[SEGWRITER_HISTOGRAM_BUCKETS];
+    int64_t requests = 0;
+    int64_t bytes = 0;
+    int64_t errors = 0;
+    int64_t start;
+    int64_t elapsed;
+    int connections = 16;
+    int seconds = 10;
+    int i;
+    int j;
+
+    if (argc > 1) {
+        connections = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        seconds = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        segment_every = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        port = atoi(argv[4]);
+    }
+    if (connections < 1 || connections > ORIGINLOAD_MAX_CLIENTS || seconds < 1 || segment_every < 0) {
+        fprintf(stderr,"usage: %s [connections 1-%d] [seconds] [segment every N requests] [port]\n",
+                argv[0], ORIGINLOAD_MAX_CLIENTS);
+        return 1;
+    }
+
+    if (!mkdtemp(directory)) {
+        fprintf(stderr,"ORIGINLOAD: ERROR - UNABLE TO CREATE %s\n", directory);
+        return 1;
+    }
+    core.cd = &cd;
+    cd.origin_port = port;
+    cd.origin_cache_mb = ORIGIN_DEFAULT_CACHE_MB;
+    if (start_origin_server(&core) < 0) {
+        fprintf(stderr,"ORIGINLOAD: ERROR - UNABLE TO START THE ORIGIN ON PORT %d\n", port);
+        return 1;
+    }
+    if (publish(&core) < 0) {
+        fprintf(stderr,"ORIGINLOAD: ERROR - UNABLE TO PUBLISH THE TEST OBJECTS\n");
+        return 1;
+    }
+
+    start = load_now();
+    for (i = 0; i < connections; i++) {
+        pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+    }
+    sleep(seconds);
+    running = 0;
+    memset(histogram, 0, sizeof(histogram));
+    for (i = 0; i < connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        bytes += clients[i].bytes;
+        errors += clients[i].errors;
+        for (j = 0; j < SEGWRITER_HISTOGRAM_BUCKETS; j++) {
+            histogram[j] += clients[i].histogram[j];
+        }
+    }
+    elapsed = load_now() - start;
+
+    origin_report(core.origin);
+    stop_origin_server(&core);
+    rmdir(directory);
+
+    fprintf(stderr,"ORIGINLOAD: connections=%d requests=%ld (%.0f/s) %.1fMB/s p50<=%ldus p99<=%ldus errors=%ld\n",
+            connections, requests, requests * 1000000.0 / elapsed, bytes / (elapsed / 1000000.0) / 1e6,
+            latency_histogram_percentile(histogram, 50), latency_histogram_percentile(histogram, 99), errors);
+
+    return errors ? 1 : 0;
+}
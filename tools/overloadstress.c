@@ -0,0 +1,373 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// overload controller stress test- 10 seconds of cpu starvation on the mux side
+//
+// a receive thread takes frame messages and compressed buffers from the real
+// pools at the ingest rate, a mux thread gives them back. for the starvation
+// window the mux thread drops to SCHED_IDLE while busy threads take every cpu,
+// so the pools fill up and run dry the way they do on an overloaded host.
+// the test passes when the process is still running, the controller shed load
+// and signalled it, came back to NORMAL on its own and no buffer was lost.
+// a transcode core (the default) has to shed non-reference frames once it is
+// at SHED_NONREF and never below it, a repackage core must never shed video
+//
+// usage: overloadstress [renditions] [starvation seconds] [transcode 0/1]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "fillet.h"
+#include "dataqueue.h"
+#include "mempool.h"
+#include "esignal.h"
+#include "overload.h"
+
+#define STRESS_RING_SIZE      16384
+#define STRESS_FPS            60
+#define STRESS_AUDIO_FPS      47
+#define STRESS_WARMUP_MS      5000
+#define STRESS_RECOVER_MS     90000
+#define STRESS_MUX_WORK_US    20
+#define MAX_STRESS_HOGS       64
+
+typedef struct _stress_frame_struct
+{
+    uint8_t             *buffer;
+    void                *pool;
+    void                *message;
+} stress_frame_struct;
+
+static fillet_app_struct core_data;
+static config_options_struct config_data;
+static stress_frame_struct ring[STRESS_RING_SIZE];
+static volatile int64_t ring_head = 0;
+static volatile int64_t ring_tail = 0;
+static volatile int running = 1;
+static volatile int mux_stop = 0;
+static volatile int starving = 0;
+static volatile int hogs_running = 0;
+static volatile int64_t frames_in = 0;
+static volatile int64_t frames_dropped = 0;
+static volatile int64_t frames_shed = 0;
+static volatile int64_t frames_shed_early = 0;
+static volatile int64_t high_cpu_signals = 0;
+static int renditions = 8;
+
+static int64_t now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void spin_us(int64_t us)
+{
+    struct timespec start;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((int64_t)(now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 < us);
+}
+
+static int fake_frame(uint8_t *buffer, int size, int64_t count)
+{
+    // h264 start code + slice header byte- every third frame is a reference frame
+    memset(buffer, 0x5a, size);
+    buffer[0] = 0x00;
+    buffer[1] = 0x00;
+    buffer[2] = 0x00;
+    buffer[3] = 0x01;
+    buffer[4] = (count % 3 == 0) ? 0x65 : 0x01;
+    return count % 3 == 0;
+}
+
+static void *receive_thread(void *arg)
+{
+    fillet_app_struct *core = &core_data;
+    int64_t interval_us = 1000000 / ((STRESS_FPS + STRESS_AUDIO_FPS) * renditions);
+    int64_t next_us = now_ms() * 1000;
+    int64_t count = 0;
+
+    while (running) {
+        int video = (count % (STRESS_FPS + STRESS_AUDIO_FPS)) < STRESS_FPS;
+        void *pool = video ? core->compressed_video_pool : core->compressed_audio_pool;
+        int size = video ? 2000 + (int)(count % 7) * 3000 : 400;
+        uint8_t sample[32];
+        uint8_t *buffer;
+        void *message;
+        int sync_frame;
+
+        // paced on the wall clock, a live source does not slow down for the packager
+        next_us += interval_us;
+        if (next_us > now_ms() * 1000) {
+            usleep(next_us - now_ms() * 1000);
+        }
+        count++;
+        frames_in++;
+
+        sync_frame = fake_frame(sample, sizeof(sample), count);
+        if (video && overload_drop_video(core, (int)(count % renditions), sample, sizeof(sample), STREAM_TYPE_H264, sync_frame)) {
+            frames_shed++;
+            if (overload_level(core) < OVERLOAD_LEVEL_SHED_NONREF) {
+                frames_shed_early++;
+            }
+            continue;
+        }
+
+        buffer = (uint8_t*)memory_take(pool, size);
+        if (!buffer) {
+            frames_dropped++;
+            overload_exhausted(core, video ? "compressed video pool" : "compressed audio pool");
+            continue;
+        }
+        fake_frame(buffer, size, count);
+        message = memory_take(core->frame_msg_pool, sizeof(dataqueue_message_struct));
+        if (!message) {
+            memory_return(pool, buffer);
+            frames_dropped++;
+            overload_exhausted(core, "frame pool");
+            continue;
+        }
+        while (ring_head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= STRESS_RING_SIZE) {
+            usleep(1000);
+        }
+        ring[ring_head % STRESS_RING_SIZE].buffer = buffer;
+        ring[ring_head % STRESS_RING_SIZE].pool = pool;
+        ring[ring_head % STRESS_RING_SIZE].message = message;
+        __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *mux_thread(void *arg)
+{
+    fillet_app_struct *core = &core_data;
+    int idle = 0;
+
+    // the receive thread is joined before mux_stop is set, so nothing lands in the ring after the last check
+    while (!mux_stop || __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) != ring_tail) {
+        stress_frame_struct *frame;
+
+        if (starving != idle) {
+            struct sched_param param;
+
+            // the starvation window- only runs when every other thread is blocked
+            memset(&param, 0, sizeof(param));
+            idle = starving;
+            pthread_setschedparam(pthread_self(), idle ? SCHED_IDLE : SCHED_OTHER, &param);
+        }
+        if (__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == ring_tail) {
+            if (mux_stop) {
+                break;
+            }
+            usleep(1000);
+            continue;
+        }
+        frame = &ring[ring_tail % STRESS_RING_SIZE];
+        spin_us(STRESS_MUX_WORK_US);
+        memory_return(frame->pool, frame->buffer);
+        memory_return(core->frame_msg_pool, frame->message);
+        __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *signal_drain_thread(void *arg)
+{
+    fillet_app_struct *core = &core_data;
+
+    while (running) {
+        dataqueue_message_struct *msg = dataqueue_take_back(core->signal_queue);
+
+        if (!msg) {
+            usleep(10000);
+            continue;
+        }
+        if (msg->buffer_type == SIGNAL_HIGH_CPU) {
+            high_cpu_signals++;
+            fprintf(stderr,"OVERLOADSTRESS: SIGNAL: %s\n", msg->smallbuf);
+        }
+        memory_return(core->fillet_msg_pool, msg);
+    }
+    return NULL;
+}
+
+static void *hog_thread(void *arg)
+{
+    volatile uint64_t spin = 0;
+
+    while (hogs_running) {
+        spin++;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    fillet_app_struct *core = &core_data;
+    pthread_t receive_thread_id;
+    pthread_t mux_thread_id;
+    pthread_t signal_thread_id;
+    pthread_t hogs[MAX_STRESS_HOGS];
+    int starve_seconds = 10;
+    int hog_count;
+    int max_level = OVERLOAD_LEVEL_NORMAL;
+    int level;
+    int64_t start;
+    int64_t starve_end;
+    int64_t recovered = -1;
+    int64_t last_print = 0;
+    int leaked = 0;
+    int shed_ok;
+    int passed;
+    int i;
+
+    if (argc > 1) {
+        renditions = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        starve_seconds = atoi(argv[2]);
+    }
+    if (renditions < 1 || starve_seconds < 1) {
+        fprintf(stderr,"usage: %s [renditions] [starvation seconds] [transcode 0/1]\n", argv[0]);
+        return 1;
+    }
+
+    memset(core, 0, sizeof(fillet_app_struct));
+    memset(&config_data, 0, sizeof(config_data));
+    core->cd = &config_data;
+    core->num_sources = renditions;
+    core->transcode_enabled = 1;
+    if (argc > 3) {
+        core->transcode_enabled = atoi(argv[3]);
+    }
+    core->fillet_msg_pool = memory_create(MAX_MSG_BUFFERS, sizeof(dataqueue_message_struct));
+    core->frame_msg_pool = memory_create(MAX_FRAME_BUFFERS, sizeof(dataqueue_message_struct));
+    core->compressed_video_pool = memory_create(MAX_VIDEO_COMPRESSED_BUFFERS, 0);
+    core->compressed_audio_pool = memory_create(MAX_AUDIO_COMPRESSED_BUFFERS, 0);
+    memory_enable_magazines(core->fillet_msg_pool);
+    memory_enable_magazines(core->frame_msg_pool);
+    core->signal_queue = dataqueue_create();
+    core->overload = overload_create(core);
+    if (!core->fillet_msg_pool || !core->frame_msg_pool || !core->compressed_video_pool ||
+        !core->compressed_audio_pool || !core->signal_queue || !core->overload) {
+        fprintf(stderr,"OVERLOADSTRESS: ERROR - UNABLE TO SET UP THE POOLS\n");
+        return 1;
+    }
+
+    hog_count = 2 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (hog_count < 2) {
+        hog_count = 2;
+    }
+    if (hog_count > MAX_STRESS_HOGS) {
+        hog_count = MAX_STRESS_HOGS;
+    }
+
+    pthread_create(&signal_thread_id, NULL, signal_drain_thread, NULL);
+    pthread_create(&mux_thread_id, NULL, mux_thread, NULL);
+    pthread_create(&receive_thread_id, NULL, receive_thread, NULL);
+
+    start = now_ms();
+    starve_end = start + STRESS_WARMUP_MS + starve_seconds * 1000;
+    while (1) {
+        int64_t now = now_ms();
+
+        if (!starving && now >= start + STRESS_WARMUP_MS && now < starve_end) {
+            fprintf(stderr,"OVERLOADSTRESS: starving the mux thread for %d seconds with %d busy threads\n",
+                    starve_seconds, hog_count);
+            hogs_running = 1;
+            for (i = 0; i < hog_count; i++) {
+                pthread_create(&hogs[i], NULL, hog_thread, NULL);
+            }
+            starving = 1;
+        }
+        if (starving && now >= starve_end) {
+            hogs_running = 0;
+            for (i = 0; i < hog_count; i++) {
+                pthread_join(hogs[i], NULL);
+            }
+            starving = 0;
+            fprintf(stderr,"OVERLOADSTRESS: starvation over, waiting for the controller to recover\n");
+        }
+
+        level = overload_update(core);
+        if (level > max_level) {
+            max_level = level;
+        }
+        if (now - last_print >= 1000) {
+            last_print = now;
+            fprintf(stderr,"OVERLOADSTRESS: t=%lds level=%d in=%ld shed=%ld dropped=%ld queued=%ld frame_pool_free=%d\n",
+                    (now - start) / 1000, level, frames_in, frames_shed, frames_dropped,
+                    ring_head - ring_tail, memory_unused(core->frame_msg_pool));
+        }
+        if (now > starve_end && max_level > OVERLOAD_LEVEL_NORMAL && level == OVERLOAD_LEVEL_NORMAL) {
+            recovered = now - starve_end;
+            break;
+        }
+        if (now > starve_end + STRESS_RECOVER_MS) {
+            break;
+        }
+        usleep(100000);
+    }
+
+    // ingest stops first, then the mux side drains whatever it left in the ring
+    running = 0;
+    pthread_join(receive_thread_id, NULL);
+    mux_stop = 1;
+    pthread_join(mux_thread_id, NULL);
+    pthread_join(signal_thread_id, NULL);
+
+    fprintf(stderr,"OVERLOADSTRESS: unused frame=%d/%d video=%d/%d audio=%d/%d\n",
+            memory_unused(core->frame_msg_pool), memory_count(core->frame_msg_pool),
+            memory_unused(core->compressed_video_pool), memory_count(core->compressed_video_pool),
+            memory_unused(core->compressed_audio_pool), memory_count(core->compressed_audio_pool));
+    if (memory_unused(core->frame_msg_pool) != memory_count(core->frame_msg_pool) ||
+        memory_unused(core->compressed_video_pool) != memory_count(core->compressed_video_pool) ||
+        memory_unused(core->compressed_audio_pool) != memory_count(core->compressed_audio_pool)) {
+        leaked = 1;
+    }
+
+    if (core->transcode_enabled) {
+        shed_ok = max_level >= OVERLOAD_LEVEL_SHED_NONREF && frames_shed > 0 && frames_shed_early == 0;
+    } else {
+        shed_ok = frames_shed == 0;
+    }
+    passed = max_level > OVERLOAD_LEVEL_NORMAL && recovered >= 0 && high_cpu_signals > 0 && shed_ok && !leaked;
+    fprintf(stderr,"OVERLOADSTRESS: %s - %s, max level=%d, recovered %lds after the starvation, signals=%ld, shed=%ld (%ld before SHED_NONREF), dropped=%ld of %ld, leaked=%d\n",
+            passed ? "PASS" : "FAIL", core->transcode_enabled ? "transcode" : "repackage", max_level,
+            recovered >= 0 ? recovered / 1000 : -1, high_cpu_signals, frames_shed, frames_shed_early,
+            frames_dropped, frames_in, leaked);
+
+    overload_destroy(core->overload);
+    return passed ? 0 : 1;
+}
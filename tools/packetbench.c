@@ -0,0 +1,278 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// ts packetiser throughput- MB/s of access units turned into ts packets
+//
+// the packetiser is static inside the muxer, so the muxer source is built into
+// this tool and its definitions are used ahead of the copy in the library.
+// video and audio frames of mixed sizes (every size up to 400 bytes to hit the
+// stuffing cases, then typical and multi-megabyte frames) are packetised once
+// into memory and once with the per-sample fwrite to a file the way the muxer
+// writes a segment. every packet is checked for its sync byte. a third pass
+// packetises straight into the segment writer's chunks the way clear ts goes
+// out now, and its file has to match the fwrite one byte for byte
+//
+// usage: packetbench [frames] [output file]
+
+#include "../source/hlsmux.c"
+
+#define PACKETBENCH_FRAMES     4000
+#define PACKETBENCH_PASSES     5
+
+static int64_t bench_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static sorted_frame_struct *bench_frames(int count, int video, int64_t *total)
+{
+    sorted_frame_struct *frames = (sorted_frame_struct*)calloc(count, sizeof(sorted_frame_struct));
+    int i;
+    int j;
+
+    *total = 0;
+    srand(7);
+    for (i = 0; i < count; i++) {
+        int size;
+
+        if (i < 400) {
+            size = i + 1;
+        } else if (video) {
+            size = (i % 50 == 0) ? 1500000 + rand() % 500000 : rand() % 200000 + 1;
+        } else {
+            size = rand() % 1500 + 1;
+        }
+        frames[i].buffer = (uint8_t*)malloc(size);
+        for (j = 0; j < size; j++) {
+            frames[i].buffer[j] = rand();
+        }
+        frames[i].buffer_size = size;
+        frames[i].pts = 9000 + (int64_t)i * 3003 + (i % 3 == 0 ? 6006 : 0);
+        frames[i].dts = (i % 5 == 0) ? 0 : 9000 + (int64_t)i * 3003;
+        frames[i].sync_frame = (i % 60) == 0;
+        frames[i].media_type = video ? MEDIA_TYPE_H264 : MEDIA_TYPE_AAC;
+        *total += size;
+    }
+    return frames;
+}
+
+static int bench_pass(fillet_app_struct *core, stream_struct *stream, sorted_frame_struct *frames, int count,
+                      int video, FILE *output, int64_t *elapsed)
+{
+    int64_t start = bench_now_ns();
+    int i;
+    int j;
+
+    for (i = 0; i < count; i++) {
+        int packets;
+
+        // the pat and pmt go out in front of every sample
+        if (video) {
+            packets = muxvideosample(core, stream, &frames[i]) + MUX_TABLE_PACKETS;
+        } else {
+            packets = muxaudiosample(core, stream, &frames[i], 0, 0) + MUX_TABLE_PACKETS;
+        }
+        if (packets <= MUX_TABLE_PACKETS) {
+            fprintf(stderr,"PACKETBENCH: ERROR - FRAME %d (%d bytes) WAS NOT PACKETISED\n", i, frames[i].buffer_size);
+            return -1;
+        }
+        if (output) {
+            fwrite(stream->muxbuffer, 1, packets * 188, output);
+        }
+        for (j = 0; j < packets; j++) {
+            if (stream->muxbuffer[j * 188] != 0x47) {
+                fprintf(stderr,"PACKETBENCH: ERROR - LOST SYNC IN FRAME %d PACKET %d\n", i, j);
+                return -1;
+            }
+        }
+    }
+    if (output) {
+        fflush(output);
+    }
+    *elapsed = bench_now_ns() - start;
+
+    return 0;
+}
+
+// same samples through mux_ts_output/mux_ts_commit, the writer is torn down at
+// the end so the file is complete when the pass returns
+static int bench_writer_pass(fillet_app_struct *core, stream_struct *stream, sorted_frame_struct *frames, int count,
+                             int video, const char *filename, int64_t *elapsed)
+{
+    int64_t start = bench_now_ns();
+    int i;
+
+    core->hlsmux->writer = segwriter_create();
+    stream->output_ts_file = segwriter_open(core->hlsmux->writer, filename, 0);
+    if (!stream->output_ts_file) {
+        fprintf(stderr,"PACKETBENCH: ERROR - UNABLE TO OPEN %s\n", filename);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        int packets;
+
+        if (video) {
+            packets = muxvideosample(core, stream, &frames[i]) + MUX_TABLE_PACKETS;
+        } else {
+            packets = muxaudiosample(core, stream, &frames[i], 0, 0) + MUX_TABLE_PACKETS;
+        }
+        if (packets <= MUX_TABLE_PACKETS) {
+            fprintf(stderr,"PACKETBENCH: ERROR - FRAME %d (%d bytes) WAS NOT PACKETISED\n", i, frames[i].buffer_size);
+            return -1;
+        }
+        mux_ts_commit(core, stream, packets * 188);
+    }
+    segwriter_close(core->hlsmux->writer, stream->output_ts_file);
+    segwriter_destroy(core->hlsmux->writer);
+    stream->output_ts_file = NULL;
+    core->hlsmux->writer = NULL;
+    *elapsed = bench_now_ns() - start;
+
+    return 0;
+}
+
+static int bench_same_file(const char *filename1, const char *filename2)
+{
+    FILE *file1 = fopen(filename1, "r");
+    FILE *file2 = fopen(filename2, "r");
+    int same = file1 && file2;
+
+    while (same) {
+        int c1 = fgetc(file1);
+        int c2 = fgetc(file2);
+
+        if (c1 != c2) {
+            same = 0;
+        } else if (c1 == EOF) {
+            break;
+        }
+    }
+    if (file1) {
+        fclose(file1);
+    }
+    if (file2) {
+        fclose(file2);
+    }
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    static fillet_app_struct core;
+    static config_options_struct cd;
+    static hlsmux_struct hlsmux;
+    const char *output_file = "/tmp/packetbench.ts";
+    char writer_file[MAX_STR_SIZE];
+    int count = PACKETBENCH_FRAMES;
+    int video;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        output_file = argv[2];
+    }
+    if (count < 1) {
+        fprintf(stderr,"usage: %s [frames] [output file]\n", argv[0]);
+        return 1;
+    }
+    core.cd = &cd;
+    core.hlsmux = &hlsmux;
+    snprintf(writer_file, MAX_STR_SIZE-1, "%s.writer", output_file);
+
+    for (video = 1; video >= 0; video--) {
+        stream_struct stream;
+        sorted_frame_struct *frames;
+        int64_t total;
+        int64_t best_memory = 0;
+        int64_t best_file = 0;
+        int64_t best_writer = 0;
+        int pass;
+        int i;
+
+        memset(&stream, 0, sizeof(stream));
+        frames = bench_frames(count, video, &total);
+        for (pass = 0; pass < PACKETBENCH_PASSES; pass++) {
+            FILE *output;
+            int64_t elapsed;
+            int cnt;
+            int pat_cnt;
+            int pmt_cnt;
+
+            if (bench_pass(&core, &stream, frames, count, video, NULL, &elapsed) < 0) {
+                return 1;
+            }
+            if (!best_memory || elapsed < best_memory) {
+                best_memory = elapsed;
+            }
+
+            output = fopen(output_file, "w");
+            if (!output) {
+                fprintf(stderr,"PACKETBENCH: ERROR - UNABLE TO OPEN %s\n", output_file);
+                return 1;
+            }
+            // the writer pass starts from the same continuity counters so the files can match
+            cnt = stream.cnt;
+            pat_cnt = stream.pat_cnt;
+            pmt_cnt = stream.pmt_cnt;
+            if (bench_pass(&core, &stream, frames, count, video, output, &elapsed) < 0) {
+                return 1;
+            }
+            fclose(output);
+            if (!best_file || elapsed < best_file) {
+                best_file = elapsed;
+            }
+
+            stream.cnt = cnt;
+            stream.pat_cnt = pat_cnt;
+            stream.pmt_cnt = pmt_cnt;
+            if (bench_writer_pass(&core, &stream, frames, count, video, writer_file, &elapsed) < 0) {
+                return 1;
+            }
+            if (!bench_same_file(output_file, writer_file)) {
+                fprintf(stderr,"PACKETBENCH: ERROR - %s SEGMENT FROM THE WRITER DOES NOT MATCH THE FWRITE ONE\n",
+                        video ? "VIDEO" : "AUDIO");
+                return 1;
+            }
+            if (!best_writer || elapsed < best_writer) {
+                best_writer = elapsed;
+            }
+        }
+        fprintf(stderr,"PACKETBENCH: %s frames=%d input=%.1fMB packetise=%.0fMB/s packetise+write=%.0fMB/s packetise+segwriter=%.0fMB/s (best of %d)\n",
+                video ? "video" : "audio", count, total / 1e6,
+                total / 1e6 / (best_memory / 1e9), total / 1e6 / (best_file / 1e9),
+                total / 1e6 / (best_writer / 1e9), PACKETBENCH_PASSES);
+
+        for (i = 0; i < count; i++) {
+            free(frames[i].buffer);
+        }
+        free(frames);
+        mux_buffer_free(stream.muxbuffer, stream.mux_buffer_size);
+    }
+    unlink(output_file);
+    unlink(writer_file);
+
+    return 0;
+}
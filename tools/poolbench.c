@@ -0,0 +1,188 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// message pool lock contention with and without the per-thread magazines
+//
+// each rendition has a producer thread taking messages from one shared pool
+// and a consumer thread giving them back, the way the frame messages move
+// from the decoder threads to the mux. the lock wait only means something with
+// the threads on separate cores, so the online cpu count goes out with it
+//
+// usage: poolbench [renditions] [messages per rendition]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "mempool.h"
+
+#define POOL_COUNT     8192
+#define POOL_SIZE      256
+#define RING_SIZE      256
+#define MAX_RENDITIONS 32
+
+typedef struct _rendition_struct
+{
+    void                *pool;
+    int                 messages;
+    volatile int64_t    head;
+    volatile int64_t    tail;
+    void                *ring[RING_SIZE];
+    int64_t             failed;
+    int64_t             errors;
+} rendition_struct;
+
+static int64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void *producer(void *arg)
+{
+    rendition_struct *rendition = (rendition_struct*)arg;
+    int i;
+
+    for (i = 0; i < rendition->messages; i++) {
+        void *message;
+
+        while (rendition->head - __atomic_load_n(&rendition->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+            sched_yield();
+        }
+        message = memory_take(rendition->pool, i);
+        while (!message) {
+            rendition->failed++;
+            sched_yield();
+            message = memory_take(rendition->pool, i);
+        }
+        memset(message, i & 0xff, 64);
+        rendition->ring[rendition->head % RING_SIZE] = message;
+        __atomic_store_n(&rendition->head, rendition->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    rendition_struct *rendition = (rendition_struct*)arg;
+    int i;
+
+    for (i = 0; i < rendition->messages; i++) {
+        void *message;
+
+        while (__atomic_load_n(&rendition->head, __ATOMIC_ACQUIRE) == rendition->tail) {
+            sched_yield();
+        }
+        message = rendition->ring[rendition->tail % RING_SIZE];
+        if (((uint8_t*)message)[0] != (i & 0xff)) {
+            rendition->errors++;
+        }
+        __atomic_store_n(&rendition->tail, rendition->tail + 1, __ATOMIC_RELEASE);
+        if (memory_return(rendition->pool, message) < 0) {
+            rendition->errors++;
+        }
+    }
+    return NULL;
+}
+
+static int run(int renditions, int messages, int magazines)
+{
+    static rendition_struct rendition[MAX_RENDITIONS];
+    pthread_t producers[MAX_RENDITIONS];
+    pthread_t consumers[MAX_RENDITIONS];
+    void *pool;
+    int64_t start;
+    int64_t elapsed;
+    int64_t failed = 0;
+    int64_t errors = 0;
+    int i;
+
+    pool = memory_create(POOL_COUNT, POOL_SIZE);
+    if (!pool) {
+        fprintf(stderr,"POOLBENCH: ERROR - UNABLE TO CREATE POOL\n");
+        return -1;
+    }
+    if (magazines) {
+        memory_enable_magazines(pool);
+    }
+
+    memset(rendition, 0, sizeof(rendition));
+    start = now_ns();
+    for (i = 0; i < renditions; i++) {
+        rendition[i].pool = pool;
+        rendition[i].messages = messages;
+        pthread_create(&consumers[i], NULL, consumer, &rendition[i]);
+        pthread_create(&producers[i], NULL, producer, &rendition[i]);
+    }
+    for (i = 0; i < renditions; i++) {
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], NULL);
+        failed += rendition[i].failed;
+        errors += rendition[i].errors;
+    }
+    elapsed = now_ns() - start;
+
+    fprintf(stderr,"POOLBENCH: magazines=%s renditions=%d messages=%d elapsed=%ldms ns/message=%ld failedtakes=%ld errors=%ld unused=%d/%d\n",
+            magazines ? "on" : "off", renditions, messages * renditions, elapsed / 1000000,
+            elapsed / ((int64_t)messages * renditions), failed, errors, memory_unused(pool), POOL_COUNT);
+    memory_report(pool, magazines ? "magazines" : "locked");
+    memory_destroy(pool);
+
+    return errors ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int renditions = 8;
+    int messages = 1000000;
+    int retcode = 0;
+    long cpus;
+
+    if (argc > 1) {
+        renditions = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        messages = atoi(argv[2]);
+    }
+    if (renditions < 1 || renditions > MAX_RENDITIONS || messages < 1) {
+        fprintf(stderr,"usage: %s [renditions 1-%d] [messages per rendition]\n", argv[0], MAX_RENDITIONS);
+        return 1;
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    fprintf(stderr,"POOLBENCH: cpus=%ld renditions=%d messages per rendition=%d\n", cpus, renditions, messages);
+    if (cpus < 2) {
+        fprintf(stderr,"POOLBENCH: WARNING - ONE CPU ONLINE, THE LOCK IS NEVER WAITED ON ACROSS CORES\n");
+    }
+
+    retcode |= run(renditions, messages, 0);
+    retcode |= run(renditions, messages, 1);
+
+    return retcode ? 1 : 0;
+}
@@ -0,0 +1,484 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// segment encryption throughput- MB/s through each of the segcrypt paths
+//
+// aes-128 runs the whole segment cbc path the ts muxer uses, one sample worth of
+// ts packets per update with the lead blocks and the pkcs7 block put back in
+// order. cenc (ctr) and cbcs (1:9 pattern cbc) run on length prefixed video
+// samples mapped into subsamples the way the fmp4 writer does it, and on whole
+// audio samples. every pass starts from the same clear input and the output of
+// the first pass is decrypted with a separate openssl context and compared, so
+// a fast but wrong path fails the run. sample-aes is timed on annexb video only
+// since its output is re-escaped and is not decrypted here
+//
+// usage: segcryptbench [MB per test] [passes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "mp4core.h"
+#include "segcrypt.h"
+
+#define SEGCRYPTBENCH_WRITE_SIZE      (47*188)
+#define SEGCRYPTBENCH_SEGMENT_SIZE    (2*1024*1024)
+#define SEGCRYPTBENCH_SEI_SIZE        24
+#define SEGCRYPTBENCH_MAX_SUBSAMPLES  2
+
+typedef struct _segcryptbench_sample_struct
+{
+    uint8_t                     *buffer;
+    int                         buffer_size;
+    segcrypt_subsample_struct   subsamples[SEGCRYPTBENCH_MAX_SUBSAMPLES];
+    int                         subsample_count;
+    uint8_t                     iv[SEGCRYPT_SAMPLE_IV_SIZE];
+} segcryptbench_sample_struct;
+
+static segcrypt_key_struct key;
+
+static int64_t bench_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void fill_random(uint8_t *buffer, int size)
+{
+    int i;
+
+    // no zero bytes, so a payload never forms a start code of its own
+    for (i = 0; i < size; i++) {
+        buffer[i] = rand() % 255 + 1;
+    }
+}
+
+static void put32(uint8_t *buffer, int value)
+{
+    buffer[0] = (value >> 24) & 0xff;
+    buffer[1] = (value >> 16) & 0xff;
+    buffer[2] = (value >> 8) & 0xff;
+    buffer[3] = value & 0xff;
+}
+
+// a clear sei and then the slice, with 4 byte size prefixes or annexb start codes
+static segcryptbench_sample_struct *bench_video(int64_t total, int annexb, int *count)
+{
+    segcryptbench_sample_struct *samples;
+    int64_t made = 0;
+    int max_count = total / 1000 + 16;
+    int n = 0;
+
+    samples = (segcryptbench_sample_struct*)calloc(max_count, sizeof(segcryptbench_sample_struct));
+    srand(11);
+    while (made < total && n < max_count) {
+        segcryptbench_sample_struct *sample = &samples[n];
+        int slice_size = (n % 60 == 0) ? 150000 + rand() % 100000 : 1000 + rand() % 40000;
+        uint8_t *slice;
+        int clear_bytes;
+        int protected_bytes;
+
+        sample->buffer_size = 4 + SEGCRYPTBENCH_SEI_SIZE + 4 + slice_size;
+        sample->buffer = (uint8_t*)malloc(sample->buffer_size);
+        fill_random(sample->buffer, sample->buffer_size);
+        if (annexb) {
+            put32(sample->buffer, 1);
+            put32(sample->buffer + 4 + SEGCRYPTBENCH_SEI_SIZE, 1);
+        } else {
+            put32(sample->buffer, SEGCRYPTBENCH_SEI_SIZE);
+            put32(sample->buffer + 4 + SEGCRYPTBENCH_SEI_SIZE, slice_size);
+        }
+        sample->buffer[4] = 0x06;
+        slice = sample->buffer + 4 + SEGCRYPTBENCH_SEI_SIZE + 4;
+        slice[0] = (n % 60 == 0) ? 0x65 : 0x41;
+
+        segcrypt_subsamples(MEDIA_TYPE_H264, slice, slice_size, &clear_bytes, &protected_bytes);
+        sample->subsamples[0].clear_bytes = 4 + SEGCRYPTBENCH_SEI_SIZE + 4 + clear_bytes;
+        sample->subsamples[0].protected_bytes = protected_bytes;
+        sample->subsample_count = 1;
+
+        made += sample->buffer_size;
+        n++;
+    }
+    *count = n;
+    return samples;
+}
+
+static segcryptbench_sample_struct *bench_audio(int64_t total, int *count)
+{
+    segcryptbench_sample_struct *samples;
+    int64_t made = 0;
+    int max_count = total / 200 + 16;
+    int n = 0;
+
+    samples = (segcryptbench_sample_struct*)calloc(max_count, sizeof(segcryptbench_sample_struct));
+    srand(13);
+    while (made < total && n < max_count) {
+        segcryptbench_sample_struct *sample = &samples[n];
+
+        sample->buffer_size = 200 + rand() % 1300;
+        sample->buffer = (uint8_t*)malloc(sample->buffer_size);
+        fill_random(sample->buffer, sample->buffer_size);
+        made += sample->buffer_size;
+        n++;
+    }
+    *count = n;
+    return samples;
+}
+
+static void free_samples(segcryptbench_sample_struct *samples, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        free(samples[i].buffer);
+    }
+    free(samples);
+}
+
+static int64_t samples_total(segcryptbench_sample_struct *samples, int count)
+{
+    int64_t total = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        total += samples[i].buffer_size;
+    }
+    return total;
+}
+
+static void report(const char *name, int64_t bytes, int64_t protected_bytes, int64_t best, int passes)
+{
+    fprintf(stderr,"SEGCRYPTBENCH: %-16s input=%.1fMB protected=%.1fMB %.0fMB/s (best of %d)\n",
+            name, bytes / 1e6, protected_bytes / 1e6, bytes / 1e6 / (best / 1e9), passes);
+}
+
+// the reference side- a fresh context per range, nothing shared with segcrypt
+static void reference_cbc(uint8_t *data, int size, uint8_t *iv)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int output_size;
+
+    EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key.key, iv);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    EVP_DecryptUpdate(ctx, data, &output_size, data, size);
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+static int bench_aes128(uint8_t *clear, int64_t total, int passes)
+{
+    uint8_t *work = (uint8_t*)malloc(total);
+    uint8_t *output = (uint8_t*)malloc(total + (total / SEGCRYPTBENCH_SEGMENT_SIZE + 1) * SEGCRYPT_BLOCK_SIZE);
+    int64_t best = 0;
+    void *crypt;
+    int pass;
+
+    crypt = segcrypt_create(SEGCRYPT_SCHEME_AES128, &key);
+    if (!crypt) {
+        return -1;
+    }
+    for (pass = 0; pass < passes; pass++) {
+        int64_t output_size = 0;
+        int64_t pos = 0;
+        int64_t sequence = 1000;
+        int64_t start;
+        int64_t elapsed;
+
+        memcpy(work, clear, total);
+        start = bench_now_ns();
+        while (pos < total) {
+            int64_t segment_end = pos + SEGCRYPTBENCH_SEGMENT_SIZE < total ? pos + SEGCRYPTBENCH_SEGMENT_SIZE : total;
+
+            segcrypt_segment_start(crypt, sequence++);
+            while (pos < segment_end) {
+                uint8_t lead[SEGCRYPT_BLOCK_SIZE];
+                uint8_t *body;
+                int lead_size;
+                int write_size = segment_end - pos < SEGCRYPTBENCH_WRITE_SIZE ? segment_end - pos : SEGCRYPTBENCH_WRITE_SIZE;
+                int whole;
+
+                whole = segcrypt_segment_update(crypt, work + pos, write_size, lead, &lead_size, &body);
+                memcpy(output + output_size, lead, lead_size);
+                output_size += lead_size;
+                memcpy(output + output_size, body, whole);
+                output_size += whole;
+                pos += write_size;
+            }
+            output_size += segcrypt_segment_end(crypt, output + output_size);
+        }
+        elapsed = bench_now_ns() - start;
+        if (!best || elapsed < best) {
+            best = elapsed;
+        }
+
+        if (pass == 0) {
+            int64_t clear_pos = 0;
+            int64_t out_pos = 0;
+
+            sequence = 1000;
+            while (clear_pos < total) {
+                int64_t segment_size = total - clear_pos < SEGCRYPTBENCH_SEGMENT_SIZE ? total - clear_pos : SEGCRYPTBENCH_SEGMENT_SIZE;
+                int64_t padded = (segment_size / SEGCRYPT_BLOCK_SIZE + 1) * SEGCRYPT_BLOCK_SIZE;
+                uint8_t iv[SEGCRYPT_BLOCK_SIZE];
+                int i;
+
+                memset(iv, 0, sizeof(iv));
+                for (i = 0; i < 8; i++) {
+                    iv[SEGCRYPT_BLOCK_SIZE - 1 - i] = (sequence >> (i * 8)) & 0xff;
+                }
+                reference_cbc(output + out_pos, padded, iv);
+                if (memcmp(output + out_pos, clear + clear_pos, segment_size) != 0 ||
+                    output[out_pos + padded - 1] != padded - segment_size) {
+                    fprintf(stderr,"SEGCRYPTBENCH: ERROR - AES-128 SEGMENT %ld DOES NOT DECRYPT\n", sequence);
+                    return -1;
+                }
+                clear_pos += segment_size;
+                out_pos += padded;
+                sequence++;
+            }
+        }
+    }
+    report("aes-128 segment", total, total, best, passes);
+
+    segcrypt_destroy(crypt);
+    free(work);
+    free(output);
+    return 0;
+}
+
+static int verify_sample(int scheme, segcryptbench_sample_struct *sample, uint8_t *output)
+{
+    int pos = 0;
+    int i;
+
+    if (scheme == SEGCRYPT_SCHEME_CENC) {
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        uint8_t counter[SEGCRYPT_BLOCK_SIZE];
+        int output_size;
+
+        memset(counter, 0, sizeof(counter));
+        memcpy(counter, sample->iv, SEGCRYPT_SAMPLE_IV_SIZE);
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, key.key, counter);
+        if (sample->subsample_count == 0) {
+            EVP_DecryptUpdate(ctx, output, &output_size, output, sample->buffer_size);
+        }
+        for (i = 0; i < sample->subsample_count; i++) {
+            pos += sample->subsamples[i].clear_bytes;
+            EVP_DecryptUpdate(ctx, output + pos, &output_size, output + pos, sample->subsamples[i].protected_bytes);
+            pos += sample->subsamples[i].protected_bytes;
+        }
+        EVP_CIPHER_CTX_free(ctx);
+    } else {
+        if (sample->subsample_count == 0) {
+            reference_cbc(output, sample->buffer_size & ~(SEGCRYPT_BLOCK_SIZE - 1), key.iv);
+        }
+        for (i = 0; i < sample->subsample_count; i++) {
+            int protected_bytes = sample->subsamples[i].protected_bytes;
+            int blocks = protected_bytes / SEGCRYPT_BLOCK_SIZE;
+            uint8_t *chain = (uint8_t*)malloc((blocks / 10 + 1) * SEGCRYPT_BLOCK_SIZE);
+            uint8_t *range;
+            int chained = 0;
+            int block;
+
+            pos += sample->subsamples[i].clear_bytes;
+            range = output + pos;
+            // the encrypted blocks of the pattern form one cbc chain, gather them to undo it
+            for (block = 0; block < blocks; block += 10) {
+                memcpy(chain + chained++ * SEGCRYPT_BLOCK_SIZE, range + block * SEGCRYPT_BLOCK_SIZE, SEGCRYPT_BLOCK_SIZE);
+            }
+            reference_cbc(chain, chained * SEGCRYPT_BLOCK_SIZE, key.iv);
+            chained = 0;
+            for (block = 0; block < blocks; block += 10) {
+                memcpy(range + block * SEGCRYPT_BLOCK_SIZE, chain + chained++ * SEGCRYPT_BLOCK_SIZE, SEGCRYPT_BLOCK_SIZE);
+            }
+            free(chain);
+            pos += protected_bytes;
+        }
+    }
+    return memcmp(output, sample->buffer, sample->buffer_size) == 0 ? 0 : -1;
+}
+
+static int bench_samples(int scheme, const char *name, segcryptbench_sample_struct *samples, int count,
+                         int subsamples, int passes)
+{
+    int64_t total = samples_total(samples, count);
+    int64_t protected_total = 0;
+    uint8_t **work;
+    int64_t best = 0;
+    void *crypt;
+    int pass;
+    int i;
+
+    crypt = segcrypt_create(scheme, &key);
+    if (!crypt) {
+        return -1;
+    }
+    work = (uint8_t**)malloc(count * sizeof(uint8_t*));
+    for (i = 0; i < count; i++) {
+        work[i] = (uint8_t*)malloc(samples[i].buffer_size);
+        if (!subsamples) {
+            samples[i].subsample_count = 0;
+            protected_total += scheme == SEGCRYPT_SCHEME_CENC ? samples[i].buffer_size :
+                               samples[i].buffer_size & ~(SEGCRYPT_BLOCK_SIZE - 1);
+        } else if (scheme == SEGCRYPT_SCHEME_CENC) {
+            protected_total += samples[i].subsamples[0].protected_bytes;
+        } else {
+            int blocks = samples[i].subsamples[0].protected_bytes / SEGCRYPT_BLOCK_SIZE;
+
+            protected_total += ((blocks + 9) / 10) * SEGCRYPT_BLOCK_SIZE;
+        }
+    }
+
+    for (pass = 0; pass < passes; pass++) {
+        int64_t start;
+        int64_t elapsed;
+
+        for (i = 0; i < count; i++) {
+            memcpy(work[i], samples[i].buffer, samples[i].buffer_size);
+        }
+        start = bench_now_ns();
+        for (i = 0; i < count; i++) {
+            segcrypt_sample_iv(crypt, samples[i].iv);
+            segcrypt_sample(crypt, work[i], samples[i].buffer_size,
+                            samples[i].subsamples, samples[i].subsample_count, samples[i].iv);
+        }
+        elapsed = bench_now_ns() - start;
+        if (!best || elapsed < best) {
+            best = elapsed;
+        }
+
+        if (pass == 0) {
+            for (i = 0; i < count; i++) {
+                if (verify_sample(scheme, &samples[i], work[i]) < 0) {
+                    fprintf(stderr,"SEGCRYPTBENCH: ERROR - %s SAMPLE %d (%d bytes) DOES NOT DECRYPT\n",
+                            name, i, samples[i].buffer_size);
+                    return -1;
+                }
+            }
+        }
+    }
+    report(name, total, protected_total, best, passes);
+
+    for (i = 0; i < count; i++) {
+        free(work[i]);
+    }
+    free(work);
+    segcrypt_destroy(crypt);
+    return 0;
+}
+
+static int bench_sample_aes(segcryptbench_sample_struct *samples, int count, int passes)
+{
+    int64_t total = samples_total(samples, count);
+    int64_t best = 0;
+    void *crypt;
+    int pass;
+    int i;
+
+    crypt = segcrypt_create(SEGCRYPT_SCHEME_SAMPLE_AES, &key);
+    if (!crypt) {
+        return -1;
+    }
+    for (pass = 0; pass < passes; pass++) {
+        int64_t start = bench_now_ns();
+        int64_t elapsed;
+
+        segcrypt_segment_start(crypt, 1000 + pass);
+        for (i = 0; i < count; i++) {
+            uint8_t *output;
+
+            if (segcrypt_sample_aes(crypt, MEDIA_TYPE_H264, samples[i].buffer, samples[i].buffer_size, &output) < samples[i].buffer_size) {
+                fprintf(stderr,"SEGCRYPTBENCH: ERROR - SAMPLE-AES LOST DATA IN SAMPLE %d\n", i);
+                return -1;
+            }
+        }
+        elapsed = bench_now_ns() - start;
+        if (!best || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    report("sample-aes video", total, total, best, passes);
+
+    segcrypt_destroy(crypt);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    segcryptbench_sample_struct *video;
+    segcryptbench_sample_struct *audio;
+    uint8_t *clear;
+    int64_t total;
+    int megabytes = 100;
+    int passes = 5;
+    int video_count;
+    int audio_count;
+
+    if (argc > 1) {
+        megabytes = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        passes = atoi(argv[2]);
+    }
+    if (megabytes < 1 || passes < 1) {
+        fprintf(stderr,"usage: %s [MB per test] [passes]\n", argv[0]);
+        return 1;
+    }
+    total = (int64_t)megabytes * 1000000;
+
+    if (RAND_bytes(key.key, SEGCRYPT_KEY_SIZE) != 1 || RAND_bytes(key.iv, SEGCRYPT_KEY_SIZE) != 1) {
+        fprintf(stderr,"SEGCRYPTBENCH: ERROR - UNABLE TO MAKE A KEY\n");
+        return 1;
+    }
+
+    clear = (uint8_t*)malloc(total);
+    fill_random(clear, total);
+    if (bench_aes128(clear, total, passes) < 0) {
+        return 1;
+    }
+    free(clear);
+
+    video = bench_video(total, 1, &video_count);
+    if (bench_sample_aes(video, video_count, passes) < 0) {
+        return 1;
+    }
+    free_samples(video, video_count);
+
+    video = bench_video(total, 0, &video_count);
+    audio = bench_audio(total / 10, &audio_count);
+    if (bench_samples(SEGCRYPT_SCHEME_CENC, "cenc video", video, video_count, 1, passes) < 0 ||
+        bench_samples(SEGCRYPT_SCHEME_CBCS, "cbcs video", video, video_count, 1, passes) < 0 ||
+        bench_samples(SEGCRYPT_SCHEME_CENC, "cenc audio", audio, audio_count, 0, passes) < 0 ||
+        bench_samples(SEGCRYPT_SCHEME_CBCS, "cbcs audio", audio, audio_count, 0, passes) < 0) {
+        return 1;
+    }
+    free_samples(video, video_count);
+    free_samples(audio, audio_count);
+
+    return 0;
+}
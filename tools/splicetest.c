@@ -0,0 +1,314 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// scte35 splice point segmentation- cue-out/cue-in cuts on the splice idr, grid kept
+//
+// frames go through the real mux thread the way the encoders hand them over:
+// 30fps hevc with a 2 second gop and an idr forced on the splice frames, aac
+// alongside. a cue-out lands mid-gop at 15.2s for 10 seconds and the cue-in at
+// 24.8s. the video playlist and the first packet of every ts segment are then
+// checked- each cue tag sits on a segment that starts at its splice pts on a
+// random access point, every other segment boundary stays on the 2 second grid
+// and no segment runs past the target duration
+//
+// usage: splicetest
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fillet.h"
+#include "dataqueue.h"
+#include "mempool.h"
+#include "hlsmux.h"
+
+#define SPLICETEST_FPS             30
+#define SPLICETEST_GOP             60
+#define SPLICETEST_SEGMENT         2
+#define SPLICETEST_WINDOW          40
+#define SPLICETEST_SECONDS         88
+#define SPLICETEST_BASE            900000
+#define SPLICETEST_CUE_OUT         ((int64_t)(15.2 * 90000))
+#define SPLICETEST_CUE_IN          ((int64_t)(24.8 * 90000))
+#define SPLICETEST_BREAK           (10 * 90000)
+#define SPLICETEST_VIDEO_PID       480
+#define SPLICETEST_IDENTITY        7746
+#define SPLICETEST_MAX_NAME        256
+
+static char directory[] = "/tmp/splicetestXXXXXX";
+
+static void push_frame(fillet_app_struct *core, int frame_type, int64_t timestamp, int sync_frame,
+                       int splice_point, int64_t splice_duration)
+{
+    hlsmux_struct *hlsmux = (hlsmux_struct*)core->hlsmux;
+    int video = frame_type == FRAME_TYPE_VIDEO;
+    int size = video ? 2000 : 300;
+    sorted_frame_struct *frame;
+    dataqueue_message_struct *msg;
+
+    frame = (sorted_frame_struct*)memory_take(core->frame_msg_pool, sizeof(sorted_frame_struct));
+    msg = (dataqueue_message_struct*)memory_take(core->fillet_msg_pool, sizeof(dataqueue_message_struct));
+    if (!frame || !msg) {
+        fprintf(stderr,"SPLICETEST: ERROR - OUT OF FRAME MESSAGES\n");
+        exit(1);
+    }
+    memset(frame, 0, sizeof(sorted_frame_struct));
+    memset(msg, 0, sizeof(dataqueue_message_struct));
+
+    frame->buffer = (uint8_t*)memory_take(video ? core->compressed_video_pool : core->compressed_audio_pool, size);
+    memset(frame->buffer, 0x11, size);
+    if (video) {
+        // start code + idr_w_radl or trail_r nal header
+        frame->buffer[0] = 0x00;
+        frame->buffer[1] = 0x00;
+        frame->buffer[2] = 0x00;
+        frame->buffer[3] = 0x01;
+        frame->buffer[4] = sync_frame ? 0x26 : 0x02;
+        frame->buffer[5] = 0x01;
+    } else {
+        // adts, aac lc 48khz stereo
+        frame->buffer[0] = 0xff;
+        frame->buffer[1] = 0xf1;
+        frame->buffer[2] = 0x4c;
+        frame->buffer[3] = 0x80;
+    }
+    frame->buffer_size = size;
+    frame->pts = timestamp;
+    frame->dts = timestamp;
+    frame->full_time = timestamp;
+    frame->frame_type = frame_type;
+    frame->sync_frame = sync_frame;
+    frame->media_type = video ? MEDIA_TYPE_HEVC : MEDIA_TYPE_AAC;
+    frame->splice_point = splice_point;
+    frame->splice_duration = splice_duration;
+    frame->duration = video ? 90000 / SPLICETEST_FPS : 1920;
+
+    msg->buffer = frame;
+    dataqueue_put_front(hlsmux->input_queue, msg);
+}
+
+// the first video pes of a segment- its pts and whether it opens on a random access point
+static int segment_start(const char *filename, int64_t *pts, int *random_access)
+{
+    uint8_t packet[188];
+    FILE *segment = fopen(filename, "r");
+
+    if (!segment) {
+        return -1;
+    }
+    while (fread(packet, 1, 188, segment) == 188) {
+        int pid = ((packet[1] & 0x1f) << 8) | packet[2];
+        int payload = 4;
+        uint8_t *pes;
+
+        if (packet[0] != 0x47 || pid != SPLICETEST_VIDEO_PID || !(packet[1] & 0x40)) {
+            continue;
+        }
+        *random_access = 0;
+        if (packet[3] & 0x20) {
+            *random_access = packet[4] > 0 && (packet[5] & 0x40);
+            payload += packet[4] + 1;
+        }
+        pes = packet + payload;
+        *pts = ((int64_t)(pes[9] & 0x0e) << 29) | ((int64_t)pes[10] << 22) | ((int64_t)(pes[11] & 0xfe) << 14) |
+               ((int64_t)pes[12] << 7) | ((int64_t)pes[13] >> 1);
+        fclose(segment);
+        return 0;
+    }
+    fclose(segment);
+    return -1;
+}
+
+static int check_playlist(int64_t first_pts)
+{
+    char filename[SPLICETEST_MAX_NAME];
+    char line[SPLICETEST_MAX_NAME];
+    char cue[32];
+    double duration = 0;
+    int failures = 0;
+    int segments = 0;
+    int cue_out_seen = 0;
+    int cue_in_seen = 0;
+    FILE *playlist;
+
+    snprintf(filename, SPLICETEST_MAX_NAME-1, "%s/video0.m3u8", directory);
+    playlist = fopen(filename, "r");
+    if (!playlist) {
+        fprintf(stderr,"SPLICETEST: FAIL - NO VIDEO PLAYLIST WAS WRITTEN\n");
+        return 1;
+    }
+
+    cue[0] = 0;
+    while (fgets(line, sizeof(line), playlist)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (strncmp(line, "#EXT-X-CUE-OUT:", 15) == 0) {
+            snprintf(cue, sizeof(cue), "CUE-OUT");
+        } else if (strcmp(line, "#EXT-X-CUE-IN") == 0) {
+            snprintf(cue, sizeof(cue), "CUE-IN");
+        } else if (strncmp(line, "#EXTINF:", 8) == 0) {
+            duration = atof(line + 8);
+        } else if (line[0] != '#' && line[0] != 0) {
+            int64_t pts = 0;
+            int64_t offset;
+            int random_access = 0;
+            int on_grid;
+
+            snprintf(filename, SPLICETEST_MAX_NAME-1, "%s/%s", directory, line);
+            if (segment_start(filename, &pts, &random_access) < 0) {
+                fprintf(stderr,"SPLICETEST: FAIL - %s HAS NO VIDEO\n", line);
+                failures++;
+                continue;
+            }
+            offset = pts - first_pts;
+            on_grid = (offset % (SPLICETEST_SEGMENT * 90000)) == 0;
+            fprintf(stderr,"SPLICETEST: %-22s start=%7.3fs duration=%.3fs %s%s\n",
+                    line, offset / 90000.0, duration, random_access ? "rap " : "", cue);
+
+            if (!random_access) {
+                fprintf(stderr,"SPLICETEST: FAIL - %s DOES NOT OPEN ON A RANDOM ACCESS POINT\n", line);
+                failures++;
+            }
+            if (duration > SPLICETEST_SEGMENT + 0.001) {
+                fprintf(stderr,"SPLICETEST: FAIL - %s RUNS PAST THE TARGET DURATION\n", line);
+                failures++;
+            }
+            if (strcmp(cue, "CUE-OUT") == 0) {
+                cue_out_seen = 1;
+                if (offset != SPLICETEST_CUE_OUT) {
+                    fprintf(stderr,"SPLICETEST: FAIL - CUE-OUT IS NOT ON THE SPLICE POINT\n");
+                    failures++;
+                }
+            } else if (strcmp(cue, "CUE-IN") == 0) {
+                cue_in_seen = 1;
+                if (offset != SPLICETEST_CUE_IN) {
+                    fprintf(stderr,"SPLICETEST: FAIL - CUE-IN IS NOT ON THE SPLICE POINT\n");
+                    failures++;
+                }
+            } else if (!on_grid && offset != SPLICETEST_CUE_OUT && offset != SPLICETEST_CUE_IN) {
+                fprintf(stderr,"SPLICETEST: FAIL - %s IS OFF THE SEGMENT GRID\n", line);
+                failures++;
+            }
+            cue[0] = 0;
+            segments++;
+        }
+    }
+    fclose(playlist);
+
+    if (!cue_out_seen || !cue_in_seen) {
+        fprintf(stderr,"SPLICETEST: FAIL - CUE-OUT=%d CUE-IN=%d FOUND IN THE PLAYLIST\n", cue_out_seen, cue_in_seen);
+        failures++;
+    }
+    fprintf(stderr,"SPLICETEST: %s - %d segments checked, %d failures\n", failures ? "FAIL" : "PASS", segments, failures);
+
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    static fillet_app_struct core_data;
+    static config_options_struct cd;
+    static video_stream_struct vstream;
+    static audio_stream_struct astream;
+    static source_stream_struct source_stream[MAX_VIDEO_SOURCES];
+    fillet_app_struct *core = &core_data;
+    char command[SPLICETEST_MAX_NAME];
+    int64_t video_time = 0;
+    int64_t audio_time = 0;
+    int cue_out_sent = 0;
+    int cue_in_sent = 0;
+    int frame_count = 0;
+    int retcode;
+
+    if (!mkdtemp(directory)) {
+        fprintf(stderr,"SPLICETEST: ERROR - UNABLE TO CREATE %s\n", directory);
+        return 1;
+    }
+    snprintf(command, SPLICETEST_MAX_NAME-1, "/var/tmp/hlsmux_state_%d", SPLICETEST_IDENTITY);
+    unlink(command);
+
+    core->cd = &cd;
+    snprintf(cd.manifest_directory, sizeof(cd.manifest_directory), "%s", directory);
+    snprintf(cd.manifest_hls, sizeof(cd.manifest_hls), "master.m3u8");
+    cd.identity = SPLICETEST_IDENTITY;
+    cd.window_size = SPLICETEST_WINDOW;
+    cd.segment_length = SPLICETEST_SEGMENT;
+    cd.rollover_size = MAX_ROLLOVER_SIZE;
+    cd.enable_ts_output = 1;
+
+    vstream.video_bitrate = 3000000;
+    astream.audio_bitrate = 128;
+    core->num_sources = 1;
+    core->source_video_stream = source_stream;
+    core->source_audio_stream = source_stream;
+    source_stream[0].video_stream = &vstream;
+    source_stream[0].audio_stream = &astream;
+    core->fillet_msg_pool = memory_create(MAX_MSG_BUFFERS, sizeof(dataqueue_message_struct));
+    core->frame_msg_pool = memory_create(MAX_FRAME_BUFFERS, sizeof(sorted_frame_struct));
+    core->compressed_video_pool = memory_create(MAX_VIDEO_COMPRESSED_BUFFERS, 4000);
+    core->compressed_audio_pool = memory_create(MAX_AUDIO_COMPRESSED_BUFFERS, 1000);
+
+    if (!hlsmux_create(core)) {
+        fprintf(stderr,"SPLICETEST: ERROR - UNABLE TO START THE MUXER\n");
+        return 1;
+    }
+
+    while (video_time < (int64_t)SPLICETEST_SECONDS * 90000) {
+        int splice_point = 0;
+        int64_t splice_duration = 0;
+
+        while (audio_time <= video_time) {
+            push_frame(core, FRAME_TYPE_AUDIO, SPLICETEST_BASE + audio_time, 1, 0, 0);
+            audio_time += 1920;
+        }
+        if (!cue_out_sent && video_time >= SPLICETEST_CUE_OUT) {
+            splice_point = SPLICE_CUE_OUT;
+            splice_duration = SPLICETEST_BREAK;
+            cue_out_sent = 1;
+        } else if (!cue_in_sent && video_time >= SPLICETEST_CUE_IN) {
+            splice_point = SPLICE_CUE_IN;
+            cue_in_sent = 1;
+        }
+        // the encoder forces an idr on the splice frame and keeps its own gop cadence
+        push_frame(core, FRAME_TYPE_VIDEO, SPLICETEST_BASE + video_time,
+                   (frame_count % SPLICETEST_GOP) == 0 || splice_point,
+                   splice_point, splice_duration);
+        video_time += 90000 / SPLICETEST_FPS;
+        frame_count++;
+        usleep(200);
+    }
+    usleep(500000);
+    hlsmux_destroy(core->hlsmux);
+
+    retcode = check_playlist(SPLICETEST_BASE);
+
+    snprintf(command, SPLICETEST_MAX_NAME-1, "/var/tmp/hlsmux_state_%d", SPLICETEST_IDENTITY);
+    unlink(command);
+    snprintf(command, SPLICETEST_MAX_NAME-1, "rm -rf %s", directory);
+    if (system(command) != 0) {
+        fprintf(stderr,"SPLICETEST: unable to remove %s\n", directory);
+    }
+
+    return retcode;
+}
@@ -0,0 +1,185 @@
+/*****************************************************************************
+  Copyright (C) 2018-2020 John William
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02111, USA.
+
+  This program is also available with customization/support packages.
+  For more information, please contact me at cannonbeachgoonie@gmail.com
+
+******************************************************************************/
+
+// segment write latency seen by the mux loop- direct writes against the writer thread
+//
+// writev is wrapped at link time (-Wl,--wrap=writev) with a slow disk: a fixed
+// bandwidth and a stall every few megabytes, the way a busy or network backed
+// volume behaves. the mux side pushes one sample worth of ts packets every
+// millisecond into 600 sample segments, once with the writes done inline and
+// once through the segment writer, and reports the p50/p99/max of each push
+//
+// usage: writelatency [disk MB/s] [stall ms] [stall every MB] [samples]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "segwriter.h"
+
+#define WRITELATENCY_SAMPLE_PACKETS    47
+#define WRITELATENCY_SEGMENT_SAMPLES   600
+#define WRITELATENCY_INTERVAL_US       1000
+
+static int64_t disk_bytes_per_sec = 40*1024*1024;
+static int64_t stall_usec = 20000;
+static int64_t stall_bytes = 4*1024*1024;
+static int64_t disk_total = 0;
+
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    int64_t bytes = 0;
+    int64_t before = disk_total / stall_bytes;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        bytes += iov[i].iov_len;
+    }
+    disk_total += bytes;
+    usleep(bytes * 1000000 / disk_bytes_per_sec);
+    if (disk_total / stall_bytes != before) {
+        usleep(stall_usec);
+    }
+    return __real_writev(fd, iov, iovcnt);
+}
+
+static int64_t latency_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int run(int threaded, int samples, const char *directory)
+{
+    int64_t histogram[SEGWRITER_HISTOGRAM_BUCKETS];
+    uint8_t sample[WRITELATENCY_SAMPLE_PACKETS*188];
+    char filename[SEGWRITER_MAX_NAME];
+    void *writer = NULL;
+    void *file = NULL;
+    int64_t max_latency = 0;
+    int fd = -1;
+    int i;
+
+    memset(histogram, 0, sizeof(histogram));
+    memset(sample, 0x47, sizeof(sample));
+    disk_total = 0;
+
+    if (threaded) {
+        writer = segwriter_create();
+        if (!writer) {
+            fprintf(stderr,"WRITELATENCY: ERROR - UNABLE TO CREATE THE SEGMENT WRITER\n");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < samples; i++) {
+        int64_t start = latency_now();
+        int64_t latency;
+
+        if (i % WRITELATENCY_SEGMENT_SAMPLES == 0) {
+            snprintf(filename, SEGWRITER_MAX_NAME-1, "%s/writelatency%d.ts", directory, (i / WRITELATENCY_SEGMENT_SAMPLES) % 4);
+            if (threaded) {
+                if (file) {
+                    segwriter_close(writer, file);
+                }
+                file = segwriter_open(writer, filename, 0);
+            } else {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            }
+        }
+        if (threaded) {
+            segwriter_write(writer, file, sample, sizeof(sample));
+        } else {
+            struct iovec iov;
+
+            iov.iov_base = sample;
+            iov.iov_len = sizeof(sample);
+            writev(fd, &iov, 1);
+        }
+
+        latency = latency_now() - start;
+        latency_histogram_add(histogram, latency);
+        if (latency > max_latency) {
+            max_latency = latency;
+        }
+        usleep(WRITELATENCY_INTERVAL_US);
+    }
+
+    if (threaded) {
+        segwriter_close(writer, file);
+        segwriter_report(writer);
+        segwriter_destroy(writer);
+    } else {
+        close(fd);
+    }
+    for (i = 0; i < 4; i++) {
+        snprintf(filename, SEGWRITER_MAX_NAME-1, "%s/writelatency%d.ts", directory, i);
+        unlink(filename);
+    }
+
+    fprintf(stderr,"WRITELATENCY: %s samples=%d p50<=%ldus p99<=%ldus max=%ldus\n",
+            threaded ? "writer thread" : "inline write", samples,
+            latency_histogram_percentile(histogram, 50),
+            latency_histogram_percentile(histogram, 99),
+            max_latency);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int samples = 6000;
+
+    if (argc > 1) {
+        disk_bytes_per_sec = atoll(argv[1]) * 1024 * 1024;
+    }
+    if (argc > 2) {
+        stall_usec = atoll(argv[2]) * 1000;
+    }
+    if (argc > 3) {
+        stall_bytes = atoll(argv[3]) * 1024 * 1024;
+    }
+    if (argc > 4) {
+        samples = atoi(argv[4]);
+    }
+    if (disk_bytes_per_sec <= 0 || stall_usec < 0 || stall_bytes <= 0 || samples < 1) {
+        fprintf(stderr,"usage: %s [disk MB/s] [stall ms] [stall every MB] [samples]\n", argv[0]);
+        return 1;
+    }
+
+    if (run(0, samples, "/tmp") < 0 || run(1, samples, "/tmp") < 0) {
+        return 1;
+    }
+    return 0;
+}